@@ -0,0 +1,172 @@
+/* block_access/block_access--1.0.sql */
+
+-- complain if script is sourced in psql, rather than via CREATE EXTENSION
+\echo Use "CREATE EXTENSION block_access" to load this file. \quit
+
+CREATE FUNCTION block_access_metrics()
+RETURNS text
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE PARALLEL SAFE;
+
+REVOKE ALL ON FUNCTION block_access_metrics() FROM PUBLIC;
+GRANT EXECUTE ON FUNCTION block_access_metrics() TO pg_read_all_stats;
+
+CREATE FUNCTION block_access_shadow_stats(
+    OUT role text,
+    OUT would_deny bigint,
+    OUT would_allow bigint
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE PARALLEL SAFE;
+
+REVOKE ALL ON FUNCTION block_access_shadow_stats() FROM PUBLIC;
+GRANT EXECUTE ON FUNCTION block_access_shadow_stats() TO pg_read_all_stats;
+
+CREATE FUNCTION block_access_define(name text, intervals text, exclude_roles text DEFAULT '')
+RETURNS void
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE PARALLEL UNSAFE;
+
+CREATE FUNCTION block_access_drop(name text)
+RETURNS void
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE PARALLEL UNSAFE;
+
+CREATE FUNCTION block_access_activate(name text)
+RETURNS void
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE PARALLEL UNSAFE;
+
+CREATE FUNCTION block_access_rollback()
+RETURNS text
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE PARALLEL UNSAFE;
+
+CREATE FUNCTION block_access_policies(
+    OUT name text,
+    OUT active boolean,
+    OUT intervals text,
+    OUT exclude_roles text,
+    OUT size bigint,
+    OUT error text
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE PARALLEL SAFE;
+
+CREATE FUNCTION block_access_schedule(name text, activate_at timestamptz)
+RETURNS void
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE PARALLEL UNSAFE;
+
+CREATE FUNCTION block_access_unschedule(name text)
+RETURNS integer
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE PARALLEL UNSAFE;
+
+CREATE FUNCTION block_access_scheduled(
+    OUT name text,
+    OUT activate_at timestamptz
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE PARALLEL SAFE;
+
+CREATE FUNCTION block_access_grant_temporary(role text, duration interval)
+RETURNS timestamptz
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE PARALLEL UNSAFE;
+
+CREATE FUNCTION block_access_revoke_temporary(role text)
+RETURNS boolean
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE PARALLEL UNSAFE;
+
+CREATE FUNCTION block_access_temporary_grants(
+    OUT role text,
+    OUT granted_by text,
+    OUT granted_at timestamptz,
+    OUT expires_at timestamptz
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE PARALLEL UNSAFE;
+
+CREATE FUNCTION block_access_enforce(enabled boolean, revert_after interval DEFAULT NULL)
+RETURNS void
+AS 'MODULE_PATHNAME'
+LANGUAGE C VOLATILE PARALLEL UNSAFE;
+
+CREATE FUNCTION block_access_simulate(
+    roles text[],
+    "from" timestamptz,
+    "to" timestamptz,
+    step interval DEFAULT '15 minutes',
+    policy text DEFAULT NULL,
+    OUT role text,
+    OUT at timestamptz,
+    OUT allowed boolean
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C VOLATILE PARALLEL SAFE;
+
+CREATE FUNCTION block_access_simulate_ranges(
+    roles text[],
+    "from" timestamptz,
+    "to" timestamptz,
+    policy text DEFAULT NULL,
+    OUT role text,
+    OUT allowed tstzrange
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C VOLATILE PARALLEL SAFE;
+
+CREATE FUNCTION block_access_maintenance(
+    OUT window_opens_at timestamptz,
+    OUT command text,
+    OUT status text,
+    OUT started_at timestamptz,
+    OUT duration interval
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE PARALLEL SAFE;
+
+CREATE FUNCTION block_access_benchmark_compile(
+    nroles integer,
+    workers integer[] DEFAULT '{0,1,2,4,8}',
+    repeat integer DEFAULT 5,
+    OUT nworkers integer,
+    OUT launched integer,
+    OUT best_ms double precision,
+    OUT mean_ms double precision
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE;
+
+REVOKE ALL ON FUNCTION block_access_define(text, text, text) FROM PUBLIC;
+REVOKE ALL ON FUNCTION block_access_drop(text) FROM PUBLIC;
+REVOKE ALL ON FUNCTION block_access_activate(text) FROM PUBLIC;
+REVOKE ALL ON FUNCTION block_access_rollback() FROM PUBLIC;
+REVOKE ALL ON FUNCTION block_access_schedule(text, timestamptz) FROM PUBLIC;
+REVOKE ALL ON FUNCTION block_access_unschedule(text) FROM PUBLIC;
+REVOKE ALL ON FUNCTION block_access_grant_temporary(text, interval) FROM PUBLIC;
+REVOKE ALL ON FUNCTION block_access_revoke_temporary(text) FROM PUBLIC;
+REVOKE ALL ON FUNCTION block_access_enforce(boolean, interval) FROM PUBLIC;
+REVOKE ALL ON FUNCTION block_access_policies() FROM PUBLIC;
+REVOKE ALL ON FUNCTION block_access_scheduled() FROM PUBLIC;
+REVOKE ALL ON FUNCTION block_access_temporary_grants() FROM PUBLIC;
+REVOKE ALL ON FUNCTION block_access_simulate(text[], timestamptz, timestamptz, interval, text) FROM PUBLIC;
+REVOKE ALL ON FUNCTION block_access_simulate_ranges(text[], timestamptz, timestamptz, text) FROM PUBLIC;
+REVOKE ALL ON FUNCTION block_access_maintenance() FROM PUBLIC;
+REVOKE ALL ON FUNCTION block_access_benchmark_compile(integer, integer[], integer) FROM PUBLIC;
+GRANT EXECUTE ON FUNCTION block_access_policies() TO pg_read_all_stats;
+GRANT EXECUTE ON FUNCTION block_access_scheduled() TO pg_read_all_stats;
+GRANT EXECUTE ON FUNCTION block_access_temporary_grants() TO pg_read_all_stats;
+GRANT EXECUTE ON FUNCTION block_access_simulate(text[], timestamptz, timestamptz, interval, text) TO pg_read_all_stats;
+GRANT EXECUTE ON FUNCTION block_access_simulate_ranges(text[], timestamptz, timestamptz, text) TO pg_read_all_stats;
+GRANT EXECUTE ON FUNCTION block_access_maintenance() TO pg_read_all_stats;
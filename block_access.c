@@ -12,537 +12,5463 @@
 #include "postgres.h"
 
 #include <ctype.h>
+#include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <unistd.h>
+#ifndef WIN32
+#include <sys/mman.h>
+#endif
 
+#if PG_VERSION_NUM >= 150000
+#include "access/rmgr.h"
+#include "access/xlog.h"
+#include "access/xlog_internal.h"
+#include "access/xloginsert.h"
+#include "access/xlogreader.h"
+#endif
+#include "access/genam.h"
+#include "access/relation.h"
+#include "access/xact.h"
+#include "catalog/namespace.h"
+#include "catalog/pg_inherits.h"
+#include "catalog/pg_type.h"
+#if PG_VERSION_NUM >= 150000
+#include "common/pg_prng.h"
+#endif
+#include "fmgr.h"
+#include "funcapi.h"
+#include "lib/stringinfo.h"
 #include "libpq/auth.h"
+#include "miscadmin.h"
+#include "parser/analyze.h"
+#include "pgstat.h"
 #include "port.h"
+#include "port/atomics.h"
+#include "portability/instr_time.h"
+#include "portability/mem.h"
+#include "postmaster/bgworker.h"
+#include "postmaster/interrupt.h"
+#include "replication/walsender.h"
+#include "storage/bufmgr.h"
+#include "storage/condition_variable.h"
+#include "storage/fd.h"
+#include "storage/ipc.h"
+#include "storage/latch.h"
+#include "storage/lwlock.h"
+#include "storage/procarray.h"
+#include "storage/shmem.h"
+#include "tcop/pquery.h"
+#include "tcop/tcopprot.h"
+#include "tcop/utility.h"
+#include "utils/acl.h"
+#include "utils/array.h"
+#include "utils/builtins.h"
+#include "utils/dsa.h"
 #include "utils/guc.h"
+#include "utils/hsearch.h"
+#include "utils/tuplestore.h"
+#include "utils/memutils.h"
+#include "utils/rangetypes.h"
+#include "utils/rel.h"
+#include "utils/snapmgr.h"
+#include "utils/timeout.h"
+#include "utils/timestamp.h"
+#include "utils/typcache.h"
+#include "utils/varlena.h"
+
+#include "block_access_policy.h"
 
 PG_MODULE_MAGIC;
 
-typedef struct BATime {
-	int			hour;			/* 0 .. 23 */
-	int			minute;			/* 0 .. 59 */
-} BATime;
+/*
+ * Latency histogram buckets. Bucket i counts checks that took at most 2^i
+ * microseconds; the last bucket counts everything else.
+ */
+#define BA_LATENCY_BUCKETS		17
+
+/* Demand histogram: one slot per hour of the week (wday * 24 + hour) */
+#define BA_DEMAND_SLOTS			(7 * 24)
+
+/*
+ * Statistics in shared memory. Counters are only touched with atomic
+ * operations, so the authentication hook never waits on a lock.
+ *
+ * BACounters must only contain pg_atomic_uint64 members: it is initialized,
+ * saved and restored as an array of counters.
+ */
+typedef struct BACounters {
+	pg_atomic_uint64	checks;		/* calls to the authentication hook */
+	pg_atomic_uint64	allowed;	/* evaluated and allowed */
+	pg_atomic_uint64	denied;		/* evaluated and denied */
+	pg_atomic_uint64	exempted;	/* allowed because of exclude_roles or a grant */
+	pg_atomic_uint64	skipped;	/* not evaluated */
+	pg_atomic_uint64	errors;		/* denied because of an invalid policy */
+	pg_atomic_uint64	latency[BA_LATENCY_BUCKETS];
+	pg_atomic_uint64	latency_sum;	/* nanoseconds */
+	pg_atomic_uint64	demand_allowed[BA_DEMAND_SLOTS];
+	pg_atomic_uint64	demand_denied[BA_DEMAND_SLOTS];
+	pg_atomic_uint64	shadow_would_deny;	/* shadow denies, active allows */
+	pg_atomic_uint64	shadow_would_allow;	/* shadow allows, active denies */
+	pg_atomic_uint64	shadow_untracked;	/* shadow_max_roles exceeded */
+	pg_atomic_uint64	temporary_grants;	/* denials overridden by a grant */
+	pg_atomic_uint64	bypassed;	/* not evaluated, enforcement off */
+	pg_atomic_uint64	replication;	/* replication connections not evaluated */
+	pg_atomic_uint64	compiles;	/* GUC policies compiled by a backend */
+	pg_atomic_uint64	compile_waits;	/* logins that waited for one */
+	pg_atomic_uint64	compile_wait_time;	/* nanoseconds */
+} BACounters;
+
+#define BA_NCOUNTERS	(sizeof(BACounters) / sizeof(pg_atomic_uint64))
+
+/*
+ * Shadow policy disagreements per role. Entries are added under an exclusive
+ * lock; counters are updated with atomic operations under a shared lock.
+ */
+typedef struct BAShadowEntry {
+	char				role[NAMEDATALEN];	/* hash key; must be first */
+	pg_atomic_uint64	would_deny;
+	pg_atomic_uint64	would_allow;
+} BAShadowEntry;
+
+/*
+ * Temporary grants set by block_access_grant_temporary(): the role is allowed
+ * whatever the policy says until expires_at. Entries are modified under an
+ * exclusive exemption_lock; the hook looks them up under a shared one.
+ * Expired entries are ignored by the hook and removed by the next function
+ * that takes the exclusive lock.
+ */
+typedef struct BAExemption {
+	char		role[NAMEDATALEN];	/* hash key; must be first */
+	char		granted_by[NAMEDATALEN];
+	pg_time_t	granted_at;			/* Unix epoch */
+	pg_time_t	expires_at;			/* Unix epoch */
+} BAExemption;
+
+/*
+ * Named policies defined by block_access_define(). Each slot points to a
+ * chunk of dynamic shared memory (see slot_data()) that holds a copy of the
+ * compiled policy followed by its source text. An unused slot has an empty
+ * name.
+ *
+ * Slots are modified under an exclusive policy_lock; the hook reads them
+ * under a shared one. Hence, when a policy is redefined or dropped, no
+ * process can be using its chunk anymore, and it is freed right away.
+ */
+typedef struct BAPolicySlot {
+	char		name[NAMEDATALEN];
+	dsa_pointer	data;			/* or InvalidDsaPointer */
+	Size		size;			/* bytes of data */
+	Size		intervals_off;	/* source text, in data */
+	Size		exclude_roles_off;
+} BAPolicySlot;
+
+/*
+ * The postmaster compiles block_access.intervals / exclude_roles and the
+ * shadow parameters once at startup, and backends inherit the result. Under
+ * EXEC_BACKEND they do not, and after a reload the inherited policies are
+ * stale: assign hooks do not compile, since a reload can change both
+ * parameters of a policy. The first backend that needs one then compiles it
+ * and copies it to one of two extra slots, after the named ones; the others
+ * use that copy as is, as long as its source text matches their parameters.
+ */
+#define BA_GUC_SLOTS			2
+#define BA_DEFAULT_SLOT			(max_policies)
+#define BA_SHADOW_SLOT			(max_policies + 1)
+#define guc_policies_stale() \
+	(policy == NULL || policy_stale || shadow_policy == NULL || shadow_policy_stale)
+
+#define slot_data(i)			((char *) dsa_get_address(policy_area, policy_slots[i].data))
+#define slot_policy(i)			((BAPolicy *) slot_data(i))
+#define slot_intervals(i)		(slot_data(i) + policy_slots[i].intervals_off)
+#define slot_exclude_roles(i)	(slot_data(i) + policy_slots[i].exclude_roles_off)
+
+/* Number of previously active policies kept for block_access_rollback() */
+#define BA_ROLLBACK_DEPTH		4
+
+/* Name of the policy defined by block_access.intervals / exclude_roles */
+#define BA_DEFAULT_POLICY		"default"
+
+/* Pending activations set by block_access_schedule() */
+#define BA_MAX_SCHEDULED		16
+
+typedef struct BAScheduledSwitch {
+	uint32		active;			/* slot number + 1, or 0 (default) */
+	pg_time_t	at;				/* Unix epoch */
+} BAScheduledSwitch;
+
+/*
+ * Longest sleep of the background workers, so that they follow clock changes
+ * and activations, which do not wake them up (scheduled activations and the
+ * end of the kill switch do; see policy_change_timeout())
+ */
+#define BA_WORKER_MAX_SLEEP		(60 * 1000L)	/* ms */
+
+/* Maintenance commands of the last closed window, as run by the worker */
+#define BA_MAX_MAINTENANCE		32
+#define BA_MAINTENANCE_TEXT		256		/* longer commands are truncated */
+
+typedef enum {
+	BA_MAINTENANCE_PENDING,
+	BA_MAINTENANCE_RUNNING,
+	BA_MAINTENANCE_DONE,
+	BA_MAINTENANCE_FAILED,
+	BA_MAINTENANCE_CANCELED,	/* stopped before the window opened */
+	BA_MAINTENANCE_SKIPPED		/* not started, the window was about to open */
+} BAMaintenanceStatus;
+
+static const char *const maintenance_status_names[] = {
+	"pending", "running", "done", "failed", "canceled", "skipped"
+};
+
+typedef struct BAMaintenanceRun {
+	char		command[BA_MAINTENANCE_TEXT];
+	int			status;			/* BAMaintenanceStatus */
+	pg_time_t	started_at;		/* Unix epoch, or 0 if not started */
+	int64		duration;		/* microseconds */
+} BAMaintenanceRun;
+
+/*
+ * Parallel compilation. Finding, hashing and inserting the roles is most of
+ * the time a policy with millions of them takes to compile, and it is split
+ * between the compiling backend (the leader) and block_access.max_compile_workers
+ * dynamic background workers, through a scratch DSA area created for it (see
+ * parallel_parse_policy()):
+ *
+ * 1. exclude_roles is cut into parts after a role, and each part is scanned
+ *    for roles, which are hashed (see scan_roles());
+ * 2. the role slots are cut into ranges, and the roles of each part are
+ *    sorted by the range their hash lands in;
+ * 3. each range takes its roles from every part, merging duplicates.
+ *
+ * Each part and each range is a task that any process claims, in each phase.
+ * The leader lays out the policy from the ranges in its own memory, as
+ * build_policy() does, so that it is published exactly as a serial
+ * compilation.
+ */
+#define BA_PARALLEL_COMPILE_BYTES	(256 * 1024)	/* of exclude_roles per worker, at least */
+#define BA_COMPILE_TASKS			4	/* tasks of each phase per process */
+
+typedef enum {
+	BA_COMPILE_SCAN,			/* parts are scanned */
+	BA_COMPILE_SPLIT,			/* parts are sorted by range */
+	BA_COMPILE_INSERT,			/* ranges are filled */
+	BA_COMPILE_DONE				/* or given up by the leader */
+} BACompilePhase;
+
+#define BA_TASK_FREE			0
+#define BA_TASK_DONE			PG_UINT32_MAX
+
+typedef struct BACompileTask {
+	pg_atomic_uint32	state;	/* BA_TASK_FREE, process number + 1, or BA_TASK_DONE */
+	uint32		from;			/* bytes of exclude_roles, or role slots */
+	uint32		to;				/* exclusive */
+	int			group;			/* part: role group at from */
+	int			nroles;			/* found (part) or inserted (range) */
+	int			maxroles;		/* room in roles */
+	dsa_pointer	roles;			/* BARoleArrays, see role_arrays() */
+	dsa_pointer	order;			/* part: see split_compile_part() */
+	uint32		names;			/* range: bytes of the role names */
+	int			noverflow;		/* range: roles that probe past its end */
+	dsa_pointer	overflow;		/* BARoleArrays of maxroles roles */
+} BACompileTask;
+
+typedef struct BACompileState {
+	pg_atomic_uint32	phase;	/* BACompilePhase */
+	ConditionVariable	cv;		/* a task is done, or the phase changed */
+	int			leader_pid;
+	uint32		length;			/* of exclude_roles */
+	dsa_pointer	text;			/* exclude_roles */
+	dsa_pointer	group_days;		/* see policy_group_days() */
+	int			nparts;
+	int			nranges;		/* a power of 2 */
+	int			range_shift;	/* range of a role slot, see range_of() */
+	uint32		nslots;
+	dsa_pointer	slots;			/* int32[nslots]: role of the range, or -1 */
+	BACompileTask	tasks[FLEXIBLE_ARRAY_MEMBER];	/* see BA_COMPILE_TASK() */
+} BACompileState;
+
+/* Task k of phase (the split task of a part has its number) */
+#define BA_COMPILE_TASK(cs, phase, k) \
+	(&(cs)->tasks[((phase) - BA_COMPILE_SCAN) * (cs)->nparts + (k)])
+#define range_of(cs, slot)		((int) ((slot) >> (cs)->range_shift))
+
+/* Where a compile worker finds its BACompileState, in bgw_extra */
+typedef struct BACompileWorkerArgs {
+	dsa_handle	handle;
+	dsa_pointer	state;
+	int			tranche;
+} BACompileWorkerArgs;
+
+/* Role arrays of a task, in the scratch area */
+typedef struct BARoleArrays {
+	uint32		*off;			/* of the name in the text, or in names */
+	uint32		*len;
+	uint32		*hash;
+	uint8		*days;			/* excluded; see policy_group_days() */
+	char		*names;			/* range: copies of the names */
+} BARoleArrays;
+
+typedef struct BASharedState {
+	BACounters			counters;
+	LWLock				*lock;		/* protects shadow_roles and maintenance */
+	LWLock				*policy_lock;	/* protects policy slots and history */
+	LWLock				*exemption_lock;	/* protects exemptions */
+
+	/*
+	 * Dynamic shared memory area for the policies. The postmaster creates it
+	 * but cannot allocate from it, so saved policies are restored by the
+	 * first process that attaches to it (see attach_policy_store()).
+	 */
+	int					area_tranche;
+	pg_atomic_uint32	loaded;
+	char				*area;		/* in place, dsa_minimum_size() bytes */
+
+	/*
+	 * PID of the backend compiling the default (0) or shadow (1) GUC policy
+	 * for the shared slots, or 0. Other backends that need it wait on
+	 * compile_cv instead of compiling it too (see guc_policy()).
+	 */
+	pg_atomic_uint32	compiler[2];
+	ConditionVariable	compile_cv;
+
+	/*
+	 * Last policy generation handed out. Each compilation takes one, and a
+	 * GUC policy takes another one when it is published in its slot, so that
+	 * every backend reports the same, increasing generation for it (see
+	 * shared_guc_policy()). It starts after the postmaster's compilations.
+	 */
+	pg_atomic_uint64	generation;
+
+	/* entries in exemptions; the hook does not look them up if it is 0 */
+	pg_atomic_uint32	nexemptions;
+
+	/*
+	 * Kill switch set by block_access_enforce(): 0 if the policy is enforced,
+	 * otherwise the time (Unix epoch) until which it is not, or PG_UINT64_MAX.
+	 * The hook looks at it before evaluating anything.
+	 */
+	pg_atomic_uint64	disabled_until;
+
+	/*
+	 * Active policy: slot number + 1, or 0 for the default policy. It is
+	 * swapped atomically; the hook takes policy_lock only if it is not 0.
+	 */
+	pg_atomic_uint32	active;
+	pg_atomic_uint64	activations;	/* incremented at each switch */
+
+	/* previously active policies (same encoding), most recent first */
+	int					nhistory;
+	uint32				history[BA_ROLLBACK_DEPTH];
+
+	/*
+	 * Scheduled activations, sorted by time. next_switch is the time (Unix
+	 * epoch) of the first one, or 0: like a time window boundary, the hook
+	 * only compares it with the current time.
+	 */
+	pg_atomic_uint64	next_switch;
+	int					nscheduled;
+	BAScheduledSwitch	scheduled[BA_MAX_SCHEDULED];
+
+	/*
+	 * Set when a scheduled activation was applied at login, where the named
+	 * policies are not saved; see save_pending_policies().
+	 */
+	pg_atomic_uint32	save_pending;
+
+	/*
+	 * Commands run by the maintenance worker in the last closed window, which
+	 * opens (again) at maintenance_window, or 0 if there was none yet.
+	 */
+	pg_time_t			maintenance_window;
+	int					nmaintenance;
+	BAMaintenanceRun	maintenance[BA_MAX_MAINTENANCE];
+} BASharedState;
+
+/*
+ * Statistics file, written at shutdown and read (then removed) at startup.
+ * Bump BLOCK_ACCESS_FILE_HEADER if the meaning of BACounters changes.
+ */
+#define BLOCK_ACCESS_DUMP_FILE	PGSTAT_STAT_PERMANENT_DIRECTORY "/block_access.stat"
+
+static const uint32 BLOCK_ACCESS_FILE_HEADER = 0x62610001;
+
+/*
+ * Named policies are saved at each change, so that they (and the active one)
+ * survive restarts.
+ */
+#define BLOCK_ACCESS_POLICIES_FILE	"block_access.policies"
+
+static const uint32 BLOCK_ACCESS_POLICIES_HEADER = 0x62610102;
 
+#if PG_VERSION_NUM >= 150000
 /*
- * This data structure defines an interval (start_time until end_time) per week
- * day(s) that access will be allowed. It also specifies a set of roles that
- * are excluded from access block if current date/time is out of the specified
- * interval.
+ * Changes to named policies are WAL-logged with a custom resource manager, so
+ * that standbys replay them into their own policy store. Its ID is not the
+ * experimental one, which any extension under development may use; IDs are
+ * claimed at https://wiki.postgresql.org/wiki/CustomWALResourceManagers. A
+ * build that clashes with another extension can pick a different one with
+ * -DBA_RMGR_ID=n, the same on every server of the cluster.
  */
-typedef struct BAIntervalRole {
-	int		*wday;		/* sun (0), mon (1), tue (2), wed (3), thu (4), fri (5), sat (6) */
-	int		nwday;
-	BATime	start_time;
-	BATime	end_time;
+#ifndef BA_RMGR_ID
+#define BA_RMGR_ID			187
+#endif
+
+StaticAssertDecl(BA_RMGR_ID > RM_EXPERIMENTAL_ID && BA_RMGR_ID <= RM_MAX_CUSTOM_ID,
+				 "BA_RMGR_ID must be a custom resource manager ID");
+
+#define XLOG_BA_DEFINE		0x00	/* name, intervals, exclude_roles */
+#define XLOG_BA_DROP		0x10	/* name */
+#define XLOG_BA_STATE		0x20	/* xl_ba_state */
 
-	int		nroles;
-	char	**roles;
-} BAIntervalRole;
+/*
+ * Active policy, rollback history and pending activations, by name: slot
+ * numbers can differ on the standby.
+ */
+typedef struct xl_ba_state {
+	char		active[NAMEDATALEN];
+	int			nhistory;
+	char		history[BA_ROLLBACK_DEPTH][NAMEDATALEN];
+	int			nscheduled;
+	char		scheduled[BA_MAX_SCHEDULED][NAMEDATALEN];
+	pg_time_t	scheduled_at[BA_MAX_SCHEDULED];
+} xl_ba_state;
+#endif
 
-static char *trim(char *s);
-static char *strtok_all(char * s, char const *d);
-static void parse_interval(BAIntervalRole *i, char *s);
-static void parse_roles(BAIntervalRole *i, char *s);
-static void parse_options(BAIntervalRole *i, int n);
+static BAPolicy *compile_policy(const char *intervals, const char *roles, BAPolicy *previous);
+static int compile_workers(const char *roles);
+static BAPolicy *parallel_parse_policy(MemoryContext cxt, const char *intervals, const char *roles,
+									   Size extra, int nworkers, int *launched);
+static int launch_compile_workers(dsa_area *area, dsa_pointer state, int nworkers,
+								  BackgroundWorkerHandle **handles);
+static BAPolicy *run_parallel_compile(MemoryContext cxt, dsa_area *area, BACompileState *cs,
+									  BAIntervalRole *parsed, int nintervals,
+									  BackgroundWorkerHandle **handles, Size extra);
+static void start_compile_phase(BACompileState *cs, BACompilePhase phase);
+static void wait_compile_tasks(dsa_area *area, BACompileState *cs, BACompilePhase phase, int ntasks,
+							   BackgroundWorkerHandle **handles);
+static void run_compile_tasks(dsa_area *area, BACompileState *cs, int me);
+static Size role_arrays_size(int n);
+static void role_arrays(char *base, int n, BARoleArrays *a);
+static void scan_compile_part(dsa_area *area, BACompileState *cs, BACompileTask *t);
+static void split_compile_part(dsa_area *area, BACompileState *cs, BACompileTask *part);
+static bool insert_compile_range(dsa_area *area, BACompileState *cs, BACompileTask *t);
+static BAPolicy *merge_compile_ranges(MemoryContext cxt, dsa_area *area, BACompileState *cs,
+									  BAIntervalRole *parsed, int nintervals, int32 *slots, Size extra);
+static void finish_compile_workers(BackgroundWorkerHandle **handles, int nlaunched, bool abort);
+static BAPolicy *policy_seal(BAPolicy *p);
+static void policy_free(BAPolicy *p);
+static bool policy_pages(BAPolicy *p, uint64 *resident, uint64 *shared);
+static void install_policy(BAPolicy **target, const char *intervals, const char *roles,
+						   BAPolicy *previous);
+static bool policy_outdated(BAPolicy *p, const char *intervals, const char *roles);
+static void assign_interval_time(const char *newval, void *extra);
+static void assign_exclude_roles(const char *newval, void *extra);
+static void assign_shadow_interval_time(const char *newval, void *extra);
+static void assign_shadow_exclude_roles(const char *newval, void *extra);
+static void shadow_check(Port *port, BAPolicy *sp, int verdict, int minute);
+static Tuplestorestate *materialize_srf(FunctionCallInfo fcinfo, TupleDesc *tupdesc);
+static int find_policy_slot(const char *name);
+static Size policy_slot_size(BAPolicy *p, const char *intervals, const char *roles);
+static bool fill_policy_slot(int i, const char *name, BAPolicy *p, const char *intervals, const char *roles);
+static bool store_policy(const char *name, BAPolicy *p, const char *intervals, const char *roles, int elevel);
+static void attach_policy_store(void);
+static BAPolicy *guc_policy(bool shadow);
+static BAPolicy *shared_guc_policy(bool shadow, Size *size);
+static void compile_guc_policies(void);
+static void activate_policy(uint32 active, bool remember);
+static const char *active_policy_name(uint32 active);
+static void save_policies(int elevel);
+static void apply_scheduled_switches(pg_time_t now);
+static void schedule_switch(uint32 active, pg_time_t at);
+static void check_scheduled_switches(pg_time_t now);
+static uint32 effective_active(pg_time_t now);
+static void load_policies(void);
+static void check_policy_store(void);
+static void check_policy_name(const char *name);
+static void check_policy_change(void);
+static int policy_by_name(const char *name);
+static void remove_policy(int i);
+static void log_policy_define(const char *name, const char *intervals, const char *roles);
+static void log_policy_drop(const char *name);
+static void log_policy_state(void);
+static XLogRecPtr insert_policy_state(void);
+static void save_pending_policies(void);
+#if PG_VERSION_NUM >= 150000
+static void block_access_redo(XLogReaderState *record);
+static void redo_policy_change(XLogReaderState *record);
+static void block_access_desc(StringInfo buf, XLogReaderState *record);
+static const char *block_access_identify(uint8 info);
+#endif
+static bool temporary_grant(Port *port, pg_time_t now);
+static void prune_exemptions(pg_time_t now);
+static bool enforcement_disabled(pg_time_t now);
+static void count_check(int verdict, bool exempted, bool error, int slot, uint64 elapsed_ns);
+static Size block_access_memsize(void);
+static void block_access_shmem_startup(void);
+static void block_access_shmem_shutdown(int code, Datum arg);
+static void load_counters(void);
+#if PG_VERSION_NUM >= 150000
+static void block_access_shmem_request(void);
+#endif
+static int minutes_until_change(const uint64 *words, int minute, bool opening);
+static List *split_quoted(char *s, char sep);
+static BAPolicy *followed_policy(MemoryContext cxt, pg_time_t now, char **intervals);
+static long policy_change_timeout(pg_time_t now, long timeout);
+static void format_login_time(pg_time_t t, char *buf, size_t len);
+static bool plan_prewarm(BAPolicy *p, const char *intervals);
+static void prewarm_window(const char *relations, pg_time_t open_at);
+static int64 prewarm_relation(const char *name, int64 budget);
+static int64 prewarm_fork(Relation rel, int64 budget);
+static void run_maintenance(pg_time_t open_at);
+static void run_statement(RawStmt *parsetree, const char *sql);
+static char *statement_text(RawStmt *parsetree, const char *sql);
+static void record_maintenance(int i, int status, pg_time_t started_at, int64 duration);
+static void set_maintenance_cost(void);
 
 void		_PG_init(void);
+PGDLLEXPORT void block_access_prewarm_main(Datum main_arg);
+PGDLLEXPORT void block_access_maintenance_main(Datum main_arg);
+PGDLLEXPORT void block_access_compile_main(Datum main_arg);
+
+PG_FUNCTION_INFO_V1(block_access_metrics);
+PG_FUNCTION_INFO_V1(block_access_shadow_stats);
+PG_FUNCTION_INFO_V1(block_access_define);
+PG_FUNCTION_INFO_V1(block_access_drop);
+PG_FUNCTION_INFO_V1(block_access_activate);
+PG_FUNCTION_INFO_V1(block_access_rollback);
+PG_FUNCTION_INFO_V1(block_access_policies);
+PG_FUNCTION_INFO_V1(block_access_schedule);
+PG_FUNCTION_INFO_V1(block_access_unschedule);
+PG_FUNCTION_INFO_V1(block_access_scheduled);
+PG_FUNCTION_INFO_V1(block_access_grant_temporary);
+PG_FUNCTION_INFO_V1(block_access_revoke_temporary);
+PG_FUNCTION_INFO_V1(block_access_temporary_grants);
+PG_FUNCTION_INFO_V1(block_access_enforce);
+PG_FUNCTION_INFO_V1(block_access_simulate);
+PG_FUNCTION_INFO_V1(block_access_simulate_ranges);
+PG_FUNCTION_INFO_V1(block_access_maintenance);
+PG_FUNCTION_INFO_V1(block_access_benchmark_compile);
+
+/* Replication connections that are evaluated (block_access.enforce_replication) */
+typedef enum {
+	BA_REPLICATION_NONE,
+	BA_REPLICATION_PHYSICAL,
+	BA_REPLICATION_LOGICAL,
+	BA_REPLICATION_ALL
+} BAReplication;
+
+static const struct config_enum_entry enforce_replication_options[] = {
+	{"none", BA_REPLICATION_NONE, false},
+	{"physical", BA_REPLICATION_PHYSICAL, false},
+	{"logical", BA_REPLICATION_LOGICAL, false},
+	{"all", BA_REPLICATION_ALL, false},
+	{NULL, 0, false}
+};
 
 /* GUC Variables */
-static char		*interval_time = NULL;
+static char		*interval_time_value = NULL;
 static char		*exclude_roles = NULL;
+static bool		save_stats = true;
+static bool		protect_policy = true;
+static char		*shadow_interval_time = NULL;
+static char		*shadow_exclude_roles = NULL;
+static int		shadow_max_roles = 1000;
+static double	shadow_log_sample_rate = 1.0;
+static int		max_policies = 8;
+static int		max_policy_size = 1024;	/* kB */
+static int		max_temporary_grants = 64;
+static int		max_compile_workers = 0;
+static int		enforce_replication = BA_REPLICATION_NONE;
+static char		*prewarm_database = NULL;
+static char		*prewarm_relations = NULL;
+static int		prewarm_lead_time = 10;	/* minutes */
+static char		*maintenance_database = NULL;
+static char		*maintenance_commands = NULL;
+static int		maintenance_stop_before = 15;	/* minutes */
+static double	maintenance_cost_delay = 2;	/* ms, or -1 */
+static int		maintenance_cost_limit = 200;	/* or -1 */
+
+/* Current policy and shadow policy (evaluated but never enforced) */
+static BAPolicy	*policy = NULL;
+static BAPolicy	*shadow_policy = NULL;
+static bool		policy_stale = false;	/* parameters changed since compiled */
+static bool		shadow_policy_stale = false;
+static uint64	policy_generation = 0;
+
+/* Shared state */
+static BASharedState	*ba_state = NULL;
+static HTAB				*shadow_roles = NULL;
+static HTAB				*exemptions = NULL;
+static BAPolicySlot		*policy_slots = NULL;
+static dsa_area			*policy_area = NULL;	/* data of policy_slots */
+
+/*
+ * Relations the prewarm worker reads before a window opens on each week day:
+ * the prewarm_relations group of the interval that decides that day, or NULL.
+ * prewarm_intervals are the intervals they were matched with.
+ */
+static MemoryContext	prewarm_cxt = NULL;
+static char				*prewarm_days[7];
+static char				*prewarm_intervals = NULL;
 
 /* Original Hook */
 static ClientAuthentication_hook_type original_client_auth_hook = NULL;
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+#if PG_VERSION_NUM >= 150000
+static shmem_request_hook_type prev_shmem_request_hook = NULL;
+#endif
 
 /*
- * Strip whitespace from the beginning and end of the string
+ * Compile intervals and roles into a new policy. An invalid parameter does
+ * not throw: the parse error is saved in the policy and reported at login.
+ * Any other error (out of memory, for one) is raised.
  *
- * space (0x20), form feed (0x0c), line feed (0x0a), carriage return (0x0d),
- * horizontal tab (0x09) and vertical tab (0x0b) are removed. If s is NULL,
- * return NULL. If s contains only whitespaces, return NULL.
+ * If previous is a valid policy, the role entries of previous are reused
+ * when possible: only the intervals and the part of exclude_roles that
+ * changed are parsed, and the entries of its roles are patched (see
+ * rebuild_policy()). Otherwise, long exclude_roles are compiled with
+ * background workers (see compile_workers()).
  */
-static char *
-trim(char *s)
+static BAPolicy *
+compile_policy(const char *intervals, const char *roles, BAPolicy *previous)
+{
+	MemoryContext	cxt;
+	MemoryContext	parsecxt;
+	MemoryContext	oldcxt;
+	BAPolicy		*volatile newpolicy = NULL;
+	char			*volatile error = NULL;
+	const char		*ikey = intervals != NULL ? intervals : "";
+	const char		*rkey = roles != NULL ? roles : "";
+	Size			srclen = strlen(ikey) + strlen(rkey) + 2;
+	int				nworkers;
+	int				launched;
+	instr_time		start;
+	instr_time		duration;
+
+	cxt = AllocSetContextCreate(TopMemoryContext,
+								"block_access policy",
+								ALLOCSET_SMALL_SIZES);
+	parsecxt = AllocSetContextCreate(cxt,
+									 "block_access parser",
+									 ALLOCSET_SMALL_SIZES);
+	oldcxt = MemoryContextSwitchTo(cxt);
+
+	INSTR_TIME_SET_CURRENT(start);
+
+	PG_TRY();
+	{
+		MemoryContextSwitchTo(parsecxt);
+
+		if (previous != NULL && policy_error(previous) == NULL &&
+			previous->nintervals > 0)
+			newpolicy = rebuild_policy(cxt, previous, policy_exclude_roles(previous),
+									   intervals, roles, srclen);
+		if (newpolicy != NULL)
+			newpolicy->roles_from = previous->generation;
+		else if ((nworkers = compile_workers(roles)) > 0)
+		{
+			newpolicy = parallel_parse_policy(cxt, intervals, roles, srclen, nworkers, &launched);
+			if (newpolicy != NULL)
+				newpolicy->workers = launched;
+		}
+		else
+			newpolicy = parse_policy(cxt, intervals, roles, srclen);
+	}
+	PG_CATCH();
+	{
+		ErrorData	*edata;
+
+		MemoryContextSwitchTo(cxt);
+		edata = CopyErrorData();
+		if (edata->sqlerrcode != ERRCODE_INVALID_PARAMETER_VALUE)
+		{
+			MemoryContextSwitchTo(oldcxt);
+			MemoryContextDelete(cxt);
+			PG_RE_THROW();
+		}
+		FlushErrorState();
+
+		newpolicy = NULL;
+		error = pstrdup(edata->message);
+
+		FreeErrorData(edata);
+	}
+	PG_END_TRY();
+
+	/* parse results are not needed anymore */
+	MemoryContextSwitchTo(cxt);
+	MemoryContextDelete(parsecxt);
+
+	/* no intervals, or an error message that is kept in the policy */
+	if (newpolicy == NULL)
+	{
+		Size	len = error != NULL ? strlen(error) + 1 : 0;
+
+		newpolicy = policy_alloc(cxt, 0, 0, 0, len + srclen);
+		if (error != NULL)
+		{
+			newpolicy->error_off = policy_end(newpolicy) - (char *) newpolicy;
+			memcpy(policy_end(newpolicy), error, len);
+		}
+		newpolicy->source_off = policy_end(newpolicy) + len - (char *) newpolicy;
+	}
+
+	/* keep the source, to tell whether it changed (see install_policy()) */
+	memcpy(policy_intervals(newpolicy), ikey, strlen(ikey) + 1);
+	memcpy(policy_exclude_roles(newpolicy), rkey, strlen(rkey) + 1);
+
+	newpolicy->cxt = cxt;
+	/* from the shared counter, so that generations are unique in the cluster */
+	newpolicy->generation = ba_state != NULL ?
+		pg_atomic_add_fetch_u64(&ba_state->generation, 1) : ++policy_generation;
+
+	INSTR_TIME_SET_CURRENT(duration);
+	INSTR_TIME_SUBTRACT(duration, start);
+
+	newpolicy->compile_time = INSTR_TIME_GET_DOUBLE(duration);
+	newpolicy->size = MemoryContextMemAllocated(cxt, true);
+
+	MemoryContextSwitchTo(oldcxt);
+
+	elog(DEBUG1, "policy %lu compiled in %.4f ms (%zu bytes)%s, %d workers%s%s",
+		 (unsigned long) newpolicy->generation,
+		 newpolicy->compile_time * 1000.0, newpolicy->size,
+		 newpolicy->roles_from != 0 ? ", role entries reused" : "",
+		 newpolicy->workers,
+		 error ? ": " : "",
+		 error ? error : "");
+
+	return newpolicy;
+}
+
+/*
+ * Number of background workers to compile a policy with roles: none if it
+ * is not worth it or cannot be done (the postmaster and the startup process
+ * do not launch workers), else one per BA_PARALLEL_COMPILE_BYTES of roles,
+ * up to block_access.max_compile_workers.
+ */
+static int
+compile_workers(const char *roles)
+{
+	if (max_compile_workers == 0 || roles == NULL || ba_state == NULL ||
+		!IsUnderPostmaster || AmStartupProcess())
+		return 0;
+
+	return (int) Min((Size) max_compile_workers, strlen(roles) / BA_PARALLEL_COMPILE_BYTES);
+}
+
+/*
+ * Same as parse_policy(), with nworkers background workers. The backend
+ * starts the workers once the intervals are parsed, and takes part in each
+ * phase (see BACompileState). If no worker can be started, the policy is
+ * compiled by parse_policy(). *launched is set to the number of workers
+ * started.
+ *
+ * The policy is laid out in cxt by this backend only, once every task is
+ * done, so it is published exactly as a serial compilation would be. The
+ * scratch area is detached at the end, or at an error; workers still
+ * attached to it keep it until they are gone.
+ */
+static BAPolicy *
+parallel_parse_policy(MemoryContext cxt, const char *intervals, const char *roles,
+					  Size extra, int nworkers, int *launched)
 {
-	char	*start;
-	char	*end;
-	char	*t;
-	size_t	len;
+	BAIntervalRole	*parsed;
+	int				nintervals;
+	int				ntasks = BA_COMPILE_TASKS * (nworkers + 1);
+	BackgroundWorkerHandle **handles;
+	dsa_area		*area;
+	BACompileState	*volatile cs = NULL;
+	BAPolicy		*volatile p = NULL;
+	volatile int	nlaunched = 0;
+
+	*launched = 0;
 
-	if (s == NULL)
+	/* errors in intervals are raised before any worker is started */
+	parsed = parse_policy_intervals(intervals, roles, &nintervals);
+	if (parsed == NULL)
 		return NULL;
 
-	len = strlen(s);
-	start = s;
-	end = start + len - 1;
+	LWLockRegisterTranche(ba_state->area_tranche, "block_access policies");
+	area = dsa_create(ba_state->area_tranche);
+	handles = (BackgroundWorkerHandle **) palloc0(nworkers * sizeof(BackgroundWorkerHandle *));
+
+	PG_TRY();
+	{
+		uint32		length = strlen(roles);
+		dsa_pointer	state;
+		char		*text;
+		int			k;
+
+		state = dsa_allocate0(area, offsetof(BACompileState, tasks) +
+							  3 * ntasks * sizeof(BACompileTask));
+		cs = (BACompileState *) dsa_get_address(area, state);
+		pg_atomic_init_u32(&cs->phase, BA_COMPILE_SCAN);
+		ConditionVariableInit(&cs->cv);
+		cs->leader_pid = MyProcPid;
+		cs->length = length;
+		cs->text = dsa_allocate_extended(area, length + 1, DSA_ALLOC_HUGE);
+		text = (char *) dsa_get_address(area, cs->text);
+		memcpy(text, roles, length + 1);
+		cs->group_days = dsa_allocate(area, nintervals * sizeof(uint8));
+		policy_group_days(parsed, nintervals, (uint8 *) dsa_get_address(area, cs->group_days));
+
+		/* ranges are not more than parts; see run_parallel_compile() */
+		cs->nparts = ntasks;
+		for (k = 0; k < 3 * ntasks; k++)
+			pg_atomic_init_u32(&cs->tasks[k].state, BA_TASK_FREE);
+
+		/* parts of about the same length, cut after a role */
+		for (k = 0; k < ntasks; k++)
+		{
+			BACompileTask *t = &cs->tasks[k];
+			uint32		to = (uint32) ((uint64) length * (k + 1) / ntasks);
+			const char *semicolon;
+
+			t->from = k == 0 ? 0 : Min(cs->tasks[k - 1].to + 1, length);
+			t->group = k == 0 ? 0 : cs->tasks[k - 1].group;
+			if (k > 0)
+				for (semicolon = memchr(text + cs->tasks[k - 1].from, ';', t->from - cs->tasks[k - 1].from);
+					 semicolon != NULL;
+					 semicolon = memchr(semicolon + 1, ';', text + t->from - semicolon - 1))
+					t->group++;
+
+			to = Max(to, t->from);
+			while (to < length && text[to] != ',' && text[to] != ';')
+				to++;
+			t->to = to;
+		}
+
+		nlaunched = launch_compile_workers(area, state, nworkers, handles);
+		if (nlaunched > 0)
+		{
+			p = run_parallel_compile(cxt, area, cs, parsed, nintervals, handles, extra);
+			finish_compile_workers(handles, nlaunched, false);
+		}
+		else
+		{
+			pg_atomic_write_u32(&cs->phase, BA_COMPILE_DONE);
+			p = parse_policy(cxt, intervals, roles, extra);
+		}
+	}
+	PG_CATCH();
+	{
+		if (cs != NULL)
+		{
+			pg_atomic_write_u32(&cs->phase, BA_COMPILE_DONE);
+			ConditionVariableBroadcast(&cs->cv);
+		}
+		finish_compile_workers(handles, nlaunched, true);
+		dsa_detach(area);
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	dsa_detach(area);
+	pfree(handles);
+	*launched = nlaunched;
+
+	return p;
+}
+
+/*
+ * Take part in the phases of the compilation described by cs, as the leader,
+ * and lay out the policy in cxt
+ */
+static BAPolicy *
+run_parallel_compile(MemoryContext cxt, dsa_area *area, BACompileState *cs,
+					 BAIntervalRole *parsed, int nintervals,
+					 BackgroundWorkerHandle **handles, Size extra)
+{
+	int			maxroles = 0;
+	int			k;
 
-	while (isspace(*start))
-		start++;
+	/* 1: roles are found and hashed */
+	wait_compile_tasks(area, cs, BA_COMPILE_SCAN, cs->nparts, handles);
 
-	while (isspace(*end))
-		end--;
+	/* 2: the role slots are cut into ranges, and parts are sorted by range */
+	for (k = 0; k < cs->nparts; k++)
+		maxroles += BA_COMPILE_TASK(cs, BA_COMPILE_SCAN, k)->nroles;
 
-	if (end - start >= 0)
+	cs->nslots = policy_role_slot_count(maxroles);
+	cs->nranges = 1;
+	while (cs->nranges * 2 <= cs->nparts && cs->nranges * 2 <= cs->nslots)
+		cs->nranges *= 2;
+	cs->range_shift = pg_leftmost_one_pos32(cs->nslots) - pg_leftmost_one_pos32(cs->nranges);
+	cs->slots = dsa_allocate_extended(area, cs->nslots * sizeof(int32), DSA_ALLOC_HUGE);
+	for (k = 0; k < cs->nranges; k++)
 	{
-		t = palloc0((end - start + 2) * sizeof(char));
-		strncpy(t, start, end - start + 1);
+		BACompileTask *t = BA_COMPILE_TASK(cs, BA_COMPILE_INSERT, k);
+
+		t->from = (uint32) k << cs->range_shift;
+		t->to = (uint32) (k + 1) << cs->range_shift;
 	}
-	else
+
+	start_compile_phase(cs, BA_COMPILE_SPLIT);
+	wait_compile_tasks(area, cs, BA_COMPILE_SPLIT, cs->nparts, handles);
+
+	/* 3: ranges are filled */
+	start_compile_phase(cs, BA_COMPILE_INSERT);
+	wait_compile_tasks(area, cs, BA_COMPILE_INSERT, cs->nranges, handles);
+
+	start_compile_phase(cs, BA_COMPILE_DONE);
+
+	return merge_compile_ranges(cxt, area, cs, parsed, nintervals,
+								(int32 *) dsa_get_address(area, cs->slots), extra);
+}
+
+/* Let the workers know that phase started, once what it needs is written */
+static void
+start_compile_phase(BACompileState *cs, BACompilePhase phase)
+{
+	pg_write_barrier();
+	pg_atomic_write_u32(&cs->phase, phase);
+	ConditionVariableBroadcast(&cs->cv);
+}
+
+/*
+ * Start up to nworkers compile workers for the state at state in area.
+ * Return the number started; their handles are stored in handles.
+ */
+static int
+launch_compile_workers(dsa_area *area, dsa_pointer state, int nworkers,
+					   BackgroundWorkerHandle **handles)
+{
+	BackgroundWorker	worker;
+	BACompileWorkerArgs	args;
+	int					i;
+
+	memset(&worker, 0, sizeof(worker));
+	worker.bgw_flags = BGWORKER_SHMEM_ACCESS;
+	worker.bgw_start_time = BgWorkerStart_ConsistentState;
+	worker.bgw_restart_time = BGW_NEVER_RESTART;
+	strlcpy(worker.bgw_library_name, "block_access", BGW_MAXLEN);
+	strlcpy(worker.bgw_function_name, "block_access_compile_main", BGW_MAXLEN);
+	snprintf(worker.bgw_name, BGW_MAXLEN, "block_access compile worker for PID %d", MyProcPid);
+	strlcpy(worker.bgw_type, "block_access compile", BGW_MAXLEN);
+	worker.bgw_notify_pid = MyProcPid;
+
+	args.handle = dsa_get_handle(area);
+	args.state = state;
+	args.tranche = ba_state->area_tranche;
+	memcpy(worker.bgw_extra, &args, sizeof(args));
+
+	for (i = 0; i < nworkers; i++)
+	{
+		worker.bgw_main_arg = Int32GetDatum(i + 1);
+		if (!RegisterDynamicBackgroundWorker(&worker, &handles[i]))
+			break;
+	}
+
+	if (i < nworkers)
+		elog(DEBUG1, "could start only %d of %d compile workers", i, nworkers);
+
+	return i;
+}
+
+/*
+ * Wait for the ntasks tasks of phase to be done, doing those that are not
+ * claimed yet, and those of workers that exited without finishing them.
+ */
+static void
+wait_compile_tasks(dsa_area *area, BACompileState *cs, BACompilePhase phase, int ntasks,
+				   BackgroundWorkerHandle **handles)
+{
+	for (;;)
+	{
+		bool	done = true;
+		int		i;
+
+		run_compile_tasks(area, cs, 0);
+
+		for (i = 0; i < ntasks; i++)
+		{
+			BACompileTask *t = BA_COMPILE_TASK(cs, phase, i);
+			uint32	state = pg_atomic_read_u32(&t->state);
+			pid_t	pid;
+
+			if (state == BA_TASK_DONE)
+				continue;
+			done = false;
+
+			/* workers are numbered from 1; the leader is 0 */
+			if (state > 1 &&
+				GetBackgroundWorkerPid(handles[state - 2], &pid) == BGWH_STOPPED)
+			{
+				elog(DEBUG1, "compile worker %u exited before its task was done", state - 1);
+				(void) pg_atomic_compare_exchange_u32(&t->state, &state, BA_TASK_FREE);
+			}
+		}
+
+		if (done)
+			break;
+
+		(void) ConditionVariableTimedSleep(&cs->cv, 10, PG_WAIT_EXTENSION);
+	}
+	ConditionVariableCancelSleep();
+
+	pg_read_barrier();
+}
+
+/*
+ * Claim and do free tasks of the current phase as process me (0 for the
+ * leader). Stop when there are none left, or when the phase changes.
+ */
+static void
+run_compile_tasks(dsa_area *area, BACompileState *cs, int me)
+{
+	uint32	phase = pg_atomic_read_u32(&cs->phase);
+	int		ntasks;
+	int		i;
+
+	if (phase == BA_COMPILE_DONE)
+		return;
+	pg_read_barrier();
+	ntasks = phase == BA_COMPILE_INSERT ? cs->nranges : cs->nparts;
+
+	for (i = 0; i < ntasks; i++)
 	{
-		t = NULL;
+		BACompileTask *t = BA_COMPILE_TASK(cs, phase, i);
+		uint32		expected = BA_TASK_FREE;
+
+		if (pg_atomic_read_u32(&cs->phase) != phase || ShutdownRequestPending)
+			return;
+		if (!pg_atomic_compare_exchange_u32(&t->state, &expected, (uint32) me + 1))
+			continue;
+
+		if (phase == BA_COMPILE_SCAN)
+			scan_compile_part(area, cs, t);
+		else if (phase == BA_COMPILE_SPLIT)
+			split_compile_part(area, cs, BA_COMPILE_TASK(cs, BA_COMPILE_SCAN, i));
+		else if (!insert_compile_range(area, cs, t))
+			return;				/* given up; the leader does it again */
+
+		pg_write_barrier();
+		pg_atomic_write_u32(&t->state, BA_TASK_DONE);
+		ConditionVariableBroadcast(&cs->cv);
 	}
+}
+
+/* Bytes of the role arrays of n roles (see role_arrays()) */
+static Size
+role_arrays_size(int n)
+{
+	return 3 * MAXALIGN(n * sizeof(uint32)) + MAXALIGN(n * sizeof(uint8));
+}
+
+/*
+ * Arrays of a task for at most n roles at base: offsets and lengths of their
+ * names, hashes and days. For a part, names are in the text; for a range,
+ * they are copied after the arrays.
+ */
+static void
+role_arrays(char *base, int n, BARoleArrays *a)
+{
+	a->off = (uint32 *) base;
+	a->len = (uint32 *) (base + MAXALIGN(n * sizeof(uint32)));
+	a->hash = (uint32 *) (base + 2 * MAXALIGN(n * sizeof(uint32)));
+	a->days = (uint8 *) (base + 3 * MAXALIGN(n * sizeof(uint32)));
+	a->names = base + role_arrays_size(n);
+}
+
+/* Phase 1: find and hash the roles of a part of exclude_roles */
+static void
+scan_compile_part(dsa_area *area, BACompileState *cs, BACompileTask *t)
+{
+	const char	*text = (const char *) dsa_get_address(area, cs->text);
+	int			n = count_role_items(text, t->from, t->to);
+	dsa_pointer	roles;
+	BARoleArrays a;
+
+	roles = dsa_allocate_extended(area, role_arrays_size(n), DSA_ALLOC_HUGE);
+	role_arrays((char *) dsa_get_address(area, roles), n, &a);
+
+	t->nroles = scan_roles(text, t->from, t->to, t->group,
+						   (const uint8 *) dsa_get_address(area, cs->group_days),
+						   a.off, a.len, a.hash, a.days);
+	t->maxroles = n;
+	t->roles = roles;
+}
+
+/*
+ * Phase 2: sort the roles of a part by the range of role slots their hash
+ * lands in. order holds the start of each range in the sorted roles, and the
+ * end of the last one (nranges + 1 numbers), then the sorted role numbers.
+ */
+static void
+split_compile_part(dsa_area *area, BACompileState *cs, BACompileTask *part)
+{
+	uint32		mask = cs->nslots - 1;
+	uint32		*bounds;
+	uint32		*sorted;
+	uint32		*next;
+	dsa_pointer	order;
+	BARoleArrays a;
+	int			i;
+
+	role_arrays((char *) dsa_get_address(area, part->roles), part->maxroles, &a);
+
+	order = dsa_allocate_extended(area, (cs->nranges + 1 + part->nroles) * sizeof(uint32),
+								  DSA_ALLOC_HUGE | DSA_ALLOC_ZERO);
+	bounds = (uint32 *) dsa_get_address(area, order);
+	sorted = bounds + cs->nranges + 1;
+
+	for (i = 0; i < part->nroles; i++)
+		bounds[range_of(cs, a.hash[i] & mask) + 1]++;
+	for (i = 0; i < cs->nranges; i++)
+		bounds[i + 1] += bounds[i];
+
+	next = (uint32 *) palloc(cs->nranges * sizeof(uint32));
+	memcpy(next, bounds, cs->nranges * sizeof(uint32));
+	for (i = 0; i < part->nroles; i++)
+		sorted[next[range_of(cs, a.hash[i] & mask)]++] = i;
+	pfree(next);
+
+	part->order = order;
+}
+
+/*
+ * Phase 3: insert the roles whose hash lands in a range of role slots, as
+ * build_policy() does, merging duplicates. The range is small enough to
+ * stay in cache, where probing the whole table misses on each role. A role
+ * that would probe past the end of the range is left in the overflow of the
+ * task, for the leader. Return false if the task was given up.
+ */
+static bool
+insert_compile_range(dsa_area *area, BACompileState *cs, BACompileTask *t)
+{
+	const char	*text = (const char *) dsa_get_address(area, cs->text);
+	int32		*slots = (int32 *) dsa_get_address(area, cs->slots);
+	uint32		mask = cs->nslots - 1;
+	int			n = 0;
+	Size		names = 0;
+	uint32		used = 0;
+	dsa_pointer	roles;
+	BARoleArrays r;
+	BARoleArrays o = {0};
+	int			range = range_of(cs, t->from);
+	int			k;
+	uint32		j;
+	uint32		s;
+
+	/* roles whose hash lands in the range, at most */
+	for (k = 0; k < cs->nparts; k++)
+	{
+		BACompileTask *part = BA_COMPILE_TASK(cs, BA_COMPILE_SCAN, k);
+		uint32		*bounds = (uint32 *) dsa_get_address(area, part->order);
+		uint32		*sorted = bounds + cs->nranges + 1;
+		BARoleArrays a;
+
+		role_arrays((char *) dsa_get_address(area, part->roles), part->maxroles, &a);
+		for (j = bounds[range]; j < bounds[range + 1]; j++)
+			names += a.len[sorted[j]] + 1;
+		n += bounds[range + 1] - bounds[range];
+	}
+
+	roles = dsa_allocate_extended(area, role_arrays_size(n) + names, DSA_ALLOC_HUGE);
+	role_arrays((char *) dsa_get_address(area, roles), n, &r);
+	t->overflow = InvalidDsaPointer;
+	t->noverflow = 0;
+	t->nroles = 0;
+
+	for (s = t->from; s < t->to; s++)
+		slots[s] = -1;
+
+	for (k = 0; k < cs->nparts; k++)
+	{
+		BACompileTask *part = BA_COMPILE_TASK(cs, BA_COMPILE_SCAN, k);
+		uint32		*bounds = (uint32 *) dsa_get_address(area, part->order);
+		uint32		*sorted = bounds + cs->nranges + 1;
+		BARoleArrays a;
+
+		if (ShutdownRequestPending || pg_atomic_read_u32(&cs->phase) != BA_COMPILE_INSERT)
+			return false;
+
+		role_arrays((char *) dsa_get_address(area, part->roles), part->maxroles, &a);
+		for (j = bounds[range]; j < bounds[range + 1]; j++)
+		{
+			int			i = sorted[j];
+			uint32		h = a.hash[i];
+			uint32		len = a.len[i];
+
+			s = h & mask;
+
+			for (; s < t->to && slots[s] >= 0; s++)
+			{
+				int		role = slots[s];
+
+				if (r.hash[role] == h && r.len[role] == len &&
+					memcmp(r.names + r.off[role], text + a.off[i], len) == 0)
+					break;
+			}
+
+			if (s == t->to)
+			{
+				if (!DsaPointerIsValid(t->overflow))
+				{
+					t->overflow = dsa_allocate_extended(area, role_arrays_size(n), DSA_ALLOC_HUGE);
+					role_arrays((char *) dsa_get_address(area, t->overflow), n, &o);
+				}
+				o.off[t->noverflow] = a.off[i];
+				o.len[t->noverflow] = len;
+				o.hash[t->noverflow] = h;
+				o.days[t->noverflow] = a.days[i];
+				t->noverflow++;
+				continue;
+			}
+
+			if (slots[s] < 0)
+			{
+				slots[s] = t->nroles;
+				r.off[t->nroles] = used;
+				r.len[t->nroles] = len;
+				r.hash[t->nroles] = h;
+				r.days[t->nroles] = 0;
+				memcpy(r.names + used, text + a.off[i], len);
+				r.names[used + len] = '\0';
+				used += len + 1;
+				t->nroles++;
+			}
+
+			r.days[slots[s]] |= a.days[i];
+		}
+	}
+
+	t->maxroles = n;
+	t->roles = roles;
+	t->names = used;
+
+	return true;
+}
+
+/*
+ * Lay out the policy in cxt from the ranges: roles are numbered range after
+ * range, then the overflows of the ranges are inserted, probing the whole
+ * table as build_policy() does. slots are the role slots of cs.
+ */
+static BAPolicy *
+merge_compile_ranges(MemoryContext cxt, dsa_area *area, BACompileState *cs,
+					 BAIntervalRole *parsed, int nintervals, int32 *slots, Size extra)
+{
+	const char	*text = (const char *) dsa_get_address(area, cs->text);
+	uint32		mask = cs->nslots - 1;
+	int			maxroles = 0;
+	int			nroles = 0;
+	Size		names = 0;
+	char		**roles;
+	uint32		*role_hash;
+	uint8		*role_days;
+	BAPolicy	*p;
+	int			k;
+	int			i;
+	uint32		s;
+
+	for (k = 0; k < cs->nranges; k++)
+		maxroles += BA_COMPILE_TASK(cs, BA_COMPILE_INSERT, k)->nroles +
+			BA_COMPILE_TASK(cs, BA_COMPILE_INSERT, k)->noverflow;
+
+	roles = (char **) palloc(Max(maxroles, 1) * sizeof(char *));
+	role_hash = (uint32 *) palloc(Max(maxroles, 1) * sizeof(uint32));
+	role_days = (uint8 *) palloc(Max(maxroles, 1) * sizeof(uint8));
+
+	for (k = 0; k < cs->nranges; k++)
+	{
+		BACompileTask *t = BA_COMPILE_TASK(cs, BA_COMPILE_INSERT, k);
+		BARoleArrays r;
+
+		role_arrays((char *) dsa_get_address(area, t->roles), t->maxroles, &r);
+		for (i = 0; i < t->nroles; i++)
+		{
+			roles[nroles + i] = r.names + r.off[i];
+			role_hash[nroles + i] = r.hash[i];
+			role_days[nroles + i] = r.days[i];
+		}
+		for (s = t->from; s < t->to; s++)
+			if (slots[s] >= 0)
+				slots[s] += nroles;
+		nroles += t->nroles;
+		names += t->names;
+	}
+
+	for (k = 0; k < cs->nranges; k++)
+	{
+		BACompileTask *t = BA_COMPILE_TASK(cs, BA_COMPILE_INSERT, k);
+		BARoleArrays o;
+
+		if (t->noverflow == 0)
+			continue;
+
+		role_arrays((char *) dsa_get_address(area, t->overflow), t->maxroles, &o);
+		for (i = 0; i < t->noverflow; i++)
+		{
+			const char *name = text + o.off[i];
+			uint32		len = o.len[i];
+
+			for (s = o.hash[i] & mask; slots[s] >= 0; s = (s + 1) & mask)
+			{
+				int		role = slots[s];
+
+				if (role_hash[role] == o.hash[i] &&
+					strncmp(roles[role], name, len) == 0 && roles[role][len] == '\0')
+					break;
+			}
+
+			if (slots[s] < 0)
+			{
+				slots[s] = nroles;
+				roles[nroles] = pnstrdup(name, len);
+				role_hash[nroles] = o.hash[i];
+				role_days[nroles] = 0;
+				names += len + 1;
+				nroles++;
+			}
+
+			role_days[slots[s]] |= o.days[i];
+		}
+	}
+
+	p = layout_policy(cxt, parsed, nintervals, nroles, roles, role_hash, role_days,
+					  cs->nslots, names, extra);
+	memcpy(policy_role_slots(p), slots, cs->nslots * sizeof(int32));
+
+	return p;
+}
+
+/*
+ * Wait for the compile workers to exit. Those that are not started yet are
+ * stopped, and so are the others if abort is true: they exit cleanly, at
+ * their next check of ShutdownRequestPending.
+ */
+static void
+finish_compile_workers(BackgroundWorkerHandle **handles, int nlaunched, bool abort)
+{
+	int		i;
+
+	for (i = 0; i < nlaunched; i++)
+	{
+		pid_t	pid;
+
+		if (abort || GetBackgroundWorkerPid(handles[i], &pid) == BGWH_NOT_YET_STARTED)
+			TerminateBackgroundWorker(handles[i]);
+	}
+
+	/* at an error, the workers are not waited for */
+	if (abort)
+		return;
+
+	for (i = 0; i < nlaunched; i++)
+		(void) WaitForBackgroundWorkerShutdown(handles[i]);
+}
+
+/*
+ * Entry point of compile workers: take part in the phases of the parallel
+ * compilation described by bgw_extra, and exit. Nothing is left to clean up
+ * if the worker stops halfway; the leader does the task again.
+ */
+void
+block_access_compile_main(Datum main_arg)
+{
+	int					me = DatumGetInt32(main_arg);
+	BACompileWorkerArgs	args;
+	dsa_area			*area;
+	BACompileState		*cs;
+	uint32				phase;
+
+	pqsignal(SIGTERM, SignalHandlerForShutdownRequest);
+	BackgroundWorkerUnblockSignals();
+
+	memcpy(&args, MyBgworkerEntry->bgw_extra, sizeof(args));
+	LWLockRegisterTranche(args.tranche, "block_access policies");
+	area = dsa_attach(args.handle);
+	cs = (BACompileState *) dsa_get_address(area, args.state);
+
+	for (phase = BA_COMPILE_SCAN; phase < BA_COMPILE_DONE; phase++)
+	{
+		/* the leader starts a phase once the previous one is done */
+		ConditionVariablePrepareToSleep(&cs->cv);
+		while (pg_atomic_read_u32(&cs->phase) < phase && !ShutdownRequestPending &&
+			   BackendPidGetProc(cs->leader_pid) != NULL)
+			(void) ConditionVariableTimedSleep(&cs->cv, 100, PG_WAIT_EXTENSION);
+		ConditionVariableCancelSleep();
+
+		if (pg_atomic_read_u32(&cs->phase) < phase)
+			break;
+		run_compile_tasks(area, cs, me);
+	}
+
+	dsa_detach(area);
+	proc_exit(0);
+}
+
+/*
+ * Move a compiled policy to pages of its own, read-only if
+ * block_access.protect_policy is on.
+ *
+ * The postmaster compiles block_access.intervals and exclude_roles, and every
+ * backend reads the result. In a memory context, it would share pages with
+ * other postmaster data that is written after fork(), and each backend could
+ * end up with private copies of them. Pages that hold only the policy stay
+ * shared for as long as nobody writes them. If the pages cannot be mapped,
+ * the policy is kept where it is.
+ */
+static BAPolicy *
+policy_seal(BAPolicy *p)
+{
+#ifndef WIN32
+	Size		pagesize = (Size) sysconf(_SC_PAGESIZE);
+	Size		mapped = TYPEALIGN(pagesize, p->length);
+	void		*addr;
+	BAPolicy	*sealed;
+
+	addr = mmap(NULL, mapped, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (addr == MAP_FAILED)
+	{
+		elog(DEBUG1, "could not map %zu bytes for policy: %m", mapped);
+		return p;
+	}
+
+	sealed = policy_flatten(p, addr);
+	sealed->size = mapped;
+	sealed->mapped = mapped;
+	MemoryContextDelete(p->cxt);
+
+	if (protect_policy && mprotect(addr, mapped, PROT_READ) != 0)
+		elog(DEBUG1, "could not protect policy: %m");
+
+	return sealed;
+#else
+	return p;
+#endif
+}
+
+static void
+policy_free(BAPolicy *p)
+{
+#ifndef WIN32
+	if (p->mapped > 0)
+	{
+		munmap((void *) p, p->mapped);
+		return;
+	}
+#endif
+	MemoryContextDelete(p->cxt);
+}
+
+/*
+ * Count the pages of a sealed policy that are resident in this process, and
+ * those that are also mapped by another process (that is, not copied on
+ * write since the postmaster compiled the policy). It uses
+ * /proc/self/pagemap, so it is only available on Linux.
+ */
+static bool
+policy_pages(BAPolicy *p, uint64 *resident, uint64 *shared)
+{
+#ifdef __linux__
+	Size		pagesize = (Size) sysconf(_SC_PAGESIZE);
+	Size		npages;
+	uint64		entry;
+	int			fd;
+	Size		i;
+
+	*resident = 0;
+	*shared = 0;
+
+	if (p->mapped == 0)
+		return false;
+
+	fd = OpenTransientFile("/proc/self/pagemap", O_RDONLY | PG_BINARY);
+	if (fd < 0)
+		return false;
+
+	npages = p->mapped / pagesize;
+	for (i = 0; i < npages; i++)
+	{
+		off_t	offset = (off_t) (((uintptr_t) p / pagesize + i) * sizeof(uint64));
+
+		if (pg_pread(fd, &entry, sizeof(entry), offset) != sizeof(entry))
+		{
+			CloseTransientFile(fd);
+			return false;
+		}
+
+		/* bit 63: present; bit 56: mapped exclusively */
+		if ((entry & (UINT64CONST(1) << 63)) != 0)
+		{
+			(*resident)++;
+			if ((entry & (UINT64CONST(1) << 56)) == 0)
+				(*shared)++;
+		}
+	}
+
+	CloseTransientFile(fd);
+
+	return true;
+#else
+	return false;
+#endif
+}
+
+/*
+ * Replace *target with a policy compiled from intervals and roles, unless it
+ * was compiled from the same ones. Recompiling a policy with many roles that
+ * did not change is not free.
+ *
+ * The new policy is compared with previous, the last generation, and reuses
+ * its role entries if it can. That is *target if previous is NULL.
+ */
+static void
+install_policy(BAPolicy **target, const char *intervals, const char *roles,
+			   BAPolicy *previous)
+{
+	BAPolicy	*newpolicy;
+	BAPolicy	*oldpolicy = *target;
+
+	if (!policy_outdated(oldpolicy, intervals, roles))
+	{
+		elog(DEBUG1, "policy %lu is up to date", (unsigned long) oldpolicy->generation);
+		return;
+	}
+
+	if (previous == NULL)
+		previous = oldpolicy;
+
+	newpolicy = compile_policy(intervals, roles, previous);
+
+	/* what changed, for those that review a reload */
+	if (previous != NULL &&
+		policy_error(previous) == NULL && previous->nintervals > 0 &&
+		policy_error(newpolicy) == NULL && newpolicy->nintervals > 0)
+	{
+		int		added;
+		int		removed;
+		int		changed;
+		bool	others;
+
+		policy_diff(previous, newpolicy, &added, &removed, &changed);
+		others = memcmp(&policy_schedules(previous)[0], &policy_schedules(newpolicy)[0],
+						sizeof(BASchedule)) != 0;
+		newpolicy->changed_roles = added + removed + changed;
+
+		ereport(LOG,
+				(errmsg("block_access: %s compiled in %.3f ms%s: %d roles added, %d removed, %d changed%s",
+						target == &shadow_policy ? "shadow policy" : "policy",
+						newpolicy->compile_time * 1000.0,
+						newpolicy->roles_from != 0 ? " (role entries reused)" :
+						newpolicy->workers > 0 ? psprintf(" (%d workers)", newpolicy->workers) : "",
+						added, removed, changed,
+						others ? ", schedule of other roles changed" : "")));
+	}
+
+	newpolicy = policy_seal(newpolicy);
+	if (oldpolicy != NULL)
+		policy_free(oldpolicy);
+	*target = newpolicy;
+}
+
+/*
+ * Assign hooks only tell whether the policy still matches its parameters. A
+ * reload calls them one parameter at a time, so the last call sees both new
+ * values; the policy is compiled once, when it is needed (see BA_GUC_SLOTS).
+ */
+static bool
+policy_outdated(BAPolicy *p, const char *intervals, const char *roles)
+{
+	return p == NULL ||
+		strcmp(policy_intervals(p), intervals != NULL ? intervals : "") != 0 ||
+		strcmp(policy_exclude_roles(p), roles != NULL ? roles : "") != 0;
+}
+
+static void
+assign_interval_time(const char *newval, void *extra)
+{
+	policy_stale = policy_outdated(policy, newval, exclude_roles);
+}
+
+static void
+assign_exclude_roles(const char *newval, void *extra)
+{
+	policy_stale = policy_outdated(policy, interval_time_value, newval);
+}
+
+static void
+assign_shadow_interval_time(const char *newval, void *extra)
+{
+	shadow_policy_stale = policy_outdated(shadow_policy, newval, shadow_exclude_roles);
+}
+
+static void
+assign_shadow_exclude_roles(const char *newval, void *extra)
+{
+	shadow_policy_stale = policy_outdated(shadow_policy, shadow_interval_time, newval);
+}
+
+/*
+ * Slot of the named policy, or -1. Caller must hold policy_lock.
+ */
+static int
+find_policy_slot(const char *name)
+{
+	int		i;
+
+	for (i = 0; i < max_policies; i++)
+		if (strcmp(policy_slots[i].name, name) == 0)
+			return i;
+
+	return -1;
+}
+
+/*
+ * Policy called name: slot number + 1, 0 for the default policy, or -1.
+ * Caller must hold policy_lock.
+ */
+static int
+policy_by_name(const char *name)
+{
+	int		i;
+
+	if (strcmp(name, BA_DEFAULT_POLICY) == 0)
+		return 0;
+	if (name[0] == '\0')
+		return -1;
+
+	i = find_policy_slot(name);
+	return i < 0 ? -1 : i + 1;
+}
+
+/*
+ * Free slot i and forget it in the rollback history. Caller must hold
+ * policy_lock exclusively and check that the policy is neither active nor
+ * scheduled.
+ */
+static void
+remove_policy(int i)
+{
+	int		j;
+	int		n;
+
+	n = 0;
+	for (j = 0; j < ba_state->nhistory; j++)
+		if (ba_state->history[j] != i + 1)
+			ba_state->history[n++] = ba_state->history[j];
+	ba_state->nhistory = n;
+
+	policy_slots[i].name[0] = '\0';
+	policy_slots[i].size = 0;
+	dsa_free(policy_area, policy_slots[i].data);
+	policy_slots[i].data = InvalidDsaPointer;
+
+	/* give memory back if a whole segment is free */
+	dsa_trim(policy_area);
+}
+
+/*
+ * Bytes of a slot buffer used by a policy and its source text
+ */
+static Size
+policy_slot_size(BAPolicy *p, const char *intervals, const char *roles)
+{
+	return add_size(policy_flat_size(p),
+					add_size(strlen(intervals) + 1, strlen(roles) + 1));
+}
+
+/*
+ * Copy a policy and its source text to a new chunk for slot i, and free the
+ * previous one. Return false if there is not enough dynamic shared memory.
+ * Caller must hold policy_lock exclusively.
+ */
+static bool
+fill_policy_slot(int i, const char *name, BAPolicy *p, const char *intervals, const char *roles)
+{
+	BAPolicySlot	*slot = &policy_slots[i];
+	Size			ilen = strlen(intervals) + 1;
+	Size			rlen = strlen(roles) + 1;
+	dsa_pointer		data;
+	dsa_pointer		old = slot->data;
+
+	data = dsa_allocate_extended(policy_area, policy_slot_size(p, intervals, roles),
+								 DSA_ALLOC_HUGE | DSA_ALLOC_NO_OOM);
+	if (!DsaPointerIsValid(data))
+		return false;
+
+	slot->data = data;
+	policy_flatten(p, slot_data(i));
+	slot->intervals_off = policy_flat_size(p);
+	memcpy(slot_intervals(i), intervals, ilen);
+	slot->exclude_roles_off = slot->intervals_off + ilen;
+	memcpy(slot_exclude_roles(i), roles, rlen);
+	slot->size = policy_slot_size(p, intervals, roles);
+	strlcpy(slot->name, name, NAMEDATALEN);
+
+	if (DsaPointerIsValid(old))
+		dsa_free(policy_area, old);
+
+	return true;
+}
+
+/*
+ * Store a valid compiled policy under name, replacing any policy with the
+ * same name. If it cannot be stored, report it at elevel and return false.
+ * Caller must hold policy_lock exclusively.
+ */
+static bool
+store_policy(const char *name, BAPolicy *p, const char *intervals, const char *roles, int elevel)
+{
+	Size			size;
+	int				i;
+
+	size = policy_slot_size(p, intervals, roles);
+	if (size > (Size) max_policy_size * 1024)
+	{
+		ereport(elevel,
+				(errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+				 errmsg("policy \"%s\" needs %zu bytes", name, size),
+				 errhint("Increase block_access.max_policy_size.")));
+		return false;
+	}
+
+	i = find_policy_slot(name);
+	if (i < 0)
+		i = find_policy_slot("");
+	if (i < 0)
+	{
+		ereport(elevel,
+				(errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+				 errmsg("too many policies"),
+				 errhint("Drop a policy or increase block_access.max_policies.")));
+		return false;
+	}
+
+	if (!fill_policy_slot(i, name, p, intervals, roles))
+	{
+		ereport(elevel,
+				(errcode(ERRCODE_OUT_OF_MEMORY),
+				 errmsg("out of shared memory"),
+				 errdetail("Failed on request of size %zu for policy \"%s\".", size, name)));
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * Attach to the dynamic shared memory area of the policies, if not done yet.
+ * The first process that gets there restores the policies saved at the last
+ * shutdown.
+ */
+static void
+attach_policy_store(void)
+{
+	if (policy_area == NULL)
+	{
+		MemoryContext	oldcxt = MemoryContextSwitchTo(TopMemoryContext);
+
+		LWLockRegisterTranche(ba_state->area_tranche, "block_access policies");
+		policy_area = dsa_attach_in_place(ba_state->area, NULL);
+		dsa_pin_mapping(policy_area);
+
+		MemoryContextSwitchTo(oldcxt);
+	}
+
+	if (pg_atomic_read_u32(&ba_state->loaded) == 0)
+	{
+		LWLockAcquire(ba_state->policy_lock, LW_EXCLUSIVE);
+		if (pg_atomic_read_u32(&ba_state->loaded) == 0)
+		{
+			load_policies();
+			pg_atomic_write_u32(&ba_state->loaded, 1);
+		}
+		LWLockRelease(ba_state->policy_lock);
+	}
+}
+
+/*
+ * Policy compiled from block_access.intervals and exclude_roles (or from the
+ * shadow parameters) in a backend that did not inherit an up-to-date one; see
+ * BA_GUC_SLOTS. Caller must hold policy_lock in shared mode; it is released
+ * and taken again if the policy has to be compiled.
+ */
+static BAPolicy *
+guc_policy(bool shadow)
+{
+	BAPolicy	**local = shadow ? &shadow_policy : &policy;
+	bool		*stale = shadow ? &shadow_policy_stale : &policy_stale;
+	const char	*intervals = shadow ? shadow_interval_time : interval_time_value;
+	const char	*roles = shadow ? shadow_exclude_roles : exclude_roles;
+	int			i = shadow ? BA_SHADOW_SLOT : BA_DEFAULT_SLOT;
+	const char	*ikey = intervals != NULL ? intervals : "";
+	const char	*rkey = roles != NULL ? roles : "";
+	pg_atomic_uint32 *compiler = &ba_state->compiler[shadow ? 1 : 0];
+	BAPolicy	*previous;
+	bool		waited = false;
+	instr_time	start;
+
+	if (*local != NULL && !*stale)
+		return *local;
+
+	/*
+	 * After a reload, every new backend finds a stale slot. Only one of them
+	 * compiles the policy; the others wait for it to be published. If the
+	 * compiling backend is gone, the next one takes over.
+	 */
+	for (;;)
+	{
+		uint32	pid;
+
+		if (policy_slots[i].name[0] != '\0' &&
+			strcmp(slot_intervals(i), ikey) == 0 &&
+			strcmp(slot_exclude_roles(i), rkey) == 0)
+		{
+			if (waited)
+			{
+				instr_time	duration;
+
+				ConditionVariableCancelSleep();
+				INSTR_TIME_SET_CURRENT(duration);
+				INSTR_TIME_SUBTRACT(duration, start);
+				pg_atomic_fetch_add_u64(&ba_state->counters.compile_waits, 1);
+				pg_atomic_fetch_add_u64(&ba_state->counters.compile_wait_time,
+										INSTR_TIME_GET_MICROSEC(duration) * 1000);
+			}
+			return slot_policy(i);
+		}
+
+		pid = pg_atomic_read_u32(compiler);
+		if (pid == 0 || BackendPidGetProc((int) pid) == NULL)
+		{
+			if (pg_atomic_compare_exchange_u32(compiler, &pid, (uint32) MyProcPid))
+				break;
+			continue;
+		}
+
+		if (!waited)
+		{
+			waited = true;
+			INSTR_TIME_SET_CURRENT(start);
+		}
+
+		LWLockRelease(ba_state->policy_lock);
+		(void) ConditionVariableTimedSleep(&ba_state->compile_cv, 10, PG_WAIT_EXTENSION);
+		LWLockAcquire(ba_state->policy_lock, LW_SHARED);
+	}
+
+	if (waited)
+		ConditionVariableCancelSleep();
+
+	/*
+	 * The slot holds the last generation, compiled by any backend. Only the
+	 * compiling backend replaces it, so it stays valid without the lock.
+	 */
+	previous = policy_slots[i].name[0] != '\0' ? slot_policy(i) : NULL;
+
+	LWLockRelease(ba_state->policy_lock);
+
+	install_policy(local, intervals, roles, previous);
+	*stale = false;
+	pg_atomic_fetch_add_u64(&ba_state->counters.compiles, 1);
+
+	/* share it, unless somebody else did it while we compiled */
+	LWLockAcquire(ba_state->policy_lock, LW_EXCLUSIVE);
+	if ((policy_slots[i].name[0] == '\0' ||
+		 strcmp(slot_intervals(i), ikey) != 0 ||
+		 strcmp(slot_exclude_roles(i), rkey) != 0) &&
+		policy_slot_size(*local, ikey, rkey) <= (Size) max_policy_size * 1024 &&
+		fill_policy_slot(i, shadow ? "shadow" : BA_DEFAULT_POLICY, *local, ikey, rkey))
+		slot_policy(i)->generation = pg_atomic_add_fetch_u64(&ba_state->generation, 1);
+	pg_atomic_write_u32(compiler, 0);
+	LWLockRelease(ba_state->policy_lock);
+
+	ConditionVariableBroadcast(&ba_state->compile_cv);
+
+	LWLockAcquire(ba_state->policy_lock, LW_SHARED);
+
+	return *local;
+}
+
+/*
+ * GUC policy as the other backends see it, for reports: the copy published in
+ * its slot, whose generation is the same in every backend, or the one the
+ * postmaster compiled if none was published since startup. *size is set to
+ * the memory it uses. Caller must hold policy_lock in shared mode, as for
+ * guc_policy().
+ */
+static BAPolicy *
+shared_guc_policy(bool shadow, Size *size)
+{
+	BAPolicy	*p = guc_policy(shadow);
+	int			i = shadow ? BA_SHADOW_SLOT : BA_DEFAULT_SLOT;
+
+	if (policy_slots[i].name[0] != '\0' &&
+		strcmp(slot_intervals(i), policy_intervals(p)) == 0 &&
+		strcmp(slot_exclude_roles(i), policy_exclude_roles(p)) == 0)
+	{
+		*size = policy_slots[i].size;
+		return slot_policy(i);
+	}
+
+	*size = p->size;
+	return p;
+}
+
+/*
+ * Compile the policies of this process that are missing or stale. Only when
+ * there are no shared slots to publish them in: the postmaster at startup,
+ * and backends when block_access is not in shared_preload_libraries. Others
+ * go through guc_policy(), so that a reload compiles each policy once.
+ */
+static void
+compile_guc_policies(void)
+{
+	if (policy == NULL || policy_stale)
+	{
+		install_policy(&policy, interval_time_value, exclude_roles, NULL);
+		policy_stale = false;
+	}
+	if (shadow_policy == NULL || shadow_policy_stale)
+	{
+		install_policy(&shadow_policy, shadow_interval_time, shadow_exclude_roles, NULL);
+		shadow_policy_stale = false;
+	}
+}
+
+/*
+ * Make active (slot number + 1, or 0 for the default policy) the active
+ * policy. If remember is true, the current one is pushed into the rollback
+ * history. Caller must hold policy_lock exclusively.
+ */
+static void
+activate_policy(uint32 active, bool remember)
+{
+	uint32	previous = pg_atomic_read_u32(&ba_state->active);
+
+	if (remember && previous != active)
+	{
+		memmove(&ba_state->history[1], &ba_state->history[0],
+				(BA_ROLLBACK_DEPTH - 1) * sizeof(uint32));
+		ba_state->history[0] = previous;
+		ba_state->nhistory = Min(ba_state->nhistory + 1, BA_ROLLBACK_DEPTH);
+	}
+
+	pg_atomic_write_u32(&ba_state->active, active);
+	pg_atomic_fetch_add_u64(&ba_state->activations, 1);
+}
+
+/*
+ * Name of a policy (slot number + 1, or 0). Caller must hold policy_lock.
+ */
+static const char *
+active_policy_name(uint32 active)
+{
+	if (active == 0)
+		return BA_DEFAULT_POLICY;
+	return policy_slots[active - 1].name;
+}
+
+/*
+ * Add a pending activation of active (slot number + 1, or 0) at time at.
+ * Caller must hold policy_lock exclusively.
+ */
+static void
+schedule_switch(uint32 active, pg_time_t at)
+{
+	int		i;
+
+	if (ba_state->nscheduled >= BA_MAX_SCHEDULED)
+		ereport(ERROR,
+				(errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+				 errmsg("too many scheduled activations")));
+
+	/* keep them sorted by time */
+	for (i = ba_state->nscheduled; i > 0 && ba_state->scheduled[i - 1].at > at; i--)
+		ba_state->scheduled[i] = ba_state->scheduled[i - 1];
+	ba_state->scheduled[i].active = active;
+	ba_state->scheduled[i].at = at;
+	ba_state->nscheduled++;
+
+	pg_atomic_write_u64(&ba_state->next_switch, (uint64) ba_state->scheduled[0].at);
+}
+
+/*
+ * Apply due scheduled activations, if any. Only the authentication hook and
+ * the background workers do it; functions that report the active policy use
+ * effective_active().
+ */
+static void
+check_scheduled_switches(pg_time_t now)
+{
+	uint64		next_switch = pg_atomic_read_u64(&ba_state->next_switch);
+
+	if (next_switch != 0 && (uint64) now >= next_switch)
+		apply_scheduled_switches(now);
+}
+
+/*
+ * Policy active at now (slot number + 1, or 0 for the default policy): the
+ * target of the last due scheduled activation, even if it was not applied
+ * yet. Caller must hold policy_lock.
+ */
+static uint32
+effective_active(pg_time_t now)
+{
+	uint32	active = pg_atomic_read_u32(&ba_state->active);
+	int		i;
+
+	for (i = 0; i < ba_state->nscheduled && ba_state->scheduled[i].at <= now; i++)
+		active = ba_state->scheduled[i].active;
+
+	return active;
+}
+
+/*
+ * Activate every scheduled policy whose time has come, and WAL-log it. This
+ * is called from the authentication hook, so it does not throw: if the switch
+ * cannot be WAL-logged, it is reported, the state is put back as it was, and
+ * the next login tries again. Standbys do not switch by themselves: they
+ * replay the switch of the primary, and enforce the due policy until then
+ * (see effective_active()).
+ *
+ * The record is flushed, and the named policies are saved, after policy_lock
+ * is released; saving is left to the next SQL function or background worker
+ * (see save_pending_policies()).
+ */
+static void
+apply_scheduled_switches(pg_time_t now)
+{
+	MemoryContext	oldcxt = CurrentMemoryContext;
+	uint32			active;
+	int				nhistory;
+	uint32			history[BA_ROLLBACK_DEPTH];
+	int				nscheduled;
+	BAScheduledSwitch	scheduled[BA_MAX_SCHEDULED];
+	uint64			activations;
+	XLogRecPtr		lsn = InvalidXLogRecPtr;
+	volatile bool	logged = false;
+	int				ndue = 0;
+	int				i;
+
+#if PG_VERSION_NUM >= 150000
+	if (RecoveryInProgress())
+		return;
+#endif
+
+	LWLockAcquire(ba_state->policy_lock, LW_EXCLUSIVE);
+
+	/* somebody else could have done it while we waited */
+	while (ndue < ba_state->nscheduled && ba_state->scheduled[ndue].at <= now)
+		ndue++;
+
+	if (ndue == 0)
+	{
+		LWLockRelease(ba_state->policy_lock);
+		return;
+	}
+
+	/* to put it back if the switch cannot be logged */
+	active = pg_atomic_read_u32(&ba_state->active);
+	activations = pg_atomic_read_u64(&ba_state->activations);
+	nhistory = ba_state->nhistory;
+	memcpy(history, ba_state->history, sizeof(history));
+	nscheduled = ba_state->nscheduled;
+	memcpy(scheduled, ba_state->scheduled, sizeof(scheduled));
+
+	for (i = 0; i < ndue; i++)
+		activate_policy(scheduled[i].active, true);
+	ba_state->nscheduled -= ndue;
+	memmove(&ba_state->scheduled[0], &ba_state->scheduled[ndue],
+			ba_state->nscheduled * sizeof(BAScheduledSwitch));
+
+	PG_TRY();
+	{
+		lsn = insert_policy_state();
+		logged = true;
+	}
+	PG_CATCH();
+	{
+		ErrorData	*edata;
+
+		MemoryContextSwitchTo(oldcxt);
+		edata = CopyErrorData();
+		FlushErrorState();
+
+		ereport(LOG,
+				(errmsg("block_access: could not log scheduled activation of policy \"%s\": %s",
+						active_policy_name(scheduled[ndue - 1].active), edata->message)));
+		FreeErrorData(edata);
+	}
+	PG_END_TRY();
+
+	if (logged)
+	{
+		for (i = 0; i < ndue; i++)
+			ereport(LOG,
+					(errmsg("block_access: policy \"%s\" activated as scheduled",
+							active_policy_name(scheduled[i].active))));
+		pg_atomic_write_u64(&ba_state->next_switch,
+							ba_state->nscheduled > 0 ? (uint64) ba_state->scheduled[0].at : 0);
+		pg_atomic_write_u32(&ba_state->save_pending, 1);
+	}
+	else
+	{
+		pg_atomic_write_u32(&ba_state->active, active);
+		pg_atomic_write_u64(&ba_state->activations, activations);
+		ba_state->nhistory = nhistory;
+		memcpy(ba_state->history, history, sizeof(history));
+		ba_state->nscheduled = nscheduled;
+		memcpy(ba_state->scheduled, scheduled, sizeof(scheduled));
+	}
+
+	LWLockRelease(ba_state->policy_lock);
+
+	if (logged && !XLogRecPtrIsInvalid(lsn))
+	{
+		PG_TRY();
+		{
+			XLogFlush(lsn);
+		}
+		PG_CATCH();
+		{
+			ErrorData	*edata;
+
+			MemoryContextSwitchTo(oldcxt);
+			edata = CopyErrorData();
+			FlushErrorState();
+
+			ereport(LOG,
+					(errmsg("block_access: could not flush scheduled activation: %s",
+							edata->message)));
+			FreeErrorData(edata);
+		}
+		PG_END_TRY();
+	}
+}
+
+/*
+ * Save the named policies if a scheduled activation was applied at login
+ * since they were last saved. Should the server stop before that, the
+ * activation is still in the file, and the first login after the restart
+ * applies it again.
+ */
+static void
+save_pending_policies(void)
+{
+	if (pg_atomic_read_u32(&ba_state->save_pending) == 0)
+		return;
+
+	LWLockAcquire(ba_state->policy_lock, LW_EXCLUSIVE);
+	if (pg_atomic_read_u32(&ba_state->save_pending) != 0)
+		save_policies(LOG);
+	LWLockRelease(ba_state->policy_lock);
+}
+
+/*
+ * Account one call to the authentication hook in shared memory. slot is the
+ * hour of the week of an evaluated login, or -1.
+ */
+static void
+count_check(int verdict, bool exempted, bool error, int slot, uint64 elapsed_ns)
+{
+	uint64	bound;
+	int		i;
+
+	if (ba_state == NULL)
+		return;
+
+	pg_atomic_fetch_add_u64(&ba_state->counters.checks, 1);
+
+	if (error)
+		pg_atomic_fetch_add_u64(&ba_state->counters.errors, 1);
+	else if (verdict == BA_VERDICT_DENIED)
+		pg_atomic_fetch_add_u64(&ba_state->counters.denied, 1);
+	else if (verdict == BA_VERDICT_ALLOWED)
+		pg_atomic_fetch_add_u64(&ba_state->counters.allowed, 1);
+	else
+		pg_atomic_fetch_add_u64(&ba_state->counters.skipped, 1);
+
+	if (exempted)
+		pg_atomic_fetch_add_u64(&ba_state->counters.exempted, 1);
+
+	if (slot >= 0 && verdict == BA_VERDICT_ALLOWED)
+		pg_atomic_fetch_add_u64(&ba_state->counters.demand_allowed[slot], 1);
+	else if (slot >= 0 && verdict == BA_VERDICT_DENIED)
+		pg_atomic_fetch_add_u64(&ba_state->counters.demand_denied[slot], 1);
+
+	/* smallest bucket whose bound (in microseconds) is not exceeded */
+	bound = 1000;
+	for (i = 0; i < BA_LATENCY_BUCKETS - 1 && elapsed_ns > bound; i++)
+		bound <<= 1;
+
+	pg_atomic_fetch_add_u64(&ba_state->counters.latency[i], 1);
+	pg_atomic_fetch_add_u64(&ba_state->counters.latency_sum, elapsed_ns);
+}
+
+/*
+ * Is the kill switch on? Turn it off if its timeout has passed.
+ */
+static bool
+enforcement_disabled(pg_time_t now)
+{
+	uint64	disabled_until;
+
+	if (ba_state == NULL)
+		return false;
+
+	disabled_until = pg_atomic_read_u64(&ba_state->disabled_until);
+	if (disabled_until == 0)
+		return false;
+
+	if ((uint64) now < disabled_until)
+		return true;
+
+	/* only one backend logs it */
+	if (pg_atomic_compare_exchange_u64(&ba_state->disabled_until, &disabled_until, 0))
+		ereport(LOG,
+				(errmsg("block_access: enforcement turned back on at the end of its timeout"),
+				 errhidestmt(true)));
+
+	return false;
+}
+
+/*
+ * Check authentication
+ */
+static void
+block_access_checks(Port *port, int status)
+{
+	int				verdict = BA_VERDICT_SKIPPED;
+	bool			enforce = (status == STATUS_OK);
+	bool			exempted = false;
+	const char		*error = NULL;
+	int				slot = -1;
+	int				minute = -1;
+	int				second = 0;
+	int				next = -1;
+	BAPolicy		*p = policy;
+	BAPolicy		*sp = shadow_policy;
+	bool			locked = false;
+	time_t			t;
+	instr_time		start;
+	instr_time		duration;
+	uint64			elapsed_ns;
+
+	/*
+	 * Any other plugins which use ClientAuthentication_hook.
+	 */
+	if (original_client_auth_hook)
+		original_client_auth_hook(port, status);
+
+	TRACE_BLOCK_ACCESS_CHECK_START(port->user_name, port->database_name);
+
+	INSTR_TIME_SET_CURRENT(start);
+
+	/* actual date and time */
+	t = time(NULL);
+
+	/* enforcement turned off by block_access_enforce(), before anything else */
+	if (enforce && enforcement_disabled((pg_time_t) t))
+	{
+		enforce = false;
+		pg_atomic_fetch_add_u64(&ba_state->counters.bypassed, 1);
+	}
+
+	/*
+	 * Replication connections are not evaluated unless asked for: blocking a
+	 * walsender would break standbys and subscribers. am_db_walsender is set
+	 * for logical replication (connected to a database) only.
+	 */
+	if (enforce && am_walsender &&
+		(enforce_replication == BA_REPLICATION_NONE ||
+		 (enforce_replication == BA_REPLICATION_PHYSICAL && am_db_walsender) ||
+		 (enforce_replication == BA_REPLICATION_LOGICAL && !am_db_walsender)))
+	{
+		enforce = false;
+		if (ba_state != NULL)
+			pg_atomic_fetch_add_u64(&ba_state->counters.replication, 1);
+	}
+
+	/* restore saved policies, if nobody did it yet */
+	if (enforce && ba_state != NULL && policy_slots != NULL)
+		attach_policy_store();
+
+	/* a scheduled activation is due */
+	if (enforce && ba_state != NULL)
+		check_scheduled_switches((pg_time_t) t);
+
+	/* not loaded via shared_preload_libraries: nothing to share */
+	if (ba_state == NULL && guc_policies_stale())
+	{
+		compile_guc_policies();
+		p = policy;
+		sp = shadow_policy;
+	}
+
+	/*
+	 * A named policy is active or scheduled (a standby waits for the primary
+	 * to switch), or policies are in shared memory
+	 */
+	if (enforce && ba_state != NULL &&
+		(pg_atomic_read_u32(&ba_state->active) != 0 ||
+		 pg_atomic_read_u64(&ba_state->next_switch) != 0 ||
+		 guc_policies_stale()))
+	{
+		uint32	active;
+
+		LWLockAcquire(ba_state->policy_lock, LW_SHARED);
+		locked = true;
+
+		if (guc_policies_stale())
+		{
+			p = guc_policy(false);
+			sp = guc_policy(true);
+		}
+
+		/* it could have been switched back while we waited */
+		active = effective_active((pg_time_t) t);
+		if (active != 0)
+			p = slot_policy(active - 1);
+	}
+
+	if (enforce && (p != NULL || sp != NULL))
+	{
+		struct tm	*now;
+
+		now = localtime(&t);
+		minute = now->tm_wday * BA_MINUTES_PER_DAY + now->tm_hour * 60 + now->tm_min;
+		second = now->tm_sec;
+	}
+
+	/* invalid intervals or exclude_roles block everyone */
+	if (enforce && p != NULL && policy_error(p) != NULL)
+	{
+		verdict = BA_VERDICT_DENIED;
+		error = pstrdup(policy_error(p));
+	}
+	/* apply block access per interval time / role */
+	else if (enforce && p != NULL && p->nintervals > 0)
+	{
+		TRACE_BLOCK_ACCESS_POLICY_LOOKUP(port->user_name, port->database_name, p->nintervals);
+
+		verdict = policy_evaluate(p, port->user_name, minute, &exempted);
+		slot = minute / 60;
+		if (verdict == BA_VERDICT_DENIED)
+			next = policy_next_allowed(p, port->user_name, minute);
+
+		elog(DEBUG1, "role \"%s\" at minute %d of the week: %s%s",
+			 port->user_name, minute,
+			 verdict == BA_VERDICT_DENIED ? "denied" : "allowed",
+			 exempted ? " (in exclude_roles)" : "");
+
+		TRACE_BLOCK_ACCESS_DECISION(port->user_name, port->database_name, verdict);
+	}
+
+	if (minute >= 0 && error == NULL && sp != NULL)
+		shadow_check(port, sp, verdict, minute);
+
+	if (locked)
+		LWLockRelease(ba_state->policy_lock);
+
+	/* a temporary grant overrides any denial, even by an invalid policy */
+	if (verdict == BA_VERDICT_DENIED && temporary_grant(port, (pg_time_t) t))
+	{
+		verdict = BA_VERDICT_ALLOWED;
+		exempted = true;
+		error = NULL;
+	}
+
+	INSTR_TIME_SET_CURRENT(duration);
+	INSTR_TIME_SUBTRACT(duration, start);
+	elapsed_ns = INSTR_TIME_GET_MICROSEC(duration) * 1000;
+
+	elog(DEBUG1, "diff: %.4f ms", INSTR_TIME_GET_MILLISEC(duration));
+
+	count_check(verdict, exempted, error != NULL, slot, elapsed_ns);
+
+	TRACE_BLOCK_ACCESS_CHECK_DONE(port->user_name, port->database_name, verdict, elapsed_ns);
+
+	if (error != NULL)
+		elog(ERROR, "%s", error);
+	else if (verdict == BA_VERDICT_DENIED && next >= 0)
+	{
+		time_t	allowed_at;
+		char	buf[64];
+
+		allowed_at = t - second +
+			(time_t) ((next - minute + BA_MINUTES_PER_WEEK) % BA_MINUTES_PER_WEEK) * 60;
+		strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M", localtime(&allowed_at));
+
+		ereport(ERROR,
+				(errmsg("access denied because it is outside permitted date and time"),
+				 errdetail("Access is allowed again at %s.", buf)));
+	}
+	else if (verdict == BA_VERDICT_DENIED)
+		elog(ERROR, "access denied because it is outside permitted date and time");
+	else if (verdict == BA_VERDICT_ALLOWED)
+		elog(INFO, "access allowed");
+}
+
+/*
+ * Evaluate the shadow policy and account any disagreement with the verdict of
+ * the current policy. The shadow policy is never enforced.
+ */
+static void
+shadow_check(Port *port, BAPolicy *sp, int verdict, int minute)
+{
+	bool			shadow_exempted;
+	bool			allowed;
+	bool			shadow_allowed;
+	BAShadowEntry	*entry;
+	char			key[NAMEDATALEN];
+	bool			found;
+
+	/* not configured or invalid */
+	if (sp->nintervals == 0 || policy_error(sp) != NULL)
+		return;
+
+	allowed = (verdict != BA_VERDICT_DENIED);
+	shadow_allowed = (policy_evaluate(sp, port->user_name, minute,
+									  &shadow_exempted) != BA_VERDICT_DENIED);
+
+	if (allowed == shadow_allowed || ba_state == NULL)
+		return;
+
+	if (allowed)
+		pg_atomic_fetch_add_u64(&ba_state->counters.shadow_would_deny, 1);
+	else
+		pg_atomic_fetch_add_u64(&ba_state->counters.shadow_would_allow, 1);
+
+	/* per role counters */
+	memset(key, 0, sizeof(key));
+	strlcpy(key, port->user_name, sizeof(key));
+
+	LWLockAcquire(ba_state->lock, LW_SHARED);
+	entry = (BAShadowEntry *) hash_search(shadow_roles, key, HASH_FIND, NULL);
+	if (entry == NULL)
+	{
+		LWLockRelease(ba_state->lock);
+		LWLockAcquire(ba_state->lock, LW_EXCLUSIVE);
+		entry = (BAShadowEntry *) hash_search(shadow_roles, key, HASH_ENTER_NULL, &found);
+		if (entry != NULL && !found)
+		{
+			pg_atomic_init_u64(&entry->would_deny, 0);
+			pg_atomic_init_u64(&entry->would_allow, 0);
+		}
+	}
+
+	if (entry == NULL)
+		pg_atomic_fetch_add_u64(&ba_state->counters.shadow_untracked, 1);
+	else if (allowed)
+		pg_atomic_fetch_add_u64(&entry->would_deny, 1);
+	else
+		pg_atomic_fetch_add_u64(&entry->would_allow, 1);
+
+	LWLockRelease(ba_state->lock);
+
+	/* sample to the server log */
+	if (shadow_log_sample_rate > 0.0 &&
+#if PG_VERSION_NUM >= 150000
+		pg_prng_double(&pg_global_prng_state) < shadow_log_sample_rate)
+#else
+		random() <= ((double) MAX_RANDOM_VALUE + 1) * shadow_log_sample_rate)
+#endif
+		ereport(LOG,
+				(errmsg("block_access: shadow policy would %s role \"%s\" on database \"%s\"",
+						allowed ? "deny" : "allow",
+						port->user_name, port->database_name),
+				 errhidestmt(true)));
+}
+
+/*
+ * Look up a temporary grant for the role. Only denied logins get here, and
+ * only if there is any grant at all.
+ */
+static bool
+temporary_grant(Port *port, pg_time_t now)
+{
+	BAExemption	*entry;
+	BAExemption	grant;
+	char		key[NAMEDATALEN];
+	bool		granted = false;
+
+	if (ba_state == NULL || pg_atomic_read_u32(&ba_state->nexemptions) == 0)
+		return false;
+
+	memset(key, 0, sizeof(key));
+	strlcpy(key, port->user_name, sizeof(key));
+
+	LWLockAcquire(ba_state->exemption_lock, LW_SHARED);
+	entry = (BAExemption *) hash_search(exemptions, key, HASH_FIND, NULL);
+	if (entry != NULL && entry->expires_at > now)
+	{
+		grant = *entry;
+		granted = true;
+	}
+	LWLockRelease(ba_state->exemption_lock);
+
+	if (!granted)
+		return false;
+
+	pg_atomic_fetch_add_u64(&ba_state->counters.temporary_grants, 1);
+
+	ereport(LOG,
+			(errmsg("block_access: role \"%s\" allowed on database \"%s\" by a temporary grant",
+					port->user_name, port->database_name),
+			 errdetail("Granted by \"%s\" at %s, expires at %s.",
+					   grant.granted_by,
+					   pstrdup(timestamptz_to_str(time_t_to_timestamptz(grant.granted_at))),
+					   timestamptz_to_str(time_t_to_timestamptz(grant.expires_at))),
+			 errhidestmt(true)));
+
+	return true;
+}
+
+/*
+ * Remove expired temporary grants. Caller must hold an exclusive
+ * exemption_lock.
+ */
+static void
+prune_exemptions(pg_time_t now)
+{
+	HASH_SEQ_STATUS	hash_seq;
+	BAExemption		*entry;
+
+	hash_seq_init(&hash_seq, exemptions);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		if (entry->expires_at > now)
+			continue;
+
+		ereport(LOG,
+				(errmsg("block_access: temporary grant for role \"%s\" expired at %s",
+						entry->role,
+						timestamptz_to_str(time_t_to_timestamptz(entry->expires_at))),
+				 errdetail("Granted by \"%s\" at %s.",
+						   entry->granted_by,
+						   timestamptz_to_str(time_t_to_timestamptz(entry->granted_at)))));
+
+		hash_search(exemptions, entry->role, HASH_REMOVE, NULL);
+		pg_atomic_fetch_sub_u32(&ba_state->nexemptions, 1);
+	}
+}
+
+/*
+ * WAL-log a change to the named policies. Records are flushed right away:
+ * the change is already visible on the primary, and standbys only receive
+ * flushed WAL. Caller must hold policy_lock exclusively, so that records are
+ * in the same order as the changes. Before PostgreSQL 15, there is no custom
+ * resource manager to log them with, and these do nothing.
+ */
+static void
+log_policy_define(const char *name, const char *intervals, const char *roles)
+{
+#if PG_VERSION_NUM >= 150000
+	XLogRecPtr	lsn;
+
+	XLogBeginInsert();
+	XLogRegisterData((char *) name, strlen(name) + 1);
+	XLogRegisterData((char *) intervals, strlen(intervals) + 1);
+	XLogRegisterData((char *) roles, strlen(roles) + 1);
+	lsn = XLogInsert(BA_RMGR_ID, XLOG_BA_DEFINE);
+	XLogFlush(lsn);
+#endif
+}
+
+static void
+log_policy_drop(const char *name)
+{
+#if PG_VERSION_NUM >= 150000
+	XLogRecPtr	lsn;
+
+	XLogBeginInsert();
+	XLogRegisterData((char *) name, strlen(name) + 1);
+	lsn = XLogInsert(BA_RMGR_ID, XLOG_BA_DROP);
+	XLogFlush(lsn);
+#endif
+}
+
+static void
+log_policy_state(void)
+{
+	XLogRecPtr	lsn = insert_policy_state();
+
+	if (!XLogRecPtrIsInvalid(lsn))
+		XLogFlush(lsn);
+}
+
+/*
+ * Write the record of log_policy_state(), without waiting for it to be
+ * flushed. Return its position, or InvalidXLogRecPtr if nothing is logged.
+ * Caller must hold policy_lock.
+ */
+static XLogRecPtr
+insert_policy_state(void)
+{
+#if PG_VERSION_NUM >= 150000
+	xl_ba_state	xlrec;
+	int			i;
+
+	memset(&xlrec, 0, sizeof(xlrec));
+	strlcpy(xlrec.active, active_policy_name(pg_atomic_read_u32(&ba_state->active)),
+			NAMEDATALEN);
+	xlrec.nhistory = ba_state->nhistory;
+	for (i = 0; i < ba_state->nhistory; i++)
+		strlcpy(xlrec.history[i], active_policy_name(ba_state->history[i]), NAMEDATALEN);
+	xlrec.nscheduled = ba_state->nscheduled;
+	for (i = 0; i < ba_state->nscheduled; i++)
+	{
+		strlcpy(xlrec.scheduled[i], active_policy_name(ba_state->scheduled[i].active),
+				NAMEDATALEN);
+		xlrec.scheduled_at[i] = ba_state->scheduled[i].at;
+	}
+
+	XLogBeginInsert();
+	XLogRegisterData((char *) &xlrec, sizeof(xlrec));
+	return XLogInsert(BA_RMGR_ID, XLOG_BA_STATE);
+#else
+	return InvalidXLogRecPtr;
+#endif
+}
+
+#if PG_VERSION_NUM >= 150000
+/*
+ * Replay a change to the named policies. This runs in the startup process
+ * (on standbys and during crash recovery), where an error would stop
+ * recovery: a change that cannot be replayed (a definition that does not
+ * compile here, or runs out of memory) is reported and skipped, and the
+ * policies are left as they were.
+ */
+static void
+block_access_redo(XLogReaderState *record)
+{
+	MemoryContext	oldcxt = CurrentMemoryContext;
+
+	if (ba_state == NULL || policy_slots == NULL)
+		return;
+
+	PG_TRY();
+	{
+		redo_policy_change(record);
+	}
+	PG_CATCH();
+	{
+		ErrorData	*edata;
+
+		MemoryContextSwitchTo(oldcxt);
+		edata = CopyErrorData();
+		FlushErrorState();
+
+		if (LWLockHeldByMe(ba_state->policy_lock))
+			LWLockRelease(ba_state->policy_lock);
+
+		ereport(WARNING,
+				(errmsg("block_access: could not replay %s record: %s",
+						block_access_identify(XLogRecGetInfo(record)), edata->message)));
+		FreeErrorData(edata);
+	}
+	PG_END_TRY();
+}
+
+/*
+ * Body of block_access_redo(). Everything that can fail (compiling, taking
+ * memory) happens before the policies are changed; only writing the file of
+ * the named policies comes after, and it reports errors without throwing.
+ */
+static void
+redo_policy_change(XLogReaderState *record)
+{
+	uint8		info = XLogRecGetInfo(record) & ~XLR_INFO_MASK;
+	char		*data = XLogRecGetData(record);
+
+	attach_policy_store();
+
+	if (info == XLOG_BA_DEFINE)
+	{
+		char		*name = data;
+		char		*intervals = name + strlen(name) + 1;
+		char		*roles = intervals + strlen(intervals) + 1;
+		BAPolicy	*p;
+
+		p = compile_policy(intervals, roles, NULL);
+
+		LWLockAcquire(ba_state->policy_lock, LW_EXCLUSIVE);
+		if (policy_error(p) != NULL)
+			ereport(WARNING,
+					(errmsg("block_access: could not replay definition of policy \"%s\": %s",
+							name, policy_error(p))));
+		else if (store_policy(name, p, intervals, roles, WARNING))
+			save_policies(LOG);
+		LWLockRelease(ba_state->policy_lock);
+
+		MemoryContextDelete(p->cxt);
+	}
+	else if (info == XLOG_BA_DROP)
+	{
+		int		i;
+		int		j;
+
+		LWLockAcquire(ba_state->policy_lock, LW_EXCLUSIVE);
+		i = find_policy_slot(data);
+		if (i >= 0 && data[0] != '\0')
+		{
+			/* it cannot be active or scheduled on the primary */
+			if (pg_atomic_read_u32(&ba_state->active) == i + 1)
+				activate_policy(0, false);
+			for (j = 0; j < ba_state->nscheduled; j++)
+				if (ba_state->scheduled[j].active == i + 1)
+					ba_state->scheduled[j].active = 0;
+			remove_policy(i);
+			save_policies(LOG);
+		}
+		LWLockRelease(ba_state->policy_lock);
+	}
+	else if (info == XLOG_BA_STATE)
+	{
+		xl_ba_state	*xlrec = (xl_ba_state *) data;
+		int			active;
+		int			i;
+
+		LWLockAcquire(ba_state->policy_lock, LW_EXCLUSIVE);
+
+		active = policy_by_name(xlrec->active);
+		if (active < 0)
+			ereport(WARNING,
+					(errmsg("block_access: could not replay activation of policy \"%s\": policy does not exist",
+							xlrec->active)));
+		else if (pg_atomic_read_u32(&ba_state->active) != (uint32) active)
+		{
+			activate_policy((uint32) active, false);
+			ereport(LOG,
+					(errmsg("block_access: policy \"%s\" activated by the primary server",
+							xlrec->active)));
+		}
+
+		ba_state->nhistory = 0;
+		for (i = 0; i < xlrec->nhistory && i < BA_ROLLBACK_DEPTH; i++)
+		{
+			int		h = policy_by_name(xlrec->history[i]);
+
+			if (h >= 0)
+				ba_state->history[ba_state->nhistory++] = (uint32) h;
+		}
+
+		ba_state->nscheduled = 0;
+		pg_atomic_write_u64(&ba_state->next_switch, 0);
+		for (i = 0; i < xlrec->nscheduled && i < BA_MAX_SCHEDULED; i++)
+		{
+			int		a = policy_by_name(xlrec->scheduled[i]);
+
+			if (a >= 0)
+				schedule_switch((uint32) a, xlrec->scheduled_at[i]);
+			else
+				ereport(WARNING,
+						(errmsg("block_access: could not replay scheduled activation of policy \"%s\": policy does not exist",
+								xlrec->scheduled[i])));
+		}
+
+		save_policies(LOG);
+
+		LWLockRelease(ba_state->policy_lock);
+	}
+	else
+		elog(PANIC, "block_access_redo: unknown op code %u", info);
+}
+
+static void
+block_access_desc(StringInfo buf, XLogReaderState *record)
+{
+	uint8		info = XLogRecGetInfo(record) & ~XLR_INFO_MASK;
+	char		*data = XLogRecGetData(record);
+
+	if (info == XLOG_BA_DEFINE || info == XLOG_BA_DROP)
+		appendStringInfo(buf, "name %s", data);
+	else if (info == XLOG_BA_STATE)
+	{
+		xl_ba_state	*xlrec = (xl_ba_state *) data;
+
+		appendStringInfo(buf, "active %s; history %d; scheduled %d",
+						 xlrec->active, xlrec->nhistory, xlrec->nscheduled);
+	}
+}
+
+static const char *
+block_access_identify(uint8 info)
+{
+	switch (info & ~XLR_INFO_MASK)
+	{
+		case XLOG_BA_DEFINE:
+			return "DEFINE";
+		case XLOG_BA_DROP:
+			return "DROP";
+		case XLOG_BA_STATE:
+			return "STATE";
+	}
+
+	return NULL;
+}
+
+static const RmgrData block_access_rmgr = {
+	.rm_name = "block_access",
+	.rm_redo = block_access_redo,
+	.rm_desc = block_access_desc,
+	.rm_identify = block_access_identify,
+};
+#endif
+
+/*
+ * Shared memory size
+ */
+static Size
+block_access_memsize(void)
+{
+	Size	size;
+
+	size = MAXALIGN(sizeof(BASharedState));
+	size = add_size(size, hash_estimate_size(shadow_max_roles, sizeof(BAShadowEntry)));
+	size = add_size(size, mul_size(max_policies + BA_GUC_SLOTS, MAXALIGN(sizeof(BAPolicySlot))));
+	size = add_size(size, MAXALIGN(dsa_minimum_size()));
+	size = add_size(size, hash_estimate_size(max_temporary_grants, sizeof(BAExemption)));
+
+	return size;
+}
+
+#if PG_VERSION_NUM >= 150000
+/*
+ * Request shared memory
+ */
+static void
+block_access_shmem_request(void)
+{
+	if (prev_shmem_request_hook)
+		prev_shmem_request_hook();
+
+	RequestAddinShmemSpace(block_access_memsize());
+	RequestNamedLWLockTranche("block_access", 3);
+}
+#endif
+
+/*
+ * Allocate or attach to shared memory
+ */
+static void
+block_access_shmem_startup(void)
+{
+	bool				found;
+	bool				slots_found;
+	HASHCTL				info;
+	pg_atomic_uint64	*counters;
+	int					i;
+
+	if (prev_shmem_startup_hook)
+		prev_shmem_startup_hook();
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+	ba_state = ShmemInitStruct("block_access", sizeof(BASharedState), &found);
+	if (!found)
+	{
+		counters = (pg_atomic_uint64 *) &ba_state->counters;
+		for (i = 0; i < BA_NCOUNTERS; i++)
+			pg_atomic_init_u64(&counters[i], 0);
+		ba_state->lock = &(GetNamedLWLockTranche("block_access"))[0].lock;
+		ba_state->policy_lock = &(GetNamedLWLockTranche("block_access"))[1].lock;
+		ba_state->exemption_lock = &(GetNamedLWLockTranche("block_access"))[2].lock;
+		pg_atomic_init_u32(&ba_state->nexemptions, 0);
+		pg_atomic_init_u64(&ba_state->disabled_until, 0);
+		pg_atomic_init_u32(&ba_state->active, 0);
+		pg_atomic_init_u64(&ba_state->activations, 0);
+		ba_state->nhistory = 0;
+		pg_atomic_init_u64(&ba_state->next_switch, 0);
+		ba_state->nscheduled = 0;
+		pg_atomic_init_u32(&ba_state->save_pending, 0);
+		ba_state->maintenance_window = 0;
+		ba_state->nmaintenance = 0;
+		pg_atomic_init_u32(&ba_state->loaded, 0);
+		pg_atomic_init_u32(&ba_state->compiler[0], 0);
+		pg_atomic_init_u32(&ba_state->compiler[1], 0);
+		ConditionVariableInit(&ba_state->compile_cv);
+		pg_atomic_init_u64(&ba_state->generation, policy_generation);
+	}
+
+	policy_slots = ShmemInitStruct("block_access policies",
+								   mul_size(max_policies + BA_GUC_SLOTS, MAXALIGN(sizeof(BAPolicySlot))),
+								   &slots_found);
+	if (!slots_found)
+	{
+		dsa_area	*area;
+
+		memset(policy_slots, 0, mul_size(max_policies + BA_GUC_SLOTS, MAXALIGN(sizeof(BAPolicySlot))));
+
+		/* the postmaster never uses it; backends attach to it */
+		ba_state->area = ShmemAlloc(dsa_minimum_size());
+		ba_state->area_tranche = LWLockNewTrancheId();
+		area = dsa_create_in_place(ba_state->area, dsa_minimum_size(),
+								   ba_state->area_tranche, NULL);
+		dsa_pin(area);
+		dsa_detach(area);
+	}
+
+	info.keysize = NAMEDATALEN;
+	info.entrysize = sizeof(BAShadowEntry);
+	shadow_roles = ShmemInitHash("block_access shadow roles",
+								 shadow_max_roles, shadow_max_roles,
+								 &info,
+								 HASH_ELEM | HASH_BLOBS | HASH_FIXED_SIZE);
+
+	info.keysize = NAMEDATALEN;
+	info.entrysize = sizeof(BAExemption);
+	exemptions = ShmemInitHash("block_access exemptions",
+							   max_temporary_grants, max_temporary_grants,
+							   &info,
+							   HASH_ELEM | HASH_BLOBS | HASH_FIXED_SIZE);
+
+	LWLockRelease(AddinShmemInitLock);
+
+	/*
+	 * If we're in the postmaster (or a standalone backend), set up a shmem
+	 * exit hook to dump the statistics to disk.
+	 */
+	if (!IsUnderPostmaster)
+		on_shmem_exit(block_access_shmem_shutdown, (Datum) 0);
+
+	/* Done if some other process already completed our initialization */
+	if (found)
+		return;
+
+	load_counters();
+}
+
+/*
+ * Restore statistics saved at the last shutdown. The file is removed after
+ * being read, so that a crash does not bring back stale counters.
+ */
+static void
+load_counters(void)
+{
+	FILE		*file;
+	uint32		header;
+	uint32		pgver;
+	uint32		ncounters;
+	uint64		value;
+	pg_atomic_uint64	*counters;
+	int			i;
+
+	file = AllocateFile(BLOCK_ACCESS_DUMP_FILE, PG_BINARY_R);
+	if (file == NULL)
+	{
+		if (errno != ENOENT)
+			goto read_error;
+		/* No existing persisted stats file, so we're done */
+		return;
+	}
+
+	if (fread(&header, sizeof(uint32), 1, file) != 1 ||
+		fread(&pgver, sizeof(uint32), 1, file) != 1 ||
+		fread(&ncounters, sizeof(uint32), 1, file) != 1)
+		goto read_error;
+
+	if (header != BLOCK_ACCESS_FILE_HEADER ||
+		pgver != PG_VERSION_NUM / 100 ||
+		ncounters != BA_NCOUNTERS)
+		goto data_error;
+
+	counters = (pg_atomic_uint64 *) &ba_state->counters;
+	for (i = 0; i < ncounters; i++)
+	{
+		if (fread(&value, sizeof(uint64), 1, file) != 1)
+			goto read_error;
+		pg_atomic_write_u64(&counters[i], value);
+	}
+
+	FreeFile(file);
+
+	unlink(BLOCK_ACCESS_DUMP_FILE);
+
+	return;
+
+read_error:
+	ereport(LOG,
+			(errcode_for_file_access(),
+			 errmsg("could not read file \"%s\": %m",
+					BLOCK_ACCESS_DUMP_FILE)));
+	goto fail;
+data_error:
+	ereport(LOG,
+			(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+			 errmsg("ignoring invalid data in file \"%s\"",
+					BLOCK_ACCESS_DUMP_FILE)));
+	goto fail;
+fail:
+	if (file)
+		FreeFile(file);
+	/* we don't want to read a broken file again */
+	unlink(BLOCK_ACCESS_DUMP_FILE);
+}
+
+/*
+ * Dump statistics to disk. This is called in the postmaster at shutdown.
+ */
+static void
+block_access_shmem_shutdown(int code, Datum arg)
+{
+	FILE		*file;
+	uint32		pgver = PG_VERSION_NUM / 100;
+	uint32		ncounters = BA_NCOUNTERS;
+	uint64		value;
+	pg_atomic_uint64	*counters;
+	int			i;
+
+	/* Don't try to dump during a crash */
+	if (code)
+		return;
+
+	/* Safety check ... shouldn't get here unless shmem is set up */
+	if (ba_state == NULL)
+		return;
+
+	/* Don't dump if told not to */
+	if (!save_stats)
+		return;
+
+	file = AllocateFile(BLOCK_ACCESS_DUMP_FILE ".tmp", PG_BINARY_W);
+	if (file == NULL)
+		goto error;
+
+	if (fwrite(&BLOCK_ACCESS_FILE_HEADER, sizeof(uint32), 1, file) != 1 ||
+		fwrite(&pgver, sizeof(uint32), 1, file) != 1 ||
+		fwrite(&ncounters, sizeof(uint32), 1, file) != 1)
+		goto error;
+
+	counters = (pg_atomic_uint64 *) &ba_state->counters;
+	for (i = 0; i < ncounters; i++)
+	{
+		value = pg_atomic_read_u64(&counters[i]);
+		if (fwrite(&value, sizeof(uint64), 1, file) != 1)
+			goto error;
+	}
+
+	if (FreeFile(file))
+	{
+		file = NULL;
+		goto error;
+	}
+
+	/*
+	 * Rename file into place, so we atomically replace any old one.
+	 */
+	(void) durable_rename(BLOCK_ACCESS_DUMP_FILE ".tmp", BLOCK_ACCESS_DUMP_FILE, LOG);
+
+	return;
+
+error:
+	ereport(LOG,
+			(errcode_for_file_access(),
+			 errmsg("could not write file \"%s\": %m",
+					BLOCK_ACCESS_DUMP_FILE ".tmp")));
+	if (file)
+		FreeFile(file);
+	unlink(BLOCK_ACCESS_DUMP_FILE ".tmp");
+}
+
+static void
+metric_header(StringInfo buf, const char *name, const char *type, const char *help)
+{
+	appendStringInfo(buf, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static void
+metric_counter(StringInfo buf, const char *name, const char *help, uint64 value)
+{
+	metric_header(buf, name, "counter", help);
+	appendStringInfo(buf, "%s " UINT64_FORMAT "\n", name, value);
+}
+
+/*
+ * Return statistics and policy information in Prometheus text exposition
+ * format. Counters are read with atomic loads; no lock is taken.
+ */
+Datum
+block_access_metrics(PG_FUNCTION_ARGS)
+{
+	StringInfoData	buf;
+	uint64			resident;
+	uint64			shared;
+	uint64			cumulative;
+	uint64			bound;
+	int				i;
+	char			week_day_names[7][4] = {"sun", "mon", "tue", "wed", "thu", "fri", "sat"};
+
+	if (ba_state == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("block_access must be loaded via shared_preload_libraries")));
+
+	initStringInfo(&buf);
+
+	metric_counter(&buf, "block_access_checks_total",
+				   "Calls to the authentication hook.",
+				   pg_atomic_read_u64(&ba_state->counters.checks));
+	metric_counter(&buf, "block_access_allowed_total",
+				   "Logins evaluated and allowed.",
+				   pg_atomic_read_u64(&ba_state->counters.allowed));
+	metric_counter(&buf, "block_access_denied_total",
+				   "Logins evaluated and denied.",
+				   pg_atomic_read_u64(&ba_state->counters.denied));
+	metric_counter(&buf, "block_access_exempted_total",
+				   "Logins allowed outside the intervals because of exclude_roles or a temporary grant.",
+				   pg_atomic_read_u64(&ba_state->counters.exempted));
+	metric_counter(&buf, "block_access_skipped_total",
+				   "Logins not evaluated (failed authentication or no intervals).",
+				   pg_atomic_read_u64(&ba_state->counters.skipped));
+	metric_counter(&buf, "block_access_errors_total",
+				   "Logins denied because the policy is invalid.",
+				   pg_atomic_read_u64(&ba_state->counters.errors));
+
+	metric_header(&buf, "block_access_check_duration_seconds", "histogram",
+				  "Time spent in the authentication hook.");
+	cumulative = 0;
+	bound = 1;
+	for (i = 0; i < BA_LATENCY_BUCKETS; i++)
+	{
+		cumulative += pg_atomic_read_u64(&ba_state->counters.latency[i]);
+		if (i < BA_LATENCY_BUCKETS - 1)
+			appendStringInfo(&buf, "block_access_check_duration_seconds_bucket{le=\"%g\"} " UINT64_FORMAT "\n",
+							 bound / 1000000.0, cumulative);
+		else
+			appendStringInfo(&buf, "block_access_check_duration_seconds_bucket{le=\"+Inf\"} " UINT64_FORMAT "\n",
+							 cumulative);
+		bound <<= 1;
+	}
+	appendStringInfo(&buf, "block_access_check_duration_seconds_sum %.9f\n",
+					 pg_atomic_read_u64(&ba_state->counters.latency_sum) / 1000000000.0);
+	appendStringInfo(&buf, "block_access_check_duration_seconds_count " UINT64_FORMAT "\n",
+					 cumulative);
+
+	metric_header(&buf, "block_access_demand_total", "counter",
+				  "Evaluated logins per hour of the week.");
+	for (i = 0; i < BA_DEMAND_SLOTS; i++)
+	{
+		appendStringInfo(&buf, "block_access_demand_total{wday=\"%s\",hour=\"%d\",verdict=\"allowed\"} " UINT64_FORMAT "\n",
+						 week_day_names[i / 24], i % 24,
+						 pg_atomic_read_u64(&ba_state->counters.demand_allowed[i]));
+		appendStringInfo(&buf, "block_access_demand_total{wday=\"%s\",hour=\"%d\",verdict=\"denied\"} " UINT64_FORMAT "\n",
+						 week_day_names[i / 24], i % 24,
+						 pg_atomic_read_u64(&ba_state->counters.demand_denied[i]));
+	}
+
+	if (policy_slots != NULL)
+	{
+		BAPolicy	*p;
+		Size		size;
+
+		attach_policy_store();
+
+		LWLockAcquire(ba_state->policy_lock, LW_SHARED);
+		p = shared_guc_policy(false, &size);
+
+		metric_header(&buf, "block_access_policy_generation", "gauge",
+					  "Generation of the current policy, the same in every backend; it increases when the policy changes.");
+		appendStringInfo(&buf, "block_access_policy_generation " UINT64_FORMAT "\n",
+						 p->generation);
+		metric_header(&buf, "block_access_policy_compile_seconds", "gauge",
+					  "Time spent compiling the current policy.");
+		appendStringInfo(&buf, "block_access_policy_compile_seconds %.9f\n",
+						 p->compile_time);
+		metric_header(&buf, "block_access_policy_changed_roles", "gauge",
+					  "Roles added, removed or with a new schedule at the last compilation.");
+		appendStringInfo(&buf, "block_access_policy_changed_roles %d\n",
+						 p->changed_roles);
+		metric_header(&buf, "block_access_policy_size_bytes", "gauge",
+					  "Memory used by the current policy.");
+		appendStringInfo(&buf, "block_access_policy_size_bytes %zu\n",
+						 size);
+		metric_header(&buf, "block_access_policy_shape", "gauge",
+					  "Evaluator used for the current policy.");
+		appendStringInfo(&buf, "block_access_policy_shape{shape=\"%s\"} 1\n",
+						 policy_shape_names[p->shape]);
+		metric_header(&buf, "block_access_policy_valid", "gauge",
+					  "Whether the current policy compiled without errors.");
+		appendStringInfo(&buf, "block_access_policy_valid %d\n",
+						 policy_error(p) == NULL ? 1 : 0);
+		metric_header(&buf, "block_access_policy_schedule_classes", "gauge",
+					  "Distinct schedules in the current policy.");
+		appendStringInfo(&buf, "block_access_policy_schedule_classes %d\n",
+						 p->nschedules);
+
+		LWLockRelease(ba_state->policy_lock);
+	}
+
+	/* the copy this backend inherited, if it is still current */
+	if (policy != NULL && !policy_stale && policy_pages(policy, &resident, &shared))
+	{
+		metric_header(&buf, "block_access_policy_resident_pages", "gauge",
+					  "Pages of the current policy resident in this backend.");
+		appendStringInfo(&buf, "block_access_policy_resident_pages " UINT64_FORMAT "\n",
+						 resident);
+		metric_header(&buf, "block_access_policy_shared_pages", "gauge",
+					  "Pages of the current policy this backend shares with other processes.");
+		appendStringInfo(&buf, "block_access_policy_shared_pages " UINT64_FORMAT "\n",
+						 shared);
+	}
+
+	if (policy_slots != NULL)
+	{
+		uint32	active;
+		Size	store_size = 0;
+
+		attach_policy_store();
+
+		LWLockAcquire(ba_state->policy_lock, LW_SHARED);
+		active = effective_active((pg_time_t) time(NULL));
+		metric_header(&buf, "block_access_active_policy", "gauge",
+					  "Policy enforced at login.");
+		appendStringInfo(&buf, "block_access_active_policy{name=\"%s\"} 1\n",
+						 active_policy_name(active));
+		if (active != 0)
+		{
+			metric_header(&buf, "block_access_active_policy_size_bytes", "gauge",
+						  "Shared memory used by the active named policy.");
+			appendStringInfo(&buf, "block_access_active_policy_size_bytes %zu\n",
+							 policy_slots[active - 1].size);
+		}
+		for (i = 0; i < max_policies; i++)
+			store_size += policy_slots[i].size;
+		LWLockRelease(ba_state->policy_lock);
+
+		metric_header(&buf, "block_access_policy_store_bytes", "gauge",
+					  "Dynamic shared memory used by named policies.");
+		appendStringInfo(&buf, "block_access_policy_store_bytes %zu\n",
+						 store_size);
+
+		metric_counter(&buf, "block_access_policy_activations_total",
+					   "Switches of the active policy.",
+					   pg_atomic_read_u64(&ba_state->activations));
+	}
+
+	metric_counter(&buf, "block_access_shadow_would_deny_total",
+				   "Logins allowed by the current policy that the shadow policy would deny.",
+				   pg_atomic_read_u64(&ba_state->counters.shadow_would_deny));
+	metric_counter(&buf, "block_access_shadow_would_allow_total",
+				   "Logins denied by the current policy that the shadow policy would allow.",
+				   pg_atomic_read_u64(&ba_state->counters.shadow_would_allow));
+	metric_counter(&buf, "block_access_shadow_untracked_total",
+				   "Shadow policy disagreements not tracked per role (block_access.shadow_max_roles exceeded).",
+				   pg_atomic_read_u64(&ba_state->counters.shadow_untracked));
+
+	metric_counter(&buf, "block_access_policy_compiles_total",
+				   "Policies compiled by a backend for the others after a reload.",
+				   pg_atomic_read_u64(&ba_state->counters.compiles));
+	metric_counter(&buf, "block_access_policy_compile_waits_total",
+				   "Logins that waited for another backend to compile the policy.",
+				   pg_atomic_read_u64(&ba_state->counters.compile_waits));
+	metric_header(&buf, "block_access_policy_compile_wait_seconds_total", "counter",
+				  "Time spent waiting for another backend to compile the policy.");
+	appendStringInfo(&buf, "block_access_policy_compile_wait_seconds_total %.9f\n",
+					 pg_atomic_read_u64(&ba_state->counters.compile_wait_time) / 1000000000.0);
+
+	metric_counter(&buf, "block_access_replication_skipped_total",
+				   "Replication connections not evaluated (see block_access.enforce_replication).",
+				   pg_atomic_read_u64(&ba_state->counters.replication));
+	metric_counter(&buf, "block_access_bypassed_total",
+				   "Logins not evaluated because enforcement was turned off.",
+				   pg_atomic_read_u64(&ba_state->counters.bypassed));
+	metric_header(&buf, "block_access_enforcement_enabled", "gauge",
+				  "Whether the policy is enforced (see block_access_enforce()).");
+	appendStringInfo(&buf, "block_access_enforcement_enabled %d\n",
+					 enforcement_disabled(time(NULL)) ? 0 : 1);
+
+	metric_counter(&buf, "block_access_temporary_grants_total",
+				   "Logins denied by the policy and allowed by a temporary grant.",
+				   pg_atomic_read_u64(&ba_state->counters.temporary_grants));
+	metric_header(&buf, "block_access_temporary_grants", "gauge",
+				  "Temporary grants in shared memory, including expired ones not yet removed.");
+	appendStringInfo(&buf, "block_access_temporary_grants %u\n",
+					 pg_atomic_read_u32(&ba_state->nexemptions));
+
+	if (shadow_policy != NULL && shadow_policy->nintervals > 0)
+	{
+		metric_header(&buf, "block_access_shadow_policy_valid", "gauge",
+					  "Whether the shadow policy compiled without errors.");
+		appendStringInfo(&buf, "block_access_shadow_policy_valid %d\n",
+						 policy_error(shadow_policy) == NULL ? 1 : 0);
+	}
+
+	PG_RETURN_TEXT_P(cstring_to_text_with_len(buf.data, buf.len));
+}
+
+/*
+ * Set up a materialize-mode set-returning function and return its tuplestore
+ */
+static Tuplestorestate *
+materialize_srf(FunctionCallInfo fcinfo, TupleDesc *tupdesc)
+{
+	ReturnSetInfo	*rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	Tuplestorestate	*tupstore;
+	MemoryContext	per_query_ctx;
+	MemoryContext	oldcontext;
+
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not allowed in this context")));
+
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = *tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	return tupstore;
+}
+
+/*
+ * Shadow policy disagreements per role
+ */
+Datum
+block_access_shadow_stats(PG_FUNCTION_ARGS)
+{
+	Tuplestorestate	*tupstore;
+	TupleDesc		tupdesc;
+	HASH_SEQ_STATUS	hash_seq;
+	BAShadowEntry	*entry;
+
+	if (ba_state == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("block_access must be loaded via shared_preload_libraries")));
+
+	tupstore = materialize_srf(fcinfo, &tupdesc);
+
+	LWLockAcquire(ba_state->lock, LW_SHARED);
+
+	hash_seq_init(&hash_seq, shadow_roles);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		Datum	values[3];
+		bool	nulls[3] = {false, false, false};
+
+		values[0] = CStringGetTextDatum(entry->role);
+		values[1] = Int64GetDatum((int64) pg_atomic_read_u64(&entry->would_deny));
+		values[2] = Int64GetDatum((int64) pg_atomic_read_u64(&entry->would_allow));
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	LWLockRelease(ba_state->lock);
+
+	return (Datum) 0;
+}
+
+static void
+check_policy_store(void)
+{
+	if (ba_state == NULL || policy_slots == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("block_access must be loaded via shared_preload_libraries")));
+
+	attach_policy_store();
+	save_pending_policies();
+}
+
+static void
+check_policy_name(const char *name)
+{
+	if (name[0] == '\0' || strlen(name) >= NAMEDATALEN)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("invalid policy name \"%s\"", name)));
+	if (strcmp(name, BA_DEFAULT_POLICY) == 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("policy \"%s\" is defined by block_access.intervals and block_access.exclude_roles",
+						BA_DEFAULT_POLICY)));
+}
+
+/*
+ * Named policies are changed on the primary only: standbys replay its
+ * changes. Before PostgreSQL 15 they are not WAL-logged, and every server
+ * changes its own.
+ */
+static void
+check_policy_change(void)
+{
+	check_policy_store();
+
+#if PG_VERSION_NUM >= 150000
+	if (RecoveryInProgress())
+		ereport(ERROR,
+				(errcode(ERRCODE_READ_ONLY_SQL_TRANSACTION),
+				 errmsg("cannot change block_access policies during recovery"),
+				 errhint("Policies are replicated from the primary server.")));
+#else
+	/* no custom resource managers: each server has its own policies */
+	ereport(NOTICE,
+			(errmsg("block_access policy changes are not replicated to standbys"),
+			 errdetail("Replication of named policies requires PostgreSQL 15 or later.")));
+#endif
+}
+
+/*
+ * block_access_define(name, intervals, exclude_roles)
+ *
+ * Compile a named policy and keep it in shared memory. Redefining the active
+ * policy takes effect at the next login.
+ */
+Datum
+block_access_define(PG_FUNCTION_ARGS)
+{
+	char		*name = text_to_cstring(PG_GETARG_TEXT_PP(0));
+	char		*intervals = text_to_cstring(PG_GETARG_TEXT_PP(1));
+	char		*roles = text_to_cstring(PG_GETARG_TEXT_PP(2));
+	BAPolicy	*p;
+
+	check_policy_change();
+	check_policy_name(name);
+
+	p = compile_policy(intervals, roles, NULL);
+	if (policy_error(p) != NULL)
+	{
+		char	*msg = pstrdup(policy_error(p));
+
+		MemoryContextDelete(p->cxt);
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("invalid policy \"%s\": %s", name, msg)));
+	}
+
+	PG_TRY();
+	{
+		LWLockAcquire(ba_state->policy_lock, LW_EXCLUSIVE);
+		store_policy(name, p, intervals, roles, ERROR);
+		log_policy_define(name, intervals, roles);
+		save_policies(ERROR);
+		LWLockRelease(ba_state->policy_lock);
+	}
+	PG_FINALLY();
+	{
+		MemoryContextDelete(p->cxt);
+	}
+	PG_END_TRY();
+
+	PG_RETURN_VOID();
+}
+
+/*
+ * block_access_drop(name)
+ */
+Datum
+block_access_drop(PG_FUNCTION_ARGS)
+{
+	char	*name = text_to_cstring(PG_GETARG_TEXT_PP(0));
+	int		i;
+	int		j;
+
+	check_policy_change();
+	check_policy_name(name);
+
+	LWLockAcquire(ba_state->policy_lock, LW_EXCLUSIVE);
+
+	i = find_policy_slot(name);
+	if (i < 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_UNDEFINED_OBJECT),
+				 errmsg("policy \"%s\" does not exist", name)));
+	if (pg_atomic_read_u32(&ba_state->active) == i + 1)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("cannot drop active policy \"%s\"", name)));
+	for (j = 0; j < ba_state->nscheduled; j++)
+		if (ba_state->scheduled[j].active == i + 1)
+			ereport(ERROR,
+					(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+					 errmsg("cannot drop policy \"%s\" because its activation is scheduled", name),
+					 errhint("Use block_access_unschedule() first.")));
+
+	remove_policy(i);
+	log_policy_drop(name);
+	save_policies(ERROR);
+
+	LWLockRelease(ba_state->policy_lock);
+
+	PG_RETURN_VOID();
+}
+
+/*
+ * block_access_activate(name)
+ *
+ * Switch the policy enforced at login. It is an atomic swap in shared memory:
+ * no reload is needed and the next login uses the new policy. The previous
+ * one is remembered for block_access_rollback().
+ */
+Datum
+block_access_activate(PG_FUNCTION_ARGS)
+{
+	char	*name = text_to_cstring(PG_GETARG_TEXT_PP(0));
+	int		i = -1;
+
+	check_policy_change();
+
+	LWLockAcquire(ba_state->policy_lock, LW_EXCLUSIVE);
+
+	if (strcmp(name, BA_DEFAULT_POLICY) != 0)
+	{
+		i = find_policy_slot(name);
+		if (i < 0 || name[0] == '\0')
+			ereport(ERROR,
+					(errcode(ERRCODE_UNDEFINED_OBJECT),
+					 errmsg("policy \"%s\" does not exist", name)));
+	}
+
+	activate_policy(i + 1, true);
+	log_policy_state();
+	save_policies(ERROR);
+
+	LWLockRelease(ba_state->policy_lock);
+
+	ereport(LOG,
+			(errmsg("block_access: policy \"%s\" activated", name)));
+
+	PG_RETURN_VOID();
+}
+
+/*
+ * block_access_rollback()
+ *
+ * Activate the previously active policy and return its name.
+ */
+Datum
+block_access_rollback(PG_FUNCTION_ARGS)
+{
+	uint32	active;
+	char	name[NAMEDATALEN];
+
+	check_policy_change();
+
+	LWLockAcquire(ba_state->policy_lock, LW_EXCLUSIVE);
+
+	if (ba_state->nhistory == 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("no previously active policy")));
+
+	active = ba_state->history[0];
+	memmove(&ba_state->history[0], &ba_state->history[1],
+			(BA_ROLLBACK_DEPTH - 1) * sizeof(uint32));
+	ba_state->nhistory--;
+
+	activate_policy(active, false);
+	log_policy_state();
+	save_policies(ERROR);
+
+	strlcpy(name, active_policy_name(active), NAMEDATALEN);
+
+	LWLockRelease(ba_state->policy_lock);
+
+	ereport(LOG,
+			(errmsg("block_access: policy \"%s\" activated by rollback", name)));
+
+	PG_RETURN_TEXT_P(cstring_to_text(name));
+}
+
+/*
+ * block_access_policies()
+ *
+ * List the default policy and the named policies.
+ */
+Datum
+block_access_policies(PG_FUNCTION_ARGS)
+{
+	Tuplestorestate	*tupstore;
+	TupleDesc		tupdesc;
+	uint32			active;
+	Datum			values[6];
+	bool			nulls[6];
+	BAPolicy		*p;
+	Size			size;
+	int				i;
+
+	check_policy_store();
+
+	tupstore = materialize_srf(fcinfo, &tupdesc);
+
+	LWLockAcquire(ba_state->policy_lock, LW_SHARED);
+
+	p = shared_guc_policy(false, &size);
+	active = effective_active((pg_time_t) time(NULL));
+
+	memset(nulls, 0, sizeof(nulls));
+	values[0] = CStringGetTextDatum(BA_DEFAULT_POLICY);
+	values[1] = BoolGetDatum(active == 0);
+	nulls[2] = (interval_time_value == NULL);
+	if (interval_time_value != NULL)
+		values[2] = CStringGetTextDatum(interval_time_value);
+	nulls[3] = (exclude_roles == NULL);
+	if (exclude_roles != NULL)
+		values[3] = CStringGetTextDatum(exclude_roles);
+	values[4] = Int64GetDatum((int64) size);
+	nulls[5] = (policy_error(p) == NULL);
+	if (!nulls[5])
+		values[5] = CStringGetTextDatum(policy_error(p));
+	tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+
+	for (i = 0; i < max_policies; i++)
+	{
+		BAPolicySlot	*slot = &policy_slots[i];
+
+		if (slot->name[0] == '\0')
+			continue;
+
+		memset(nulls, 0, sizeof(nulls));
+		values[0] = CStringGetTextDatum(slot->name);
+		values[1] = BoolGetDatum(active == i + 1);
+		values[2] = CStringGetTextDatum(slot_intervals(i));
+		values[3] = CStringGetTextDatum(slot_exclude_roles(i));
+		values[4] = Int64GetDatum((int64) slot->size);
+		nulls[5] = true;
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	LWLockRelease(ba_state->policy_lock);
+
+	return (Datum) 0;
+}
+
+/*
+ * block_access_schedule(name, at)
+ *
+ * Activate a policy at a given time. Nothing has to happen at that time: the
+ * first login after it switches the policy.
+ */
+Datum
+block_access_schedule(PG_FUNCTION_ARGS)
+{
+	char		*name = text_to_cstring(PG_GETARG_TEXT_PP(0));
+	TimestampTz	at = PG_GETARG_TIMESTAMPTZ(1);
+	int			i = -1;
+
+	check_policy_change();
+
+	if (at <= GetCurrentTimestamp())
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("activation time must be in the future"),
+				 errhint("Use block_access_activate() to activate a policy now.")));
+
+	LWLockAcquire(ba_state->policy_lock, LW_EXCLUSIVE);
+
+	if (strcmp(name, BA_DEFAULT_POLICY) != 0)
+	{
+		i = find_policy_slot(name);
+		if (i < 0 || name[0] == '\0')
+			ereport(ERROR,
+					(errcode(ERRCODE_UNDEFINED_OBJECT),
+					 errmsg("policy \"%s\" does not exist", name)));
+	}
+
+	schedule_switch(i + 1, timestamptz_to_time_t(at));
+	log_policy_state();
+	save_policies(ERROR);
+
+	LWLockRelease(ba_state->policy_lock);
+
+	PG_RETURN_VOID();
+}
+
+/*
+ * block_access_unschedule(name)
+ *
+ * Cancel the scheduled activations of a policy and return how many there were.
+ */
+Datum
+block_access_unschedule(PG_FUNCTION_ARGS)
+{
+	char	*name = text_to_cstring(PG_GETARG_TEXT_PP(0));
+	int		removed;
+	int		i;
+	int		n;
+
+	check_policy_change();
+
+	LWLockAcquire(ba_state->policy_lock, LW_EXCLUSIVE);
+
+	n = 0;
+	for (i = 0; i < ba_state->nscheduled; i++)
+		if (strcmp(active_policy_name(ba_state->scheduled[i].active), name) != 0)
+			ba_state->scheduled[n++] = ba_state->scheduled[i];
+	removed = ba_state->nscheduled - n;
+	ba_state->nscheduled = n;
+
+	pg_atomic_write_u64(&ba_state->next_switch,
+						n > 0 ? (uint64) ba_state->scheduled[0].at : 0);
+
+	if (removed > 0)
+	{
+		log_policy_state();
+		save_policies(ERROR);
+	}
+
+	LWLockRelease(ba_state->policy_lock);
+
+	PG_RETURN_INT32(removed);
+}
+
+/*
+ * block_access_scheduled()
+ *
+ * List pending activations.
+ */
+Datum
+block_access_scheduled(PG_FUNCTION_ARGS)
+{
+	Tuplestorestate	*tupstore;
+	TupleDesc		tupdesc;
+	pg_time_t		now = (pg_time_t) time(NULL);
+	int				i;
+
+	check_policy_store();
+
+	tupstore = materialize_srf(fcinfo, &tupdesc);
+
+	LWLockAcquire(ba_state->policy_lock, LW_SHARED);
+
+	for (i = 0; i < ba_state->nscheduled; i++)
+	{
+		Datum	values[2];
+		bool	nulls[2] = {false, false};
+
+		/* due: effective_active() already counts it as done */
+		if (ba_state->scheduled[i].at <= now)
+			continue;
+
+		values[0] = CStringGetTextDatum(active_policy_name(ba_state->scheduled[i].active));
+		values[1] = TimestampTzGetDatum(time_t_to_timestamptz(ba_state->scheduled[i].at));
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	LWLockRelease(ba_state->policy_lock);
+
+	return (Datum) 0;
+}
+
+/*
+ * block_access_grant_temporary(role, duration)
+ *
+ * Allow a role to log in whatever the active policy says, until now +
+ * duration. Granting again replaces the expiration time. Return it.
+ */
+Datum
+block_access_grant_temporary(PG_FUNCTION_ARGS)
+{
+	char		*role = text_to_cstring(PG_GETARG_TEXT_PP(0));
+	Interval	*duration = PG_GETARG_INTERVAL_P(1);
+	TimestampTz	now = GetCurrentTimestamp();
+	TimestampTz	expires;
+	char		*granted_by;
+	char		key[NAMEDATALEN];
+	BAExemption	*entry;
+	bool		found;
+
+	check_policy_store();
+
+	/* typos would go unnoticed until the login fails */
+	(void) get_role_oid(role, false);
+
+	expires = DatumGetTimestampTz(DirectFunctionCall2(timestamptz_pl_interval,
+													  TimestampTzGetDatum(now),
+													  IntervalPGetDatum(duration)));
+	if (expires <= now)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("duration must be positive")));
+
+	granted_by = GetUserNameFromId(GetUserId(), false);
+
+	memset(key, 0, sizeof(key));
+	strlcpy(key, role, sizeof(key));
+
+	LWLockAcquire(ba_state->exemption_lock, LW_EXCLUSIVE);
+
+	prune_exemptions(timestamptz_to_time_t(now));
+
+	entry = (BAExemption *) hash_search(exemptions, key, HASH_ENTER_NULL, &found);
+	if (entry == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+				 errmsg("too many temporary grants"),
+				 errhint("Revoke a temporary grant or increase block_access.max_temporary_grants.")));
+
+	strlcpy(entry->granted_by, granted_by, NAMEDATALEN);
+	entry->granted_at = timestamptz_to_time_t(now);
+	entry->expires_at = timestamptz_to_time_t(expires);
+	if (!found)
+		pg_atomic_fetch_add_u32(&ba_state->nexemptions, 1);
+
+	LWLockRelease(ba_state->exemption_lock);
+
+	ereport(LOG,
+			(errmsg("block_access: role \"%s\" temporarily granted access until %s by \"%s\"",
+					key, timestamptz_to_str(expires), granted_by)));
+
+	PG_RETURN_TIMESTAMPTZ(expires);
+}
+
+/*
+ * block_access_revoke_temporary(role)
+ *
+ * Remove a temporary grant before it expires. Return whether there was one.
+ */
+Datum
+block_access_revoke_temporary(PG_FUNCTION_ARGS)
+{
+	char	*role = text_to_cstring(PG_GETARG_TEXT_PP(0));
+	char	key[NAMEDATALEN];
+	bool	found;
+
+	check_policy_store();
+
+	memset(key, 0, sizeof(key));
+	strlcpy(key, role, sizeof(key));
+
+	LWLockAcquire(ba_state->exemption_lock, LW_EXCLUSIVE);
+
+	prune_exemptions(time(NULL));
+
+	hash_search(exemptions, key, HASH_REMOVE, &found);
+	if (found)
+		pg_atomic_fetch_sub_u32(&ba_state->nexemptions, 1);
+
+	LWLockRelease(ba_state->exemption_lock);
+
+	if (found)
+		ereport(LOG,
+				(errmsg("block_access: temporary grant for role \"%s\" revoked by \"%s\"",
+						key, GetUserNameFromId(GetUserId(), false))));
+
+	PG_RETURN_BOOL(found);
+}
+
+/*
+ * block_access_temporary_grants()
+ *
+ * List temporary grants that have not expired.
+ */
+Datum
+block_access_temporary_grants(PG_FUNCTION_ARGS)
+{
+	Tuplestorestate	*tupstore;
+	TupleDesc		tupdesc;
+	HASH_SEQ_STATUS	hash_seq;
+	BAExemption		*entry;
+	pg_time_t		now = (pg_time_t) time(NULL);
+
+	check_policy_store();
+
+	tupstore = materialize_srf(fcinfo, &tupdesc);
+
+	/* expired grants are pruned by the functions that change them */
+	LWLockAcquire(ba_state->exemption_lock, LW_SHARED);
+
+	hash_seq_init(&hash_seq, exemptions);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		Datum	values[4];
+		bool	nulls[4] = {false, false, false, false};
+
+		if (entry->expires_at <= now)
+			continue;
+
+		values[0] = CStringGetTextDatum(entry->role);
+		values[1] = CStringGetTextDatum(entry->granted_by);
+		values[2] = TimestampTzGetDatum(time_t_to_timestamptz(entry->granted_at));
+		values[3] = TimestampTzGetDatum(time_t_to_timestamptz(entry->expires_at));
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	LWLockRelease(ba_state->exemption_lock);
+
+	return (Datum) 0;
+}
+
+/*
+ * block_access_enforce(enabled, revert_after)
+ *
+ * Turn enforcement off or on for the next logins, without a reload. If
+ * revert_after is not NULL, turning it off only lasts that long.
+ */
+Datum
+block_access_enforce(PG_FUNCTION_ARGS)
+{
+	bool		enabled;
+	uint64		disabled_until = PG_UINT64_MAX;
+	TimestampTz	until = 0;
+	char		*by;
+
+	if (PG_ARGISNULL(0))
+		ereport(ERROR,
+				(errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+				 errmsg("enabled must not be null")));
+	enabled = PG_GETARG_BOOL(0);
+
+	check_policy_store();
+
+	if (!enabled && !PG_ARGISNULL(1))
+	{
+		TimestampTz	now = GetCurrentTimestamp();
+
+		until = DatumGetTimestampTz(DirectFunctionCall2(timestamptz_pl_interval,
+														TimestampTzGetDatum(now),
+														PG_GETARG_DATUM(1)));
+		if (until <= now)
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("revert_after must be positive")));
+		disabled_until = (uint64) timestamptz_to_time_t(until);
+	}
+
+	pg_atomic_write_u64(&ba_state->disabled_until, enabled ? 0 : disabled_until);
+
+	by = GetUserNameFromId(GetUserId(), false);
+	if (enabled)
+		ereport(LOG,
+				(errmsg("block_access: enforcement turned on by \"%s\"", by)));
+	else if (until != 0)
+		ereport(LOG,
+				(errmsg("block_access: enforcement turned off by \"%s\" until %s",
+						by, timestamptz_to_str(until))));
+	else
+		ereport(LOG,
+				(errmsg("block_access: enforcement turned off by \"%s\"", by)));
+
+	PG_RETURN_VOID();
+}
+
+/*
+ * Copy of the policy called name, or of the active policy if name is NULL,
+ * for the simulation functions. They can run for a long time, so they do not
+ * hold policy_lock.
+ */
+static BAPolicy *
+simulated_policy(const char *name)
+{
+	BAPolicy	*src;
+	BAPolicy	*copy;
+	int			i;
+
+	check_policy_store();
+
+	LWLockAcquire(ba_state->policy_lock, LW_SHARED);
+
+	i = name != NULL ? policy_by_name(name) : (int) effective_active((pg_time_t) time(NULL));
+	if (i < 0)
+	{
+		LWLockRelease(ba_state->policy_lock);
+		ereport(ERROR,
+				(errcode(ERRCODE_UNDEFINED_OBJECT),
+				 errmsg("policy \"%s\" does not exist", name)));
+	}
+
+	src = i == 0 ? guc_policy(false) : slot_policy(i - 1);
+	copy = (BAPolicy *) MemoryContextAllocHuge(CurrentMemoryContext, policy_flat_size(src));
+	policy_flatten(src, (char *) copy);
+
+	LWLockRelease(ba_state->policy_lock);
+
+	return copy;
+}
+
+/*
+ * Whether roles of schedule class cls are allowed at minute of the week.
+ * Like at login, an invalid policy denies everyone and an empty one nobody.
+ */
+static inline bool
+simulated_verdict(BAPolicy *p, int cls, int minute)
+{
+	if (policy_error(p) != NULL)
+		return false;
+	if (p->nintervals == 0)
+		return true;
+
+	return bitmap_test(policy_schedules(p)[cls].words, minute);
+}
+
+/* Minute of the week of t, in the time zone used at login */
+static int
+simulated_minute(pg_time_t t, int *second)
+{
+	time_t		tt = (time_t) t;
+	struct tm	*tm = localtime(&tt);
+
+	if (second != NULL)
+		*second = tm->tm_sec;
+
+	return tm->tm_wday * BA_MINUTES_PER_DAY + tm->tm_hour * 60 + tm->tm_min;
+}
+
+/*
+ * Roles of a text[] argument; null elements are returned as NULL.
+ */
+static char **
+simulated_roles(ArrayType *array, int *nroles)
+{
+	Datum		*elems;
+	bool		*nulls;
+	char		**roles;
+	int			i;
+
+	deconstruct_array(array, TEXTOID, -1, false, TYPALIGN_INT,
+					  &elems, &nulls, nroles);
+
+	roles = (char **) palloc(Max(*nroles, 1) * sizeof(char *));
+	for (i = 0; i < *nroles; i++)
+		roles[i] = nulls[i] ? NULL : TextDatumGetCString(elems[i]);
+
+	return roles;
+}
+
+static void
+check_simulated_range(FunctionCallInfo fcinfo, int nargs)
+{
+	int		i;
+
+	for (i = 0; i < nargs; i++)
+		if (PG_ARGISNULL(i))
+			ereport(ERROR,
+					(errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+					 errmsg("only the policy argument can be null")));
+
+	if (PG_GETARG_TIMESTAMPTZ(2) <= PG_GETARG_TIMESTAMPTZ(1) ||
+		TIMESTAMP_NOT_FINITE(PG_GETARG_TIMESTAMPTZ(1)) ||
+		TIMESTAMP_NOT_FINITE(PG_GETARG_TIMESTAMPTZ(2)))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("\"from\" and \"to\" must be finite and \"from\" must be earlier than \"to\"")));
+}
+
+/*
+ * block_access_simulate(roles, from, to, step, policy)
+ *
+ * Evaluate a policy (the active one if policy is null) for each role at each
+ * time from "from" to "to" (excluded) every step, as a login would, except
+ * for temporary grants and block_access_enforce(). Each role is looked up
+ * once; each time is converted to a minute of the week once.
+ */
+Datum
+block_access_simulate(PG_FUNCTION_ARGS)
+{
+	Tuplestorestate	*tupstore;
+	TupleDesc		tupdesc;
+	BAPolicy		*p;
+	char			**roles;
+	int				nroles;
+	TimestampTz		to;
+	TimestampTz		at;
+	TimestampTz		*times;
+	int				*minutes;
+	int				ntimes = 0;
+	int				maxtimes = 1024;
+	Datum			values[3];
+	bool			nulls[3] = {false, false, false};
+	int				i;
+	int				j;
+
+	check_simulated_range(fcinfo, 4);
+	p = simulated_policy(PG_ARGISNULL(4) ? NULL : text_to_cstring(PG_GETARG_TEXT_PP(4)));
+	roles = simulated_roles(PG_GETARG_ARRAYTYPE_P(0), &nroles);
+	to = PG_GETARG_TIMESTAMPTZ(2);
+
+	times = (TimestampTz *) palloc(maxtimes * sizeof(TimestampTz));
+	minutes = (int *) palloc(maxtimes * sizeof(int));
+	for (at = PG_GETARG_TIMESTAMPTZ(1); at < to;)
+	{
+		TimestampTz	next;
+
+		CHECK_FOR_INTERRUPTS();
+
+		if (ntimes == maxtimes)
+		{
+			maxtimes *= 2;
+			times = (TimestampTz *) repalloc_huge(times, maxtimes * sizeof(TimestampTz));
+			minutes = (int *) repalloc_huge(minutes, maxtimes * sizeof(int));
+		}
+		times[ntimes] = at;
+		minutes[ntimes] = simulated_minute(timestamptz_to_time_t(at), NULL);
+		ntimes++;
+
+		next = DatumGetTimestampTz(DirectFunctionCall2(timestamptz_pl_interval,
+													   TimestampTzGetDatum(at),
+													   PG_GETARG_DATUM(3)));
+		if (next <= at)
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("step must be positive")));
+		at = next;
+	}
+
+	tupstore = materialize_srf(fcinfo, &tupdesc);
+
+	for (i = 0; i < nroles; i++)
+	{
+		int		cls;
+
+		if (roles[i] == NULL)
+			continue;
+
+		CHECK_FOR_INTERRUPTS();
+
+		cls = policy_role_class(p, roles[i]);
+		values[0] = CStringGetTextDatum(roles[i]);
+		for (j = 0; j < ntimes; j++)
+		{
+			values[1] = TimestampTzGetDatum(times[j]);
+			values[2] = BoolGetDatum(simulated_verdict(p, cls, minutes[j]));
+			tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+		}
+	}
+
+	return (Datum) 0;
+}
+
+/*
+ * Allowed times of schedule class cls between from and to, as ranges. A run
+ * of minutes with the same verdict is found with a bit scan. Runs are checked
+ * against the clock, since a change of UTC offset moves the minutes of the
+ * week; the run that contains the change is walked minute by minute.
+ */
+static void
+simulated_ranges(BAPolicy *p, int cls, pg_time_t from, pg_time_t to,
+				 pg_time_t **starts, pg_time_t **ends, int *nranges)
+{
+	int			maxranges = 16;
+	pg_time_t	t = from;
+	pg_time_t	start = -1;
+
+	*nranges = 0;
+	*starts = (pg_time_t *) palloc(maxranges * sizeof(pg_time_t));
+	*ends = (pg_time_t *) palloc(maxranges * sizeof(pg_time_t));
+
+	while (t < to)
+	{
+		int			second;
+		int			minute = simulated_minute(t, &second);
+		bool		allowed = simulated_verdict(p, cls, minute);
+		pg_time_t	end;
+
+		CHECK_FOR_INTERRUPTS();
+
+		if (policy_error(p) != NULL || p->nintervals == 0)
+			end = to;
+		else
+		{
+			const uint64	*words = policy_schedules(p)[cls].words;
+			int				next;
+
+			next = allowed ? bitmap_next_clear(words, minute) : bitmap_next(words, minute);
+			if (next < 0)
+				end = to;
+			else
+			{
+				int		run = (next - minute + BA_MINUTES_PER_WEEK) % BA_MINUTES_PER_WEEK;
+
+				end = t - second + (pg_time_t) run * 60;
+				if (end < to && simulated_minute(end, NULL) != next)
+					end = t - second + 60;
+			}
+		}
+		end = Min(end, to);
+
+		if (allowed && start < 0)
+			start = t;
+		else if (!allowed && start >= 0)
+		{
+			if (*nranges == maxranges)
+			{
+				maxranges *= 2;
+				*starts = (pg_time_t *) repalloc(*starts, maxranges * sizeof(pg_time_t));
+				*ends = (pg_time_t *) repalloc(*ends, maxranges * sizeof(pg_time_t));
+			}
+			(*starts)[*nranges] = start;
+			(*ends)[*nranges] = t;
+			(*nranges)++;
+			start = -1;
+		}
+
+		t = end;
+	}
+
+	if (start >= 0)
+	{
+		if (*nranges == maxranges)
+		{
+			*starts = (pg_time_t *) repalloc(*starts, (maxranges + 1) * sizeof(pg_time_t));
+			*ends = (pg_time_t *) repalloc(*ends, (maxranges + 1) * sizeof(pg_time_t));
+		}
+		(*starts)[*nranges] = start;
+		(*ends)[*nranges] = to;
+		(*nranges)++;
+	}
+}
+
+/*
+ * block_access_simulate_ranges(roles, from, to, policy)
+ *
+ * Same as block_access_simulate(), but return the times at which each role is
+ * allowed as ranges, to the minute. Roles that share a schedule class share
+ * the computation.
+ */
+Datum
+block_access_simulate_ranges(PG_FUNCTION_ARGS)
+{
+	Tuplestorestate	*tupstore;
+	TupleDesc		tupdesc;
+	TypeCacheEntry	*typcache;
+	BAPolicy		*p;
+	char			**roles;
+	int				nroles;
+	pg_time_t		from;
+	pg_time_t		to;
+	pg_time_t		**starts;
+	pg_time_t		**ends;
+	int				*nranges;
+	int				nclasses;
+	Datum			values[2];
+	bool			nulls[2] = {false, false};
+	int				i;
+	int				j;
+
+	check_simulated_range(fcinfo, 3);
+	p = simulated_policy(PG_ARGISNULL(3) ? NULL : text_to_cstring(PG_GETARG_TEXT_PP(3)));
+	roles = simulated_roles(PG_GETARG_ARRAYTYPE_P(0), &nroles);
+	from = timestamptz_to_time_t(PG_GETARG_TIMESTAMPTZ(1));
+	to = timestamptz_to_time_t(PG_GETARG_TIMESTAMPTZ(2));
+
+	typcache = lookup_type_cache(TSTZRANGEOID, TYPECACHE_RANGE_INFO);
+
+	/* ranges of each schedule class; a policy without intervals has none */
+	nclasses = Max(p->nschedules, 1);
+	starts = (pg_time_t **) palloc(nclasses * sizeof(pg_time_t *));
+	ends = (pg_time_t **) palloc(nclasses * sizeof(pg_time_t *));
+	nranges = (int *) palloc(nclasses * sizeof(int));
+	for (i = 0; i < nclasses; i++)
+		nranges[i] = -1;
+
+	tupstore = materialize_srf(fcinfo, &tupdesc);
+
+	for (i = 0; i < nroles; i++)
+	{
+		int		cls;
+
+		if (roles[i] == NULL)
+			continue;
+
+		cls = policy_role_class(p, roles[i]);
+		if (nranges[cls] < 0)
+			simulated_ranges(p, cls, from, to, &starts[cls], &ends[cls], &nranges[cls]);
+
+		values[0] = CStringGetTextDatum(roles[i]);
+		for (j = 0; j < nranges[cls]; j++)
+		{
+			RangeBound	lower;
+			RangeBound	upper;
+
+			lower.val = TimestampTzGetDatum(starts[cls][j] == from ?
+											PG_GETARG_TIMESTAMPTZ(1) :
+											time_t_to_timestamptz(starts[cls][j]));
+			lower.infinite = false;
+			lower.inclusive = true;
+			lower.lower = true;
+			upper.val = TimestampTzGetDatum(ends[cls][j] == to ?
+											PG_GETARG_TIMESTAMPTZ(2) :
+											time_t_to_timestamptz(ends[cls][j]));
+			upper.infinite = false;
+			upper.inclusive = false;
+			upper.lower = false;
+
+#if PG_VERSION_NUM >= 160000
+			values[1] = RangeTypePGetDatum(make_range(typcache, &lower, &upper, false, NULL));
+#else
+			values[1] = RangeTypePGetDatum(make_range(typcache, &lower, &upper, false));
+#endif
+			tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+		}
+	}
+
+	return (Datum) 0;
+}
+
+/*
+ * block_access_maintenance()
+ *
+ * Commands run by the maintenance worker in the last closed window (or the
+ * current one), with their status and how long they took.
+ */
+Datum
+block_access_maintenance(PG_FUNCTION_ARGS)
+{
+	Tuplestorestate	*tupstore;
+	TupleDesc		tupdesc;
+	int				i;
+
+	check_policy_store();
+
+	tupstore = materialize_srf(fcinfo, &tupdesc);
+
+	LWLockAcquire(ba_state->lock, LW_SHARED);
+
+	for (i = 0; i < ba_state->nmaintenance; i++)
+	{
+		BAMaintenanceRun	*run = &ba_state->maintenance[i];
+		Datum	values[5];
+		bool	nulls[5] = {false, false, false, false, false};
+
+		values[0] = TimestampTzGetDatum(time_t_to_timestamptz(ba_state->maintenance_window));
+		values[1] = CStringGetTextDatum(run->command);
+		values[2] = CStringGetTextDatum(maintenance_status_names[run->status]);
+		if (run->started_at != 0)
+			values[3] = TimestampTzGetDatum(time_t_to_timestamptz(run->started_at));
+		else
+			nulls[3] = true;
+		if (run->status >= BA_MAINTENANCE_DONE && run->status != BA_MAINTENANCE_SKIPPED)
+		{
+			Interval	*duration = (Interval *) palloc0(sizeof(Interval));
+
+			duration->time = run->duration;
+			values[4] = IntervalPGetDatum(duration);
+		}
+		else
+			nulls[4] = true;
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	LWLockRelease(ba_state->lock);
+
+	return (Datum) 0;
+}
+
+/*
+ * block_access_benchmark_compile(nroles, workers, repeat)
+ *
+ * Compile a policy of seven intervals with nroles roles each, as
+ * block_access_verify --benchmark=compile does, repeat times with each
+ * number of workers, and return the best and mean times. 0 workers is the
+ * serial compilation. Only the roles and intervals are compiled: the policy
+ * is neither sealed nor published. Each policy is compared with a serial
+ * compilation, and an error is raised if they differ.
+ */
+Datum
+block_access_benchmark_compile(PG_FUNCTION_ARGS)
+{
+	static const char *const days[] = {"sun", "mon", "tue", "wed", "thu", "fri", "sat"};
+	int32			nroles = PG_GETARG_INT32(0);
+	int32			repeat = PG_GETARG_INT32(2);
+	Datum			*elems;
+	bool			*elemnulls;
+	int				nelems;
+	StringInfoData	intervals;
+	StringInfoData	roles;
+	BAPolicy		*reference;
+	Tuplestorestate	*tupstore;
+	TupleDesc		tupdesc;
+	int				i;
+	int				k;
+
+	check_policy_store();
+
+	if (nroles < 1 || repeat < 1)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("nroles and repeat must be positive")));
+
+	deconstruct_array(PG_GETARG_ARRAYTYPE_P(1), INT4OID, sizeof(int32), true, TYPALIGN_INT,
+					  &elems, &elemnulls, &nelems);
+	for (i = 0; i < nelems; i++)
+		if (elemnulls[i] || DatumGetInt32(elems[i]) < 0 || DatumGetInt32(elems[i]) > 64)
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("numbers of workers must be between 0 and 64")));
+
+	initStringInfo(&intervals);
+	initStringInfo(&roles);
+	for (i = 0; i < 7; i++)
+	{
+		appendStringInfo(&intervals, "%s%s - 08:00-18:00", i > 0 ? " ; " : "", days[i]);
+		if (i > 0)
+			appendStringInfoChar(&roles, ';');
+		for (k = 0; k < nroles; k++)
+			appendStringInfo(&roles, "%sbench_role_%d", k > 0 ? ", " : "", i * (nroles / 2) + k);
+	}
+
+	/* what every compilation must match */
+	reference = parse_policy(CurrentMemoryContext, intervals.data, roles.data, 0);
+	reference->generation = PG_UINT64_MAX;	/* see policy_diff() */
+
+	tupstore = materialize_srf(fcinfo, &tupdesc);
+
+	for (i = 0; i < nelems; i++)
+	{
+		int		nworkers = DatumGetInt32(elems[i]);
+		int		launched = nworkers;
+		double	best = 0;
+		double	total = 0;
+		Datum	values[4];
+		bool	nulls[4] = {false, false, false, false};
+
+		for (k = 0; k < repeat; k++)
+		{
+			MemoryContext	cxt;
+			MemoryContext	oldcxt;
+			instr_time		start;
+			instr_time		duration;
+			BAPolicy		*p;
+			int				n = 0;
+			int				added;
+			int				removed;
+			int				changed;
+
+			CHECK_FOR_INTERRUPTS();
+
+			cxt = AllocSetContextCreate(CurrentMemoryContext,
+										"block_access benchmark",
+										ALLOCSET_DEFAULT_SIZES);
+			oldcxt = MemoryContextSwitchTo(cxt);
+
+			INSTR_TIME_SET_CURRENT(start);
+			if (nworkers == 0)
+				p = parse_policy(cxt, intervals.data, roles.data, 0);
+			else
+				p = parallel_parse_policy(cxt, intervals.data, roles.data, 0, nworkers, &n);
+			INSTR_TIME_SET_CURRENT(duration);
+			INSTR_TIME_SUBTRACT(duration, start);
+
+			policy_diff(reference, p, &added, &removed, &changed);
+			if (added + removed + changed != 0 || p->nroles != reference->nroles ||
+				p->nschedules != reference->nschedules)
+				elog(ERROR, "policy compiled with %d workers differs from the serial one: %d roles added, %d removed, %d changed",
+					 nworkers, added, removed, changed);
+
+			MemoryContextSwitchTo(oldcxt);
+			MemoryContextDelete(cxt);
+
+			if (k == 0 || INSTR_TIME_GET_DOUBLE(duration) < best)
+				best = INSTR_TIME_GET_DOUBLE(duration);
+			total += INSTR_TIME_GET_DOUBLE(duration);
+			launched = Min(launched, n);
+		}
+
+		values[0] = Int32GetDatum(nworkers);
+		values[1] = Int32GetDatum(launched);
+		values[2] = Float8GetDatum(best * 1000.0);
+		values[3] = Float8GetDatum(total * 1000.0 / repeat);
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	return (Datum) 0;
+}
+
+/*
+ * Minutes from minute (of the week) until the next time words opens (a set
+ * bit after a clear one) or closes, between 1 and BA_MINUTES_PER_WEEK, or -1
+ * if it never does: the schedule is always or never open.
+ */
+static int
+minutes_until_change(const uint64 *words, int minute, bool opening)
+{
+	int		from;
+	int		to;
+
+	/* the first minute on the other side, then the first one back */
+	from = opening ? bitmap_next_clear(words, minute) : bitmap_next(words, minute);
+	if (from < 0)
+		return -1;
+	to = opening ? bitmap_next(words, from) : bitmap_next_clear(words, from);
+	if (to < 0)
+		return -1;
+
+	return (to - minute + BA_MINUTES_PER_WEEK - 1) % BA_MINUTES_PER_WEEK + 1;
+}
+
+/*
+ * Split s in place at each sep that is not between double quotes, and return
+ * the items without surrounding whitespace. Empty items are kept, since
+ * groups are matched with intervals by position.
+ */
+static List *
+split_quoted(char *s, char sep)
+{
+	List	*items = NIL;
+	char	*item = s;
+	bool	quoted = false;
+
+	for (;; s++)
+	{
+		bool	end = (*s == '\0');
+		char	*e = s;
+
+		if (*s == '"')
+			quoted = !quoted;
+		if (!end && (*s != sep || quoted))
+			continue;
+
+		*s = '\0';
+		while (isspace((unsigned char) *item))
+			item++;
+		while (e > item && isspace((unsigned char) e[-1]))
+			*--e = '\0';
+		items = lappend(items, item);
+
+		if (end)
+			break;
+		item = s + 1;
+	}
+
+	return items;
+}
+
+/*
+ * Copy in cxt of the policy the background workers follow at now: the active
+ * one, or the target of a due scheduled activation, which is switched here as
+ * at login. NULL while the kill switch is on: nobody is blocked then. If
+ * intervals is not NULL, it is set to a copy of the intervals of the policy.
+ */
+static BAPolicy *
+followed_policy(MemoryContext cxt, pg_time_t now, char **intervals)
+{
+	BAPolicy	*src;
+	BAPolicy	*copy;
+	uint32		active;
+
+	if (enforcement_disabled(now))
+		return NULL;
+
+	attach_policy_store();
+	check_scheduled_switches(now);
+	save_pending_policies();
+
+	LWLockAcquire(ba_state->policy_lock, LW_SHARED);
+
+	active = effective_active(now);
+	src = active == 0 ? guc_policy(false) : slot_policy(active - 1);
+	copy = (BAPolicy *) MemoryContextAllocHuge(cxt, policy_flat_size(src));
+	policy_flatten(src, (char *) copy);
+	if (intervals != NULL)
+		*intervals = MemoryContextStrdup(cxt, active != 0 ? slot_intervals(active - 1) :
+										 interval_time_value != NULL ? interval_time_value : "");
+
+	LWLockRelease(ba_state->policy_lock);
+
+	return copy;
+}
+
+/*
+ * Milliseconds until the next scheduled activation or the end of the kill
+ * switch, if that is sooner than timeout
+ */
+static long
+policy_change_timeout(pg_time_t now, long timeout)
+{
+	uint64	at;
+
+	at = pg_atomic_read_u64(&ba_state->next_switch);
+	if (at > (uint64) now)
+		timeout = Min(timeout, (long) (at - (uint64) now) * 1000L);
+
+	at = pg_atomic_read_u64(&ba_state->disabled_until);
+	if (at > (uint64) now)
+		timeout = Min(timeout, (long) (at - (uint64) now) * 1000L);
+
+	return timeout;
+}
+
+/*
+ * t as "YYYY-MM-DD HH:MM", in the time zone used at login, for the server log
+ */
+static void
+format_login_time(pg_time_t t, char *buf, size_t len)
+{
+	time_t		tt = (time_t) t;
+
+	strftime(buf, len, "%Y-%m-%d %H:%M", localtime(&tt));
+}
+
+/*
+ * Match the groups of block_access.prewarm_relations with the intervals of p,
+ * the policy in effect, and store in prewarm_days the relations of the
+ * interval that decides each week day (the first one that has it). Return
+ * false if there is nothing to prewarm.
+ */
+static bool
+plan_prewarm(BAPolicy *p, const char *intervals)
+{
+	MemoryContext	oldcxt;
+	BAIntervalRole	*parsed;
+	List			*groups;
+	int				i;
+	int				j;
+
+	if (prewarm_cxt == NULL)
+		prewarm_cxt = AllocSetContextCreate(TopMemoryContext,
+											"block_access prewarm",
+											ALLOCSET_SMALL_SIZES);
+	MemoryContextReset(prewarm_cxt);
+	memset(prewarm_days, 0, sizeof(prewarm_days));
+	prewarm_intervals = MemoryContextStrdup(prewarm_cxt, intervals);
+
+	if (prewarm_relations == NULL || prewarm_relations[0] == '\0' ||
+		p->nintervals == 0 || policy_error(p) != NULL)
+		return false;
+
+	oldcxt = MemoryContextSwitchTo(prewarm_cxt);
+
+	groups = split_quoted(pstrdup(prewarm_relations), ';');
+	if (list_length(groups) != p->nintervals)
+	{
+		ereport(LOG,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("block_access: number of intervals and prewarm_relations elements do not match"),
+				 errdetail("Nothing will be prewarmed until they do.")));
+		MemoryContextSwitchTo(oldcxt);
+		return false;
+	}
+
+	/* it was compiled, hence it parses */
+	parsed = (BAIntervalRole *) palloc0(p->nintervals * sizeof(BAIntervalRole));
+	parse_options(parsed, p->nintervals, pstrdup(intervals), NULL);
+
+	for (i = p->nintervals - 1; i >= 0; i--)
+		for (j = 0; j < parsed[i].nwday; j++)
+			prewarm_days[parsed[i].wday[j]] = list_nth(groups, i);
+
+	MemoryContextSwitchTo(oldcxt);
+
+	return true;
+}
+
+/*
+ * Read the relations of a window that opens at open_at into shared buffers,
+ * each one in a transaction of its own: one that cannot be read is reported
+ * and the others are read anyway. Stop when as many blocks as shared buffers
+ * were read, or the first ones would be evicted by the last.
+ */
+static void
+prewarm_window(const char *relations, pg_time_t open_at)
+{
+	MemoryContext	oldcxt = CurrentMemoryContext;
+	char			*copy = pstrdup(relations);
+	List			*names;
+	ListCell		*lc;
+	int64			nblocks = 0;
+	int				nrelations = 0;
+	instr_time		start;
+	instr_time		duration;
+	char			buf[64];
+
+	names = split_quoted(copy, ',');
+
+	INSTR_TIME_SET_CURRENT(start);
+
+	foreach(lc, names)
+	{
+		char	*name = (char *) lfirst(lc);
+
+		if (name[0] == '\0')
+			continue;
+
+		if (nblocks >= NBuffers)
+		{
+			ereport(LOG,
+					(errmsg("block_access: shared_buffers is full, \"%s\" and the next relations were not prewarmed",
+							name)));
+			break;
+		}
+
+		SetCurrentStatementStartTimestamp();
+		StartTransactionCommand();
+		pgstat_report_activity(STATE_RUNNING, name);
+
+		PG_TRY();
+		{
+			nblocks += prewarm_relation(name, NBuffers - nblocks);
+			nrelations++;
+			CommitTransactionCommand();
+		}
+		PG_CATCH();
+		{
+			HOLD_INTERRUPTS();
+			EmitErrorReport();
+			AbortOutOfAnyTransaction();
+			FlushErrorState();
+			RESUME_INTERRUPTS();
+		}
+		PG_END_TRY();
+
+		MemoryContextSwitchTo(oldcxt);
+	}
+
+	pgstat_report_activity(STATE_IDLE, NULL);
+
+	INSTR_TIME_SET_CURRENT(duration);
+	INSTR_TIME_SUBTRACT(duration, start);
+
+	format_login_time(open_at, buf, sizeof(buf));
+	ereport(LOG,
+			(errmsg("block_access: prewarmed %d relations (" INT64_FORMAT " blocks) in %.3f s for the window opening at %s",
+					nrelations, nblocks, INSTR_TIME_GET_DOUBLE(duration), buf)));
+
+	list_free(names);
+	pfree(copy);
+}
+
+/*
+ * Read up to budget blocks of a relation, of its partitions or children, and
+ * of their indexes, into shared buffers. Return the number of blocks read.
+ */
+static int64
+prewarm_relation(const char *name, int64 budget)
+{
+	RangeVar	*rv;
+	Oid			relid;
+	List		*relids;
+	ListCell	*lc;
+	int64		nblocks = 0;
+
+	rv = makeRangeVarFromNameList(textToQualifiedNameList(cstring_to_text(name)));
+	relid = RangeVarGetRelid(rv, AccessShareLock, true);
+	if (!OidIsValid(relid))
+	{
+		ereport(WARNING,
+				(errcode(ERRCODE_UNDEFINED_TABLE),
+				 errmsg("block_access: relation \"%s\" does not exist and was not prewarmed", name)));
+		return 0;
+	}
+
+	relids = find_all_inheritors(relid, AccessShareLock, NULL);
+
+	foreach(lc, relids)
+	{
+		Relation	rel = relation_open(lfirst_oid(lc), NoLock);
+		List		*indexes = RelationGetIndexList(rel);
+		ListCell	*ilc;
+
+		nblocks += prewarm_fork(rel, budget - nblocks);
+
+		foreach(ilc, indexes)
+		{
+			Relation	index = index_open(lfirst_oid(ilc), AccessShareLock);
+
+			nblocks += prewarm_fork(index, budget - nblocks);
+			index_close(index, AccessShareLock);
+		}
+
+		list_free(indexes);
+		relation_close(rel, NoLock);
+	}
+
+	return nblocks;
+}
+
+/*
+ * Read up to budget blocks of the main fork of rel, from the first one.
+ * Relations without storage (views, partitioned tables) have none.
+ */
+static int64
+prewarm_fork(Relation rel, int64 budget)
+{
+	BlockNumber	nblocks;
+	BlockNumber	block;
+
+	if (!RELKIND_HAS_STORAGE(rel->rd_rel->relkind) || budget <= 0)
+		return 0;
+
+	nblocks = RelationGetNumberOfBlocksInFork(rel, MAIN_FORKNUM);
+
+	for (block = 0; block < nblocks && block < budget; block++)
+	{
+		CHECK_FOR_INTERRUPTS();
+		ReleaseBuffer(ReadBufferExtended(rel, MAIN_FORKNUM, block, RBM_NORMAL, NULL));
+	}
+
+	return block;
+}
+
+/*
+ * Main loop of the prewarm worker. It wakes up block_access.prewarm_lead_time
+ * minutes before each time the policy in effect opens (for roles that are not
+ * excluded), reads the relations of the interval that decides that day, and
+ * sleeps until the next one.
+ * The policy in effect is the active one, or the one a scheduled activation
+ * switches to; nothing is planned while the kill switch is on.
+ *
+ * The worker also runs on a hot standby, whose logins are blocked as well.
+ */
+void
+block_access_prewarm_main(Datum main_arg)
+{
+	pg_time_t	prewarmed_at = 0;	/* opening time of the last prewarm */
+	bool		planned = false;
+	bool		replan = true;
+	MemoryContext	cxt;
+
+	pqsignal(SIGHUP, SignalHandlerForConfigReload);
+	pqsignal(SIGTERM, die);
+	BackgroundWorkerUnblockSignals();
+
+	BackgroundWorkerInitializeConnection(prewarm_database, NULL, 0);
+
+	cxt = AllocSetContextCreate(TopMemoryContext,
+								"block_access followed policy",
+								ALLOCSET_DEFAULT_SIZES);
+
+	for (;;)
+	{
+		long		timeout = BA_WORKER_MAX_SLEEP;
+		time_t		t;
+		BAPolicy	*p;
+		char		*intervals = NULL;
+
+		CHECK_FOR_INTERRUPTS();
+
+		if (ConfigReloadPending)
+		{
+			ConfigReloadPending = false;
+			ProcessConfigFile(PGC_SIGHUP);
+			replan = true;
+		}
+
+		t = time(NULL);
+		MemoryContextReset(cxt);
+		p = followed_policy(cxt, (pg_time_t) t, &intervals);
+		timeout = policy_change_timeout((pg_time_t) t, timeout);
+
+		/* another policy is in effect, or its intervals changed */
+		if (p != NULL && (replan || strcmp(intervals, prewarm_intervals) != 0))
+		{
+			planned = plan_prewarm(p, intervals);
+			replan = false;
+		}
+
+		if (p != NULL && planned)
+		{
+			const uint64 *open = policy_schedules(p)[0].words;
+			struct tm  *now = localtime(&t);
+			int			minute;
+			int			delta;
+			int			opening;	/* minute of the week */
+			pg_time_t	open_at;
+			pg_time_t	prewarm_at;
+
+			minute = now->tm_wday * BA_MINUTES_PER_DAY + now->tm_hour * 60 + now->tm_min;
+			delta = minutes_until_change(open, minute, true);
+			opening = (minute + delta) % BA_MINUTES_PER_WEEK;
+			open_at = (pg_time_t) t - now->tm_sec + (pg_time_t) delta * 60;
+
+			/* already done for the next opening: the one after it */
+			if (delta > 0 && open_at == prewarmed_at)
+			{
+				delta = minutes_until_change(open, opening, true);
+				opening = (opening + delta) % BA_MINUTES_PER_WEEK;
+				open_at += (pg_time_t) delta * 60;
+			}
+
+			if (delta > 0)
+			{
+				prewarm_at = open_at - (pg_time_t) prewarm_lead_time * 60;
+
+				if (prewarm_at <= (pg_time_t) t)
+				{
+					char	*relations = prewarm_days[opening / BA_MINUTES_PER_DAY];
+
+					if (relations != NULL && relations[0] != '\0')
+						prewarm_window(relations, open_at);
+					prewarmed_at = open_at;
+					continue;
+				}
+
+				timeout = Min(timeout, (long) (prewarm_at - (pg_time_t) t) * 1000L);
+			}
+		}
 
-	return t;
+		(void) WaitLatch(MyLatch,
+						 WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH,
+						 timeout, PG_WAIT_EXTENSION);
+		ResetLatch(MyLatch);
+	}
 }
 
 /*
- * Same as strtok() except that it returns all tokens even if the token is
- * empty.
- *
- * FIXME if all items are empty, it does not return the last item
+ * Run block_access.maintenance_commands, one statement after the other, in a
+ * closed window that opens at open_at. Each statement runs as a top-level
+ * command in a transaction of its own (so that VACUUM or REINDEX CONCURRENTLY
+ * can), and is canceled if it is still running
+ * block_access.maintenance_stop_before minutes before the window opens; the
+ * next ones are then skipped. One that fails is reported and the next ones
+ * run anyway.
  */
-static char *
-strtok_all(char *str, char const *delims)
+static void
+run_maintenance(pg_time_t open_at)
 {
-	static char	*src = NULL;
-	char		*ret = 0;
-	char		*p;
+	MemoryContext	cxt;
+	MemoryContext	oldcxt = CurrentMemoryContext;
+	pg_time_t		stop_at = open_at - (pg_time_t) maintenance_stop_before * 60;
+	char			*sql;
+	List			*volatile parsetrees = NIL;
+	ListCell		*lc;
+	int				counts[lengthof(maintenance_status_names)];
+	int				i;
+	instr_time		start;
+	instr_time		duration;
+	char			buf[64];
 
-	if (str != NULL)
-		src = str;
+	cxt = AllocSetContextCreate(TopMemoryContext,
+								"block_access maintenance",
+								ALLOCSET_DEFAULT_SIZES);
+	MemoryContextSwitchTo(cxt);
 
-	if (src == NULL)
-		return NULL;
+	sql = pstrdup(maintenance_commands);
 
-	if ((p = strpbrk(src, delims)) != NULL)
+	PG_TRY();
 	{
-		*p  = 0;
-		ret = src;
-		src = ++p;
+		parsetrees = pg_parse_query(sql);
 	}
-	else if (*src)
+	PG_CATCH();
 	{
-		ret = src;
-		src = NULL;
+		HOLD_INTERRUPTS();
+		EmitErrorReport();
+		FlushErrorState();
+		RESUME_INTERRUPTS();
 	}
+	PG_END_TRY();
 
-	return ret;
-}
-
-/*
- * Each interval item contains:
- * (i) list of abbrev week days separated by comma;
- * (ii) dash;
- * (iii) start time;
- * (iv) dash;
- * (v) end time;
- *
- * Example: mon, wed, fri, sat - 08:00-12:00
- *
- */
-static void
-parse_interval(BAIntervalRole *interval, char *s)
-{
-	char	*item;
-	char	*item_wd;
-	char	*ptr;
-	char	*weekday_str;
-	char	*start_time_str;
-	char	*end_time_str;
-	int		i;
-
-	/* debug purposes */
-	char	week_day_names[7][4] = {"sun", "mon", "tue", "wed", "thu", "fri", "sat"};
+	MemoryContextSwitchTo(cxt);
 
-	item = pstrdup(s);
-
-	ptr = strtok(item, "-");
-	if (ptr == NULL)
-		elog(ERROR, "parse week day failed: %s", s);
-
-	weekday_str = trim(ptr);
+	LWLockAcquire(ba_state->lock, LW_EXCLUSIVE);
+	ba_state->maintenance_window = open_at;
+	ba_state->nmaintenance = 0;
+	foreach(lc, parsetrees)
+	{
+		BAMaintenanceRun	*run;
 
-	ptr = strtok(NULL, "-");
-	if (ptr == NULL)
-		elog(ERROR, "parse start time failed: %s", s);
+		if (ba_state->nmaintenance == BA_MAX_MAINTENANCE)
+			break;
+		run = &ba_state->maintenance[ba_state->nmaintenance++];
+		strlcpy(run->command, statement_text(lfirst_node(RawStmt, lc), sql), BA_MAINTENANCE_TEXT);
+		run->status = BA_MAINTENANCE_PENDING;
+		run->started_at = 0;
+		run->duration = 0;
+	}
+	LWLockRelease(ba_state->lock);
 
-	start_time_str = trim(ptr);
+	memset(counts, 0, sizeof(counts));
+	INSTR_TIME_SET_CURRENT(start);
 
-	ptr = strtok(NULL, "-");
-	if (ptr == NULL)
-		elog(ERROR, "parse end time failed: %s", s);
+	i = 0;
+	foreach(lc, parsetrees)
+	{
+		RawStmt		*parsetree = lfirst_node(RawStmt, lc);
+		char		*command = statement_text(parsetree, sql);
+		pg_time_t	started_at = (pg_time_t) time(NULL);
+		volatile int	status = BA_MAINTENANCE_FAILED;
+		instr_time	elapsed;
 
-	end_time_str = trim(ptr);
+		if (started_at >= stop_at)
+		{
+			record_maintenance(i++, BA_MAINTENANCE_SKIPPED, 0, 0);
+			counts[BA_MAINTENANCE_SKIPPED]++;
+			continue;
+		}
 
-	elog(DEBUG1, "week days: \"%s\" ; start time: \"%s\" ; end time: \"%s\"", weekday_str, start_time_str, end_time_str);
+		record_maintenance(i, BA_MAINTENANCE_RUNNING, started_at, 0);
+		INSTR_TIME_SET_CURRENT(elapsed);
 
-	pfree(item);
+		SetCurrentStatementStartTimestamp();
+		StartTransactionCommand();
+		pgstat_report_activity(STATE_RUNNING, command);
+		enable_timeout_after(STATEMENT_TIMEOUT,
+							 (int) Min((stop_at - started_at) * 1000, (pg_time_t) PG_INT32_MAX));
 
-	item = pstrdup(weekday_str);
+		PG_TRY();
+		{
+			run_statement(parsetree, sql);
+			CommitTransactionCommand();
+			status = BA_MAINTENANCE_DONE;
+		}
+		PG_CATCH();
+		{
+			ErrorData	*edata;
 
-	/* number of week days */
-	interval->nwday = 1;		/* we should have at least one token */
-	for (ptr = item; *ptr != '\0'; ptr++)
-	{
-		if (*ptr == ',')
-			interval->nwday++;
-	}
+			HOLD_INTERRUPTS();
+			MemoryContextSwitchTo(cxt);
+			edata = CopyErrorData();
+			if (edata->sqlerrcode == ERRCODE_QUERY_CANCELED)
+				status = BA_MAINTENANCE_CANCELED;
+			EmitErrorReport();
+			AbortOutOfAnyTransaction();
+			FlushErrorState();
+			FreeErrorData(edata);
+			RESUME_INTERRUPTS();
+		}
+		PG_END_TRY();
 
-	interval->wday = (int *) palloc(interval->nwday * sizeof(int));
+		/* a timeout that went off after the command ended cancels nothing */
+		disable_timeout(STATEMENT_TIMEOUT, false);
+		QueryCancelPending = false;
 
-	/* week days such as 'mon,wed,fri,sat' */
-	i = 0;
-	ptr = strtok(item, ",");
-	while (ptr)
-	{
-		item_wd = trim(ptr);
-		if (strcmp(item_wd, "sun") == 0)
-			interval->wday[i++] = 0;	/* sunday */
-		else if (strcmp(item_wd, "mon") == 0)
-			interval->wday[i++] = 1;	/* monday */
-		else if (strcmp(item_wd, "tue") == 0)
-			interval->wday[i++] = 2;	/* tuesday */
-		else if (strcmp(item_wd, "wed") == 0)
-			interval->wday[i++] = 3;	/* wednesday */
-		else if (strcmp(item_wd, "thu") == 0)
-			interval->wday[i++] = 4;	/* thursday */
-		else if (strcmp(item_wd, "fri") == 0)
-			interval->wday[i++] = 5;	/* friday */
-		else if (strcmp(item_wd, "sat") == 0)
-			interval->wday[i++] = 6;	/* saturday */
-		else
-			elog(ERROR, "parse week days failed: \"%s\" -> %s", item_wd, weekday_str);
+		MemoryContextSwitchTo(cxt);
+		pgstat_report_activity(STATE_IDLE, NULL);
 
-		elog(DEBUG2, "week day: \"%s\"", week_day_names[interval->wday[i - 1]]);
+		INSTR_TIME_SET_CURRENT(duration);
+		INSTR_TIME_SUBTRACT(duration, elapsed);
 
-		pfree(item_wd);
+		record_maintenance(i++, status, started_at, INSTR_TIME_GET_MICROSEC(duration));
+		counts[status]++;
 
-		ptr = strtok(NULL, ",");
+		ereport(LOG,
+				(errmsg("block_access: maintenance command \"%s\" %s in %.3f s",
+						command, maintenance_status_names[status],
+						INSTR_TIME_GET_DOUBLE(duration))));
 	}
 
-	pfree(item);
+	INSTR_TIME_SET_CURRENT(duration);
+	INSTR_TIME_SUBTRACT(duration, start);
 
-	item = pstrdup(start_time_str);
+	format_login_time(open_at, buf, sizeof(buf));
+	ereport(LOG,
+			(errmsg("block_access: maintenance for the window opening at %s: %d done, %d failed, %d canceled, %d skipped in %.3f s",
+					buf, counts[BA_MAINTENANCE_DONE], counts[BA_MAINTENANCE_FAILED],
+					counts[BA_MAINTENANCE_CANCELED], counts[BA_MAINTENANCE_SKIPPED],
+					INSTR_TIME_GET_DOUBLE(duration))));
 
-	/* start time such as '08:00' */
-	ptr = strtok(item, ":");
-	if (ptr == NULL)
-		elog(ERROR, "parse start hour failed: %s", start_time_str);
-
-	interval->start_time.hour = atoi(ptr);
-	if (interval->start_time.hour < 0 || interval->start_time.hour > 23)
-		elog(ERROR, "parse start hour failed: out of range (%d)", interval->start_time.hour);
+	MemoryContextSwitchTo(oldcxt);
+	MemoryContextDelete(cxt);
+}
 
-	ptr = strtok(NULL, ":");
-	if (ptr == NULL)
-		elog(ERROR, "parse start minute failed: %s", start_time_str);
+/*
+ * Run a statement of sql as a top-level command, in the current transaction,
+ * as exec_simple_query() does. Its result is discarded.
+ */
+static void
+run_statement(RawStmt *parsetree, const char *sql)
+{
+	bool			snapshot_set = false;
+	List			*querytrees;
+	List			*plantrees;
+	Portal			portal;
+	DestReceiver	*receiver;
 
-	interval->start_time.minute = atoi(ptr);
-	if (interval->start_time.minute < 0 || interval->start_time.minute > 59)
-		elog(ERROR, "parse start minute failed: out of range (%d)", interval->start_time.minute);
-	
-	elog(DEBUG2, "start time: hour: %d minute: %d", interval->start_time.hour, interval->start_time.minute);
+	if (analyze_requires_snapshot(parsetree))
+	{
+		PushActiveSnapshot(GetTransactionSnapshot());
+		snapshot_set = true;
+	}
 
-	pfree(item);
+#if PG_VERSION_NUM >= 150000
+	querytrees = pg_analyze_and_rewrite_fixedparams(parsetree, sql, NULL, 0, NULL);
+#else
+	querytrees = pg_analyze_and_rewrite(parsetree, sql, NULL, 0, NULL);
+#endif
+	plantrees = pg_plan_queries(querytrees, sql, CURSOR_OPT_PARALLEL_OK, NULL);
 
-	item = pstrdup(end_time_str);
+	if (snapshot_set)
+		PopActiveSnapshot();
 
-	/* end time such as '18:00' */
-	ptr = strtok(item, ":");
-	if (ptr == NULL)
-		elog(ERROR, "parse end hour failed: %s", end_time_str);
+	portal = CreatePortal("", true, true);
+	portal->visible = false;
+	PortalDefineQuery(portal, NULL, sql, CreateCommandTag(parsetree->stmt), plantrees, NULL);
+	PortalStart(portal, NULL, 0, InvalidSnapshot);
 
-	interval->end_time.hour = atoi(ptr);
-	if (interval->end_time.hour < 0 || interval->end_time.hour > 23)
-		elog(ERROR, "parse end hour failed: out of range (%d)", interval->end_time.hour);
+	receiver = CreateDestReceiver(DestNone);
+#if PG_VERSION_NUM >= 180000
+	(void) PortalRun(portal, FETCH_ALL, true, receiver, receiver, NULL);
+#else
+	(void) PortalRun(portal, FETCH_ALL, true, true, receiver, receiver, NULL);
+#endif
+	receiver->rDestroy(receiver);
 
-	ptr = strtok(NULL, ":");
-	if (ptr == NULL)
-		elog(ERROR, "parse end minute failed: %s", end_time_str);
+	PortalDrop(portal, false);
+}
 
-	interval->end_time.minute = atoi(ptr);
-	if (interval->end_time.minute < 0 || interval->end_time.minute > 59)
-		elog(ERROR, "parse end minute failed: out of range (%d)", interval->end_time.minute);
+/*
+ * Text of a statement of sql, without the whitespace around it
+ */
+static char *
+statement_text(RawStmt *parsetree, const char *sql)
+{
+	int		location = Max(parsetree->stmt_location, 0);
+	int		len = parsetree->stmt_len > 0 ? parsetree->stmt_len : (int) strlen(sql + location);
 
-	elog(DEBUG2, "end time: hour: %d minute: %d", interval->end_time.hour, interval->end_time.minute);
+	while (len > 0 && isspace((unsigned char) sql[location]))
+	{
+		location++;
+		len--;
+	}
+	while (len > 0 && isspace((unsigned char) sql[location + len - 1]))
+		len--;
 
-	pfree(item);
-	pfree(weekday_str);
-	pfree(start_time_str);
-	pfree(end_time_str);
+	return pnstrdup(sql + location, len);
 }
 
 /*
- * Each item of exclude_roles list are separated by comma.
- *
- * Example: foo, bar, baz, euler, jose
- *
+ * Update the i-th command run in the current window, if it is kept
  */
 static void
-parse_roles(BAIntervalRole *interval, char *s)
+record_maintenance(int i, int status, pg_time_t started_at, int64 duration)
 {
-	char	*item;
-	char	*ptr;
-	int		i;
-
-	if (s == NULL)
-	{
-		elog(DEBUG1, "role group is empty");
-		interval->nroles = 0;
-		interval->roles = NULL;
+	BAMaintenanceRun	*run;
 
+	if (i >= BA_MAX_MAINTENANCE)
 		return;
-	}
 
-	item = pstrdup(s);
+	LWLockAcquire(ba_state->lock, LW_EXCLUSIVE);
+	run = &ba_state->maintenance[i];
+	run->status = status;
+	run->started_at = started_at;
+	run->duration = duration;
+	LWLockRelease(ba_state->lock);
+}
+
+/*
+ * Throttle the maintenance commands with block_access.maintenance_cost_delay
+ * and maintenance_cost_limit; -1 leaves vacuum_cost_delay or vacuum_cost_limit
+ * as configured. Manual VACUUM is not throttled by default, and a command that
+ * runs until the window opens would compete with users. A SET among the
+ * commands overrides them until the next reload.
+ */
+static void
+set_maintenance_cost(void)
+{
+	char	buf[32];
 
-	/* number of roles */
-	interval->nroles = 1;		/* we should have at least one role */
-	for (ptr = item; *ptr != '\0'; ptr++)
+	if (maintenance_cost_delay >= 0)
 	{
-		if (*ptr == ',')
-			interval->nroles++;
+		snprintf(buf, sizeof(buf), "%g", maintenance_cost_delay);
+		SetConfigOption("vacuum_cost_delay", buf, PGC_SUSET, PGC_S_SESSION);
 	}
+	else
+		SetConfigOption("vacuum_cost_delay", NULL, PGC_SUSET, PGC_S_SESSION);
 
-	elog(DEBUG1, "role group \"%s\"", item);
-
-	interval->roles = (char **) palloc(interval->nroles * sizeof(char *));
-
-	/* store each role */
-	i = 0;
-	ptr = strtok(item, ",");
-	while (ptr)
+	if (maintenance_cost_limit > 0)
 	{
-		interval->roles[i++] = trim(ptr);
-		elog(DEBUG2, "role: \"%s\"", interval->roles[i - 1]);
-		ptr = strtok(NULL, ",");
+		snprintf(buf, sizeof(buf), "%d", maintenance_cost_limit);
+		SetConfigOption("vacuum_cost_limit", buf, PGC_SUSET, PGC_S_SESSION);
 	}
-
-	pfree(item);
+	else
+		SetConfigOption("vacuum_cost_limit", NULL, PGC_SUSET, PGC_S_SESSION);
 }
 
 /*
- * interval_time
- * mon,tue,wed,thu,fri - 08:00-18:00; sat - 08:00-12:00
- *
- * exclude_roles
- * foo,bar,baz ; euler, jose
+ * Main loop of the maintenance worker. It wakes up when the policy in effect
+ * closes (for roles that are not excluded), runs the maintenance commands
+ * once per closed window, and sleeps until the next one. The policy in effect
+ * is the active one, or the one a scheduled activation switches to. A policy
+ * that never opens or never closes has no window to run them in, and there is
+ * none while the kill switch is on.
  */
-static void
-parse_options(BAIntervalRole *ir, int n)
+void
+block_access_maintenance_main(Datum main_arg)
 {
-	char	*intervals_str;
-	char	*roles_str;
-	char	*ptr;
-	char	**item;
-	int		i;
+	pg_time_t	done_for = 0;	/* opening time of the last window handled */
+	bool		planned;
+	MemoryContext	cxt;
 
-	/* no intervals, no access block */
-	if (interval_time == NULL)
-		return;
+	pqsignal(SIGHUP, SignalHandlerForConfigReload);
+	pqsignal(SIGTERM, die);
+	BackgroundWorkerUnblockSignals();
 
-	/*
-	 * interval_time and exclude_roles shouldn't be modified, hence store
-	 * content in new variables.
-	 */
-	intervals_str = trim(interval_time);
-	roles_str = trim(exclude_roles);
+	BackgroundWorkerInitializeConnection(maintenance_database, NULL, 0);
 
-	/* store each token them parse'em */
-	/* FIXME palloc0 because of strtok_all */
-	item = (char **) palloc0(n * sizeof(char *));
-	i = 0;
-	ptr = strtok(intervals_str, ";");
-	while (ptr)
-	{
-		item[i++] = trim(ptr);
-		ptr = strtok(NULL, ";");
-	}
+	cxt = AllocSetContextCreate(TopMemoryContext,
+								"block_access followed policy",
+								ALLOCSET_DEFAULT_SIZES);
+	set_maintenance_cost();
+	planned = (maintenance_commands != NULL && maintenance_commands[0] != '\0');
 
-	/* process each interval item */
-	for (i = 0; i < n; i++)
+	for (;;)
 	{
-		parse_interval(&ir[i], item[i]);
-		pfree(item[i]);
-	}
-	pfree(item);
+		long		timeout = BA_WORKER_MAX_SLEEP;
+		time_t		t;
+		BAPolicy	*p = NULL;
 
-	/* store each token them parse'em */
-	/* FIXME palloc0 because of strtok_all */
-	item = (char **) palloc0(n * sizeof(char *));
-	i = 0;
-	ptr = strtok_all(roles_str, ";");
-	while (ptr)
-	{
-		item[i++] = trim(ptr);
-		elog(DEBUG1, "XXX: %s", item[i - 1]);
-		ptr = strtok_all(NULL, ";");
+		CHECK_FOR_INTERRUPTS();
+
+		if (ConfigReloadPending)
+		{
+			ConfigReloadPending = false;
+			ProcessConfigFile(PGC_SIGHUP);
+			set_maintenance_cost();
+			planned = (maintenance_commands != NULL && maintenance_commands[0] != '\0');
+		}
+
+		t = time(NULL);
+		MemoryContextReset(cxt);
+		if (planned)
+		{
+			p = followed_policy(cxt, (pg_time_t) t, NULL);
+			timeout = policy_change_timeout((pg_time_t) t, timeout);
+		}
+
+		if (p != NULL && p->nintervals > 0 && policy_error(p) == NULL)
+		{
+			const uint64 *open = policy_schedules(p)[0].words;
+			struct tm  *now = localtime(&t);
+			int			minute;
+			int			delta;
+
+			minute = now->tm_wday * BA_MINUTES_PER_DAY + now->tm_hour * 60 + now->tm_min;
+
+			if (!bitmap_test(open, minute))
+			{
+				pg_time_t	open_at;
+
+				delta = minutes_until_change(open, minute, true);
+				open_at = (pg_time_t) t - now->tm_sec + (pg_time_t) delta * 60;
+
+				if (delta > 0 && open_at != done_for)
+				{
+					run_maintenance(open_at);
+					done_for = open_at;
+					continue;
+				}
+			}
+
+			/* sleep until the window closes again */
+			delta = minutes_until_change(open, minute, false);
+			if (delta > 0)
+				timeout = Min(timeout, ((long) delta * 60 - now->tm_sec) * 1000L);
+		}
+
+		(void) WaitLatch(MyLatch,
+						 WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH,
+						 timeout, PG_WAIT_EXTENSION);
+		ResetLatch(MyLatch);
 	}
+}
+
+static bool
+write_string(FILE *file, const char *s)
+{
+	uint32	len = strlen(s);
 
-	/* process each roles item */
-	for (i = 0; i < n; i++)
+	return fwrite(&len, sizeof(uint32), 1, file) == 1 &&
+		fwrite(s, 1, len, file) == len;
+}
+
+static char *
+read_string(FILE *file)
+{
+	uint32	len;
+	char	*s;
+
+	if (fread(&len, sizeof(uint32), 1, file) != 1 || len > MaxAllocSize - 1)
+		return NULL;
+
+	s = palloc(len + 1);
+	if (fread(s, 1, len, file) != len)
 	{
-		parse_roles(&ir[i], item[i]);
-		if (item[i])
-			pfree(item[i]);
+		pfree(s);
+		return NULL;
 	}
-	pfree(item);
+	s[len] = '\0';
 
-	pfree(intervals_str);
-	pfree(roles_str);
+	return s;
 }
 
 /*
- * Check authentication
+ * Write the named policies, the name of the active one and the scheduled
+ * activations. Caller must hold policy_lock exclusively. Errors are reported
+ * at elevel.
  */
 static void
-block_access_checks(Port *port, int status)
+save_policies(int elevel)
 {
-	/* assume that we initially do not have intervals */
-	BAIntervalRole	*intervals = NULL;
-	int				nintervals = 0;
-	int				nroles = 0;
-
-	/*
-	 * Any other plugins which use ClientAuthentication_hook.
-	 */
-	if (original_client_auth_hook)
-		original_client_auth_hook(port, status);
+	FILE		*file;
+	uint32		npolicies = 0;
+	int			i;
 
-	if (interval_time != NULL)
-		elog(DEBUG1, "interval_time: %s", interval_time);
+	pg_atomic_write_u32(&ba_state->save_pending, 0);
 
-	if (exclude_roles != NULL)
-		elog(DEBUG1, "exclude_roles: %s", exclude_roles);
-
-	/* apply block access per interval time / role */
-	if (status == STATUS_OK && interval_time != NULL)
-	{
-		bool		bailout = false;
+	for (i = 0; i < max_policies; i++)
+		if (policy_slots[i].name[0] != '\0')
+			npolicies++;
 
-		time_t		t;
-		struct tm	*now;
-		int			i, j, k;
-		char		*ptr;
-		char		week_day_names[7][4] = {"sun", "mon", "tue", "wed", "thu", "fri", "sat"};
+	file = AllocateFile(BLOCK_ACCESS_POLICIES_FILE ".tmp", PG_BINARY_W);
+	if (file == NULL)
+		goto error;
 
-#ifndef WIN32
-		struct timespec	before;
-		struct timespec after;
-		double posix_wall;
+	if (fwrite(&BLOCK_ACCESS_POLICIES_HEADER, sizeof(uint32), 1, file) != 1 ||
+		fwrite(&npolicies, sizeof(uint32), 1, file) != 1)
+		goto error;
 
-		clock_gettime(CLOCK_MONOTONIC, &before);
-#endif
+	for (i = 0; i < max_policies; i++)
+	{
+		BAPolicySlot	*slot = &policy_slots[i];
 
-		/* number of intervals */
-		nintervals = 1;		/* we should have at least one token */
-		for (ptr = interval_time; *ptr != '\0'; ptr++)
-			if (*ptr == ';')
-				nintervals++;
+		if (slot->name[0] == '\0')
+			continue;
 
-		elog(DEBUG2, "number of intervals: %d", nintervals);
+		if (!write_string(file, slot->name) ||
+			!write_string(file, slot_intervals(i)) ||
+			!write_string(file, slot_exclude_roles(i)))
+			goto error;
+	}
 
-		/* number of roles */
-		nroles = 1;		/* we should have at least one token */
-		for (ptr = exclude_roles; *ptr != '\0'; ptr++)
-			if (*ptr == ';')
-				nroles++;
+	if (!write_string(file, active_policy_name(pg_atomic_read_u32(&ba_state->active))))
+		goto error;
 
-		elog(DEBUG2, "number of role groups: %d", nroles);
+	if (fwrite(&ba_state->nscheduled, sizeof(int), 1, file) != 1)
+		goto error;
+	for (i = 0; i < ba_state->nscheduled; i++)
+	{
+		int64	at = (int64) ba_state->scheduled[i].at;
 
-		/* set of intervals x set of roles mismatch */
-		if (nintervals != nroles)
-			elog(ERROR, "number of intervals and exclude_roles elements do not match");
+		if (!write_string(file, active_policy_name(ba_state->scheduled[i].active)) ||
+			fwrite(&at, sizeof(int64), 1, file) != 1)
+			goto error;
+	}
 
-		intervals = (BAIntervalRole *) palloc0(nintervals * sizeof(BAIntervalRole));
+	if (FreeFile(file))
+	{
+		file = NULL;
+		goto error;
+	}
 
-		/* parse block_access.intervals and fills variable 'intervals' */
-		parse_options(intervals, nintervals);
+	(void) durable_rename(BLOCK_ACCESS_POLICIES_FILE ".tmp", BLOCK_ACCESS_POLICIES_FILE, elevel);
 
-		/* actual date and time */
-		t = time(NULL);
-		now = localtime(&t);
+	return;
 
-		/* search current date/time in the specified intervals */
-		for (i = 0; i < nintervals; i++)
-		{
-			/* we already find a week day but don't block access */
-			if (bailout)
-				break;
+error:
+	if (file)
+		FreeFile(file);
+	ereport(elevel,
+			(errcode_for_file_access(),
+			 errmsg("could not write file \"%s\": %m",
+					BLOCK_ACCESS_POLICIES_FILE ".tmp")));
+}
 
-			for (j = 0; j < intervals[i].nwday; j++)
-			{
+/*
+ * Restore named policies saved at the last shutdown (see
+ * attach_policy_store()). Policies that cannot be compiled or stored anymore
+ * are skipped. Caller must hold policy_lock exclusively.
+ */
+static void
+load_policies(void)
+{
+	FILE		*file;
+	uint32		header;
+	uint32		npolicies;
+	char		*active = NULL;
+	int			nscheduled;
+	int			i;
 
-				elog(DEBUG1, "interval: \"%s\" %02d:%02d - %02d:%02d ; now: \"%s\" %02d:%02d",
-								week_day_names[intervals[i].wday[j]],
-								intervals[i].start_time.hour, intervals[i].start_time.minute,
-								intervals[i].end_time.hour, intervals[i].end_time.minute,
-								week_day_names[now->tm_wday],
-								now->tm_hour, now->tm_min);
+	file = AllocateFile(BLOCK_ACCESS_POLICIES_FILE, PG_BINARY_R);
+	if (file == NULL)
+	{
+		if (errno != ENOENT)
+			goto read_error;
+		return;
+	}
 
-				/* same week day */
-				if (intervals[i].wday[j] == now->tm_wday)
-				{
-					int s1, s2, n1;
+	if (fread(&header, sizeof(uint32), 1, file) != 1 ||
+		fread(&npolicies, sizeof(uint32), 1, file) != 1)
+		goto read_error;
 
-					elog(DEBUG2, "found week day: \"%s\"", week_day_names[now->tm_wday]);
+	if (header != BLOCK_ACCESS_POLICIES_HEADER)
+		goto data_error;
 
-					/* time in minutes */
-					s1 = intervals[i].start_time.hour * 60 + intervals[i].start_time.minute;
-					s2 = intervals[i].end_time.hour * 60 + intervals[i].end_time.minute;
-					n1 = now->tm_hour * 60 + now->tm_min;
+	for (i = 0; i < npolicies; i++)
+	{
+		char		*name = read_string(file);
+		char		*intervals = read_string(file);
+		char		*roles = read_string(file);
+		BAPolicy	*p;
 
-					/* now is outside interval time */
-					if (n1 < s1 || n1 > s2)
-					{
-						int	found = false;
+		if (name == NULL || intervals == NULL || roles == NULL)
+			goto read_error;
 
-						elog(DEBUG1, "outside interval time");
+		p = compile_policy(intervals, roles, NULL);
 
-						/* role is not found, then bail out */
-						for (k = 0; k < intervals[i].nroles; k++)
-						{
-							if (strcmp(intervals[i].roles[k], port->user_name) == 0)
-							{
-								elog(DEBUG1, "role \"%s\" in exclude_roles", port->user_name);
+		if (policy_error(p) != NULL)
+			ereport(LOG,
+					(errmsg("block_access: could not restore policy \"%s\": %s",
+							name, policy_error(p))));
+		else if (strlen(name) >= NAMEDATALEN)
+			ereport(LOG,
+					(errmsg("block_access: could not restore policy \"%s\": name too long",
+							name)));
+		else
+			(void) store_policy(name, p, intervals, roles, LOG);
 
-								found = true;
-								break;
-							}
-						}
+		MemoryContextDelete(p->cxt);
+	}
 
-						if (!found)
-							elog(ERROR, "access denied because it is outside permitted date and time");
-					}
+	active = read_string(file);
+	if (active == NULL)
+		goto read_error;
 
-					/* we are not expecting to find more than one week day in different interval times */
-					bailout = true;
-					break;
-				}
-			}
+	if (fread(&nscheduled, sizeof(int), 1, file) != 1)
+		goto read_error;
+	for (i = 0; i < nscheduled; i++)
+	{
+		char	*name = read_string(file);
+		int64	at;
+		int		j = -1;
 
-			for (j = 0; j < intervals[i].nroles; j++)
-				if (intervals[i].roles[j])
-					pfree(intervals[i].roles[j]);
-		}
+		if (name == NULL || fread(&at, sizeof(int64), 1, file) != 1)
+			goto read_error;
 
-		pfree(intervals);
+		if (strcmp(name, BA_DEFAULT_POLICY) != 0)
+			j = find_policy_slot(name);
+		if (j < 0 && strcmp(name, BA_DEFAULT_POLICY) != 0)
+			ereport(LOG,
+					(errmsg("block_access: scheduled activation of policy \"%s\" was not restored",
+							name)));
+		else if (ba_state->nscheduled < BA_MAX_SCHEDULED)
+			schedule_switch(j + 1, (pg_time_t) at);
+	}
 
-#ifndef WIN32
-		clock_gettime(CLOCK_MONOTONIC, &after);
+	FreeFile(file);
 
-		posix_wall = (1000.0 * after.tv_sec + 1e-6 * after.tv_nsec) -
-						(1000.0 * before.tv_sec + 1e-6 * before.tv_nsec);
+	if (strcmp(active, BA_DEFAULT_POLICY) != 0)
+	{
+		i = find_policy_slot(active);
+		if (i >= 0)
+			activate_policy(i + 1, false);
+		else
+			ereport(LOG,
+					(errmsg("block_access: active policy \"%s\" was not restored, using \"%s\"",
+							active, BA_DEFAULT_POLICY)));
+	}
 
-		elog(DEBUG1, "diff: %.4f ms", posix_wall);
-#endif
+	return;
 
-		elog(INFO, "access allowed");
-	}
+read_error:
+	ereport(LOG,
+			(errcode_for_file_access(),
+			 errmsg("could not read file \"%s\": %m",
+					BLOCK_ACCESS_POLICIES_FILE)));
+	goto fail;
+data_error:
+	ereport(LOG,
+			(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+			 errmsg("ignoring invalid data in file \"%s\"",
+					BLOCK_ACCESS_POLICIES_FILE)));
+	goto fail;
+fail:
+	if (file)
+		FreeFile(file);
 }
 
 /*
@@ -551,6 +5477,15 @@ block_access_checks(Port *port, int status)
 void
 _PG_init(void)
 {
+	/* read when the policies are compiled, below */
+	DefineCustomBoolVariable("block_access.protect_policy",
+							"Make the compiled policy read-only.",
+							NULL,
+							&protect_policy,
+							true,
+							PGC_SIGHUP, 0,
+							NULL, NULL, NULL);
+
 	/*
 	 * mon, tue, wed, thu, fri - 08:00-18:00 ; sat - 08:00-12:00
 	 *
@@ -561,10 +5496,10 @@ _PG_init(void)
 	DefineCustomStringVariable("block_access.intervals",
 							"Allow users only between the intervals",
 							NULL,
-							&interval_time,
+							&interval_time_value,
 							NULL,
 							PGC_SIGHUP, 0,
-							NULL, NULL, NULL);
+							NULL, assign_interval_time, NULL);
 
 	/*
 	 * foo,bar,baz ; euler, jose
@@ -582,9 +5517,249 @@ _PG_init(void)
 							&exclude_roles,
 							NULL,
 							PGC_SIGHUP, 0,
+							NULL, assign_exclude_roles, NULL);
+
+	/*
+	 * Shadow policy: same syntax as block_access.intervals and
+	 * block_access.exclude_roles. It is evaluated at each login, and any
+	 * disagreement with the current policy is counted, but it is never
+	 * enforced.
+	 */
+	DefineCustomStringVariable("block_access.shadow_intervals",
+							"Intervals of a policy that is evaluated but not enforced",
+							NULL,
+							&shadow_interval_time,
+							NULL,
+							PGC_SIGHUP, 0,
+							NULL, assign_shadow_interval_time, NULL);
+
+	DefineCustomStringVariable("block_access.shadow_exclude_roles",
+							"Excluded roles of a policy that is evaluated but not enforced",
+							NULL,
+							&shadow_exclude_roles,
+							NULL,
+							PGC_SIGHUP, 0,
+							NULL, assign_shadow_exclude_roles, NULL);
+
+	DefineCustomIntVariable("block_access.shadow_max_roles",
+							"Maximum number of roles whose shadow policy disagreements are tracked",
+							NULL,
+							&shadow_max_roles,
+							1000,
+							100,
+							INT_MAX / 2,
+							PGC_POSTMASTER, 0,
+							NULL, NULL, NULL);
+
+	DefineCustomRealVariable("block_access.shadow_log_sample_rate",
+							"Fraction of shadow policy disagreements to log",
+							NULL,
+							&shadow_log_sample_rate,
+							1.0,
+							0.0,
+							1.0,
+							PGC_SIGHUP, 0,
+							NULL, NULL, NULL);
+
+	DefineCustomIntVariable("block_access.max_policies",
+							"Maximum number of named policies",
+							NULL,
+							&max_policies,
+							8,
+							1,
+							1024,
+							PGC_POSTMASTER, 0,
+							NULL, NULL, NULL);
+
+	DefineCustomIntVariable("block_access.max_policy_size",
+							"Maximum size of a named policy",
+							NULL,
+							&max_policy_size,
+							1024,
+							64,
+							MAX_KILOBYTES,
+							PGC_SIGHUP, GUC_UNIT_KB,
+							NULL, NULL, NULL);
+
+	DefineCustomIntVariable("block_access.max_compile_workers",
+							"Maximum number of background workers that compile a policy with a backend",
+							"They are used only for long exclude_roles; 0 compiles policies in the backend alone.",
+							&max_compile_workers,
+							0,
+							0,
+							64,
+							PGC_SIGHUP, 0,
+							NULL, NULL, NULL);
+
+	DefineCustomIntVariable("block_access.max_temporary_grants",
+							"Maximum number of temporary grants",
+							NULL,
+							&max_temporary_grants,
+							64,
+							1,
+							10000,
+							PGC_POSTMASTER, 0,
+							NULL, NULL, NULL);
+
+	/*
+	 * Replication connections (walsenders) are not evaluated by default.
+	 * "physical" and "logical" evaluate only that kind of replication
+	 * connection; "all" evaluates both like any other connection.
+	 */
+	DefineCustomEnumVariable("block_access.enforce_replication",
+							"Replication connections that are evaluated",
+							NULL,
+							&enforce_replication,
+							BA_REPLICATION_NONE,
+							enforce_replication_options,
+							PGC_SIGHUP, 0,
+							NULL, NULL, NULL);
+
+	/*
+	 * Prewarm worker: relations to read into shared buffers before a window
+	 * opens, one group per interval as in block_access.exclude_roles.
+	 */
+	DefineCustomStringVariable("block_access.prewarm_database",
+							"Database of the relations prewarmed before a window opens",
+							"The prewarm worker is not started if it is empty.",
+							&prewarm_database,
+							NULL,
+							PGC_POSTMASTER, 0,
+							NULL, NULL, NULL);
+
+	DefineCustomStringVariable("block_access.prewarm_relations",
+							"Relations to prewarm before each interval opens",
+							NULL,
+							&prewarm_relations,
+							NULL,
+							PGC_SIGHUP, 0,
+							NULL, NULL, NULL);
+
+	DefineCustomIntVariable("block_access.prewarm_lead_time",
+							"Time before a window opens when its relations are prewarmed",
+							NULL,
+							&prewarm_lead_time,
+							10,
+							1,
+							BA_MINUTES_PER_DAY,
+							PGC_SIGHUP, GUC_UNIT_MIN,
+							NULL, NULL, NULL);
+
+	/*
+	 * Maintenance worker: commands run while the default policy is closed,
+	 * stopped before it opens again.
+	 */
+	DefineCustomStringVariable("block_access.maintenance_database",
+							"Database in which maintenance commands run while access is blocked",
+							"The maintenance worker is not started if it is empty.",
+							&maintenance_database,
+							NULL,
+							PGC_POSTMASTER, 0,
+							NULL, NULL, NULL);
+
+	DefineCustomStringVariable("block_access.maintenance_commands",
+							"SQL commands run once in each window when access is blocked",
+							NULL,
+							&maintenance_commands,
+							NULL,
+							PGC_SIGHUP, 0,
+							NULL, NULL, NULL);
+
+	DefineCustomIntVariable("block_access.maintenance_stop_before",
+							"Time before a window opens when maintenance commands are canceled",
+							NULL,
+							&maintenance_stop_before,
+							15,
+							0,
+							BA_MINUTES_PER_DAY,
+							PGC_SIGHUP, GUC_UNIT_MIN,
+							NULL, NULL, NULL);
+
+	DefineCustomRealVariable("block_access.maintenance_cost_delay",
+							"Vacuum cost delay of the maintenance commands",
+							"-1 uses vacuum_cost_delay.",
+							&maintenance_cost_delay,
+							2,
+							-1,
+							100,
+							PGC_SIGHUP, GUC_UNIT_MS,
+							NULL, NULL, NULL);
+
+	DefineCustomIntVariable("block_access.maintenance_cost_limit",
+							"Vacuum cost limit of the maintenance commands",
+							"-1 uses vacuum_cost_limit.",
+							&maintenance_cost_limit,
+							200,
+							-1,
+							10000,
+							PGC_SIGHUP, 0,
+							NULL, NULL, NULL);
+
+	DefineCustomBoolVariable("block_access.save",
+							"Save block_access statistics across server shutdowns.",
+							NULL,
+							&save_stats,
+							true,
+							PGC_SIGHUP, 0,
 							NULL, NULL, NULL);
 
 	/* Install Hooks */
+	/* compile once, now that all parameters are set (see BA_GUC_SLOTS) */
+	if (!IsUnderPostmaster)
+		compile_guc_policies();
+
 	original_client_auth_hook = ClientAuthentication_hook;
 	ClientAuthentication_hook = block_access_checks;
+
+	/*
+	 * Statistics live in shared memory, which can only be requested at
+	 * postmaster startup.
+	 */
+	if (!process_shared_preload_libraries_in_progress)
+		return;
+
+#if PG_VERSION_NUM >= 150000
+	prev_shmem_request_hook = shmem_request_hook;
+	shmem_request_hook = block_access_shmem_request;
+#else
+	RequestAddinShmemSpace(block_access_memsize());
+	RequestNamedLWLockTranche("block_access", 3);
+#endif
+	prev_shmem_startup_hook = shmem_startup_hook;
+	shmem_startup_hook = block_access_shmem_startup;
+
+#if PG_VERSION_NUM >= 150000
+	RegisterCustomRmgr(BA_RMGR_ID, &block_access_rmgr);
+#endif
+
+	if (prewarm_database != NULL && prewarm_database[0] != '\0')
+	{
+		BackgroundWorker	worker;
+
+		memset(&worker, 0, sizeof(worker));
+		worker.bgw_flags = BGWORKER_SHMEM_ACCESS | BGWORKER_BACKEND_DATABASE_CONNECTION;
+		/* logins to a hot standby are blocked too: prewarm it as well */
+		worker.bgw_start_time = BgWorkerStart_ConsistentState;
+		worker.bgw_restart_time = 60;
+		strlcpy(worker.bgw_library_name, "block_access", BGW_MAXLEN);
+		strlcpy(worker.bgw_function_name, "block_access_prewarm_main", BGW_MAXLEN);
+		strlcpy(worker.bgw_name, "block_access prewarm", BGW_MAXLEN);
+		strlcpy(worker.bgw_type, "block_access prewarm", BGW_MAXLEN);
+		RegisterBackgroundWorker(&worker);
+	}
+
+	if (maintenance_database != NULL && maintenance_database[0] != '\0')
+	{
+		BackgroundWorker	worker;
+
+		memset(&worker, 0, sizeof(worker));
+		worker.bgw_flags = BGWORKER_SHMEM_ACCESS | BGWORKER_BACKEND_DATABASE_CONNECTION;
+		worker.bgw_start_time = BgWorkerStart_RecoveryFinished;
+		worker.bgw_restart_time = 60;
+		strlcpy(worker.bgw_library_name, "block_access", BGW_MAXLEN);
+		strlcpy(worker.bgw_function_name, "block_access_maintenance_main", BGW_MAXLEN);
+		strlcpy(worker.bgw_name, "block_access maintenance", BGW_MAXLEN);
+		strlcpy(worker.bgw_type, "block_access maintenance", BGW_MAXLEN);
+		RegisterBackgroundWorker(&worker);
+	}
 }
@@ -0,0 +1,199 @@
+/* -------------------------------------------------------------------------
+ *
+ * block_access_fuzz.c
+ *
+ * Fuzzing harness for the policy parser and compiler.
+ *
+ * An input is a value of block_access.intervals, a line break and a value of
+ * block_access.exclude_roles. It is compiled as by the GUC assign hooks: a
+ * parse error is fine, but a crash, memory that is not freed or memory out of
+ * proportion with the input is not. A compiled policy is then checked
+ * against its own schedules (see check_policy()).
+ *
+ * LLVMFuzzerTestOneInput() is the entry point of libFuzzer, and of AFL++ when
+ * built with afl-clang-fast -fsanitize=fuzzer. Built with FUZZ_STANDALONE,
+ * the harness runs the files given as arguments (or the standard input)
+ * instead, to replay a corpus or a crash without either.
+ *
+ * Copyright (c) 2017-2018, Euler Taveira de Oliveira
+ *
+ * IDENTIFICATION
+ *		block_access/block_access_fuzz.c
+ *
+ * -------------------------------------------------------------------------
+ */
+#include "postgres_fe.h"
+
+#include <setjmp.h>
+
+#include "block_access_policy.h"
+
+/*
+ * Most memory a compilation can hold at once: the schedules (up to 128
+ * classes, twice) and a few words per byte of input, since any byte can be a
+ * role or a comma.
+ */
+#define FUZZ_MEMORY_BASE		(1024 * 1024)
+#define FUZZ_MEMORY_PER_BYTE	64
+
+/* roles evaluated per policy, besides one that is in no list */
+#define FUZZ_MAX_ROLES			4
+
+/* policy_next_allowed() is checked every so many minutes */
+#define FUZZ_NEXT_STEP			97
+
+static sigjmp_buf	compile_error;
+
+int			LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+static void
+fuzz_error(const char *message)
+{
+	siglongjmp(compile_error, 1);
+}
+
+/*
+ * Evaluate p for a few of its roles at each minute of the week, and compare
+ * the result with the schedules of their classes.
+ */
+static void
+check_policy(BAPolicy *p)
+{
+	int		nroles = Min(p->nroles, FUZZ_MAX_ROLES);
+	int		r;
+
+	if ((p->nroles == 0) != (p->shape == BA_SHAPE_TIME) ||
+		(p->nroles > 0 && p->nroles <= BA_SMALL_ROLES) != (p->shape == BA_SHAPE_SMALL))
+		abort();
+
+	for (r = 0; r < p->nroles; r++)
+	{
+		if (policy_find_role(p, policy_role(p, r)) != r ||
+			policy_role_classes(p)[r] >= p->nschedules)
+			abort();
+	}
+
+	for (r = -1; r < nroles; r++)
+	{
+		const char	*role = r >= 0 ? policy_role(p, r) : "\x01 not a role";
+		int			cls = r >= 0 ? policy_role_classes(p)[r] : 0;
+		const uint64 *allowed = policy_schedules(p)[cls].words;
+		BASchedule	exempt;
+		int			minute;
+
+		/* nobody logs in with a longer name, and comparing it is slow */
+		if (strlen(role) >= NAMEDATALEN)
+			continue;
+
+		/* allowed by the exclusion only: outside the open schedule */
+		exempt = policy_schedules(p)[cls];
+		bitmap_andnot(exempt.words, policy_schedules(p)[0].words);
+
+		for (minute = 0; minute < BA_MINUTES_PER_WEEK; minute++)
+		{
+			bool	exempted;
+			int		verdict = policy_evaluate(p, role, minute, &exempted);
+			int		next;
+
+			if ((verdict == BA_VERDICT_ALLOWED) != bitmap_test(allowed, minute) ||
+				exempted != bitmap_test(exempt.words, minute))
+				abort();
+
+			if (minute % FUZZ_NEXT_STEP != 0)
+				continue;
+
+			next = policy_next_allowed(p, role, minute);
+			if (next >= 0 ? !bitmap_test(allowed, next) : bitmap_count(allowed) != 0)
+				abort();
+		}
+	}
+}
+
+int
+LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	char	   *intervals;
+	char	   *roles;
+
+	/* GUC values end at the first NUL */
+	intervals = pg_malloc(size + 1);
+	if (size > 0)
+		memcpy(intervals, data, size);
+	intervals[size] = '\0';
+
+	roles = strchr(intervals, '\n');
+	if (roles != NULL)
+		*roles++ = '\0';
+
+	policy_error_hook = fuzz_error;
+
+	if (sigsetjmp(compile_error, 0) == 0)
+	{
+		BAPolicy   *p = parse_policy(NULL, intervals, roles, 0);
+
+		if (p != NULL)
+			check_policy(p);
+	}
+
+	if (policy_memory_peak() > FUZZ_MEMORY_BASE + FUZZ_MEMORY_PER_BYTE * size)
+		abort();
+
+	policy_memory_reset();
+	pg_free(intervals);
+
+	return 0;
+}
+
+#ifdef FUZZ_STANDALONE
+static void
+run_file(const char *filename, FILE *fp)
+{
+	char	   *data = NULL;
+	size_t		size = 0;
+	size_t		len;
+	char		buf[8192];
+
+	while ((len = fread(buf, 1, sizeof(buf), fp)) > 0)
+	{
+		data = pg_realloc(data, size + len);
+		memcpy(data + size, buf, len);
+		size += len;
+	}
+
+	if (ferror(fp))
+	{
+		fprintf(stderr, "could not read file \"%s\": %s\n", filename, strerror(errno));
+		exit(1);
+	}
+
+	LLVMFuzzerTestOneInput((const uint8_t *) data, size);
+	printf("%s: ok (%zu bytes)\n", filename, size);
+
+	if (data != NULL)
+		pg_free(data);
+}
+
+int
+main(int argc, char **argv)
+{
+	int			i;
+
+	if (argc < 2)
+		run_file("stdin", stdin);
+
+	for (i = 1; i < argc; i++)
+	{
+		FILE	   *fp = fopen(argv[i], "rb");
+
+		if (fp == NULL)
+		{
+			fprintf(stderr, "could not open file \"%s\": %s\n", argv[i], strerror(errno));
+			exit(1);
+		}
+		run_file(argv[i], fp);
+		fclose(fp);
+	}
+
+	return 0;
+}
+#endif							/* FUZZ_STANDALONE */
@@ -0,0 +1,2322 @@
+/* -------------------------------------------------------------------------
+ *
+ * block_access_policy.c
+ *
+ * Parse block_access.intervals and exclude_roles, compile them into a policy
+ * and evaluate it. See block_access_policy.h for what this file can use.
+ *
+ * Copyright (c) 2017-2018, Euler Taveira de Oliveira
+ *
+ * IDENTIFICATION
+ *		block_access/block_access_policy.c
+ *
+ * -------------------------------------------------------------------------
+ */
+#ifdef FRONTEND
+#include "postgres_fe.h"
+#else
+#include "postgres.h"
+#endif
+
+#include <ctype.h>
+#include <string.h>
+
+#include "common/hashfn.h"
+#ifdef FRONTEND
+#include "common/logging.h"
+#endif
+#include "port/pg_bitutils.h"
+#ifndef FRONTEND
+#include "storage/shmem.h"
+#endif
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define USE_BA_X86_KERNELS
+#define BA_TARGET_AVX2			__attribute__((target("avx2")))
+#endif
+
+#include "block_access_policy.h"
+
+#ifdef FRONTEND
+/*
+ * Chunks allocated by the parser and the compiler are linked in a list, so
+ * that policy_memory_reset() can free them.
+ */
+typedef struct PolicyChunk {
+	struct PolicyChunk	*prev;
+	struct PolicyChunk	*next;
+	Size				size;
+} PolicyChunk;
+
+static PolicyChunk	policy_chunks = {&policy_chunks, &policy_chunks, 0};
+static Size			policy_memory = 0;		/* bytes in policy_chunks */
+static Size			policy_memory_max = 0;
+
+void		(*policy_error_hook) (const char *message) = NULL;
+
+static void *chunk_alloc(Size size, int flags);
+static void *chunk_realloc(void *ptr, Size size);
+static void chunk_free(void *ptr);
+static char *chunk_strdup(const char *s);
+
+#define palloc(size)					chunk_alloc(size, 0)
+#define palloc0(size)					chunk_alloc(size, MCXT_ALLOC_ZERO)
+#define palloc_extended(size, flags)	chunk_alloc(size, flags)
+#define repalloc(ptr, size)				chunk_realloc(ptr, size)
+#define pfree(ptr)						chunk_free(ptr)
+#define pstrdup(s)						chunk_strdup(s)
+#endif
+
+/*
+ * Role table used while building a policy: the hash is kept next to the
+ * index, so that a probe touches one cache line until the names compare.
+ */
+typedef struct BARoleSlot {
+	int32			role;		/* index into roles or -1 */
+	uint32			hash;
+} BARoleSlot;
+
+#define BA_ROLE_BATCH			16	/* roles hashed before their slots are probed */
+
+#if defined(__GNUC__) || defined(__clang__)
+#define ba_prefetch(addr)		__builtin_prefetch(addr)
+#else
+#define ba_prefetch(addr)		((void) 0)
+#endif
+
+const char *const policy_shape_names[] = {
+	[BA_SHAPE_EMPTY] = "empty",
+	[BA_SHAPE_TIME] = "time",
+	[BA_SHAPE_SMALL] = "small",
+	[BA_SHAPE_FULL] = "full"
+};
+
+static char *trim(char *s);
+static char *trim_in_place(char *s);
+static char *strtok_all(char * s, char const *d);
+static void parse_interval(BAIntervalRole *i, char *s);
+static void parse_time(BATime *t, char *s, const char *what);
+static int parse_time_field(const char *s, const char *what, const char *field, int max);
+static void parse_roles(BAIntervalRole *i, char *s);
+static void parse_interval_list(BAIntervalRole *ir, int n, char *intervals_str);
+static int count_intervals(const char *intervals_str);
+static void find_day_owners(BAIntervalRole *intervals, int nintervals, int owner[7]);
+static void open_schedule(uint64 *words, BAIntervalRole *intervals, int owner[7]);
+static void class_schedule(uint64 *words, int days, const uint64 *open);
+static void bitmap_set_range(uint64 *words, int from, int to);
+static int bitmap_find(const uint64 *words, int bit, uint64 skip);
+
+/*
+ * Strip whitespace from the beginning and end of the string
+ *
+ * space (0x20), form feed (0x0c), line feed (0x0a), carriage return (0x0d),
+ * horizontal tab (0x09) and vertical tab (0x0b) are removed. If s is NULL,
+ * return NULL. If s contains only whitespaces, return NULL.
+ */
+static char *
+trim(char *s)
+{
+	char	*start;
+	char	*end;
+	char	*t;
+	size_t	len;
+
+	if (s == NULL)
+		return NULL;
+
+	len = strlen(s);
+	start = s;
+	end = start + len - 1;
+
+	while (isspace(*start))
+		start++;
+
+	while (end >= start && isspace(*end))
+		end--;
+
+	if (end - start >= 0)
+	{
+		t = palloc0((end - start + 2) * sizeof(char));
+		strncpy(t, start, end - start + 1);
+	}
+	else
+	{
+		t = NULL;
+	}
+
+	return t;
+}
+
+/*
+ * Same as trim() but whitespaces are removed in place: return a pointer into
+ * s, or NULL if s contains only whitespaces.
+ */
+static char *
+trim_in_place(char *s)
+{
+	char	*end;
+
+	while (isspace((unsigned char) *s))
+		s++;
+
+	end = s + strlen(s);
+	while (end > s && isspace((unsigned char) end[-1]))
+		end--;
+
+	if (end == s)
+		return NULL;
+
+	*end = '\0';
+
+	return s;
+}
+
+/*
+ * Same as strtok() except that it returns all tokens even if the token is
+ * empty: a string with n delimiters has n + 1 tokens.
+ */
+static char *
+strtok_all(char *str, char const *delims)
+{
+	static char	*src = NULL;
+	char		*ret = 0;
+	char		*p;
+
+	if (str != NULL)
+		src = str;
+
+	if (src == NULL)
+		return NULL;
+
+	if ((p = strpbrk(src, delims)) != NULL)
+	{
+		*p  = 0;
+		ret = src;
+		src = ++p;
+	}
+	else
+	{
+		ret = src;
+		src = NULL;
+	}
+
+	return ret;
+}
+
+/*
+ * Each interval item contains:
+ * (i) list of abbrev week days separated by comma;
+ * (ii) dash;
+ * (iii) start time;
+ * (iv) dash;
+ * (v) end time;
+ *
+ * Example: mon, wed, fri, sat - 08:00-12:00
+ *
+ */
+static void
+parse_interval(BAIntervalRole *interval, char *s)
+{
+	char	*item;
+	char	*item_wd;
+	char	*ptr;
+	char	*weekday_str;
+	char	*start_time_str;
+	char	*end_time_str;
+	int		i;
+
+	/* debug purposes */
+	char	week_day_names[7][4] = {"sun", "mon", "tue", "wed", "thu", "fri", "sat"};
+
+	item = pstrdup(s);
+
+	ptr = strtok(item, "-");
+	if (ptr == NULL || (weekday_str = trim(ptr)) == NULL)
+		policy_parse_error("parse week day failed: %s", s);
+
+	ptr = strtok(NULL, "-");
+	if (ptr == NULL || (start_time_str = trim(ptr)) == NULL)
+		policy_parse_error("parse start time failed: %s", s);
+
+	ptr = strtok(NULL, "-");
+	if (ptr == NULL || (end_time_str = trim(ptr)) == NULL)
+		policy_parse_error("parse end time failed: %s", s);
+
+	if (strtok(NULL, "-") != NULL)
+		policy_parse_error("parse interval failed: too many dashes: %s", s);
+
+	elog(DEBUG1, "week days: \"%s\" ; start time: \"%s\" ; end time: \"%s\"", weekday_str, start_time_str, end_time_str);
+
+	pfree(item);
+
+	item = pstrdup(weekday_str);
+
+	/* number of week days; empty items are skipped below */
+	interval->nwday = 1;		/* we should have at least one token */
+	for (ptr = item; *ptr != '\0'; ptr++)
+	{
+		if (*ptr == ',')
+			interval->nwday++;
+	}
+
+	interval->wday = (int *) palloc(interval->nwday * sizeof(int));
+
+	/* week days such as 'mon,wed,fri,sat' */
+	i = 0;
+	ptr = strtok(item, ",");
+	while (ptr)
+	{
+		item_wd = trim(ptr);
+		if (item_wd == NULL)
+		{
+			/* empty item, such as the one in 'mon, ,wed' */
+			ptr = strtok(NULL, ",");
+			continue;
+		}
+
+		if (strcmp(item_wd, "sun") == 0)
+			interval->wday[i++] = 0;	/* sunday */
+		else if (strcmp(item_wd, "mon") == 0)
+			interval->wday[i++] = 1;	/* monday */
+		else if (strcmp(item_wd, "tue") == 0)
+			interval->wday[i++] = 2;	/* tuesday */
+		else if (strcmp(item_wd, "wed") == 0)
+			interval->wday[i++] = 3;	/* wednesday */
+		else if (strcmp(item_wd, "thu") == 0)
+			interval->wday[i++] = 4;	/* thursday */
+		else if (strcmp(item_wd, "fri") == 0)
+			interval->wday[i++] = 5;	/* friday */
+		else if (strcmp(item_wd, "sat") == 0)
+			interval->wday[i++] = 6;	/* saturday */
+		else
+			policy_parse_error("parse week days failed: \"%s\" -> %s", item_wd, weekday_str);
+
+		elog(DEBUG2, "week day: \"%s\"", week_day_names[interval->wday[i - 1]]);
+
+		pfree(item_wd);
+
+		ptr = strtok(NULL, ",");
+	}
+
+	/* without the empty items */
+	interval->nwday = i;
+	if (interval->nwday == 0)
+		policy_parse_error("parse week days failed: no week day -> %s", weekday_str);
+
+	pfree(item);
+
+	/* start time such as '08:00' */
+	parse_time(&interval->start_time, start_time_str, "start");
+
+	elog(DEBUG2, "start time: hour: %d minute: %d", interval->start_time.hour, interval->start_time.minute);
+
+	/* end time such as '18:00' */
+	parse_time(&interval->end_time, end_time_str, "end");
+
+	elog(DEBUG2, "end time: hour: %d minute: %d", interval->end_time.hour, interval->end_time.minute);
+
+	pfree(weekday_str);
+	pfree(start_time_str);
+	pfree(end_time_str);
+}
+
+/*
+ * Time such as 08:00: hour, colon, minute. what is "start" or "end", for
+ * error messages. s is modified.
+ */
+static void
+parse_time(BATime *t, char *s, const char *what)
+{
+	char	*minute = strchr(s, ':');
+
+	if (minute == NULL)
+		policy_parse_error("parse %s minute failed: %s", what, s);
+	if (strchr(minute + 1, ':') != NULL)
+		policy_parse_error("parse %s time failed: seconds are not supported: %s", what, s);
+	*minute++ = '\0';
+
+	t->hour = parse_time_field(s, what, "hour", 23);
+	t->minute = parse_time_field(minute, what, "minute", 59);
+}
+
+/*
+ * Hour or minute of a time: only digits, possibly surrounded by whitespaces,
+ * unlike atoi() that ignores whatever follows them.
+ */
+static int
+parse_time_field(const char *s, const char *what, const char *field, int max)
+{
+	const char	*ptr = s;
+	int			val = 0;
+
+	while (isspace((unsigned char) *ptr))
+		ptr++;
+
+	if (!isdigit((unsigned char) *ptr))
+		policy_parse_error("parse %s %s failed: %s", what, field, s);
+
+	for (; isdigit((unsigned char) *ptr); ptr++)
+	{
+		val = val * 10 + (*ptr - '0');
+		if (val > max)
+			policy_parse_error("parse %s %s failed: out of range (%s)", what, field, s);
+	}
+
+	while (isspace((unsigned char) *ptr))
+		ptr++;
+
+	if (*ptr != '\0')
+		policy_parse_error("parse %s %s failed: %s", what, field, s);
+
+	return val;
+}
+
+/*
+ * Each item of exclude_roles list are separated by comma.
+ *
+ * Example: foo, bar, baz, euler, jose
+ *
+ * Role names point into a copy of s that is kept with them: lists can have
+ * millions of roles, and one allocation per role was most of the parse time.
+ */
+static void
+parse_roles(BAIntervalRole *interval, char *s)
+{
+	char	*item;
+	char	*ptr;
+	int		i;
+
+	if (s == NULL)
+	{
+		elog(DEBUG1, "role group is empty");
+		interval->nroles = 0;
+		interval->roles = NULL;
+
+		return;
+	}
+
+	item = pstrdup(s);
+
+	/* number of roles, at most */
+	interval->nroles = 1;		/* we should have at least one role */
+	for (ptr = item; *ptr != '\0'; ptr++)
+	{
+		if (*ptr == ',')
+			interval->nroles++;
+	}
+
+	elog(DEBUG1, "role group \"%s\"", item);
+
+	interval->roles = (char **) palloc(interval->nroles * sizeof(char *));
+
+	/* store each role; empty ones, such as the one in 'foo,,bar', are skipped */
+	i = 0;
+	ptr = strtok(item, ",");
+	while (ptr)
+	{
+		char	*role = trim_in_place(ptr);
+
+		if (role != NULL)
+			interval->roles[i++] = role;
+		ptr = strtok(NULL, ",");
+	}
+	interval->nroles = i;
+}
+
+/*
+ * interval_time
+ * mon,tue,wed,thu,fri - 08:00-18:00; sat - 08:00-12:00
+ *
+ * exclude_roles
+ * foo,bar,baz ; euler, jose
+ */
+void
+parse_options(BAIntervalRole *ir, int n, const char *intervals, const char *roles)
+{
+	char	*intervals_str;
+	char	*roles_str;
+	char	*ptr;
+	char	**item;
+	int		i;
+
+	/* no intervals, no access block */
+	if (intervals == NULL)
+		return;
+
+	/*
+	 * GUC values shouldn't be modified, hence store content in new
+	 * variables.
+	 */
+	intervals_str = trim((char *) intervals);
+	roles_str = trim((char *) roles);
+
+	parse_interval_list(ir, n, intervals_str);
+
+	/* store each token them parse'em; an empty group is NULL */
+	item = (char **) palloc0(n * sizeof(char *));
+	i = 0;
+	/* strtok_all(NULL) would continue a previous tokenization */
+	ptr = roles_str ? strtok_all(roles_str, ";") : NULL;
+	while (ptr && i < n)
+	{
+		item[i++] = trim(ptr);
+		elog(DEBUG1, "role group %d: \"%s\"", i, item[i - 1] ? item[i - 1] : "");
+		ptr = strtok_all(NULL, ";");
+	}
+
+	/* process each roles item */
+	for (i = 0; i < n; i++)
+	{
+		parse_roles(&ir[i], item[i]);
+		if (item[i])
+			pfree(item[i]);
+	}
+	pfree(item);
+
+	pfree(intervals_str);
+	if (roles_str)
+		pfree(roles_str);
+}
+
+/*
+ * Parse the n intervals of intervals_str, which is modified, into ir.
+ * Their roles are not touched.
+ */
+static void
+parse_interval_list(BAIntervalRole *ir, int n, char *intervals_str)
+{
+	char	*ptr;
+	char	**item;
+	int		i;
+
+	/*
+	 * store each token them parse'em; empty tokens are kept, so that an
+	 * error names the right interval, and missing ones stay NULL
+	 */
+	item = (char **) palloc0(n * sizeof(char *));
+	i = 0;
+	ptr = strtok_all(intervals_str, ";");
+	while (ptr && i < n)
+	{
+		item[i++] = trim(ptr);
+		ptr = strtok_all(NULL, ";");
+	}
+
+	/* process each interval item */
+	for (i = 0; i < n; i++)
+	{
+		if (item[i] == NULL)
+			policy_parse_error("parse interval failed: interval %d is empty", i + 1);
+		parse_interval(&ir[i], item[i]);
+		pfree(item[i]);
+	}
+	pfree(item);
+}
+
+/* Number of intervals in a trimmed, non-empty block_access.intervals */
+static int
+count_intervals(const char *intervals_str)
+{
+	const char *ptr;
+	int		n = 1;		/* we should have at least one token */
+
+	for (ptr = intervals_str; *ptr != '\0'; ptr++)
+		if (*ptr == ';')
+			n++;
+
+	return n;
+}
+
+/*
+ * Set bits from (inclusive) to to (inclusive)
+ */
+static void
+bitmap_set_range(uint64 *words, int from, int to)
+{
+	int		first = from / 64;
+	int		last = to / 64;
+	uint64	head = ~UINT64CONST(0) << (from % 64);
+	uint64	tail = ~UINT64CONST(0) >> (63 - to % 64);
+	int		i;
+
+	if (first == last)
+	{
+		words[first] |= head & tail;
+		return;
+	}
+
+	words[first] |= head;
+	for (i = first + 1; i < last; i++)
+		words[i] = ~UINT64CONST(0);
+	words[last] |= tail;
+}
+
+/*
+ * Bits of the last word of a schedule that are minutes of the week
+ */
+#define BA_LAST_WORD_MASK \
+	((BA_MINUTES_PER_WEEK % 64) == 0 ? ~UINT64CONST(0) : \
+	 (UINT64CONST(1) << (BA_MINUTES_PER_WEEK % 64)) - 1)
+
+/*
+ * Portable kernels, one word at a time. pg_popcount() uses the POPCNT
+ * instruction if the CPU has it.
+ */
+static void
+or_words_scalar(uint64 *dst, const uint64 *src)
+{
+	int		i;
+
+	for (i = 0; i < BA_SCHEDULE_WORDS; i++)
+		dst[i] |= src[i];
+}
+
+static void
+and_words_scalar(uint64 *dst, const uint64 *src)
+{
+	int		i;
+
+	for (i = 0; i < BA_SCHEDULE_WORDS; i++)
+		dst[i] &= src[i];
+}
+
+static void
+andnot_words_scalar(uint64 *dst, const uint64 *src)
+{
+	int		i;
+
+	for (i = 0; i < BA_SCHEDULE_WORDS; i++)
+		dst[i] &= ~src[i];
+}
+
+static int
+count_scalar(const uint64 *words)
+{
+	return (int) pg_popcount((const char *) words, BA_SCHEDULE_WORDS * sizeof(uint64));
+}
+
+static int
+scan_scalar(const uint64 *words, int from, int to, uint64 skip)
+{
+	int		w;
+
+	for (w = from; w < to; w++)
+		if (words[w] != skip)
+			return w;
+
+	return to;
+}
+
+static const BABitmapKernels bitmap_kernels_scalar = {
+	"scalar", or_words_scalar, and_words_scalar, andnot_words_scalar,
+	count_scalar, scan_scalar
+};
+
+#ifdef USE_BA_X86_KERNELS
+/*
+ * SSE2 kernels, two words at a time. Every x86-64 CPU has SSE2. There is no
+ * POPCNT in SSE2: bytes are counted with shifts and masks, and summed with
+ * PSADBW.
+ */
+static void
+or_words_sse2(uint64 *dst, const uint64 *src)
+{
+	int		i;
+
+	for (i = 0; i + 2 <= BA_SCHEDULE_WORDS; i += 2)
+	{
+		__m128i	a = _mm_loadu_si128((const __m128i *) &dst[i]);
+		__m128i	b = _mm_loadu_si128((const __m128i *) &src[i]);
+
+		_mm_storeu_si128((__m128i *) &dst[i], _mm_or_si128(a, b));
+	}
+	for (; i < BA_SCHEDULE_WORDS; i++)
+		dst[i] |= src[i];
+}
+
+static void
+and_words_sse2(uint64 *dst, const uint64 *src)
+{
+	int		i;
+
+	for (i = 0; i + 2 <= BA_SCHEDULE_WORDS; i += 2)
+	{
+		__m128i	a = _mm_loadu_si128((const __m128i *) &dst[i]);
+		__m128i	b = _mm_loadu_si128((const __m128i *) &src[i]);
+
+		_mm_storeu_si128((__m128i *) &dst[i], _mm_and_si128(a, b));
+	}
+	for (; i < BA_SCHEDULE_WORDS; i++)
+		dst[i] &= src[i];
+}
+
+static void
+andnot_words_sse2(uint64 *dst, const uint64 *src)
+{
+	int		i;
+
+	for (i = 0; i + 2 <= BA_SCHEDULE_WORDS; i += 2)
+	{
+		__m128i	a = _mm_loadu_si128((const __m128i *) &dst[i]);
+		__m128i	b = _mm_loadu_si128((const __m128i *) &src[i]);
+
+		_mm_storeu_si128((__m128i *) &dst[i], _mm_andnot_si128(b, a));
+	}
+	for (; i < BA_SCHEDULE_WORDS; i++)
+		dst[i] &= ~src[i];
+}
+
+static int
+count_sse2(const uint64 *words)
+{
+	const __m128i m1 = _mm_set1_epi8(0x55);
+	const __m128i m2 = _mm_set1_epi8(0x33);
+	const __m128i m4 = _mm_set1_epi8(0x0f);
+	__m128i	sum = _mm_setzero_si128();
+	int		count = 0;
+	int		i;
+
+	for (i = 0; i + 2 <= BA_SCHEDULE_WORDS; i += 2)
+	{
+		__m128i	x = _mm_loadu_si128((const __m128i *) &words[i]);
+
+		x = _mm_sub_epi8(x, _mm_and_si128(_mm_srli_epi64(x, 1), m1));
+		x = _mm_add_epi8(_mm_and_si128(x, m2),
+						 _mm_and_si128(_mm_srli_epi64(x, 2), m2));
+		x = _mm_and_si128(_mm_add_epi8(x, _mm_srli_epi64(x, 4)), m4);
+		sum = _mm_add_epi64(sum, _mm_sad_epu8(x, _mm_setzero_si128()));
+	}
+	for (; i < BA_SCHEDULE_WORDS; i++)
+		count += pg_popcount64(words[i]);
+
+	return count + (int) (_mm_cvtsi128_si64(sum) +
+						  _mm_cvtsi128_si64(_mm_unpackhi_epi64(sum, sum)));
+}
+
+static int
+scan_sse2(const uint64 *words, int from, int to, uint64 skip)
+{
+	__m128i	s = _mm_set1_epi64x((int64) skip);
+	int		w;
+
+	for (w = from; w + 2 <= to; w += 2)
+	{
+		__m128i	x = _mm_loadu_si128((const __m128i *) &words[w]);
+		int		eq = _mm_movemask_epi8(_mm_cmpeq_epi8(x, s));
+
+		if (eq != 0xffff)
+			return (eq & 0xff) != 0xff ? w : w + 1;
+	}
+	for (; w < to; w++)
+		if (words[w] != skip)
+			return w;
+
+	return to;
+}
+
+static const BABitmapKernels bitmap_kernels_sse2 = {
+	"sse2", or_words_sse2, and_words_sse2, andnot_words_sse2,
+	count_sse2, scan_sse2
+};
+
+/*
+ * AVX2 kernels, four words at a time. They are compiled for AVX2 whatever
+ * the build flags are, and used only if the CPU supports it. Bytes are
+ * counted with a nibble lookup table (PSHUFB).
+ */
+BA_TARGET_AVX2 static void
+or_words_avx2(uint64 *dst, const uint64 *src)
+{
+	int		i;
+
+	for (i = 0; i + 4 <= BA_SCHEDULE_WORDS; i += 4)
+	{
+		__m256i	a = _mm256_loadu_si256((const __m256i *) &dst[i]);
+		__m256i	b = _mm256_loadu_si256((const __m256i *) &src[i]);
+
+		_mm256_storeu_si256((__m256i *) &dst[i], _mm256_or_si256(a, b));
+	}
+	for (; i < BA_SCHEDULE_WORDS; i++)
+		dst[i] |= src[i];
+}
+
+BA_TARGET_AVX2 static void
+and_words_avx2(uint64 *dst, const uint64 *src)
+{
+	int		i;
+
+	for (i = 0; i + 4 <= BA_SCHEDULE_WORDS; i += 4)
+	{
+		__m256i	a = _mm256_loadu_si256((const __m256i *) &dst[i]);
+		__m256i	b = _mm256_loadu_si256((const __m256i *) &src[i]);
+
+		_mm256_storeu_si256((__m256i *) &dst[i], _mm256_and_si256(a, b));
+	}
+	for (; i < BA_SCHEDULE_WORDS; i++)
+		dst[i] &= src[i];
+}
+
+BA_TARGET_AVX2 static void
+andnot_words_avx2(uint64 *dst, const uint64 *src)
+{
+	int		i;
+
+	for (i = 0; i + 4 <= BA_SCHEDULE_WORDS; i += 4)
+	{
+		__m256i	a = _mm256_loadu_si256((const __m256i *) &dst[i]);
+		__m256i	b = _mm256_loadu_si256((const __m256i *) &src[i]);
+
+		_mm256_storeu_si256((__m256i *) &dst[i], _mm256_andnot_si256(b, a));
+	}
+	for (; i < BA_SCHEDULE_WORDS; i++)
+		dst[i] &= ~src[i];
+}
+
+BA_TARGET_AVX2 static int
+count_avx2(const uint64 *words)
+{
+	const __m256i lut = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3,
+										 1, 2, 2, 3, 2, 3, 3, 4,
+										 0, 1, 1, 2, 1, 2, 2, 3,
+										 1, 2, 2, 3, 2, 3, 3, 4);
+	const __m256i m4 = _mm256_set1_epi8(0x0f);
+	__m256i	sum = _mm256_setzero_si256();
+	int		count = 0;
+	int		i;
+
+	for (i = 0; i + 4 <= BA_SCHEDULE_WORDS; i += 4)
+	{
+		__m256i	x = _mm256_loadu_si256((const __m256i *) &words[i]);
+		__m256i	lo = _mm256_shuffle_epi8(lut, _mm256_and_si256(x, m4));
+		__m256i	hi = _mm256_shuffle_epi8(lut,
+										 _mm256_and_si256(_mm256_srli_epi16(x, 4), m4));
+
+		sum = _mm256_add_epi64(sum, _mm256_sad_epu8(_mm256_add_epi8(lo, hi),
+													_mm256_setzero_si256()));
+	}
+	for (; i < BA_SCHEDULE_WORDS; i++)
+		count += pg_popcount64(words[i]);
+
+	return count + (int) (_mm256_extract_epi64(sum, 0) + _mm256_extract_epi64(sum, 1) +
+						  _mm256_extract_epi64(sum, 2) + _mm256_extract_epi64(sum, 3));
+}
+
+BA_TARGET_AVX2 static int
+scan_avx2(const uint64 *words, int from, int to, uint64 skip)
+{
+	__m256i	s = _mm256_set1_epi64x((int64) skip);
+	int		w;
+
+	for (w = from; w + 4 <= to; w += 4)
+	{
+		__m256i	x = _mm256_loadu_si256((const __m256i *) &words[w]);
+		int		eq = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(x, s)));
+
+		if (eq != 0xf)
+			return w + pg_rightmost_one_pos32(~eq & 0xf);
+	}
+	for (; w < to; w++)
+		if (words[w] != skip)
+			return w;
+
+	return to;
+}
+
+static const BABitmapKernels bitmap_kernels_avx2 = {
+	"avx2", or_words_avx2, and_words_avx2, andnot_words_avx2,
+	count_avx2, scan_avx2
+};
+#endif							/* USE_BA_X86_KERNELS */
+
+/*
+ * All kernel sets built in, slowest first
+ */
+const BABitmapKernels *const bitmap_kernel_variants[] = {
+	&bitmap_kernels_scalar,
+#ifdef USE_BA_X86_KERNELS
+	&bitmap_kernels_sse2,
+	&bitmap_kernels_avx2,
+#endif
+	NULL
+};
+
+/* kernels in use, chosen at the first call */
+static const BABitmapKernels *bitmap_kernels = NULL;
+
+/*
+ * Whether the CPU can run these kernels
+ */
+bool
+bitmap_kernels_supported(const BABitmapKernels *k)
+{
+#ifdef USE_BA_X86_KERNELS
+	if (k == &bitmap_kernels_avx2)
+	{
+		__builtin_cpu_init();
+		return __builtin_cpu_supports("avx2");
+	}
+#endif
+
+	return true;
+}
+
+/*
+ * Kernels in use. The first call picks the last supported set of
+ * bitmap_kernel_variants.
+ */
+const BABitmapKernels *
+bitmap_current_kernels(void)
+{
+	if (bitmap_kernels == NULL)
+	{
+		int		i;
+
+		for (i = 0; bitmap_kernel_variants[i] != NULL; i++)
+			if (bitmap_kernels_supported(bitmap_kernel_variants[i]))
+				bitmap_kernels = bitmap_kernel_variants[i];
+	}
+
+	return bitmap_kernels;
+}
+
+/*
+ * Use other kernels, for tests and benchmarks. They must be supported.
+ */
+void
+bitmap_use_kernels(const BABitmapKernels *k)
+{
+	Assert(bitmap_kernels_supported(k));
+	bitmap_kernels = k;
+}
+
+/*
+ * dst |= src, for weekly schedules
+ */
+void
+bitmap_or(uint64 *dst, const uint64 *src)
+{
+	bitmap_current_kernels()->or_words(dst, src);
+}
+
+/*
+ * dst &= src, for weekly schedules
+ */
+void
+bitmap_and(uint64 *dst, const uint64 *src)
+{
+	bitmap_current_kernels()->and_words(dst, src);
+}
+
+/*
+ * dst &= ~src, for weekly schedules
+ */
+void
+bitmap_andnot(uint64 *dst, const uint64 *src)
+{
+	bitmap_current_kernels()->andnot_words(dst, src);
+}
+
+/*
+ * Number of bits set in a weekly schedule
+ */
+int
+bitmap_count(const uint64 *words)
+{
+	return bitmap_current_kernels()->count(words);
+}
+
+/*
+ * First bit at or after bit that differs from skip (0 or all ones) in a weekly
+ * schedule, wrapping around at the end of the week, or -1 if there is none.
+ * Whole words equal to skip are passed over by the scan kernel. Bits past the
+ * end of the week are not part of the schedule.
+ */
+static int
+bitmap_find(const uint64 *words, int bit, uint64 skip)
+{
+	const BABitmapKernels *k = bitmap_current_kernels();
+	int		start = bit / 64;
+	int		w = start;
+	uint64	word = (words[w] ^ skip) & (~UINT64CONST(0) << (bit % 64));
+	bool	wrapped = false;
+
+	for (;;)
+	{
+		if (w == BA_SCHEDULE_WORDS - 1)
+			word &= BA_LAST_WORD_MASK;
+		if (word != 0)
+			return w * 64 + pg_rightmost_one_pos64(word);
+
+		w = k->scan(words, w + 1, wrapped ? start + 1 : BA_SCHEDULE_WORDS, skip);
+		if (w == (wrapped ? start + 1 : BA_SCHEDULE_WORDS))
+		{
+			if (wrapped)
+				return -1;
+
+			/* the rest of the week, up to and including the first word */
+			wrapped = true;
+			w = k->scan(words, 0, start + 1, skip);
+			if (w == start + 1)
+				return -1;
+		}
+		word = words[w] ^ skip;
+	}
+}
+
+/*
+ * First bit set at or after bit in a weekly schedule, wrapping around at the
+ * end of the week, or -1 if none is.
+ */
+int
+bitmap_next(const uint64 *words, int bit)
+{
+	return bitmap_find(words, bit, 0);
+}
+
+/*
+ * Same as bitmap_next(), for the first bit not set
+ */
+int
+bitmap_next_clear(const uint64 *words, int bit)
+{
+	return bitmap_find(words, bit, ~UINT64CONST(0));
+}
+
+/*
+ * Find role in the policy. Return its index in the role table, or -1 if it
+ * is not in any exclude_roles list.
+ */
+int
+policy_find_role(BAPolicy *p, const char *role)
+{
+	const int32		*slots;
+	const uint32	*role_hash;
+	uint32	h;
+	uint32	mask;
+	uint32	i;
+	int32	r;
+
+	if (p->nroles == 0)
+		return -1;
+
+	slots = policy_role_slots(p);
+	role_hash = policy_role_hash(p);
+	h = hash_bytes((const unsigned char *) role, strlen(role));
+	mask = p->nslots - 1;
+
+	for (i = h & mask; (r = slots[i]) >= 0; i = (i + 1) & mask)
+	{
+		if (role_hash[r] == h && strcmp(policy_role(p, r), role) == 0)
+			return r;
+	}
+
+	return -1;
+}
+
+/*
+ * Schedule class of role: 0 for roles that are not in any exclude_roles
+ * list.
+ */
+int
+policy_role_class(BAPolicy *p, const char *role)
+{
+	int		r = policy_find_role(p, role);
+
+	return r >= 0 ? policy_role_classes(p)[r] : 0;
+}
+
+/*
+ * Compare the role entries of two valid policies: roles of newp that are not
+ * in oldp (added) or whose schedule is not the same (changed), and roles of
+ * oldp that are not in newp anymore (removed).
+ */
+void
+policy_diff(BAPolicy *oldp, BAPolicy *newp, int *added, int *removed, int *changed)
+{
+	int8	*same;			/* per pair of classes: -1 not compared yet */
+	int		kept = 0;
+	int		r;
+
+	*added = 0;
+	*changed = 0;
+
+	/* role entries patched from oldp: counted by rebuild_policy() */
+	if (newp->roles_from == oldp->generation)
+	{
+		*added = newp->roles_added;
+		*removed = newp->roles_removed;
+		*changed = newp->roles_changed;
+		return;
+	}
+
+	same = (int8 *) palloc(oldp->nschedules * newp->nschedules);
+	memset(same, -1, oldp->nschedules * newp->nschedules);
+
+	for (r = 0; r < newp->nroles; r++)
+	{
+		int		o = policy_find_role(oldp, policy_role(newp, r));
+		int		oldcls;
+		int		newcls;
+
+		if (o < 0)
+		{
+			(*added)++;
+			continue;
+		}
+
+		kept++;
+		oldcls = policy_role_classes(oldp)[o];
+		newcls = policy_role_classes(newp)[r];
+		if (same[oldcls * newp->nschedules + newcls] < 0)
+			same[oldcls * newp->nschedules + newcls] =
+				memcmp(&policy_schedules(oldp)[oldcls], &policy_schedules(newp)[newcls],
+					   sizeof(BASchedule)) == 0;
+		if (!same[oldcls * newp->nschedules + newcls])
+			(*changed)++;
+	}
+
+	pfree(same);
+	*removed = oldp->nroles - kept;
+}
+
+/*
+ * Next minute of the week at or after minute at which role is allowed, or -1
+ * if it is never allowed.
+ */
+int
+policy_next_allowed(BAPolicy *p, const char *role, int minute)
+{
+	return bitmap_next(policy_schedules(p)[policy_role_class(p, role)].words, minute);
+}
+
+/*
+ * Allocate a policy in cxt with room for its arrays and extra bytes at the
+ * end (see policy_end()), and set their offsets.
+ */
+BAPolicy *
+policy_alloc(MemoryContext cxt, int nschedules, int nroles, uint32 nslots, Size extra)
+{
+	BAPolicy	*p;
+	Size		len;
+	Size		schedules_off, class_days_off, roles_off, role_hash_off, role_class_off, slots_off;
+
+	len = MAXALIGN(sizeof(BAPolicy));
+	schedules_off = len;
+	len = add_size(len, MAXALIGN(mul_size(nschedules, sizeof(BASchedule))));
+	class_days_off = len;
+	len = add_size(len, MAXALIGN(mul_size(nschedules, sizeof(uint8))));
+	roles_off = len;
+	len = add_size(len, MAXALIGN(mul_size(nroles, sizeof(Size))));
+	role_hash_off = len;
+	len = add_size(len, MAXALIGN(mul_size(nroles, sizeof(uint32))));
+	role_class_off = len;
+	len = add_size(len, MAXALIGN(mul_size(nroles, sizeof(uint8))));
+	slots_off = len;
+	len = add_size(len, MAXALIGN(mul_size(nslots, sizeof(int32))));
+	len = MAXALIGN(add_size(len, extra));
+
+	p = (BAPolicy *) MemoryContextAllocExtended(cxt, len, MCXT_ALLOC_HUGE | MCXT_ALLOC_ZERO);
+	p->length = len;
+	p->nschedules = nschedules;
+	p->schedules_off = schedules_off;
+	p->class_days_off = class_days_off;
+	p->nroles = nroles;
+	p->roles_off = roles_off;
+	p->role_hash_off = role_hash_off;
+	p->role_class_off = role_class_off;
+	p->nslots = nslots;
+	p->slots_off = slots_off;
+
+	return p;
+}
+
+/* Start of the extra bytes of policy_alloc() */
+char *
+policy_end(BAPolicy *p)
+{
+	return (char *) p + p->slots_off + MAXALIGN(p->nslots * sizeof(int32));
+}
+
+/*
+ * Turn parsed intervals into schedules and a role table, and lay them out in
+ * a new policy allocated in cxt. Work arrays are allocated in the current
+ * memory context. extra bytes are left for the caller at source_off.
+ *
+ * For each week day, only the first interval that lists it counts: if now is
+ * outside of it, access is allowed only to its exclude_roles. Days that no
+ * interval lists are allowed. Hence the schedule of a role depends only on
+ * the set of days on which it is excluded; roles sharing that set share a
+ * schedule class. Class 0 is the empty set (every other role).
+ */
+BAPolicy *
+build_policy(MemoryContext cxt, BAIntervalRole *intervals, int nintervals, Size extra)
+{
+	BAPolicy	*p;
+	uint8		*group_days;
+	int			maxroles = 0;
+	int			nroles;
+	char		**roles;
+	uint32		*role_hash;
+	uint8		*role_days;
+	int32		*slots;
+	uint32		nslots;
+	BARoleSlot	*table;
+	Size		names;
+	int			i, k;
+
+	group_days = (uint8 *) palloc(Max(nintervals, 1) * sizeof(uint8));
+	policy_group_days(intervals, nintervals, group_days);
+
+	/* role table: open addressing, at most half full */
+	for (i = 0; i < nintervals; i++)
+		maxroles += intervals[i].nroles;
+
+	nslots = policy_role_slot_count(maxroles);
+	table = (BARoleSlot *) palloc(nslots * sizeof(BARoleSlot));
+	for (i = 0; i < nslots; i++)
+		table[i].role = -1;
+	roles = (char **) palloc(Max(maxroles, 1) * sizeof(char *));
+	role_hash = (uint32 *) palloc(Max(maxroles, 1) * sizeof(uint32));
+	role_days = (uint8 *) palloc0(Max(maxroles, 1) * sizeof(uint8));
+	nroles = 0;
+	names = 0;
+
+	/* days on which each role is excluded */
+	for (i = 0; i < nintervals; i++)
+	{
+		int		days = group_days[i];
+
+		/*
+		 * With millions of roles, each probe is a cache miss. Hash a batch
+		 * of roles and prefetch their slots before inserting them.
+		 */
+		for (k = 0; k < intervals[i].nroles; k += BA_ROLE_BATCH)
+		{
+			int			n = Min(BA_ROLE_BATCH, intervals[i].nroles - k);
+			uint32		h[BA_ROLE_BATCH];
+			uint32		mask = nslots - 1;
+			int			b;
+
+			for (b = 0; b < n; b++)
+			{
+				char	*role = intervals[i].roles[k + b];
+
+				if (role == NULL)
+					continue;
+				h[b] = hash_bytes((const unsigned char *) role, strlen(role));
+				ba_prefetch(&table[h[b] & mask]);
+			}
+
+			for (b = 0; b < n; b++)
+			{
+				char		*role = intervals[i].roles[k + b];
+				uint32		s;
+
+				if (role == NULL)
+					continue;
+
+				for (s = h[b] & mask; table[s].role >= 0; s = (s + 1) & mask)
+				{
+					if (table[s].hash == h[b] && strcmp(roles[table[s].role], role) == 0)
+						break;
+				}
+
+				if (table[s].role < 0)
+				{
+					table[s].role = nroles;
+					table[s].hash = h[b];
+					roles[nroles] = role;
+					role_hash[nroles] = h[b];
+					names += strlen(role) + 1;
+					nroles++;
+				}
+
+				role_days[table[s].role] |= days;
+			}
+		}
+	}
+
+	p = layout_policy(cxt, intervals, nintervals, nroles, roles, role_hash, role_days,
+					  nslots, names, extra);
+	slots = policy_role_slots(p);
+	for (i = 0; i < nslots; i++)
+		slots[i] = table[i].role;
+
+	return p;
+}
+
+/*
+ * Lay out a policy in cxt from its role table: nroles role names, with names
+ * bytes in all (terminators included), their hashes and the days on which
+ * each one is excluded, which are turned into schedule classes in place.
+ * The nslots role slots are left for the caller to fill in, and extra bytes
+ * at source_off. Work arrays are allocated in the current memory context.
+ */
+BAPolicy *
+layout_policy(MemoryContext cxt, BAIntervalRole *intervals, int nintervals,
+			  int nroles, char **roles, uint32 *role_hash, uint8 *role_days,
+			  uint32 nslots, Size names, Size extra)
+{
+	BAPolicy	*p;
+	int			owner[7];
+	int			class_of_days[BA_MAX_SCHEDULES];
+	uint8		days_of_class[BA_MAX_SCHEDULES];
+	int			nschedules;
+	BASchedule	*schedules;
+	Size		*role_off;
+	char		*ptr;
+	int			i;
+
+	find_day_owners(intervals, nintervals, owner);
+
+	/* class 0: roles that are not excluded */
+	schedules = (BASchedule *) palloc0(sizeof(BASchedule));
+	nschedules = 1;
+	open_schedule(schedules[0].words, intervals, owner);
+
+	for (i = 0; i < lengthof(class_of_days); i++)
+		class_of_days[i] = -1;
+	class_of_days[0] = 0;
+	days_of_class[0] = 0;
+
+	/* one schedule per distinct set of days */
+	for (i = 0; i < nroles; i++)
+	{
+		int		days = role_days[i];
+
+		if (class_of_days[days] < 0)
+		{
+			days_of_class[nschedules] = days;
+			class_of_days[days] = nschedules++;
+			schedules = (BASchedule *) repalloc(schedules, nschedules * sizeof(BASchedule));
+			class_schedule(schedules[class_of_days[days]].words, days, schedules[0].words);
+		}
+
+		role_days[i] = class_of_days[days];
+	}
+
+	/* lay out the policy; role names go at the end */
+	p = policy_alloc(cxt, nschedules, nroles, nslots, names + extra);
+	p->nintervals = nintervals;
+	for (i = 0; i < 7; i++)
+		p->day_owner[i] = owner[i];
+	memcpy(policy_schedules(p), schedules, nschedules * sizeof(BASchedule));
+	memcpy(policy_class_days(p), days_of_class, nschedules * sizeof(uint8));
+	memcpy(policy_role_hash(p), role_hash, nroles * sizeof(uint32));
+	memcpy(policy_role_classes(p), role_days, nroles * sizeof(uint8));
+
+	role_off = BA_POLICY_ARRAY(p, Size, roles_off);
+	ptr = policy_end(p);
+	for (i = 0; i < nroles; i++)
+	{
+		Size	len = strlen(roles[i]) + 1;
+
+		role_off[i] = ptr - (char *) p;
+		memcpy(ptr, roles[i], len);
+		ptr += len;
+	}
+	p->source_off = ptr - (char *) p;
+
+	if (nroles == 0)
+		p->shape = BA_SHAPE_TIME;
+	else if (nroles <= BA_SMALL_ROLES)
+		p->shape = BA_SHAPE_SMALL;
+	else
+		p->shape = BA_SHAPE_FULL;
+
+	elog(DEBUG1, "policy: %d intervals, %d roles, %d schedule classes, %d minutes a week open to every role, %s shape",
+		 p->nintervals, p->nroles, p->nschedules,
+		 bitmap_count(policy_schedules(p)[0].words), policy_shape_names[p->shape]);
+
+	return p;
+}
+
+/*
+ * Role slots of a policy with up to maxroles roles: a power of 2, so that
+ * the table is at most half full
+ */
+uint32
+policy_role_slot_count(int maxroles)
+{
+	uint32		nslots = 1;
+
+	while (nslots < maxroles * 2)
+		nslots <<= 1;
+
+	return nslots;
+}
+
+/*
+ * Days on which the roles of each interval are excluded, a bit per week day:
+ * those that the interval owns (see find_day_owners())
+ */
+void
+policy_group_days(BAIntervalRole *intervals, int nintervals, uint8 *days)
+{
+	int		owner[7];
+	int		i, j;
+
+	find_day_owners(intervals, nintervals, owner);
+	for (i = 0; i < nintervals; i++)
+	{
+		days[i] = 0;
+		for (j = 0; j < 7; j++)
+			if (owner[j] == i)
+				days[i] |= 1 << j;
+	}
+}
+
+/*
+ * Most roles that bytes from (inclusive) to to (exclusive) of exclude_roles
+ * can hold: one more than their separators
+ */
+int
+count_role_items(const char *s, Size from, Size to)
+{
+	int		n = 1;
+	Size	i;
+
+	for (i = from; i < to; i++)
+		if (s[i] == ',' || s[i] == ';')
+			n++;
+
+	return n;
+}
+
+/*
+ * Find the roles in bytes from (inclusive) to to (exclusive) of exclude_roles
+ * s, as parse_options() does, without modifying s: from must be the start of
+ * a role, in role group group, and to the end of one. The offset, length and
+ * hash of each role, and the days of its group (see policy_group_days()),
+ * are stored in the arrays, which have room for count_role_items() roles.
+ * Return the number of roles.
+ */
+int
+scan_roles(const char *s, Size from, Size to, int group, const uint8 *group_days,
+		   uint32 *off, uint32 *len, uint32 *hash, uint8 *days)
+{
+	int		n = 0;
+	Size	i = from;
+
+	while (i <= to)
+	{
+		Size	start = i;
+		Size	end;
+
+		while (i < to && s[i] != ',' && s[i] != ';')
+			i++;
+		end = i;
+
+		/* empty roles, such as the one in 'foo,,bar', are skipped */
+		while (start < end && isspace((unsigned char) s[start]))
+			start++;
+		while (end > start && isspace((unsigned char) s[end - 1]))
+			end--;
+		if (end > start)
+		{
+			off[n] = start;
+			len[n] = end - start;
+			hash[n] = hash_bytes((const unsigned char *) s + start, end - start);
+			days[n] = group_days[group];
+			n++;
+		}
+
+		if (i < to && s[i] == ';')
+			group++;
+		i++;
+	}
+
+	return n;
+}
+
+/*
+ * First interval that lists each week day, or -1
+ */
+static void
+find_day_owners(BAIntervalRole *intervals, int nintervals, int owner[7])
+{
+	int		i, j;
+
+	for (i = 0; i < 7; i++)
+		owner[i] = -1;
+	for (i = nintervals - 1; i >= 0; i--)
+		for (j = 0; j < intervals[i].nwday; j++)
+			owner[intervals[i].wday[j]] = i;
+}
+
+/*
+ * Schedule of roles that are not excluded: days that no interval lists, and
+ * the window of the interval that owns each other day
+ */
+static void
+open_schedule(uint64 *words, BAIntervalRole *intervals, int owner[7])
+{
+	int		i;
+
+	memset(words, 0, sizeof(BASchedule));
+	for (i = 0; i < 7; i++)
+	{
+		int		day = i * BA_MINUTES_PER_DAY;
+
+		if (owner[i] < 0)
+			bitmap_set_range(words, day, day + BA_MINUTES_PER_DAY - 1);
+		else
+		{
+			BAIntervalRole	*ir = &intervals[owner[i]];
+			int		s1 = ir->start_time.hour * 60 + ir->start_time.minute;
+			int		s2 = ir->end_time.hour * 60 + ir->end_time.minute;
+
+			if (s1 <= s2)
+				bitmap_set_range(words, day + s1, day + s2);
+		}
+	}
+}
+
+/*
+ * Schedule of roles excluded on days (a bit per week day): these days, and
+ * the open schedule
+ */
+static void
+class_schedule(uint64 *words, int days, const uint64 *open)
+{
+	int		j;
+
+	memset(words, 0, sizeof(BASchedule));
+	for (j = 0; j < 7; j++)
+		if (days & (1 << j))
+			bitmap_set_range(words, j * BA_MINUTES_PER_DAY,
+							 (j + 1) * BA_MINUTES_PER_DAY - 1);
+	bitmap_or(words, open);
+}
+
+/*
+ * Role whose entry may change when a policy is patched (see rebuild_policy()):
+ * it is listed in the changed part of the old or of the new exclude_roles.
+ */
+typedef struct BARolePatch {
+	const char	*name;			/* in either list, not terminated */
+	uint32		len;
+	uint32		hash;
+	bool		in_old;			/* listed in the changed part of the old list */
+	bool		in_new;			/* listed in the changed part of the new list */
+	bool		outside;		/* listed out of the changed parts (in_old only) */
+	uint8		days;			/* days of the occurrences found so far */
+	int			role;			/* index in the old policy, or -1 */
+	int			cls;			/* new class, or -1 if removed */
+} BARolePatch;
+
+#define BA_PATCH_ALWAYS			65536	/* bytes of roles that can always change */
+#define BA_COMPARE_BYTES		4096	/* compared at once to find the changed part */
+#define BA_ROLE_REMOVED			0xFF	/* in role classes, while patching */
+
+/*
+ * Entry of the role called name (len bytes, hash h) in patches, whose table
+ * has mask + 1 slots. If there is none and npatches is not NULL, add one.
+ */
+static BARolePatch *
+find_role_patch(BARolePatch *patches, int32 *table, uint32 mask,
+				const char *name, uint32 len, uint32 h, int *npatches)
+{
+	uint32		s;
+
+	for (s = h & mask; table[s] >= 0; s = (s + 1) & mask)
+	{
+		BARolePatch	*e = &patches[table[s]];
+
+		if (e->hash == h && e->len == len && memcmp(e->name, name, len) == 0)
+			return e;
+	}
+
+	if (npatches == NULL)
+		return NULL;
+
+	table[s] = *npatches;
+	patches[*npatches].name = name;
+	patches[*npatches].len = len;
+	patches[*npatches].hash = h;
+
+	return &patches[(*npatches)++];
+}
+
+/* Whether byte i of s is the start of a role, whitespace aside */
+static bool
+role_start(const char *s, Size i)
+{
+	while (i > 0 && isspace((unsigned char) s[i - 1]))
+		i--;
+
+	return i == 0 || s[i - 1] == ',' || s[i - 1] == ';';
+}
+
+/* Whether a role of s (len bytes) ends before byte i, whitespace aside */
+static bool
+role_end(const char *s, Size len, Size i)
+{
+	while (i < len && isspace((unsigned char) s[i]))
+		i++;
+
+	return i == len || s[i] == ',' || s[i] == ';';
+}
+
+/* Role groups that start in bytes from (inclusive) to to (exclusive) of s */
+static int
+count_groups(const char *s, Size from, Size to)
+{
+	const char	*ptr = s + from;
+	int			n = 0;
+
+	while ((ptr = memchr(ptr, ';', s + to - ptr)) != NULL)
+	{
+		n++;
+		ptr++;
+	}
+
+	return n;
+}
+
+/* Cheap key of a role name, so that most roles need not be hashed */
+#define role_filter_key(name, len) \
+	((((len) << 4) ^ ((unsigned char) (name)[0] << 2) ^ (unsigned char) (name)[(len) - 1]) & 0xFF)
+
+/*
+ * Scan the roles in bytes from (inclusive) to to (exclusive) of s, in role
+ * group group at from, for those of patches that were listed in the changed
+ * part of the old list: whether they are listed elsewhere, and on which days.
+ * The scan is that of scan_roles(), but only the roles whose filter key is
+ * that of one of those are hashed.
+ */
+static void
+scan_unchanged_roles(const char *s, Size from, Size to, int group, const uint8 *group_days,
+					 BARolePatch *patches, int npatches, int32 *table, uint32 mask)
+{
+	bool	filter[256];
+	Size	i = from;
+	int		k;
+
+	memset(filter, 0, sizeof(filter));
+	for (k = 0; k < npatches; k++)
+		if (patches[k].in_old)
+			filter[role_filter_key(patches[k].name, patches[k].len)] = true;
+
+	while (i <= to)
+	{
+		Size	start = i;
+		Size	end;
+
+		while (i < to && s[i] != ',' && s[i] != ';')
+			i++;
+		end = i;
+
+		while (start < end && isspace((unsigned char) s[start]))
+			start++;
+		while (end > start && isspace((unsigned char) s[end - 1]))
+			end--;
+		if (end > start && filter[role_filter_key(s + start, end - start)])
+		{
+			BARolePatch	*e;
+
+			e = find_role_patch(patches, table, mask, s + start, end - start,
+								hash_bytes((const unsigned char *) s + start, end - start),
+								NULL);
+			if (e != NULL && e->in_old)
+			{
+				e->outside = true;
+				e->days |= group_days[group];
+			}
+		}
+
+		if (i < to && s[i] == ';')
+			group++;
+		i++;
+	}
+}
+
+/*
+ * Find the role called name (len bytes, hash h) in p. Return its index, or
+ * -1; see policy_find_role().
+ */
+static int
+find_role_len(BAPolicy *p, const char *name, uint32 len, uint32 h)
+{
+	const int32	*slots = policy_role_slots(p);
+	uint32		mask = p->nslots - 1;
+	uint32		s;
+	int32		r;
+
+	if (p->nroles == 0)
+		return -1;
+
+	for (s = h & mask; (r = slots[s]) >= 0; s = (s + 1) & mask)
+	{
+		const char *role = policy_role(p, r);
+
+		if (policy_role_hash(p)[r] == h && strncmp(role, name, len) == 0 && role[len] == '\0')
+			return r;
+	}
+
+	return -1;
+}
+
+/*
+ * Empty slot s of an open addressing table with mask + 1 slots, moving back
+ * the roles after it that would not be found anymore (hash holds the hash of
+ * each role).
+ */
+static void
+delete_role_slot(int32 *slots, uint32 mask, const uint32 *hash, uint32 s)
+{
+	uint32		j = s;
+
+	for (;;)
+	{
+		uint32		home;
+
+		j = (j + 1) & mask;
+		if (slots[j] < 0)
+			break;
+
+		/* the role in j can move to s if s is between its home slot and j */
+		home = hash[slots[j]] & mask;
+		if ((j > s && (home <= s || home > j)) ||
+			(j < s && home <= s && home > j))
+		{
+			slots[s] = slots[j];
+			s = j;
+		}
+	}
+	slots[s] = -1;
+}
+
+/* Slot of role r, which hashes to h, in an open addressing table */
+static uint32
+find_role_slot(const int32 *slots, uint32 mask, uint32 h, int32 r)
+{
+	uint32		s;
+
+	for (s = h & mask; slots[s] != r; s = (s + 1) & mask)
+		Assert(slots[s] >= 0);
+
+	return s;
+}
+
+/*
+ * Copy the role entries of oldp to p, which has room for them, patched as
+ * patches say: added and removed are the numbers of roles that they add and
+ * remove. If none is removed, the entries are copied in place and the names
+ * in one piece; otherwise the last roles fill the holes.
+ */
+static void
+patch_role_entries(BAPolicy *p, BAPolicy *oldp, BARolePatch *patches, int npatches,
+				   int added, int removed)
+{
+	Size	*role_off;
+	uint32	*role_hash;
+	uint8	*role_class;
+	int32	*slots;
+	uint32	mask;
+	char	*ptr;
+	int		nroles;
+	int		i;
+
+	if (removed == 0)
+	{
+		role_off = BA_POLICY_ARRAY(p, Size, roles_off);
+		role_hash = policy_role_hash(p);
+		role_class = policy_role_classes(p);
+	}
+	else
+	{
+		role_off = (Size *) palloc(Max(oldp->nroles + added, 1) * sizeof(Size));
+		role_hash = (uint32 *) palloc(Max(oldp->nroles + added, 1) * sizeof(uint32));
+		role_class = (uint8 *) palloc(Max(oldp->nroles + added, 1) * sizeof(uint8));
+	}
+	memcpy(role_off, BA_POLICY_ARRAY(oldp, Size, roles_off), oldp->nroles * sizeof(Size));
+	memcpy(role_hash, policy_role_hash(oldp), oldp->nroles * sizeof(uint32));
+	memcpy(role_class, policy_role_classes(oldp), oldp->nroles * sizeof(uint8));
+	slots = policy_role_slots(p);
+	memcpy(slots, policy_role_slots(oldp), p->nslots * sizeof(int32));
+	mask = p->nslots - 1;
+
+	for (i = 0; i < npatches; i++)
+	{
+		BARolePatch	*e = &patches[i];
+
+		if (e->role < 0)
+			continue;
+		if (e->cls < 0)
+		{
+			delete_role_slot(slots, mask, role_hash,
+							 find_role_slot(slots, mask, e->hash, e->role));
+			role_class[e->role] = BA_ROLE_REMOVED;
+		}
+		else
+			role_class[e->role] = e->cls;
+	}
+
+	/* the last roles fill the holes of removed ones */
+	nroles = oldp->nroles;
+	if (removed > 0)
+	{
+		for (i = 0; i < nroles; i++)
+		{
+			if (role_class[i] != BA_ROLE_REMOVED)
+				continue;
+			while (nroles > i + 1 && role_class[nroles - 1] == BA_ROLE_REMOVED)
+				nroles--;
+			nroles--;
+			if (nroles > i)
+			{
+				slots[find_role_slot(slots, mask, role_hash[nroles], nroles)] = i;
+				role_off[i] = role_off[nroles];
+				role_hash[i] = role_hash[nroles];
+				role_class[i] = role_class[nroles];
+			}
+		}
+	}
+
+	/* names of the roles kept: in one piece if none was removed */
+	ptr = policy_end(p);
+	if (removed == 0)
+	{
+		Size	shift = (policy_end(p) - (char *) p) - (policy_end(oldp) - (char *) oldp);
+
+		memcpy(ptr, policy_end(oldp), oldp->source_off - (policy_end(oldp) - (char *) oldp));
+		ptr += oldp->source_off - (policy_end(oldp) - (char *) oldp);
+		for (i = 0; i < nroles; i++)
+			role_off[i] += shift;
+	}
+	else
+	{
+		for (i = 0; i < nroles; i++)
+		{
+			const char *name = (char *) oldp + role_off[i];
+			Size	len = strlen(name) + 1;
+
+			memcpy(ptr, name, len);
+			role_off[i] = ptr - (char *) p;
+			ptr += len;
+		}
+	}
+
+	/* and the added ones */
+	for (i = 0; i < npatches; i++)
+	{
+		BARolePatch	*e = &patches[i];
+		uint32		s;
+
+		if (e->role >= 0 || e->cls < 0)
+			continue;
+
+		/* not found before: no slot of it to reuse */
+		for (s = e->hash & mask; slots[s] >= 0; s = (s + 1) & mask)
+			;
+		slots[s] = nroles;
+		role_off[nroles] = ptr - (char *) p;
+		role_hash[nroles] = e->hash;
+		role_class[nroles] = e->cls;
+		memcpy(ptr, e->name, e->len);
+		ptr[e->len] = '\0';
+		ptr += e->len + 1;
+		nroles++;
+	}
+	Assert(nroles == p->nroles);
+	p->source_off = ptr - (char *) p;
+
+	if (removed > 0)
+	{
+		memcpy(BA_POLICY_ARRAY(p, Size, roles_off), role_off, nroles * sizeof(Size));
+		memcpy(policy_role_hash(p), role_hash, nroles * sizeof(uint32));
+		memcpy(policy_role_classes(p), role_class, nroles * sizeof(uint8));
+		pfree(role_off);
+		pfree(role_hash);
+		pfree(role_class);
+	}
+
+	if (nroles <= BA_SMALL_ROLES)
+		p->shape = BA_SHAPE_SMALL;
+	else
+		p->shape = BA_SHAPE_FULL;
+}
+
+/*
+ * Build a policy in cxt from new intervals and roles, and the role entries of
+ * oldp, which was compiled from oldroles; extra bytes are left at source_off,
+ * as build_policy() does. Roles are neither parsed nor hashed again: the role
+ * names, hashes, classes and slots of oldp are copied, and only the entries of
+ * roles in the part of the list that changed are patched. The schedules are
+ * built again.
+ *
+ * The changed part lies between the longest common prefix and suffix of
+ * oldroles and roles, cut where roles start or end. Its roles are looked up
+ * in oldp; those that it no longer lists are looked for in the rest of the
+ * list (see scan_unchanged_roles()), to tell whether they are still listed
+ * there and on which days. If it is more than a quarter of a long list,
+ * compiling the policy from scratch is faster.
+ *
+ * That is possible only if every week day belongs to the same interval as in
+ * oldp, since the class of a role is the set of days on which it is excluded,
+ * and if the schedule classes stay the same: a patched role must go to an
+ * existing class, and no class may lose its last role. The table must also
+ * stay at most half full. Return NULL otherwise, or if there are no intervals
+ * anymore; the caller compiles the policy from scratch then. Errors are
+ * raised as in parse_policy().
+ *
+ * What changed against oldp is counted in roles_added, roles_removed and
+ * roles_changed, for policy_diff().
+ */
+BAPolicy *
+rebuild_policy(MemoryContext cxt, BAPolicy *oldp, const char *oldroles,
+			   const char *intervals, const char *roles, Size extra)
+{
+	char	*intervals_str;
+	int		nintervals;
+	BAIntervalRole	*parsed;
+	int		owner[7];
+	uint8	*group_days;
+	int		class_of_days[BA_MAX_SCHEDULES];
+	int		class_roles[BA_MAX_SCHEDULES];
+	bool	differs[BA_MAX_SCHEDULES];
+	Size	olen;
+	Size	nlen;
+	Size	prefix;
+	Size	suffix;
+	Size	oend;
+	Size	nend;
+	int		group;
+	BARolePatch	*patches = NULL;
+	int		npatches = 0;
+	int		added = 0;
+	int		removed = 0;
+	int		changed = 0;
+	int		patched = 0;
+	bool	leaving = false;
+	int		nroles;
+	Size	names;
+	BAPolicy	*p;
+	int		i;
+
+	Assert(policy_error(oldp) == NULL && oldp->nintervals > 0);
+
+	intervals_str = trim((char *) intervals);
+	if (intervals_str == NULL)
+		return NULL;
+
+	nintervals = count_intervals(intervals_str);
+	if (nintervals != oldp->nintervals)
+	{
+		pfree(intervals_str);
+		return NULL;
+	}
+
+	parsed = (BAIntervalRole *) palloc0(nintervals * sizeof(BAIntervalRole));
+	parse_interval_list(parsed, nintervals, intervals_str);
+	pfree(intervals_str);
+
+	find_day_owners(parsed, nintervals, owner);
+	for (i = 0; i < 7; i++)
+		if (owner[i] != oldp->day_owner[i])
+			return NULL;
+
+	group_days = (uint8 *) palloc(nintervals * sizeof(uint8));
+	policy_group_days(parsed, nintervals, group_days);
+
+	for (i = 0; i < BA_MAX_SCHEDULES; i++)
+		class_of_days[i] = -1;
+	for (i = 0; i < oldp->nschedules; i++)
+		class_of_days[policy_class_days(oldp)[i]] = i;
+
+	/*
+	 * Changed part of the lists: it starts where a role starts, or where one
+	 * ends in both lists, and ends where a role ends, or where one starts in
+	 * both, so that the roles of the common parts are whole.
+	 */
+	oldroles = oldroles != NULL ? oldroles : "";
+	roles = roles != NULL ? roles : "";
+	olen = strlen(oldroles);
+	nlen = strlen(roles);
+	prefix = 0;
+	while (prefix + BA_COMPARE_BYTES <= Min(olen, nlen) &&
+		   memcmp(oldroles + prefix, roles + prefix, BA_COMPARE_BYTES) == 0)
+		prefix += BA_COMPARE_BYTES;
+	while (prefix < olen && prefix < nlen && oldroles[prefix] == roles[prefix])
+		prefix++;
+	if (!role_end(oldroles, olen, prefix) || !role_end(roles, nlen, prefix))
+		while (!role_start(oldroles, prefix))
+			prefix--;
+
+	suffix = 0;
+	while (suffix + BA_COMPARE_BYTES <= Min(olen, nlen) - prefix &&
+		   memcmp(oldroles + olen - suffix - BA_COMPARE_BYTES,
+				  roles + nlen - suffix - BA_COMPARE_BYTES, BA_COMPARE_BYTES) == 0)
+		suffix += BA_COMPARE_BYTES;
+	while (suffix < Min(olen, nlen) - prefix &&
+		   oldroles[olen - suffix - 1] == roles[nlen - suffix - 1])
+		suffix++;
+	oend = olen - suffix;
+	nend = nlen - suffix;
+	if (!role_start(oldroles, oend) || !role_start(roles, nend))
+		while (!role_end(oldroles, olen, oend))
+			oend++;
+	nend = nlen - (olen - oend);
+
+	/* patching a large part of a long list is slower than compiling it */
+	if ((oend - prefix) + (nend - prefix) > Max(BA_PATCH_ALWAYS, (olen + nlen) / 4))
+		return NULL;
+
+	group = count_groups(oldroles, 0, prefix);
+	if (count_groups(oldroles, prefix, oend) != count_groups(roles, prefix, nend))
+		return NULL;			/* not as many groups as intervals */
+
+	if (oend > prefix || nend > prefix)
+	{
+		int		maxroles = Max(count_role_items(oldroles, prefix, oend),
+							   count_role_items(roles, prefix, nend));
+		uint32	*off = (uint32 *) palloc(maxroles * sizeof(uint32));
+		uint32	*len = (uint32 *) palloc(maxroles * sizeof(uint32));
+		uint32	*hash = (uint32 *) palloc(maxroles * sizeof(uint32));
+		uint8	*days = (uint8 *) palloc(maxroles * sizeof(uint8));
+		uint32	nslots = policy_role_slot_count(2 * maxroles);
+		int32	*table = (int32 *) palloc(nslots * sizeof(int32));
+		bool	lookup;
+		int		n;
+
+		patches = (BARolePatch *) palloc0(2 * maxroles * sizeof(BARolePatch));
+		memset(table, -1, nslots * sizeof(int32));
+
+		n = scan_roles(oldroles, prefix, oend, group, group_days, off, len, hash, days);
+		for (i = 0; i < n; i++)
+			find_role_patch(patches, table, nslots - 1, oldroles + off[i], len[i], hash[i],
+							&npatches)->in_old = true;
+		lookup = npatches > 0;
+
+		n = scan_roles(roles, prefix, nend, group, group_days, off, len, hash, days);
+		for (i = 0; i < n; i++)
+		{
+			BARolePatch	*e = find_role_patch(patches, table, nslots - 1, roles + off[i],
+											 len[i], hash[i], &npatches);
+
+			e->in_new = true;
+			e->days |= days[i];
+		}
+
+		/* roles that the old changed part listed may be listed elsewhere */
+		if (lookup)
+		{
+			scan_unchanged_roles(oldroles, 0, prefix, 0, group_days,
+								 patches, npatches, table, nslots - 1);
+			scan_unchanged_roles(oldroles, oend, olen, group + count_groups(oldroles, prefix, oend),
+								 group_days, patches, npatches, table, nslots - 1);
+		}
+
+		pfree(off);
+		pfree(len);
+		pfree(hash);
+		pfree(days);
+		pfree(table);
+	}
+
+	/* new entry of each role */
+	for (i = 0; i < npatches; i++)
+	{
+		BARolePatch	*e = &patches[i];
+		int			oldcls;
+
+		e->role = find_role_len(oldp, e->name, e->len, e->hash);
+		oldcls = e->role >= 0 ? policy_role_classes(oldp)[e->role] : -1;
+
+		/* roles not listed in the old changed part are listed as before elsewhere */
+		if (!e->in_old && e->role >= 0)
+		{
+			e->outside = true;
+			e->days |= policy_class_days(oldp)[oldcls];
+		}
+
+		if (!e->in_new && !e->outside)
+			e->cls = -1;
+		else if ((e->cls = class_of_days[e->days]) < 0)
+			return NULL;		/* a new schedule class */
+
+		if (e->role < 0)
+			added += e->cls >= 0;
+		else if (e->cls < 0)
+			removed++;
+		if (e->role >= 0 && e->cls != oldcls)
+			leaving = true;
+		patched += e->cls != oldcls;
+	}
+
+	nroles = oldp->nroles + added - removed;
+	if (nroles == 0 || nroles > oldp->nslots / 2)
+		return NULL;
+
+	/* no class may lose its last role */
+	if (leaving)
+	{
+		memset(class_roles, 0, sizeof(class_roles));
+		for (i = 0; i < oldp->nroles; i++)
+			class_roles[policy_role_classes(oldp)[i]]++;
+		for (i = 0; i < npatches; i++)
+		{
+			if (patches[i].role >= 0)
+				class_roles[policy_role_classes(oldp)[patches[i].role]]--;
+			if (patches[i].cls >= 0)
+				class_roles[patches[i].cls]++;
+		}
+		for (i = 1; i < oldp->nschedules; i++)
+			if (class_roles[i] == 0)
+				return NULL;
+	}
+
+	/* bytes of the role names */
+	names = oldp->source_off - (policy_end(oldp) - (char *) oldp);
+	for (i = 0; i < npatches; i++)
+	{
+		if (patches[i].role < 0 && patches[i].cls >= 0)
+			names += patches[i].len + 1;
+		else if (patches[i].role >= 0 && patches[i].cls < 0)
+			names -= patches[i].len + 1;
+	}
+
+	p = policy_alloc(cxt, oldp->nschedules, nroles, oldp->nslots, names + extra);
+	p->nintervals = nintervals;
+	for (i = 0; i < 7; i++)
+		p->day_owner[i] = owner[i];
+	memcpy(policy_class_days(p), policy_class_days(oldp), p->nschedules * sizeof(uint8));
+
+	open_schedule(policy_schedules(p)[0].words, parsed, owner);
+	for (i = 1; i < p->nschedules; i++)
+		class_schedule(policy_schedules(p)[i].words, policy_class_days(p)[i],
+					   policy_schedules(p)[0].words);
+
+	if (npatches == 0)
+	{
+		/* same roles: the role section is copied in one piece */
+		Assert(p->roles_off == oldp->roles_off);
+		memcpy((char *) p + p->roles_off, (char *) oldp + oldp->roles_off,
+			   oldp->source_off - oldp->roles_off);
+		p->source_off = oldp->source_off;
+		p->shape = oldp->shape;
+	}
+	else
+		patch_role_entries(p, oldp, patches, npatches, added, removed);
+
+	/*
+	 * What changed: roles of a class whose schedule changed, and the patched
+	 * ones, whose old and new schedules are compared instead
+	 */
+	for (i = 0; i < p->nschedules; i++)
+		differs[i] = memcmp(&policy_schedules(oldp)[i], &policy_schedules(p)[i],
+							sizeof(BASchedule)) != 0;
+	for (i = 0; i < p->nschedules && !differs[i]; i++)
+		;
+	if (i < p->nschedules)
+		for (i = 0; i < nroles; i++)
+			changed += differs[policy_role_classes(p)[i]];
+	for (i = 0; i < npatches; i++)
+	{
+		BARolePatch	*e = &patches[i];
+		int			oldcls = e->role >= 0 ? policy_role_classes(oldp)[e->role] : -1;
+
+		if (e->cls < 0 || e->cls == oldcls)
+			continue;
+		changed -= differs[e->cls];
+		if (e->role >= 0)
+			changed += memcmp(&policy_schedules(oldp)[oldcls], &policy_schedules(p)[e->cls],
+							  sizeof(BASchedule)) != 0;
+	}
+	p->roles_added = added;
+	p->roles_removed = removed;
+	p->roles_changed = changed;
+
+	elog(DEBUG1, "policy: %d intervals, role entries of the previous policy with %d patched, %d minutes a week open to every role",
+		 p->nintervals, patched,
+		 bitmap_count(policy_schedules(p)[0].words));
+
+	return p;
+}
+
+/*
+ * Parse intervals and roles, and build a policy in cxt with extra bytes at
+ * source_off (see build_policy()). Return NULL if there are no intervals.
+ * Errors are raised with policy_parse_error(); work arrays are allocated in
+ * the current memory context.
+ */
+BAPolicy *
+parse_policy(MemoryContext cxt, const char *intervals, const char *roles, Size extra)
+{
+	char	*intervals_str;
+	int		nintervals;
+	int		nroles;
+	const char	*ptr;
+	BAIntervalRole	*parsed;
+
+	intervals_str = trim((char *) intervals);
+
+	/* no intervals (or only whitespaces), no access block */
+	if (intervals_str == NULL)
+		return NULL;
+
+	/* number of intervals */
+	nintervals = count_intervals(intervals_str);
+
+	elog(DEBUG2, "number of intervals: %d", nintervals);
+
+	/* number of roles */
+	nroles = 1;		/* we should have at least one token */
+	for (ptr = roles; ptr != NULL && *ptr != '\0'; ptr++)
+		if (*ptr == ';')
+			nroles++;
+
+	elog(DEBUG2, "number of role groups: %d", nroles);
+
+	/* set of intervals x set of roles mismatch */
+	if (nintervals != nroles)
+		policy_parse_error("number of intervals and exclude_roles elements do not match");
+
+	parsed = (BAIntervalRole *) palloc0(nintervals * sizeof(BAIntervalRole));
+
+	/* parse block_access.intervals and fills variable 'parsed' */
+	parse_options(parsed, nintervals, intervals_str, roles);
+
+	return build_policy(cxt, parsed, nintervals, extra);
+}
+
+/*
+ * Parse intervals, and check that roles has a role group for each of them.
+ * Return them, with no roles, and their number in *nintervals, or NULL if
+ * there are no intervals. Errors are raised as in parse_policy(). This is
+ * where a parallel compilation starts (see block_access.c); the roles are
+ * found with scan_roles().
+ */
+BAIntervalRole *
+parse_policy_intervals(const char *intervals, const char *roles, int *nintervals)
+{
+	char	*intervals_str;
+	BAIntervalRole	*parsed;
+
+	intervals_str = trim((char *) intervals);
+	if (intervals_str == NULL)
+		return NULL;
+
+	*nintervals = count_intervals(intervals_str);
+	if (*nintervals != (roles != NULL ? count_intervals(roles) : 1))
+		policy_parse_error("number of intervals and exclude_roles elements do not match");
+
+	parsed = (BAIntervalRole *) palloc0(*nintervals * sizeof(BAIntervalRole));
+	parse_interval_list(parsed, *nintervals, intervals_str);
+	pfree(intervals_str);
+
+	return parsed;
+}
+
+/*
+ * Bytes needed by policy_flatten()
+ */
+Size
+policy_flat_size(BAPolicy *p)
+{
+	return p->length;
+}
+
+/*
+ * Copy a compiled policy into dst (policy_flat_size(p) bytes). It contains no
+ * pointers, so this is a plain copy. Return the copy.
+ */
+BAPolicy *
+policy_flatten(BAPolicy *p, char *dst)
+{
+	BAPolicy	*flat = (BAPolicy *) dst;
+
+	memcpy(flat, p, p->length);
+	flat->cxt = NULL;
+
+	return flat;
+}
+
+#ifdef FRONTEND
+static void *
+chunk_alloc(Size size, int flags)
+{
+	PolicyChunk	*c;
+
+	c = (PolicyChunk *) ((flags & MCXT_ALLOC_ZERO) ?
+						 pg_malloc0(sizeof(PolicyChunk) + size) :
+						 pg_malloc(sizeof(PolicyChunk) + size));
+	c->size = size;
+	c->prev = &policy_chunks;
+	c->next = policy_chunks.next;
+	c->next->prev = c;
+	policy_chunks.next = c;
+
+	policy_memory += size;
+	policy_memory_max = Max(policy_memory_max, policy_memory);
+
+	return c + 1;
+}
+
+static void *
+chunk_realloc(void *ptr, Size size)
+{
+	PolicyChunk	*c = (PolicyChunk *) ptr - 1;
+	void		*newptr = chunk_alloc(size, 0);
+
+	memcpy(newptr, ptr, Min(c->size, size));
+	chunk_free(ptr);
+
+	return newptr;
+}
+
+static void
+chunk_free(void *ptr)
+{
+	PolicyChunk	*c = (PolicyChunk *) ptr - 1;
+
+	c->prev->next = c->next;
+	c->next->prev = c->prev;
+	policy_memory -= c->size;
+	pg_free(c);
+}
+
+static char *
+chunk_strdup(const char *s)
+{
+	Size	len = strlen(s) + 1;
+
+	return memcpy(chunk_alloc(len, 0), s, len);
+}
+
+/* Most bytes held at once since the last policy_memory_reset() */
+Size
+policy_memory_peak(void)
+{
+	return policy_memory_max;
+}
+
+/* Free everything the parser and the compiler allocated */
+void
+policy_memory_reset(void)
+{
+	while (policy_chunks.next != &policy_chunks)
+		chunk_free(policy_chunks.next + 1);
+
+	policy_memory_max = 0;
+}
+
+void
+policy_report_error(const char *fmt,...)
+{
+	char		message[1024];
+	va_list		args;
+
+	va_start(args, fmt);
+	vsnprintf(message, sizeof(message), fmt, args);
+	va_end(args);
+
+	if (policy_error_hook != NULL)
+		policy_error_hook(message);
+
+	pg_log_error("%s", message);
+	exit(1);
+}
+#endif							/* FRONTEND */
@@ -0,0 +1,332 @@
+/* -------------------------------------------------------------------------
+ *
+ * block_access_policy.h
+ *
+ * Policy compiler and evaluator of block_access.
+ *
+ * The extension and the offline tools (see block_access_replay.c,
+ * block_access_verify.c and block_access_fuzz.c) are built from the same
+ * code. The tools compile it with FRONTEND defined, with the replacements for
+ * elog() and memory contexts below.
+ *
+ * Copyright (c) 2017-2018, Euler Taveira de Oliveira
+ *
+ * IDENTIFICATION
+ *		block_access/block_access_policy.h
+ *
+ * -------------------------------------------------------------------------
+ */
+#ifndef BLOCK_ACCESS_POLICY_H
+#define BLOCK_ACCESS_POLICY_H
+
+#include "block_access_probes.h"
+
+#ifdef FRONTEND
+#define DEBUG2		13
+#define DEBUG1		14
+#define ERROR		21
+
+/*
+ * elog(ERROR) calls policy_error_hook with the message if it is set, and the
+ * hook must not return (the fuzzer longjmps out of it). Otherwise, the message
+ * is reported and the program exits.
+ */
+#define elog(elevel, ...) \
+	do { \
+		if ((elevel) >= ERROR) \
+			policy_report_error(__VA_ARGS__); \
+	} while (0)
+
+extern void (*policy_error_hook) (const char *message);
+extern void policy_report_error(const char *fmt,...) pg_attribute_printf(1, 2);
+
+/*
+ * There are no memory contexts either: what the parser allocates is tracked,
+ * and policy_memory_reset() frees all of it, compiled policies included.
+ */
+typedef void *MemoryContext;
+
+extern Size policy_memory_peak(void);
+extern void policy_memory_reset(void);
+
+#define MemoryContextAllocExtended(cxt, size, flags)	palloc_extended(size, flags)
+#define add_size(s1, s2)		((s1) + (s2))
+#define mul_size(s1, s2)		((s1) * (s2))
+#endif							/* FRONTEND */
+
+/*
+ * Invalid block_access.intervals or exclude_roles. The extension keeps the
+ * message in the policy (see compile_policy()) and raises any other error.
+ */
+#ifdef FRONTEND
+#define policy_parse_error(...)		elog(ERROR, __VA_ARGS__)
+#else
+#define policy_parse_error(...) \
+	ereport(ERROR, \
+			(errcode(ERRCODE_INVALID_PARAMETER_VALUE), \
+			 errmsg_internal(__VA_ARGS__)))
+#endif
+
+typedef struct BATime {
+	int			hour;			/* 0 .. 23 */
+	int			minute;			/* 0 .. 59 */
+} BATime;
+
+/*
+ * This data structure defines an interval (start_time until end_time) per week
+ * day(s) that access will be allowed. It also specifies a set of roles that
+ * are excluded from access block if current date/time is out of the specified
+ * interval.
+ */
+typedef struct BAIntervalRole {
+	int		*wday;		/* sun (0), mon (1), tue (2), wed (3), thu (4), fri (5), sat (6) */
+	int		nwday;
+	BATime	start_time;
+	BATime	end_time;
+
+	int		nroles;
+	char	**roles;
+} BAIntervalRole;
+
+#define BA_MINUTES_PER_DAY		(24 * 60)
+#define BA_MINUTES_PER_WEEK		(7 * BA_MINUTES_PER_DAY)
+#define BA_SCHEDULE_WORDS		((BA_MINUTES_PER_WEEK + 63) / 64)
+
+/*
+ * Weekly schedule: one bit per minute of the week, starting at Sunday 00:00.
+ * A set bit means access is allowed.
+ */
+typedef struct BASchedule {
+	uint64		words[BA_SCHEDULE_WORDS];
+} BASchedule;
+
+/*
+ * Kernels for weekly schedules. There is a portable set and, on x86-64 with
+ * gcc or clang, SSE2 and AVX2 sets; the bitmap_*() functions use the fastest
+ * one the CPU supports, chosen at their first call. scan returns the first
+ * word in [from, to) that is not equal to skip, or to.
+ */
+typedef struct BABitmapKernels {
+	const char	*name;
+	void		(*or_words) (uint64 *dst, const uint64 *src);
+	void		(*and_words) (uint64 *dst, const uint64 *src);
+	void		(*andnot_words) (uint64 *dst, const uint64 *src);
+	int			(*count) (const uint64 *words);
+	int			(*scan) (const uint64 *words, int from, int to, uint64 skip);
+} BABitmapKernels;
+
+extern const BABitmapKernels *const bitmap_kernel_variants[];
+
+/*
+ * Policy compiled from block_access.intervals and block_access.exclude_roles.
+ *
+ * The postmaster compiles the policy at startup, and the first backend that
+ * needs it after a reload that changed those parameters compiles it once for
+ * all of them (see BA_GUC_SLOTS in block_access.c). Backends do not parse
+ * anything at login. If the parameters cannot be parsed, error holds the
+ * message that is reported at each login.
+ *
+ * Evaluation is one hash probe for the role and one bit test: roles that are
+ * excluded on the same week days share a schedule class.
+ *
+ * A policy is one chunk of length bytes: arrays follow the struct and are
+ * referenced by offsets from its start, never by pointers. A copy of it is
+ * usable as is in any process, wherever it is mapped (shared memory under
+ * EXEC_BACKEND, for instance).
+ */
+typedef struct BAPolicy {
+	MemoryContext	cxt;		/* holds this policy, or NULL for a copy */
+	uint64			generation;	/* incremented at each compilation */
+	double			compile_time;	/* seconds */
+	Size			size;		/* bytes allocated in cxt, or mapped */
+	Size			length;		/* bytes of this struct and its arrays */
+	Size			mapped;		/* see policy_seal(); 0 if in cxt */
+
+	int				nintervals;	/* 0 means no access block */
+	int				shape;		/* BAPolicyShape: evaluator to use */
+	int8			day_owner[7];	/* interval that sets each week day, or -1 */
+
+	int				nschedules;
+	Size			schedules_off;	/* BASchedule[]; class 0 is the default */
+	Size			class_days_off;	/* uint8[]: days on which each class is excluded */
+
+	int				nroles;		/* roles listed in exclude_roles */
+	Size			roles_off;		/* Size[]: offsets of role names */
+	Size			role_hash_off;	/* uint32[] */
+	Size			role_class_off;	/* uint8[]: index into schedules */
+	uint32			nslots;		/* power of 2 */
+	Size			slots_off;		/* int32[]: index into roles or -1 */
+
+	Size			error_off;	/* error message, or 0 */
+	Size			source_off;	/* intervals and exclude_roles it was compiled from */
+
+	int				changed_roles;	/* see policy_diff() */
+	uint64			roles_from;	/* generation whose role entries were reused, or 0 */
+	int				roles_added;	/* against roles_from, see rebuild_policy() */
+	int				roles_removed;
+	int				roles_changed;
+	int				workers;	/* background workers that helped compile it */
+} BAPolicy;
+
+/*
+ * Most policies are a single set of windows with a few exclusions, or none.
+ * The compiler classifies each policy and policy_evaluate() uses an evaluator
+ * for its shape. The shape is stored instead of a function pointer, so that a
+ * copy of the policy is usable in another process.
+ */
+typedef enum BAPolicyShape {
+	BA_SHAPE_EMPTY = 0,			/* no intervals */
+	BA_SHAPE_TIME,				/* no exclude_roles: one bit test */
+	BA_SHAPE_SMALL,				/* up to BA_SMALL_ROLES roles: no hashing */
+	BA_SHAPE_FULL
+} BAPolicyShape;
+
+#define BA_SMALL_ROLES			4
+
+/* Schedule classes of a policy: at most one per set of week days */
+#define BA_MAX_SCHEDULES		(1 << 7)
+
+extern const char *const policy_shape_names[];
+
+#define BA_POLICY_ARRAY(p, type, off)	((type *) ((char *) (p) + (p)->off))
+#define policy_schedules(p)		BA_POLICY_ARRAY(p, BASchedule, schedules_off)
+#define policy_class_days(p)	BA_POLICY_ARRAY(p, uint8, class_days_off)
+#define policy_role_hash(p)		BA_POLICY_ARRAY(p, uint32, role_hash_off)
+#define policy_role_classes(p)	BA_POLICY_ARRAY(p, uint8, role_class_off)
+#define policy_role_slots(p)	BA_POLICY_ARRAY(p, int32, slots_off)
+#define policy_role(p, r)		((char *) (p) + BA_POLICY_ARRAY(p, Size, roles_off)[r])
+#define policy_error(p)			((p)->error_off != 0 ? (char *) (p) + (p)->error_off : NULL)
+#define policy_intervals(p)		((char *) (p) + (p)->source_off)
+#define policy_exclude_roles(p)	(policy_intervals(p) + strlen(policy_intervals(p)) + 1)
+extern void parse_options(BAIntervalRole *ir, int n, const char *intervals, const char *roles);
+extern BAPolicy *build_policy(MemoryContext cxt, BAIntervalRole *intervals, int nintervals, Size extra);
+extern BAPolicy *layout_policy(MemoryContext cxt, BAIntervalRole *intervals, int nintervals,
+							   int nroles, char **roles, uint32 *role_hash, uint8 *role_days,
+							   uint32 nslots, Size names, Size extra);
+extern uint32 policy_role_slot_count(int maxroles);
+extern void policy_group_days(BAIntervalRole *intervals, int nintervals, uint8 *days);
+extern BAIntervalRole *parse_policy_intervals(const char *intervals, const char *roles, int *nintervals);
+extern int count_role_items(const char *s, Size from, Size to);
+extern int scan_roles(const char *s, Size from, Size to, int group, const uint8 *group_days,
+					  uint32 *off, uint32 *len, uint32 *hash, uint8 *days);
+extern BAPolicy *parse_policy(MemoryContext cxt, const char *intervals, const char *roles, Size extra);
+extern BAPolicy *rebuild_policy(MemoryContext cxt, BAPolicy *oldp, const char *oldroles,
+								const char *intervals, const char *roles, Size extra);
+extern BAPolicy *policy_alloc(MemoryContext cxt, int nschedules, int nroles, uint32 nslots, Size extra);
+extern char *policy_end(BAPolicy *p);
+extern Size policy_flat_size(BAPolicy *p);
+extern BAPolicy *policy_flatten(BAPolicy *p, char *dst);
+extern bool bitmap_kernels_supported(const BABitmapKernels *k);
+extern const BABitmapKernels *bitmap_current_kernels(void);
+extern void bitmap_use_kernels(const BABitmapKernels *k);
+extern void bitmap_or(uint64 *dst, const uint64 *src);
+extern void bitmap_and(uint64 *dst, const uint64 *src);
+extern void bitmap_andnot(uint64 *dst, const uint64 *src);
+extern int bitmap_count(const uint64 *words);
+extern int bitmap_next(const uint64 *words, int bit);
+extern int bitmap_next_clear(const uint64 *words, int bit);
+extern int policy_find_role(BAPolicy *p, const char *role);
+extern int policy_role_class(BAPolicy *p, const char *role);
+extern void policy_diff(BAPolicy *oldp, BAPolicy *newp, int *added, int *removed, int *changed);
+extern int policy_next_allowed(BAPolicy *p, const char *role, int minute);
+
+static inline bool
+bitmap_test(const uint64 *words, int bit)
+{
+	return (words[bit / 64] & (UINT64CONST(1) << (bit % 64))) != 0;
+}
+
+static inline int
+evaluate_empty(BAPolicy *p, const char *role, int minute, bool *exempted)
+{
+	*exempted = false;
+
+	return BA_VERDICT_SKIPPED;
+}
+
+static inline int
+evaluate_time(BAPolicy *p, const char *role, int minute, bool *exempted)
+{
+	*exempted = false;
+
+	return bitmap_test(policy_schedules(p)[0].words, minute) ?
+		BA_VERDICT_ALLOWED : BA_VERDICT_DENIED;
+}
+
+static inline int
+evaluate_small(BAPolicy *p, const char *role, int minute, bool *exempted)
+{
+	int		r;
+
+	*exempted = false;
+
+	if (bitmap_test(policy_schedules(p)[0].words, minute))
+		return BA_VERDICT_ALLOWED;
+
+	/* comparing a few names is cheaper than hashing one */
+	for (r = 0; r < p->nroles; r++)
+	{
+		const char *name = policy_role(p, r);
+
+		if (name[0] == role[0] && strcmp(name, role) == 0)
+		{
+			int		cls = policy_role_classes(p)[r];
+
+			if (cls != 0 && bitmap_test(policy_schedules(p)[cls].words, minute))
+			{
+				*exempted = true;
+				return BA_VERDICT_ALLOWED;
+			}
+			break;
+		}
+	}
+
+	return BA_VERDICT_DENIED;
+}
+
+static inline int
+evaluate_full(BAPolicy *p, const char *role, int minute, bool *exempted)
+{
+	int		cls;
+
+	*exempted = false;
+
+	if (bitmap_test(policy_schedules(p)[0].words, minute))
+		return BA_VERDICT_ALLOWED;
+
+	cls = policy_role_class(p, role);
+	if (cls != 0 && bitmap_test(policy_schedules(p)[cls].words, minute))
+	{
+		*exempted = true;
+		return BA_VERDICT_ALLOWED;
+	}
+
+	return BA_VERDICT_DENIED;
+}
+
+/*
+ * Evaluate the policy for role at minute of the week (0 = Sunday 00:00).
+ * exempted is set if access is allowed only because of exclude_roles.
+ *
+ * A switch rather than a table of function pointers: the evaluators are
+ * inlined and there is no indirect call.
+ */
+static inline int
+policy_evaluate(BAPolicy *p, const char *role, int minute, bool *exempted)
+{
+	switch ((BAPolicyShape) p->shape)
+	{
+		case BA_SHAPE_EMPTY:
+			return evaluate_empty(p, role, minute, exempted);
+		case BA_SHAPE_TIME:
+			return evaluate_time(p, role, minute, exempted);
+		case BA_SHAPE_SMALL:
+			return evaluate_small(p, role, minute, exempted);
+		case BA_SHAPE_FULL:
+			break;
+	}
+
+	return evaluate_full(p, role, minute, exempted);
+}
+
+#endif							/* BLOCK_ACCESS_POLICY_H */
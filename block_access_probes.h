@@ -0,0 +1,63 @@
+/* -------------------------------------------------------------------------
+ *
+ * block_access_probes.h
+ *
+ * Static (USDT) probes for block_access.
+ *
+ * PostgreSQL defines ENABLE_DTRACE in pg_config.h when the server was built
+ * with --enable-dtrace. In that case we emit our own probes through
+ * <sys/sdt.h> (SystemTap on Linux, DTrace elsewhere) under the provider name
+ * "block_access". A probe site is a single nop until a tracer attaches to it.
+ * Otherwise, probes expand to nothing.
+ *
+ * Probe arguments:
+ *
+ *	check__start(role, database)
+ *	policy__lookup(role, database, nintervals)
+ *	decision(role, database, verdict)
+ *	check__done(role, database, verdict, elapsed_ns)
+ *
+ * verdict is 1 (allowed), 0 (denied) or -1 (not evaluated, e.g. failed
+ * authentication or no intervals).
+ *
+ * Copyright (c) 2017-2018, Euler Taveira de Oliveira
+ *
+ * IDENTIFICATION
+ *		block_access/block_access_probes.h
+ *
+ * -------------------------------------------------------------------------
+ */
+#ifndef BLOCK_ACCESS_PROBES_H
+#define BLOCK_ACCESS_PROBES_H
+
+#define BA_VERDICT_DENIED		0
+#define BA_VERDICT_ALLOWED		1
+#define BA_VERDICT_SKIPPED		(-1)
+
+#ifdef ENABLE_DTRACE
+
+#include <sys/sdt.h>
+
+#define TRACE_BLOCK_ACCESS_CHECK_START(role, db) \
+	DTRACE_PROBE2(block_access, check__start, role, db)
+#define TRACE_BLOCK_ACCESS_POLICY_LOOKUP(role, db, n) \
+	DTRACE_PROBE3(block_access, policy__lookup, role, db, n)
+#define TRACE_BLOCK_ACCESS_DECISION(role, db, verdict) \
+	DTRACE_PROBE3(block_access, decision, role, db, verdict)
+#define TRACE_BLOCK_ACCESS_CHECK_DONE(role, db, verdict, elapsed) \
+	DTRACE_PROBE4(block_access, check__done, role, db, verdict, elapsed)
+
+#else							/* !ENABLE_DTRACE */
+
+#define TRACE_BLOCK_ACCESS_CHECK_START(role, db) \
+	do {} while (0)
+#define TRACE_BLOCK_ACCESS_POLICY_LOOKUP(role, db, n) \
+	do {} while (0)
+#define TRACE_BLOCK_ACCESS_DECISION(role, db, verdict) \
+	do {} while (0)
+#define TRACE_BLOCK_ACCESS_CHECK_DONE(role, db, verdict, elapsed) \
+	do {} while (0)
+
+#endif							/* ENABLE_DTRACE */
+
+#endif							/* BLOCK_ACCESS_PROBES_H */
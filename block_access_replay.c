@@ -0,0 +1,538 @@
+/* -------------------------------------------------------------------------
+ *
+ * block_access_replay.c
+ *
+ * Replay connections through a policy, offline.
+ *
+ * Records (timestamp, role, database, address) are read from a CSV file, one
+ * per line, and the policy is evaluated for each of them as the
+ * authentication hook would. The result is the number of connections that
+ * would be allowed and denied per role, and the throughput.
+ *
+ * Only the policy is evaluated: temporary grants, block_access_enforce() and
+ * named policies are not. The database and the address are not part of a
+ * policy and are ignored.
+ *
+ * Copyright (c) 2017-2018, Euler Taveira de Oliveira
+ *
+ * IDENTIFICATION
+ *		block_access/block_access_replay.c
+ *
+ * -------------------------------------------------------------------------
+ */
+#include "postgres_fe.h"
+
+#include <limits.h>
+#include <time.h>
+
+#include "common/hashfn.h"
+#include "common/logging.h"
+#include "getopt_long.h"
+#include "portability/instr_time.h"
+
+#include "block_access_policy.h"
+
+#define REPLAY_LINE_SIZE		8192
+#define REPLAY_FIELDS			4	/* timestamp, role, database, address */
+#define REPLAY_MAX_WARNINGS		10	/* invalid records reported */
+
+/* Decisions per role. Roles are kept in an open addressing table. */
+typedef struct ReplayRole {
+	char		*role;			/* or NULL if the slot is free */
+	uint32		hash;
+	uint64		allowed;
+	uint64		denied;
+	uint64		exempted;		/* allowed only because of exclude_roles */
+} ReplayRole;
+
+static const char *progname;
+
+static ReplayRole	*roles = NULL;
+static uint32		nslots = 0;		/* power of 2 */
+static uint32		nroles = 0;
+
+static void usage(void);
+static int split_record(char *line, char **fields, int nfields);
+static int week_day(int year, int month, int day);
+static int64 days_from_civil(int year, int month, int day);
+static int parse_offset(const char *s);
+static int parse_minute(const char *ts);
+static ReplayRole *lookup_role(const char *role);
+static void grow_roles(void);
+static int compare_roles(const void *a, const void *b);
+static void print_field(const char *s);
+
+static void
+usage(void)
+{
+	printf("%s replays connections through a block_access policy.\n\n", progname);
+	printf("Usage:\n");
+	printf("  %s [OPTION]... [FILE]\n\n", progname);
+	printf("Options:\n");
+	printf("  -i, --intervals=INTERVALS     value of block_access.intervals\n");
+	printf("  -e, --exclude-roles=ROLES     value of block_access.exclude_roles\n");
+	printf("  -z, --timezone=TZ             time zone of the server (default: TZ)\n");
+	printf("  -V, --version                 output version information, then exit\n");
+	printf("  -?, --help                    show this help, then exit\n\n");
+	printf("Each line of FILE (standard input if omitted or \"-\") is a CSV record:\n");
+	printf("timestamp, role, database, address. Timestamps with an offset (Z, +02, -05:30)\n"
+		   "are converted to the server time zone; others are in it already.\n");
+	printf("Counts per role are written to standard output, throughput to standard error.\n");
+}
+
+/*
+ * Split a CSV record in place. Quoted fields can contain commas and doubled
+ * quotes, not line breaks. Store the first nfields fields and return the
+ * number of fields, or -1 if a quote is not closed.
+ */
+static int
+split_record(char *line, char **fields, int nfields)
+{
+	char	*src = line;
+	int		n = 0;
+
+	for (;;)
+	{
+		char	*field = src;
+		char	*dst = src;
+
+		if (*src == '"')
+		{
+			for (src++;; src++)
+			{
+				if (*src == '\0')
+					return -1;
+				if (*src == '"')
+				{
+					if (src[1] != '"')
+					{
+						src++;
+						break;
+					}
+					src++;
+				}
+				*dst++ = *src;
+			}
+		}
+
+		while (*src != ',' && *src != '\0' && *src != '\n' && *src != '\r')
+			*dst++ = *src++;
+
+		if (n < nfields)
+			fields[n] = field;
+		n++;
+
+		if (*src != ',')
+		{
+			*dst = '\0';
+			break;
+		}
+		*dst = '\0';
+		src++;
+	}
+
+	return n;
+}
+
+/*
+ * Day of the week of a date of the Gregorian calendar: sun (0) .. sat (6)
+ */
+static int
+week_day(int year, int month, int day)
+{
+	static const int	offset[] = {0, 3, 2, 5, 0, 3, 5, 1, 4, 6, 2, 4};
+
+	if (month < 3)
+		year--;
+
+	return (year + year / 4 - year / 100 + year / 400 + offset[month - 1] + day) % 7;
+}
+
+/*
+ * Days since 1970-01-01 of a date of the Gregorian calendar
+ */
+static int64
+days_from_civil(int year, int month, int day)
+{
+	int64	era;
+	int		yoe;
+	int		doy;
+
+	if (month < 3)
+		year--;
+	era = (year >= 0 ? year : year - 399) / 400;
+	yoe = year - era * 400;
+	doy = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+
+	return era * 146097 + yoe * 365 + yoe / 4 - yoe / 100 + doy - 719468;
+}
+
+#define DIGIT(c)			((unsigned) ((c) - '0') < 10)
+#define NUM2(s)				(((s)[0] - '0') * 10 + (s)[1] - '0')
+
+/*
+ * Offset from UTC in seconds of a time zone such as Z, UTC, +02, -0530 or
+ * +05:30, or INT_MIN if s is not one
+ */
+static int
+parse_offset(const char *s)
+{
+	int		sign;
+	int		hours;
+	int		minutes = 0;
+
+	if (strcmp(s, "Z") == 0 || strcmp(s, "UTC") == 0 || strcmp(s, "GMT") == 0)
+		return 0;
+	if ((s[0] != '+' && s[0] != '-') || !DIGIT(s[1]) || !DIGIT(s[2]))
+		return INT_MIN;
+	sign = s[0] == '-' ? -1 : 1;
+	hours = NUM2(s + 1);
+	s += 3;
+
+	if (*s == ':')
+	{
+		if (!DIGIT(s[1]) || !DIGIT(s[2]))
+			return INT_MIN;
+		s++;
+	}
+	if (DIGIT(s[0]) && DIGIT(s[1]))
+	{
+		minutes = NUM2(s);
+		s += 2;
+	}
+	if (*s != '\0' || hours > 15 || minutes > 59)
+		return INT_MIN;
+
+	return sign * (hours * 60 + minutes) * 60;
+}
+
+/*
+ * Minute of the week (0 = Sunday 00:00) of a timestamp such as
+ * 2024-03-04 08:15:00. Date and time can also be separated by a T, and
+ * seconds and fractions of seconds are ignored. A timestamp with an offset
+ * from UTC (2024-03-04T08:15:00+01, or 08:15:00.123 UTC as in csvlog) is
+ * converted to the local time of the time zone of the server (see
+ * --timezone). One without an offset, or with the abbreviation of that time
+ * zone, is a local time already. Any other time zone name cannot be
+ * resolved: return -1, as if ts were not a timestamp.
+ *
+ * Records are usually sorted, so the week day of the last date is kept.
+ */
+static int
+parse_minute(const char *ts)
+{
+	static char	last_date[10];
+	static int	last_wday = -1;
+	const char *rest;
+	int			month;
+	int			day;
+	int			hour;
+	int			minute;
+
+	if (!DIGIT(ts[0]) || !DIGIT(ts[1]) || !DIGIT(ts[2]) || !DIGIT(ts[3]) ||
+		ts[4] != '-' || !DIGIT(ts[5]) || !DIGIT(ts[6]) ||
+		ts[7] != '-' || !DIGIT(ts[8]) || !DIGIT(ts[9]) ||
+		(ts[10] != ' ' && ts[10] != 'T') ||
+		!DIGIT(ts[11]) || !DIGIT(ts[12]) || ts[13] != ':' ||
+		!DIGIT(ts[14]) || !DIGIT(ts[15]))
+		return -1;
+
+	month = NUM2(ts + 5);
+	day = NUM2(ts + 8);
+	hour = NUM2(ts + 11);
+	minute = NUM2(ts + 14);
+	if (month < 1 || month > 12 || day < 1 || day > 31 || hour > 23 || minute > 59)
+		return -1;
+
+	/* seconds and their fraction */
+	rest = ts + 16;
+	if (rest[0] == ':' && DIGIT(rest[1]) && DIGIT(rest[2]))
+	{
+		rest += 3;
+		if (*rest == '.')
+			for (rest++; DIGIT(*rest); rest++)
+				;
+	}
+	if (*rest == ' ')
+		rest++;
+
+	if (*rest != '\0' && strcmp(rest, tzname[0]) != 0 && strcmp(rest, tzname[1]) != 0)
+	{
+		int			offset = parse_offset(rest);
+		time_t		t;
+		struct tm	tm;
+
+		if (offset == INT_MIN)
+			return -1;
+
+		t = (time_t) (days_from_civil(NUM2(ts) * 100 + NUM2(ts + 2), month, day) * 86400 +
+					  hour * 3600 + minute * 60 - offset);
+		if (localtime_r(&t, &tm) == NULL)
+			return -1;
+
+		return tm.tm_wday * BA_MINUTES_PER_DAY + tm.tm_hour * 60 + tm.tm_min;
+	}
+
+	if (last_wday < 0 || memcmp(last_date, ts, sizeof(last_date)) != 0)
+	{
+		memcpy(last_date, ts, sizeof(last_date));
+		last_wday = week_day(NUM2(ts) * 100 + NUM2(ts + 2), month, day);
+	}
+
+	return last_wday * BA_MINUTES_PER_DAY + hour * 60 + minute;
+}
+
+/*
+ * Entry of role, added if it is not there yet
+ */
+static ReplayRole *
+lookup_role(const char *role)
+{
+	uint32		h = hash_bytes((const unsigned char *) role, strlen(role));
+	uint32		mask;
+	uint32		i;
+
+	/* at most half full */
+	if (nroles >= nslots / 2)
+		grow_roles();
+
+	mask = nslots - 1;
+	for (i = h & mask; roles[i].role != NULL; i = (i + 1) & mask)
+	{
+		if (roles[i].hash == h && strcmp(roles[i].role, role) == 0)
+			return &roles[i];
+	}
+
+	roles[i].role = pg_strdup(role);
+	roles[i].hash = h;
+	nroles++;
+
+	return &roles[i];
+}
+
+static void
+grow_roles(void)
+{
+	ReplayRole	*old = roles;
+	uint32		oldslots = nslots;
+	uint32		mask;
+	uint32		i;
+
+	nslots = nslots == 0 ? 1024 : nslots * 2;
+	roles = (ReplayRole *) pg_malloc0(nslots * sizeof(ReplayRole));
+	mask = nslots - 1;
+
+	for (i = 0; i < oldslots; i++)
+	{
+		uint32		s;
+
+		if (old[i].role == NULL)
+			continue;
+
+		for (s = old[i].hash & mask; roles[s].role != NULL; s = (s + 1) & mask)
+			;
+		roles[s] = old[i];
+	}
+
+	if (old != NULL)
+		pg_free(old);
+}
+
+static int
+compare_roles(const void *a, const void *b)
+{
+	return strcmp(((const ReplayRole *) a)->role, ((const ReplayRole *) b)->role);
+}
+
+/* Write s as a CSV field, quoted if needed */
+static void
+print_field(const char *s)
+{
+	if (strpbrk(s, ",\"\r\n") == NULL)
+	{
+		fputs(s, stdout);
+		return;
+	}
+
+	putchar('"');
+	for (; *s != '\0'; s++)
+	{
+		if (*s == '"')
+			putchar('"');
+		putchar(*s);
+	}
+	putchar('"');
+}
+
+int
+main(int argc, char **argv)
+{
+	static struct option long_options[] = {
+		{"intervals", required_argument, NULL, 'i'},
+		{"exclude-roles", required_argument, NULL, 'e'},
+		{"timezone", required_argument, NULL, 'z'},
+		{"version", no_argument, NULL, 'V'},
+		{"help", no_argument, NULL, '?'},
+		{NULL, 0, NULL, 0}
+	};
+
+	char		*intervals = NULL;
+	char		*exclude = NULL;
+	const char	*filename = NULL;
+	FILE		*fp;
+	BAPolicy	*p;
+	char		line[REPLAY_LINE_SIZE];
+	char		*fields[REPLAY_FIELDS];
+	uint64		lineno = 0;
+	uint64		nrecords = 0;
+	uint64		ninvalid = 0;
+	uint64		nallowed = 0;
+	uint64		ndenied = 0;
+	instr_time	start;
+	instr_time	duration;
+	double		elapsed;
+	int			c;
+	uint32		i;
+	uint32		n;
+
+	pg_logging_init(argv[0]);
+	progname = get_progname(argv[0]);
+
+	if (argc > 1)
+	{
+		if (strcmp(argv[1], "--help") == 0 || strcmp(argv[1], "-?") == 0)
+		{
+			usage();
+			exit(0);
+		}
+		if (strcmp(argv[1], "--version") == 0 || strcmp(argv[1], "-V") == 0)
+		{
+			puts("block_access_replay (PostgreSQL) " PG_VERSION);
+			exit(0);
+		}
+	}
+
+	while ((c = getopt_long(argc, argv, "i:e:z:V?", long_options, NULL)) != -1)
+	{
+		switch (c)
+		{
+			case 'i':
+				intervals = pg_strdup(optarg);
+				break;
+			case 'e':
+				exclude = pg_strdup(optarg);
+				break;
+			case 'z':
+				setenv("TZ", optarg, 1);
+				break;
+			default:
+				fprintf(stderr, "Try \"%s --help\" for more information.\n", progname);
+				exit(1);
+		}
+	}
+
+	if (optind < argc)
+		filename = argv[optind++];
+
+	if (optind < argc)
+	{
+		pg_log_error("too many command-line arguments (first is \"%s\")", argv[optind]);
+		fprintf(stderr, "Try \"%s --help\" for more information.\n", progname);
+		exit(1);
+	}
+
+	/* the time zone timestamps with an offset are converted to */
+	tzset();
+
+	/* a parse error is reported and exits */
+	p = parse_policy(NULL, intervals, exclude, 0);
+	if (p == NULL)
+		pg_log_warning("no intervals: every connection is allowed");
+
+	if (filename == NULL || strcmp(filename, "-") == 0)
+		fp = stdin;
+	else if ((fp = fopen(filename, "r")) == NULL)
+	{
+		pg_log_error("could not open file \"%s\": %m", filename);
+		exit(1);
+	}
+	setvbuf(fp, NULL, _IOFBF, 1024 * 1024);
+
+	INSTR_TIME_SET_CURRENT(start);
+
+	while (fgets(line, sizeof(line), fp) != NULL)
+	{
+		ReplayRole	*r;
+		int			minute;
+		int			verdict;
+		bool		exempted = false;
+
+		lineno++;
+
+		if (strchr(line, '\n') == NULL && !feof(fp))
+		{
+			pg_log_error("line " UINT64_FORMAT " is longer than %d bytes", lineno, REPLAY_LINE_SIZE - 1);
+			exit(1);
+		}
+
+		if (split_record(line, fields, REPLAY_FIELDS) < 2 ||
+			(minute = parse_minute(fields[0])) < 0 ||
+			fields[1][0] == '\0')
+		{
+			/* the first line can be a header */
+			if (lineno > 1 && ++ninvalid <= REPLAY_MAX_WARNINGS)
+				pg_log_warning("line " UINT64_FORMAT ": invalid record", lineno);
+			continue;
+		}
+
+		r = lookup_role(fields[1]);
+		verdict = p != NULL ? policy_evaluate(p, fields[1], minute, &exempted) : BA_VERDICT_SKIPPED;
+
+		if (verdict == BA_VERDICT_DENIED)
+			r->denied++;
+		else
+		{
+			r->allowed++;
+			if (exempted)
+				r->exempted++;
+		}
+		nrecords++;
+	}
+
+	if (ferror(fp))
+	{
+		pg_log_error("could not read file \"%s\": %m", filename ? filename : "stdin");
+		exit(1);
+	}
+
+	INSTR_TIME_SET_CURRENT(duration);
+	INSTR_TIME_SUBTRACT(duration, start);
+	elapsed = INSTR_TIME_GET_DOUBLE(duration);
+
+	/* roles in name order */
+	for (i = 0, n = 0; i < nslots; i++)
+		if (roles[i].role != NULL)
+			roles[n++] = roles[i];
+	if (n > 0)
+		qsort(roles, n, sizeof(ReplayRole), compare_roles);
+
+	printf("role,allowed,denied,exempted\n");
+	for (i = 0; i < n; i++)
+	{
+		print_field(roles[i].role);
+		printf("," UINT64_FORMAT "," UINT64_FORMAT "," UINT64_FORMAT "\n",
+			   roles[i].allowed, roles[i].denied, roles[i].exempted);
+		nallowed += roles[i].allowed;
+		ndenied += roles[i].denied;
+	}
+
+	fprintf(stderr, "%s: " UINT64_FORMAT " records, %u roles in %.3f s (%.0f records/s): "
+			UINT64_FORMAT " allowed, " UINT64_FORMAT " denied, " UINT64_FORMAT " invalid\n",
+			progname, nrecords, n, elapsed, elapsed > 0 ? nrecords / elapsed : 0.0,
+			nallowed, ndenied, ninvalid);
+
+	if (fp != stdin)
+		fclose(fp);
+
+	return 0;
+}
@@ -0,0 +1,877 @@
+/* -------------------------------------------------------------------------
+ *
+ * block_access_stress.c
+ *
+ * Switch policies while clients keep logging in, and check every login.
+ *
+ * Client threads log in as one of four roles, over and over, while the main
+ * thread switches between two policies that block everyone at any time of
+ * the week, one excluding ba_stress_even and the other ba_stress_odd. Both
+ * exclude ba_stress_both and neither excludes ba_stress_none. Policies are
+ * switched with block_access_activate() or by rewriting
+ * block_access.exclude_roles and reloading the configuration (SIGHUP).
+ *
+ * Each login must be decided by one of the policies that were active while
+ * it lasted: if no switch overlapped it, by the active one. A login that is
+ * refused for any other reason is an error. Login times near a switch are
+ * reported apart from the others, to see how much a switch delays logins.
+ *
+ * The configuration it changes is saved first and put back at the end, also
+ * when the tool exits on an error or is interrupted (SIGINT, SIGTERM).
+ *
+ * Copyright (c) 2017-2018, Euler Taveira de Oliveira
+ *
+ * IDENTIFICATION
+ *		block_access/block_access_stress.c
+ *
+ * -------------------------------------------------------------------------
+ */
+#include "postgres_fe.h"
+
+#include <pthread.h>
+#include <signal.h>
+
+#include "common/logging.h"
+#include "getopt_long.h"
+#include "libpq-fe.h"
+#include "portability/instr_time.h"
+#include "pqexpbuffer.h"
+
+#define STRESS_NROLES			4
+#define STRESS_MAX_WARNINGS		10		/* errors and inconsistencies reported */
+#define STRESS_RELOAD_TIMEOUT	10000	/* ms to wait for a reload */
+
+/* block every minute of the week: each one is outside 00:01-00:00 */
+#define STRESS_INTERVALS		"sun, mon, tue, wed, thu, fri, sat - 00:01-00:00"
+
+#define STRESS_DENIED_MESSAGE	"outside permitted date and time"
+
+typedef enum StressRole {
+	STRESS_ROLE_BOTH = 0,		/* excluded by both policies */
+	STRESS_ROLE_EVEN,			/* excluded by even generations */
+	STRESS_ROLE_ODD,			/* excluded by odd generations */
+	STRESS_ROLE_NONE			/* never excluded */
+} StressRole;
+
+typedef enum StressMode {
+	STRESS_MODE_NAMED,			/* block_access_activate() */
+	STRESS_MODE_GUC				/* ALTER SYSTEM and pg_reload_conf() */
+} StressMode;
+
+/* A login: when it started and how long it took, in ms since the start */
+typedef struct StressLogin {
+	double		start;
+	double		latency;
+} StressLogin;
+
+/* A switch, from the start of the request until it is in effect */
+typedef struct StressSwitch {
+	double		start;
+	double		end;
+} StressSwitch;
+
+typedef struct StressThread {
+	pthread_t	thread;
+	uint64		prng_state;
+	StressLogin	*logins;
+	int			nlogins;
+	int			maxlogins;
+	uint64		allowed;
+	uint64		denied;
+	uint64		overlapped;		/* a switch happened during the login */
+	uint64		inconsistent;
+	uint64		errors;
+} StressThread;
+
+static const char *progname;
+
+static const char *const stress_roles[STRESS_NROLES] = {
+	"ba_stress_both", "ba_stress_even", "ba_stress_odd", "ba_stress_none"
+};
+
+static const char *connstr = "";
+static StressMode mode = STRESS_MODE_NAMED;
+static char *exclude_roles[2];	/* by generation parity */
+
+static instr_time	start_time;
+
+/*
+ * Generation n is the policy in effect after n switches. switches_started is
+ * incremented before a switch is requested and switches_done once it is in
+ * effect: a login that starts after that must not see an older generation.
+ */
+static pthread_mutex_t switch_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64 switches_started = 0;
+static uint64 switches_done = 0;
+static volatile bool stop = false;
+
+static pthread_mutex_t report_lock = PTHREAD_MUTEX_INITIALIZER;
+static int	nwarnings = 0;
+
+/* set by SIGINT and SIGTERM: stop switching, and put everything back */
+static volatile sig_atomic_t interrupted = false;
+
+/*
+ * What teardown() puts back: the policy that was active (named mode), or the
+ * values of block_access.intervals and exclude_roles set by ALTER SYSTEM, or
+ * NULL if they were not set (guc mode).
+ */
+static const char *const stress_settings[2] = {
+	"block_access.intervals", "block_access.exclude_roles"
+};
+static char *saved_active = NULL;
+static char *saved_settings[2] = {NULL, NULL};
+static bool needs_teardown = false;
+
+static void usage(void);
+static double elapsed_ms(void);
+static void read_switches(uint64 *started, uint64 *done);
+static bool role_allowed(int role, uint64 generation);
+static void report(const char *fmt,...) pg_attribute_printf(1, 2);
+static void *run_client(void *arg);
+static PGresult *run_command(PGconn *conn, const char *sql, ExecStatusType expected);
+static bool try_command(PGconn *conn, const char *sql, ExecStatusType expected);
+static void save_configuration(PGconn *conn);
+static void setup(PGconn *conn);
+static bool teardown(PGconn *conn);
+static void teardown_at_exit(void);
+static void handle_signal(int signum);
+static void switch_policy(PGconn *conn, uint64 generation);
+static void wait_for_reload(const char *expected);
+static int compare_latencies(const void *a, const void *b);
+static void print_latencies(const char *label, double *latencies, int n);
+
+static void
+usage(void)
+{
+	printf("%s switches block_access policies while clients keep logging in.\n\n", progname);
+	printf("Usage:\n");
+	printf("  %s [OPTION]...\n\n", progname);
+	printf("Options:\n");
+	printf("  -d, --dbname=CONNSTR          connection string of a superuser (default: libpq defaults)\n");
+	printf("  -c, --clients=NUM             number of clients logging in (default: 16)\n");
+	printf("  -T, --time=SECONDS            duration of the test (default: 30)\n");
+	printf("  -i, --interval=MS             time between switches (default: 500)\n");
+	printf("  -m, --mode=named|guc          switch named policies, or exclude_roles and reload\n");
+	printf("                                (default: named)\n");
+	printf("  -w, --window=MS               logins this close to a switch are reported apart\n");
+	printf("                                (default: 100)\n");
+	printf("  -V, --version                 output version information, then exit\n");
+	printf("  -?, --help                    show this help, then exit\n\n");
+	printf("Roles ba_stress_both, ba_stress_even, ba_stress_odd and ba_stress_none are\n");
+	printf("created and dropped; they must be able to log in without a password. The\n");
+	printf("active policy, or block_access.intervals and exclude_roles, are put back at\n");
+	printf("the end, also on errors and interrupts.\n");
+	printf("The exit status is 1 if any login was inconsistent or failed, if the\n");
+	printf("configuration could not be put back, or if the test was interrupted.\n");
+}
+
+static double
+elapsed_ms(void)
+{
+	instr_time	now;
+
+	INSTR_TIME_SET_CURRENT(now);
+	INSTR_TIME_SUBTRACT(now, start_time);
+
+	return INSTR_TIME_GET_MILLISEC(now);
+}
+
+static void
+read_switches(uint64 *started, uint64 *done)
+{
+	pthread_mutex_lock(&switch_lock);
+	if (started != NULL)
+		*started = switches_started;
+	if (done != NULL)
+		*done = switches_done;
+	pthread_mutex_unlock(&switch_lock);
+}
+
+/* Is role let in by generation? */
+static bool
+role_allowed(int role, uint64 generation)
+{
+	switch (role)
+	{
+		case STRESS_ROLE_BOTH:
+			return true;
+		case STRESS_ROLE_EVEN:
+			return generation % 2 == 0;
+		case STRESS_ROLE_ODD:
+			return generation % 2 == 1;
+		default:
+			return false;
+	}
+}
+
+/* Report the first errors of all threads only */
+static void
+report(const char *fmt,...)
+{
+	va_list		args;
+
+	pthread_mutex_lock(&report_lock);
+	if (nwarnings++ < STRESS_MAX_WARNINGS)
+	{
+		va_start(args, fmt);
+		fprintf(stderr, "%s: ", progname);
+		vfprintf(stderr, fmt, args);
+		fprintf(stderr, "\n");
+		va_end(args);
+	}
+	pthread_mutex_unlock(&report_lock);
+}
+
+/*
+ * Log in and out until told to stop. A login is checked against the
+ * generations that could have decided it: the one in effect when it started
+ * and the ones switched to until it ended.
+ */
+static void *
+run_client(void *arg)
+{
+	StressThread *t = (StressThread *) arg;
+	const char *keywords[] = {"dbname", "user", "fallback_application_name", NULL};
+	const char *values[] = {connstr, NULL, progname, NULL};
+
+	while (!stop)
+	{
+		PGconn	   *conn;
+		int			role;
+		uint64		from;
+		uint64		to;
+		uint64		g;
+		bool		allowed;
+		bool		consistent = false;
+		double		start;
+		double		latency;
+
+		/* xorshift64*, as in block_access_verify */
+		t->prng_state ^= t->prng_state >> 12;
+		t->prng_state ^= t->prng_state << 25;
+		t->prng_state ^= t->prng_state >> 27;
+		role = ((t->prng_state * UINT64CONST(2685821657736338717)) >> 32) % STRESS_NROLES;
+		values[1] = stress_roles[role];
+
+		read_switches(NULL, &from);
+		start = elapsed_ms();
+		conn = PQconnectdbParams(keywords, values, 1);
+		latency = elapsed_ms() - start;
+		read_switches(&to, NULL);
+
+		allowed = (PQstatus(conn) == CONNECTION_OK);
+
+		if (!allowed && strstr(PQerrorMessage(conn), STRESS_DENIED_MESSAGE) == NULL)
+		{
+			t->errors++;
+			report("login of \"%s\" failed: %s", stress_roles[role], PQerrorMessage(conn));
+			PQfinish(conn);
+			continue;
+		}
+
+		/* two generations in a row cover both parities */
+		for (g = from; g <= to && g <= from + 1; g++)
+			if (role_allowed(role, g) == allowed)
+				consistent = true;
+
+		if (!consistent)
+		{
+			t->inconsistent++;
+			if (to == from)
+				report("login of \"%s\" at %.3f ms was %s, but generation " UINT64_FORMAT " %s it",
+					   stress_roles[role], start, allowed ? "allowed" : "denied", from,
+					   allowed ? "denies" : "allows");
+			else
+				report("login of \"%s\" at %.3f ms was %s, but generations " UINT64_FORMAT " to " UINT64_FORMAT " all %s it",
+					   stress_roles[role], start, allowed ? "allowed" : "denied", from, to,
+					   allowed ? "deny" : "allow");
+		}
+
+		if (to != from)
+			t->overlapped++;
+		if (allowed)
+			t->allowed++;
+		else
+			t->denied++;
+
+		if (t->nlogins == t->maxlogins)
+		{
+			t->maxlogins = Max(1024, t->maxlogins * 2);
+			t->logins = pg_realloc(t->logins, t->maxlogins * sizeof(StressLogin));
+		}
+		t->logins[t->nlogins].start = start;
+		t->logins[t->nlogins].latency = latency;
+		t->nlogins++;
+
+		PQfinish(conn);
+	}
+
+	return NULL;
+}
+
+/* Run sql on conn, and exit unless it returns status expected */
+static PGresult *
+run_command(PGconn *conn, const char *sql, ExecStatusType expected)
+{
+	PGresult   *res = PQexec(conn, sql);
+
+	if (PQresultStatus(res) != expected)
+	{
+		pg_log_error("query failed: %s", PQerrorMessage(conn));
+		pg_log_error("query was: %s", sql);
+		exit(1);
+	}
+
+	return res;
+}
+
+/*
+ * Run sql on conn, and report it unless it returns status expected. Used on
+ * the way out, where exiting would leave things behind.
+ */
+static bool
+try_command(PGconn *conn, const char *sql, ExecStatusType expected)
+{
+	PGresult   *res = PQexec(conn, sql);
+	bool		ok = (PQresultStatus(res) == expected);
+
+	if (!ok)
+	{
+		pg_log_error("query failed: %s", PQerrorMessage(conn));
+		pg_log_error("query was: %s", sql);
+	}
+	PQclear(res);
+
+	return ok;
+}
+
+/*
+ * Save what setup() and switch_policy() change, for teardown(): the active
+ * policy, or what ALTER SYSTEM set block_access.intervals and exclude_roles
+ * to, if anything.
+ */
+static void
+save_configuration(PGconn *conn)
+{
+	PGresult   *res;
+	int			i;
+
+	if (mode == STRESS_MODE_NAMED)
+	{
+		res = run_command(conn, "SELECT name FROM block_access_policies() WHERE active",
+						  PGRES_TUPLES_OK);
+		if (PQntuples(res) > 0)
+			saved_active = pg_strdup(PQgetvalue(res, 0, 0));
+		PQclear(res);
+		return;
+	}
+
+	res = run_command(conn,
+					  "SELECT name, setting FROM pg_file_settings "
+					  "WHERE sourcefile ~ '/postgresql\\.auto\\.conf$' "
+					  "AND name IN ('block_access.intervals', 'block_access.exclude_roles')",
+					  PGRES_TUPLES_OK);
+	for (i = 0; i < PQntuples(res); i++)
+	{
+		int		k = strcmp(PQgetvalue(res, i, 0), stress_settings[0]) == 0 ? 0 : 1;
+
+		if (saved_settings[k] != NULL)
+			pg_free(saved_settings[k]);
+		saved_settings[k] = pg_strdup(PQgetvalue(res, i, 1));
+	}
+	PQclear(res);
+}
+
+/*
+ * Create the roles and the policies, and put generation 0 in effect. The
+ * superuser running the test is excluded from both policies, or it could
+ * not log in again.
+ */
+static void
+setup(PGconn *conn)
+{
+	PQExpBufferData sql;
+	char	   *user;
+	char	   *s;
+	int			i;
+
+	initPQExpBuffer(&sql);
+
+	/* from now on, whatever happens, put things back */
+	save_configuration(conn);
+	needs_teardown = true;
+	atexit(teardown_at_exit);
+
+	for (i = 0; i < STRESS_NROLES; i++)
+	{
+		resetPQExpBuffer(&sql);
+		appendPQExpBuffer(&sql,
+						  "DO $$BEGIN CREATE ROLE %s LOGIN; "
+						  "EXCEPTION WHEN duplicate_object THEN NULL; END$$",
+						  stress_roles[i]);
+		PQclear(run_command(conn, sql.data, PGRES_COMMAND_OK));
+	}
+
+	user = PQuser(conn);
+	exclude_roles[0] = psprintf("%s, %s, %s", user,
+								stress_roles[STRESS_ROLE_BOTH], stress_roles[STRESS_ROLE_EVEN]);
+	exclude_roles[1] = psprintf("%s, %s, %s", user,
+								stress_roles[STRESS_ROLE_BOTH], stress_roles[STRESS_ROLE_ODD]);
+
+	if (mode == STRESS_MODE_NAMED)
+	{
+		for (i = 0; i < 2; i++)
+		{
+			s = PQescapeLiteral(conn, exclude_roles[i], strlen(exclude_roles[i]));
+			resetPQExpBuffer(&sql);
+			appendPQExpBuffer(&sql,
+							  "SELECT block_access_define('ba_stress_%s', '%s', %s)",
+							  i == 0 ? "even" : "odd", STRESS_INTERVALS, s);
+			PQclear(run_command(conn, sql.data, PGRES_TUPLES_OK));
+			PQfreemem(s);
+		}
+	}
+	else
+		PQclear(run_command(conn,
+							"ALTER SYSTEM SET block_access.intervals = '" STRESS_INTERVALS "'",
+							PGRES_COMMAND_OK));
+
+	switch_policy(conn, 0);
+
+	termPQExpBuffer(&sql);
+}
+
+/*
+ * Put the configuration back as it was, and drop the roles. Errors are
+ * reported, and the rest is done anyway; return false if there was any.
+ */
+static bool
+teardown(PGconn *conn)
+{
+	PQExpBufferData sql;
+	bool		ok = true;
+	char	   *s;
+	int			i;
+
+	needs_teardown = false;
+	initPQExpBuffer(&sql);
+
+	if (mode == STRESS_MODE_NAMED)
+	{
+		/* a policy of a previous run that did not finish is not put back */
+		if (saved_active == NULL || strncmp(saved_active, "ba_stress_", 10) == 0)
+			saved_active = pg_strdup("default");
+		s = PQescapeLiteral(conn, saved_active, strlen(saved_active));
+		appendPQExpBuffer(&sql, "SELECT block_access_activate(%s)", s != NULL ? s : "'default'");
+		PQfreemem(s);
+		ok &= try_command(conn, sql.data, PGRES_TUPLES_OK);
+		ok &= try_command(conn,
+						  "SELECT block_access_drop(name) FROM block_access_policies() "
+						  "WHERE name IN ('ba_stress_even', 'ba_stress_odd')",
+						  PGRES_TUPLES_OK);
+	}
+	else
+	{
+		for (i = 0; i < 2; i++)
+		{
+			resetPQExpBuffer(&sql);
+			if (saved_settings[i] == NULL)
+				appendPQExpBuffer(&sql, "ALTER SYSTEM RESET %s", stress_settings[i]);
+			else
+			{
+				s = PQescapeLiteral(conn, saved_settings[i], strlen(saved_settings[i]));
+				appendPQExpBuffer(&sql, "ALTER SYSTEM SET %s = %s",
+								  stress_settings[i], s != NULL ? s : "DEFAULT");
+				PQfreemem(s);
+			}
+			ok &= try_command(conn, sql.data, PGRES_COMMAND_OK);
+		}
+		ok &= try_command(conn, "SELECT pg_reload_conf()", PGRES_TUPLES_OK);
+	}
+
+	for (i = 0; i < STRESS_NROLES; i++)
+	{
+		resetPQExpBuffer(&sql);
+		appendPQExpBuffer(&sql, "DROP ROLE IF EXISTS %s", stress_roles[i]);
+		ok &= try_command(conn, sql.data, PGRES_COMMAND_OK);
+	}
+	termPQExpBuffer(&sql);
+
+	return ok;
+}
+
+/*
+ * On exit(1) after setup() began, put things back with a new connection: the
+ * one in use may be what failed. Client threads may still be running.
+ */
+static void
+teardown_at_exit(void)
+{
+	PGconn	   *conn;
+
+	if (!needs_teardown)
+		return;
+
+	stop = true;
+	pg_log_info("putting the configuration back");
+
+	conn = PQconnectdb(connstr);
+	if (PQstatus(conn) != CONNECTION_OK)
+		pg_log_error("could not connect to put the configuration back: %s",
+					 PQerrorMessage(conn));
+	else
+		(void) teardown(conn);
+	PQfinish(conn);
+}
+
+/*
+ * SIGINT and SIGTERM stop the test; main() puts things back and reports. A
+ * second signal kills the tool.
+ */
+static void
+handle_signal(int signum)
+{
+	interrupted = true;
+	stop = true;
+	signal(signum, SIG_DFL);
+}
+
+/*
+ * Put generation in effect. block_access_activate() returns once the next
+ * login uses the new policy; a reload only signals the postmaster, so its
+ * end is when a new backend sees the new value.
+ */
+static void
+switch_policy(PGconn *conn, uint64 generation)
+{
+	PQExpBufferData sql;
+	char	   *s;
+
+	initPQExpBuffer(&sql);
+
+	if (mode == STRESS_MODE_NAMED)
+	{
+		appendPQExpBuffer(&sql, "SELECT block_access_activate('ba_stress_%s')",
+						  generation % 2 == 0 ? "even" : "odd");
+		PQclear(run_command(conn, sql.data, PGRES_TUPLES_OK));
+	}
+	else
+	{
+		s = PQescapeLiteral(conn, exclude_roles[generation % 2],
+							strlen(exclude_roles[generation % 2]));
+		appendPQExpBuffer(&sql, "ALTER SYSTEM SET block_access.exclude_roles = %s", s);
+		PQclear(run_command(conn, sql.data, PGRES_COMMAND_OK));
+		PQfreemem(s);
+
+		PQclear(run_command(conn, "SELECT pg_reload_conf()", PGRES_TUPLES_OK));
+		wait_for_reload(exclude_roles[generation % 2]);
+	}
+
+	termPQExpBuffer(&sql);
+}
+
+/* Wait until a new backend sees block_access.exclude_roles set to expected */
+static void
+wait_for_reload(const char *expected)
+{
+	double		deadline = elapsed_ms() + STRESS_RELOAD_TIMEOUT;
+
+	for (;;)
+	{
+		PGconn	   *conn = PQconnectdb(connstr);
+		PGresult   *res;
+		bool		reloaded;
+
+		if (PQstatus(conn) != CONNECTION_OK)
+		{
+			pg_log_error("could not connect: %s", PQerrorMessage(conn));
+			exit(1);
+		}
+
+		res = run_command(conn, "SHOW block_access.exclude_roles", PGRES_TUPLES_OK);
+		reloaded = (strcmp(PQgetvalue(res, 0, 0), expected) == 0);
+		PQclear(res);
+		PQfinish(conn);
+
+		if (reloaded || interrupted)
+			return;
+
+		if (elapsed_ms() > deadline)
+		{
+			pg_log_error("configuration not reloaded after %d ms", STRESS_RELOAD_TIMEOUT);
+			exit(1);
+		}
+		pg_usleep(1000);
+	}
+}
+
+static int
+compare_latencies(const void *a, const void *b)
+{
+	double		x = *(const double *) a;
+	double		y = *(const double *) b;
+
+	return (x > y) - (x < y);
+}
+
+static void
+print_latencies(const char *label, double *latencies, int n)
+{
+	double		sum = 0;
+	int			i;
+
+	if (n == 0)
+	{
+		printf("%s: no logins\n", label);
+		return;
+	}
+
+	qsort(latencies, n, sizeof(double), compare_latencies);
+	for (i = 0; i < n; i++)
+		sum += latencies[i];
+
+	printf("%s: %d logins, avg %.3f ms, p50 %.3f ms, p99 %.3f ms, max %.3f ms\n",
+		   label, n, sum / n, latencies[n / 2], latencies[(int) (n * 0.99)],
+		   latencies[n - 1]);
+}
+
+int
+main(int argc, char **argv)
+{
+	static struct option long_options[] = {
+		{"dbname", required_argument, NULL, 'd'},
+		{"clients", required_argument, NULL, 'c'},
+		{"time", required_argument, NULL, 'T'},
+		{"interval", required_argument, NULL, 'i'},
+		{"mode", required_argument, NULL, 'm'},
+		{"window", required_argument, NULL, 'w'},
+		{"version", no_argument, NULL, 'V'},
+		{"help", no_argument, NULL, '?'},
+		{NULL, 0, NULL, 0}
+	};
+
+	int			nclients = 16;
+	int			duration = 30;
+	int			interval = 500;
+	int			window = 100;
+	PGconn	   *conn;
+	StressThread *threads;
+	StressSwitch *switches = NULL;
+	int			nswitches = 0;
+	int			maxswitches = 0;
+	double	   *steady;
+	double	   *nearby;
+	int			nsteady = 0;
+	int			nnearby = 0;
+	int			nlogins = 0;
+	uint64		allowed = 0;
+	uint64		denied = 0;
+	uint64		overlapped = 0;
+	uint64		inconsistent = 0;
+	uint64		errors = 0;
+	bool		torn_down;
+	int			c;
+	int			i;
+	int			j;
+	int			k;
+
+	pg_logging_init(argv[0]);
+	progname = get_progname(argv[0]);
+
+	if (argc > 1)
+	{
+		if (strcmp(argv[1], "--help") == 0 || strcmp(argv[1], "-?") == 0)
+		{
+			usage();
+			exit(0);
+		}
+		if (strcmp(argv[1], "--version") == 0 || strcmp(argv[1], "-V") == 0)
+		{
+			puts("block_access_stress (PostgreSQL) " PG_VERSION);
+			exit(0);
+		}
+	}
+
+	while ((c = getopt_long(argc, argv, "d:c:T:i:m:w:V?", long_options, NULL)) != -1)
+	{
+		switch (c)
+		{
+			case 'd':
+				connstr = pg_strdup(optarg);
+				break;
+			case 'c':
+				nclients = atoi(optarg);
+				if (nclients <= 0)
+				{
+					pg_log_error("invalid number of clients: \"%s\"", optarg);
+					exit(1);
+				}
+				break;
+			case 'T':
+				duration = atoi(optarg);
+				if (duration <= 0)
+				{
+					pg_log_error("invalid duration: \"%s\"", optarg);
+					exit(1);
+				}
+				break;
+			case 'i':
+				interval = atoi(optarg);
+				if (interval < 0)
+				{
+					pg_log_error("invalid interval: \"%s\"", optarg);
+					exit(1);
+				}
+				break;
+			case 'm':
+				if (strcmp(optarg, "named") == 0)
+					mode = STRESS_MODE_NAMED;
+				else if (strcmp(optarg, "guc") == 0)
+					mode = STRESS_MODE_GUC;
+				else
+				{
+					pg_log_error("invalid mode: \"%s\"", optarg);
+					exit(1);
+				}
+				break;
+			case 'w':
+				window = atoi(optarg);
+				if (window < 0)
+				{
+					pg_log_error("invalid window: \"%s\"", optarg);
+					exit(1);
+				}
+				break;
+			default:
+				fprintf(stderr, "Try \"%s --help\" for more information.\n", progname);
+				exit(1);
+		}
+	}
+
+	if (optind < argc)
+	{
+		pg_log_error("too many command-line arguments (first is \"%s\")", argv[optind]);
+		fprintf(stderr, "Try \"%s --help\" for more information.\n", progname);
+		exit(1);
+	}
+
+	conn = PQconnectdb(connstr);
+	if (PQstatus(conn) != CONNECTION_OK)
+	{
+		pg_log_error("could not connect: %s", PQerrorMessage(conn));
+		exit(1);
+	}
+
+	signal(SIGINT, handle_signal);
+	signal(SIGTERM, handle_signal);
+
+	INSTR_TIME_SET_CURRENT(start_time);
+	setup(conn);
+
+	threads = pg_malloc0(nclients * sizeof(StressThread));
+	for (i = 0; i < nclients; i++)
+	{
+		int			rc;
+
+		threads[i].prng_state = (uint64) i * UINT64CONST(0x9E3779B97F4A7C15) + 1;
+		rc = pthread_create(&threads[i].thread, NULL, run_client, &threads[i]);
+		if (rc != 0)
+		{
+			pg_log_error("could not create thread: %s", strerror(rc));
+			exit(1);
+		}
+	}
+
+	/* switch until the time is up; switches_done is the generation */
+	while (!interrupted && elapsed_ms() < duration * 1000.0)
+	{
+		uint64		generation;
+
+		pg_usleep(interval * 1000L);
+
+		if (nswitches == maxswitches)
+		{
+			maxswitches = Max(64, maxswitches * 2);
+			switches = pg_realloc(switches, maxswitches * sizeof(StressSwitch));
+		}
+
+		pthread_mutex_lock(&switch_lock);
+		generation = ++switches_started;
+		pthread_mutex_unlock(&switch_lock);
+
+		switches[nswitches].start = elapsed_ms();
+		switch_policy(conn, generation);
+		switches[nswitches].end = elapsed_ms();
+		nswitches++;
+
+		pthread_mutex_lock(&switch_lock);
+		switches_done = generation;
+		pthread_mutex_unlock(&switch_lock);
+	}
+
+	stop = true;
+	for (i = 0; i < nclients; i++)
+	{
+		pthread_join(threads[i].thread, NULL);
+		nlogins += threads[i].nlogins;
+		allowed += threads[i].allowed;
+		denied += threads[i].denied;
+		overlapped += threads[i].overlapped;
+		inconsistent += threads[i].inconsistent;
+		errors += threads[i].errors;
+	}
+
+	torn_down = teardown(conn);
+	PQfinish(conn);
+
+	if (interrupted)
+		pg_log_warning("interrupted after %.0f ms", elapsed_ms());
+
+	/* logins that overlap a switch, widened by the window, are apart */
+	steady = pg_malloc(Max(nlogins, 1) * sizeof(double));
+	nearby = pg_malloc(Max(nlogins, 1) * sizeof(double));
+	for (i = 0; i < nclients; i++)
+	{
+		for (j = 0; j < threads[i].nlogins; j++)
+		{
+			StressLogin *l = &threads[i].logins[j];
+			bool		is_near = false;
+
+			for (k = 0; k < nswitches && !is_near; k++)
+				is_near = (l->start <= switches[k].end + window &&
+						   l->start + l->latency >= switches[k].start - window);
+
+			if (is_near)
+				nearby[nnearby++] = l->latency;
+			else
+				steady[nsteady++] = l->latency;
+		}
+	}
+
+	printf("mode: %s, %d clients, %d s, %d switches every %d ms\n",
+		   mode == STRESS_MODE_NAMED ? "named" : "guc", nclients, duration,
+		   nswitches, interval);
+	printf("logins: %d (" UINT64_FORMAT " allowed, " UINT64_FORMAT " denied), "
+		   UINT64_FORMAT " during a switch, " UINT64_FORMAT " inconsistent, "
+		   UINT64_FORMAT " failed\n",
+		   nlogins, allowed, denied, overlapped, inconsistent, errors);
+
+	if (nswitches > 0)
+	{
+		double		sum = 0;
+		double		max = 0;
+
+		for (k = 0; k < nswitches; k++)
+		{
+			sum += switches[k].end - switches[k].start;
+			max = Max(max, switches[k].end - switches[k].start);
+		}
+		printf("switches: avg %.3f ms, max %.3f ms until in effect\n", sum / nswitches, max);
+	}
+
+	print_latencies("steady", steady, nsteady);
+	print_latencies("near a switch", nearby, nnearby);
+
+	return (inconsistent > 0 || errors > 0 || !torn_down || interrupted) ? 1 : 0;
+}
@@ -0,0 +1,1354 @@
+/* -------------------------------------------------------------------------
+ *
+ * block_access_verify.c
+ *
+ * Compare the compiled policy with the original evaluation loop.
+ *
+ * Random policies are generated and compiled, and each one is evaluated for
+ * random (role, minute of the week) tuples twice: by policy_evaluate() and by
+ * legacy_evaluate(), which is the loop block_access_checks() ran over the
+ * parsed intervals before policies were compiled. The reference is parsed by
+ * a copy of the parser of that time (legacy_parse_options()), not by the
+ * current one. Both must agree on every tuple. The number of tuples that agree and the time taken by each
+ * evaluator are reported.
+ *
+ * Each policy is then patched with a random edit of its exclude_roles by
+ * rebuild_policy(), and the patched policy must agree with the edited one
+ * compiled from scratch, on the same tuples and on what policy_diff() counts.
+ *
+ * With --benchmark, it times parts of the policy code instead: "compile"
+ * parses and builds a policy with many roles, "bitmaps" checks each set of
+ * schedule kernels the CPU supports against the portable one, then times
+ * them, and "shapes" times the evaluator of each policy shape against the
+ * general one and the legacy loop.
+ *
+ * Copyright (c) 2017-2018, Euler Taveira de Oliveira
+ *
+ * IDENTIFICATION
+ *		block_access/block_access_verify.c
+ *
+ * -------------------------------------------------------------------------
+ */
+#include "postgres_fe.h"
+
+#include <ctype.h>
+
+#include "common/logging.h"
+#include "getopt_long.h"
+#include "lib/stringinfo.h"
+#include "portability/instr_time.h"
+
+#include "block_access_policy.h"
+
+#define VERIFY_MAX_INTERVALS	6
+#define VERIFY_MAX_ROLES		64	/* role names in a policy */
+#define VERIFY_MAX_WARNINGS		10	/* mismatches reported */
+#define VERIFY_BUFFER_SIZE		(VERIFY_MAX_INTERVALS * (VERIFY_MAX_ROLES * 12 + 64))
+#define VERIFY_BITMAPS			256	/* random schedules for --benchmark=bitmaps */
+#define VERIFY_BITMAP_LOOPS		100000	/* operations timed per run */
+#define VERIFY_SHAPE_LOOPS		100		/* passes over the tuples per run */
+
+/* A tuple to evaluate. The legacy loop wants the minute broken down. */
+typedef struct VerifyTuple {
+	const char	*role;
+	int			minute;			/* of the week, 0 is Sunday 00:00 */
+	int			wday;
+	int			hour;
+	int			min;
+} VerifyTuple;
+
+static const char *progname;
+
+static const char *const week_day_names[7] = {"sun", "mon", "tue", "wed", "thu", "fri", "sat"};
+
+static char role_names[VERIFY_MAX_ROLES + 1][NAMEDATALEN];
+
+static uint64 prng_state;
+
+/* results of timed bitmap calls, so that they are not optimized away */
+static volatile uint64 bitmap_sink;
+
+static void usage(void);
+static void benchmark_compile(int nroles, int repeat);
+static bool benchmark_bitmaps(int repeat);
+static bool benchmark_shapes(int ntuples, int repeat);
+static void random_tuples(VerifyTuple *tuples, int ntuples);
+static uint32 random_uint32(uint32 n);
+static void random_schedule(uint64 *words);
+static int random_policy(char *intervals, char *roles);
+static void random_edit(char *edited, const char *roles);
+static char *legacy_trim(char *s);
+static char *legacy_strtok_all(char *s, char const *d);
+static void legacy_parse_interval(BAIntervalRole *i, char *s);
+static void legacy_parse_roles(BAIntervalRole *i, char *s);
+static void legacy_parse_options(BAIntervalRole *ir, int n, char *interval_time, char *exclude_roles);
+static void legacy_free_options(BAIntervalRole *ir, int n);
+static bool legacy_evaluate(BAIntervalRole *intervals, int nintervals,
+							const char *role, int wday, int hour, int min);
+
+static void
+usage(void)
+{
+	printf("%s compares compiled block_access policies with the original evaluation loop.\n\n", progname);
+	printf("Usage:\n");
+	printf("  %s [OPTION]...\n\n", progname);
+	printf("Options:\n");
+	printf("  -b, --benchmark=WHAT          time WHAT instead of comparing: compile,\n"
+		   "                                bitmaps, shapes\n");
+	printf("  -p, --policies=NUM            number of random policies (default: 1000),\n"
+		   "                                or of runs with --benchmark (default: 5)\n");
+	printf("  -r, --roles=NUM               roles per interval to compile (default: 100000)\n");
+	printf("  -t, --tuples=NUM              tuples evaluated per policy (default: 10000)\n");
+	printf("  -s, --seed=NUM                random seed (default: from the clock)\n");
+	printf("  -V, --version                 output version information, then exit\n");
+	printf("  -?, --help                    show this help, then exit\n\n");
+	printf("The exit status is 1 if the evaluators disagree on any tuple, if a\n"
+		   "patched policy disagrees with the same policy compiled from scratch, or\n"
+		   "if schedule kernels disagree with --benchmark=bitmaps.\n");
+}
+
+/*
+ * Parse and build a policy with seven intervals of nroles roles each, repeat
+ * times, and report the best time of each phase. Each interval lists half of
+ * the roles of the previous one, so that roles are excluded on different sets
+ * of days, as in real policies. Then the policy is rebuilt with other opening
+ * hours and the same roles, as a reload that changes only
+ * block_access.intervals does, and with one more role in the first interval.
+ */
+static void
+benchmark_compile(int nroles, int repeat)
+{
+	StringInfoData	intervals;
+	StringInfoData	roles;
+	StringInfoData	later;
+	StringInfoData	edited;
+	double		best_parse = 0;
+	double		best_build = 0;
+	double		best_rebuild = 0;
+	double		best_patch = 0;
+	int			nclasses = 0;
+	int			ndistinct = 0;
+	int			i;
+	int			k;
+
+	initStringInfo(&intervals);
+	initStringInfo(&roles);
+	initStringInfo(&later);
+	initStringInfo(&edited);
+	for (i = 0; i < 7; i++)
+	{
+		appendStringInfo(&intervals, "%s%s - 08:00-18:00", i > 0 ? " ; " : "", week_day_names[i]);
+		appendStringInfo(&later, "%s%s - 09:00-19:00", i > 0 ? " ; " : "", week_day_names[i]);
+		if (i > 0)
+			appendStringInfoChar(&roles, ';');
+		for (k = 0; k < nroles; k++)
+			appendStringInfo(&roles, "%sbench_role_%d", k > 0 ? ", " : "", i * (nroles / 2) + k);
+	}
+	appendStringInfo(&edited, "bench_new_role, %s", roles.data);
+
+	for (i = 0; i < repeat; i++)
+	{
+		BAIntervalRole	parsed[7];
+		BAPolicy		*p;
+		BAPolicy		*q;
+		instr_time		start;
+		instr_time		duration;
+		double			parse_time;
+		double			build_time;
+		double			rebuild_time;
+		double			patch_time;
+
+		memset(parsed, 0, sizeof(parsed));
+
+		INSTR_TIME_SET_CURRENT(start);
+		parse_options(parsed, 7, intervals.data, roles.data);
+		INSTR_TIME_SET_CURRENT(duration);
+		INSTR_TIME_SUBTRACT(duration, start);
+		parse_time = INSTR_TIME_GET_DOUBLE(duration);
+
+		INSTR_TIME_SET_CURRENT(start);
+		p = build_policy(NULL, parsed, 7, 0);
+		INSTR_TIME_SET_CURRENT(duration);
+		INSTR_TIME_SUBTRACT(duration, start);
+		build_time = INSTR_TIME_GET_DOUBLE(duration);
+
+		INSTR_TIME_SET_CURRENT(start);
+		q = rebuild_policy(NULL, p, roles.data, later.data, roles.data, 0);
+		INSTR_TIME_SET_CURRENT(duration);
+		INSTR_TIME_SUBTRACT(duration, start);
+		rebuild_time = INSTR_TIME_GET_DOUBLE(duration);
+		if (q == NULL)
+		{
+			pg_log_error("could not rebuild the policy with its role entries");
+			exit(1);
+		}
+
+		INSTR_TIME_SET_CURRENT(start);
+		q = rebuild_policy(NULL, p, roles.data, intervals.data, edited.data, 0);
+		INSTR_TIME_SET_CURRENT(duration);
+		INSTR_TIME_SUBTRACT(duration, start);
+		patch_time = INSTR_TIME_GET_DOUBLE(duration);
+		if (q == NULL || q->nroles != p->nroles + 1)
+		{
+			pg_log_error("could not patch the role entries of the policy");
+			exit(1);
+		}
+
+		if (i == 0 || parse_time < best_parse)
+			best_parse = parse_time;
+		if (i == 0 || build_time < best_build)
+			best_build = build_time;
+		if (i == 0 || rebuild_time < best_rebuild)
+			best_rebuild = rebuild_time;
+		if (i == 0 || patch_time < best_patch)
+			best_patch = patch_time;
+		nclasses = p->nschedules;
+		ndistinct = p->nroles;
+
+		policy_memory_reset();
+	}
+
+	printf("compile: 7 intervals, %d roles each (%d distinct, %d schedule classes), best of %d\n",
+		   nroles, ndistinct, nclasses, repeat);
+	printf("parse: %.3f s\n", best_parse);
+	printf("build: %.3f s\n", best_build);
+	printf("total: %.3f s (%.0f roles/s)\n", best_parse + best_build,
+		   best_parse + best_build > 0 ? 7.0 * nroles / (best_parse + best_build) : 0.0);
+	printf("rebuild with new hours: %.3f s\n", best_rebuild);
+	printf("patch with one more role: %.3f s\n", best_patch);
+
+	pfree(intervals.data);
+	pfree(roles.data);
+	pfree(later.data);
+	pfree(edited.data);
+}
+
+/*
+ * Check every set of schedule kernels the CPU supports against the portable
+ * set on random schedules, then time each operation, repeat times, and report
+ * the best time per call. Return false if any result differs.
+ */
+static bool
+benchmark_bitmaps(int repeat)
+{
+	const BABitmapKernels *scalar = bitmap_kernel_variants[0];
+	const BABitmapKernels *chosen = bitmap_current_kernels();
+	BASchedule *schedules = pg_malloc(VERIFY_BITMAPS * sizeof(BASchedule));
+	bool		ok = true;
+	int			v;
+	int			i;
+
+	for (i = 0; i < VERIFY_BITMAPS; i++)
+		random_schedule(schedules[i].words);
+
+	printf("bitmaps: %d random schedules, %d calls per run, best of %d, ns per call\n",
+		   VERIFY_BITMAPS, VERIFY_BITMAP_LOOPS, repeat);
+	printf("%-8s %8s %8s %8s %8s %8s %8s\n",
+		   "kernels", "or", "and", "andnot", "count", "next", "nextclr");
+
+	for (v = 0; bitmap_kernel_variants[v] != NULL; v++)
+	{
+		const BABitmapKernels *k = bitmap_kernel_variants[v];
+		double		best[6] = {0};
+		uint64		sink = 0;
+		int			op;
+		int			run;
+
+		if (!bitmap_kernels_supported(k))
+		{
+			printf("%-8s not supported by this CPU\n", k->name);
+			continue;
+		}
+
+		/* same results as the portable kernels */
+		for (i = 0; i < VERIFY_BITMAPS; i++)
+		{
+			const uint64 *a = schedules[i].words;
+			const uint64 *b = schedules[(i * 7 + 1) % VERIFY_BITMAPS].words;
+			BASchedule	expected;
+			BASchedule	actual;
+			int			bit = random_uint32(BA_MINUTES_PER_WEEK);
+			int			n1;
+			int			n2;
+
+			memcpy(&expected, a, sizeof(BASchedule));
+			memcpy(&actual, a, sizeof(BASchedule));
+			scalar->or_words(expected.words, b);
+			k->or_words(actual.words, b);
+			n1 = memcmp(&expected, &actual, sizeof(BASchedule));
+
+			memcpy(&actual, a, sizeof(BASchedule));
+			memcpy(&expected, a, sizeof(BASchedule));
+			scalar->and_words(expected.words, b);
+			k->and_words(actual.words, b);
+			n2 = memcmp(&expected, &actual, sizeof(BASchedule));
+
+			memcpy(&actual, a, sizeof(BASchedule));
+			memcpy(&expected, a, sizeof(BASchedule));
+			scalar->andnot_words(expected.words, b);
+			k->andnot_words(actual.words, b);
+
+			if (n1 != 0 || n2 != 0 ||
+				memcmp(&expected, &actual, sizeof(BASchedule)) != 0 ||
+				scalar->count(a) != k->count(a) ||
+				scalar->scan(a, bit / 64, BA_SCHEDULE_WORDS, 0) !=
+				k->scan(a, bit / 64, BA_SCHEDULE_WORDS, 0) ||
+				scalar->scan(a, bit / 64, BA_SCHEDULE_WORDS, ~UINT64CONST(0)) !=
+				k->scan(a, bit / 64, BA_SCHEDULE_WORDS, ~UINT64CONST(0)))
+			{
+				pg_log_error("%s kernels disagree with %s kernels on schedule %d",
+							 k->name, scalar->name, i);
+				ok = false;
+				break;
+			}
+
+			bitmap_use_kernels(scalar);
+			n1 = bitmap_next(a, bit);
+			n2 = bitmap_next_clear(a, bit);
+			bitmap_use_kernels(k);
+			if (n1 != bitmap_next(a, bit) || n2 != bitmap_next_clear(a, bit))
+			{
+				pg_log_error("%s kernels disagree with %s kernels on the next minute of schedule %d after %d",
+							 k->name, scalar->name, i, bit);
+				ok = false;
+				break;
+			}
+		}
+
+		bitmap_use_kernels(k);
+		for (run = 0; run < repeat; run++)
+		{
+			for (op = 0; op < 6; op++)
+			{
+				BASchedule	dst;
+				instr_time	start;
+				instr_time	duration;
+				double		elapsed;
+
+				memcpy(&dst, &schedules[0], sizeof(BASchedule));
+				INSTR_TIME_SET_CURRENT(start);
+				for (i = 0; i < VERIFY_BITMAP_LOOPS; i++)
+				{
+					const uint64 *src = schedules[i % VERIFY_BITMAPS].words;
+
+					switch (op)
+					{
+						case 0:
+							bitmap_or(dst.words, src);
+							break;
+						case 1:
+							bitmap_and(dst.words, src);
+							break;
+						case 2:
+							bitmap_andnot(dst.words, src);
+							break;
+						case 3:
+							sink += bitmap_count(src);
+							break;
+						case 4:
+							sink += bitmap_next(src, i % BA_MINUTES_PER_WEEK);
+							break;
+						case 5:
+							sink += bitmap_next_clear(src, i % BA_MINUTES_PER_WEEK);
+							break;
+					}
+				}
+				INSTR_TIME_SET_CURRENT(duration);
+				INSTR_TIME_SUBTRACT(duration, start);
+				sink += dst.words[0];
+
+				elapsed = INSTR_TIME_GET_DOUBLE(duration) * 1e9 / VERIFY_BITMAP_LOOPS;
+				if (run == 0 || elapsed < best[op])
+					best[op] = elapsed;
+			}
+		}
+
+		bitmap_sink = sink;
+
+		printf("%-8s %8.1f %8.1f %8.1f %8.1f %8.1f %8.1f\n", k->name,
+			   best[0], best[1], best[2], best[3], best[4], best[5]);
+	}
+
+	bitmap_use_kernels(chosen);
+	printf("in use: %s\n", chosen->name);
+	pg_free(schedules);
+
+	return ok;
+}
+
+/*
+ * Evaluate ntuples random tuples VERIFY_SHAPE_LOOPS times against a policy
+ * of each shape, repeat times, with the evaluator policy_evaluate() picks
+ * for the shape, with evaluate_full() and with the legacy loop, and report
+ * the best time per evaluation. Return false if they disagree on a tuple.
+ */
+static bool
+benchmark_shapes(int ntuples, int repeat)
+{
+	/* a week-day window, as most clusters have; the full shape lists every role */
+	static const char *const shape_intervals = "mon, tue, wed, thu, fri - 08:00-18:00";
+	const char *shape_roles[BA_SHAPE_FULL + 1];
+	char		all_roles[VERIFY_MAX_ROLES * 12];
+	VerifyTuple *tuples = pg_malloc(ntuples * sizeof(VerifyTuple));
+	bool		ok = true;
+	int			shape;
+	int			i;
+
+	all_roles[0] = '\0';
+	for (i = 0; i < VERIFY_MAX_ROLES; i++)
+		snprintf(all_roles + strlen(all_roles), sizeof(all_roles) - strlen(all_roles),
+				 "%s%s", i > 0 ? ", " : "", role_names[i]);
+	shape_roles[BA_SHAPE_EMPTY] = NULL;
+	shape_roles[BA_SHAPE_TIME] = "";
+	shape_roles[BA_SHAPE_SMALL] = "role_1, role_2";
+	shape_roles[BA_SHAPE_FULL] = all_roles;
+
+	random_tuples(tuples, ntuples);
+
+	printf("shapes: %d tuples, %d passes per run, best of %d, ns per evaluation\n",
+		   ntuples, VERIFY_SHAPE_LOOPS, repeat);
+	printf("%-8s %12s %8s %8s\n", "shape", "specialized", "full", "legacy");
+
+	for (shape = BA_SHAPE_EMPTY; shape <= BA_SHAPE_FULL; shape++)
+	{
+		BAIntervalRole	parsed;
+		int				nintervals = shape == BA_SHAPE_EMPTY ? 0 : 1;
+		BAPolicy		*p;
+		double			best[3] = {0};
+		uint64			sink = 0;
+		int				run;
+		int				e;
+
+		memset(&parsed, 0, sizeof(parsed));
+		if (shape == BA_SHAPE_EMPTY)
+			p = policy_alloc(NULL, 0, 0, 0, 0);
+		else
+		{
+			legacy_parse_options(&parsed, 1, (char *) shape_intervals, (char *) shape_roles[shape]);
+			p = parse_policy(NULL, shape_intervals, shape_roles[shape], 0);
+		}
+		Assert(p->shape == shape);
+
+		/* all of them decide the same */
+		for (i = 0; i < ntuples; i++)
+		{
+			VerifyTuple *t = &tuples[i];
+			bool	exempted;
+			bool	allowed = policy_evaluate(p, t->role, t->minute, &exempted) != BA_VERDICT_DENIED;
+
+			if (allowed != legacy_evaluate(&parsed, nintervals, t->role, t->wday, t->hour, t->min) ||
+				(shape != BA_SHAPE_EMPTY &&
+				 allowed != (evaluate_full(p, t->role, t->minute, &exempted) != BA_VERDICT_DENIED)))
+			{
+				pg_log_error("%s policy, role \"%s\" on %s at %02d:%02d: evaluators disagree",
+							 policy_shape_names[shape], t->role,
+							 week_day_names[t->wday], t->hour, t->min);
+				ok = false;
+				break;
+			}
+		}
+
+		for (run = 0; run < repeat; run++)
+		{
+			for (e = 0; e < 3; e++)
+			{
+				instr_time	start;
+				instr_time	duration;
+				double		elapsed;
+				int			loop;
+
+				/* there are no schedules to look at in an empty policy */
+				if (e == 1 && shape == BA_SHAPE_EMPTY)
+					continue;
+
+				INSTR_TIME_SET_CURRENT(start);
+				for (loop = 0; loop < VERIFY_SHAPE_LOOPS; loop++)
+				{
+					for (i = 0; i < ntuples; i++)
+					{
+						VerifyTuple *t = &tuples[i];
+						bool	exempted;
+
+						if (e == 0)
+							sink += policy_evaluate(p, t->role, t->minute, &exempted);
+						else if (e == 1)
+							sink += evaluate_full(p, t->role, t->minute, &exempted);
+						else
+							sink += legacy_evaluate(&parsed, nintervals, t->role,
+													t->wday, t->hour, t->min);
+					}
+				}
+				INSTR_TIME_SET_CURRENT(duration);
+				INSTR_TIME_SUBTRACT(duration, start);
+
+				elapsed = INSTR_TIME_GET_DOUBLE(duration) * 1e9 /
+					((double) ntuples * VERIFY_SHAPE_LOOPS);
+				if (run == 0 || elapsed < best[e])
+					best[e] = elapsed;
+			}
+		}
+		bitmap_sink = sink;
+
+		if (shape == BA_SHAPE_EMPTY)
+			printf("%-8s %12.2f %8s %8.2f\n", policy_shape_names[shape], best[0], "-", best[2]);
+		else
+			printf("%-8s %12.2f %8.2f %8.2f\n", policy_shape_names[shape], best[0], best[1], best[2]);
+
+		legacy_free_options(&parsed, nintervals);
+		policy_memory_reset();
+	}
+
+	pg_free(tuples);
+
+	return ok;
+}
+
+/*
+ * Random tuples: a quarter of them for a role that is in no policy
+ */
+static void
+random_tuples(VerifyTuple *tuples, int ntuples)
+{
+	int		j;
+
+	for (j = 0; j < ntuples; j++)
+	{
+		VerifyTuple	*t = &tuples[j];
+		int			r = random_uint32(4) == 0 ? VERIFY_MAX_ROLES : random_uint32(VERIFY_MAX_ROLES);
+
+		t->role = role_names[r];
+		t->minute = random_uint32(BA_MINUTES_PER_WEEK);
+		t->wday = t->minute / BA_MINUTES_PER_DAY;
+		t->hour = t->minute % BA_MINUTES_PER_DAY / 60;
+		t->min = t->minute % 60;
+	}
+}
+
+/*
+ * Random number in [0, n), from xorshift64*. The modulo bias does not matter
+ * here; being reproducible from the seed on any platform does.
+ */
+static uint32
+random_uint32(uint32 n)
+{
+	prng_state ^= prng_state >> 12;
+	prng_state ^= prng_state << 25;
+	prng_state ^= prng_state >> 27;
+
+	return (uint32) ((prng_state * UINT64CONST(2685821657736338717)) >> 32) % n;
+}
+
+/*
+ * Random weekly schedule: a few ranges of minutes, as intervals compile to,
+ * and sometimes the whole week or none of it, so that whole words are set or
+ * clear.
+ */
+static void
+random_schedule(uint64 *words)
+{
+	int		nranges = random_uint32(8);
+	int		i;
+
+	memset(words, 0, sizeof(BASchedule));
+	if (random_uint32(16) == 0)
+		nranges = 0;
+	else if (random_uint32(16) == 0)
+		nranges = -1;
+
+	if (nranges < 0)
+	{
+		for (i = 0; i < BA_MINUTES_PER_WEEK; i++)
+			words[i / 64] |= UINT64CONST(1) << (i % 64);
+		return;
+	}
+
+	for (i = 0; i < nranges; i++)
+	{
+		int		from = random_uint32(BA_MINUTES_PER_WEEK);
+		int		to = Min(from + (int) random_uint32(24 * 60), BA_MINUTES_PER_WEEK);
+		int		m;
+
+		for (m = from; m < to; m++)
+			words[m / 64] |= UINT64CONST(1) << (m % 64);
+	}
+}
+
+/*
+ * Write random values of block_access.intervals and block_access.exclude_roles
+ * (VERIFY_BUFFER_SIZE bytes each), and return the number of intervals.
+ *
+ * Week days can repeat, within an interval and across intervals, and an
+ * interval can end before it starts: the legacy loop gives a meaning to both,
+ * so the compiled policy must too. The number of roles varies so that every
+ * shape of policy is built.
+ */
+static int
+random_policy(char *intervals, char *roles)
+{
+	int		nintervals = 1 + random_uint32(VERIFY_MAX_INTERVALS);
+	int		nnames;
+	int		i;
+	char	*ip = intervals;
+	char	*rp = roles;
+
+	/* the first group of roles can be empty */
+	*rp = '\0';
+
+	switch (random_uint32(3))
+	{
+		case 0:
+			nnames = random_uint32(BA_SMALL_ROLES + 1);
+			break;
+		case 1:
+			nnames = 1 + random_uint32(2 * BA_SMALL_ROLES);
+			break;
+		default:
+			nnames = 1 + random_uint32(VERIFY_MAX_ROLES);
+			break;
+	}
+
+	for (i = 0; i < nintervals; i++)
+	{
+		int		nwday = 1 + random_uint32(4);
+		int		nroles = nnames > 0 ? random_uint32(Min(nnames, 16) + 1) : 0;
+		int		start = random_uint32(BA_MINUTES_PER_DAY);
+		int		end = random_uint32(BA_MINUTES_PER_DAY);
+		int		j;
+
+		/* whole days and the day edges are where off-by-one errors hide */
+		switch (random_uint32(8))
+		{
+			case 0:
+				start = 0;
+				break;
+			case 1:
+				end = BA_MINUTES_PER_DAY - 1;
+				break;
+			case 2:
+				end = start;
+				break;
+		}
+
+		if (i > 0)
+		{
+			ip += sprintf(ip, " ; ");
+			rp += sprintf(rp, ";");
+		}
+
+		for (j = 0; j < nwday; j++)
+			ip += sprintf(ip, "%s%s", j > 0 ? "," : "", week_day_names[random_uint32(7)]);
+		ip += sprintf(ip, " - %02d:%02d-%02d:%02d", start / 60, start % 60, end / 60, end % 60);
+
+		for (j = 0; j < nroles; j++)
+			rp += sprintf(rp, "%s%s", j > 0 ? ", " : "", role_names[random_uint32(nnames)]);
+	}
+
+	return nintervals;
+}
+
+/*
+ * Copy roles to edited with a random role added, removed or renamed, as an
+ * administrator edits exclude_roles. The number of role groups is kept.
+ */
+static void
+random_edit(char *edited, const char *roles)
+{
+	int			len = strlen(roles);
+	int			at = random_uint32(len + 1);
+	int			end;
+	const char *name = role_names[random_uint32(VERIFY_MAX_ROLES + 1)];
+
+	/* a whole role, or an empty one */
+	while (at > 0 && roles[at - 1] != ',' && roles[at - 1] != ';')
+		at--;
+	for (end = at; end < len && roles[end] != ',' && roles[end] != ';'; end++)
+		;
+
+	switch (random_uint32(3))
+	{
+		case 0:
+			sprintf(edited, "%.*s%s, %s", at, roles, name, roles + at);
+			break;
+		case 1:
+			/* with the comma after it, if any */
+			sprintf(edited, "%.*s%s", at, roles, roles + end + (roles[end] == ','));
+			break;
+		default:
+			sprintf(edited, "%.*s %s%s", at, roles, name, roles + end);
+			break;
+	}
+}
+
+/*
+ * The parser of block_access.intervals and exclude_roles as it was before
+ * policies were compiled, so that the reference does not share any code with
+ * what it checks. Errors are reported and exit: the generator is wrong.
+ * Debug messages are left out, and so are three bugs that random policies
+ * would hit: trim() read before the start of an empty string,
+ * parse_roles() counted empty items that it did not store, and
+ * strtok_all(NULL) continued the tokenization of the previous policy when
+ * exclude_roles was empty.
+ */
+#define legacy_error(...) \
+	do { \
+		pg_log_error(__VA_ARGS__); \
+		exit(1); \
+	} while (0)
+
+/*
+ * Strip whitespace from the beginning and end of the string
+ *
+ * space (0x20), form feed (0x0c), line feed (0x0a), carriage return (0x0d),
+ * horizontal tab (0x09) and vertical tab (0x0b) are removed. If s is NULL,
+ * return NULL. If s contains only whitespaces, return NULL.
+ */
+static char *
+legacy_trim(char *s)
+{
+	char	*start;
+	char	*end;
+	char	*t;
+	size_t	len;
+
+	if (s == NULL)
+		return NULL;
+
+	len = strlen(s);
+	start = s;
+	end = start + len - 1;
+
+	while (isspace(*start))
+		start++;
+
+	while (end >= start && isspace(*end))
+		end--;
+
+	if (end - start >= 0)
+	{
+		t = palloc0((end - start + 2) * sizeof(char));
+		strncpy(t, start, end - start + 1);
+	}
+	else
+	{
+		t = NULL;
+	}
+
+	return t;
+}
+
+/*
+ * Same as strtok() except that it returns all tokens even if the token is
+ * empty.
+ */
+static char *
+legacy_strtok_all(char *str, char const *delims)
+{
+	static char	*src = NULL;
+	char		*ret = 0;
+	char		*p;
+
+	if (str != NULL)
+		src = str;
+
+	if (src == NULL)
+		return NULL;
+
+	if ((p = strpbrk(src, delims)) != NULL)
+	{
+		*p  = 0;
+		ret = src;
+		src = ++p;
+	}
+	else if (*src)
+	{
+		ret = src;
+		src = NULL;
+	}
+
+	return ret;
+}
+
+/*
+ * Each interval item contains:
+ * (i) list of abbrev week days separated by comma;
+ * (ii) dash;
+ * (iii) start time;
+ * (iv) dash;
+ * (v) end time;
+ *
+ * Example: mon, wed, fri, sat - 08:00-12:00
+ */
+static void
+legacy_parse_interval(BAIntervalRole *interval, char *s)
+{
+	char	*item;
+	char	*item_wd;
+	char	*ptr;
+	char	*weekday_str;
+	char	*start_time_str;
+	char	*end_time_str;
+	int		i;
+
+	item = pstrdup(s);
+
+	ptr = strtok(item, "-");
+	if (ptr == NULL)
+		legacy_error("parse week day failed: %s", s);
+
+	weekday_str = legacy_trim(ptr);
+
+	ptr = strtok(NULL, "-");
+	if (ptr == NULL)
+		legacy_error("parse start time failed: %s", s);
+
+	start_time_str = legacy_trim(ptr);
+
+	ptr = strtok(NULL, "-");
+	if (ptr == NULL)
+		legacy_error("parse end time failed: %s", s);
+
+	end_time_str = legacy_trim(ptr);
+
+	pfree(item);
+
+	item = pstrdup(weekday_str);
+
+	/* number of week days */
+	interval->nwday = 1;		/* we should have at least one token */
+	for (ptr = item; *ptr != '\0'; ptr++)
+	{
+		if (*ptr == ',')
+			interval->nwday++;
+	}
+
+	interval->wday = (int *) palloc(interval->nwday * sizeof(int));
+
+	/* week days such as 'mon,wed,fri,sat' */
+	i = 0;
+	ptr = strtok(item, ",");
+	while (ptr)
+	{
+		item_wd = legacy_trim(ptr);
+		if (strcmp(item_wd, "sun") == 0)
+			interval->wday[i++] = 0;	/* sunday */
+		else if (strcmp(item_wd, "mon") == 0)
+			interval->wday[i++] = 1;	/* monday */
+		else if (strcmp(item_wd, "tue") == 0)
+			interval->wday[i++] = 2;	/* tuesday */
+		else if (strcmp(item_wd, "wed") == 0)
+			interval->wday[i++] = 3;	/* wednesday */
+		else if (strcmp(item_wd, "thu") == 0)
+			interval->wday[i++] = 4;	/* thursday */
+		else if (strcmp(item_wd, "fri") == 0)
+			interval->wday[i++] = 5;	/* friday */
+		else if (strcmp(item_wd, "sat") == 0)
+			interval->wday[i++] = 6;	/* saturday */
+		else
+			legacy_error("parse week days failed: \"%s\" -> %s", item_wd, weekday_str);
+
+		pfree(item_wd);
+
+		ptr = strtok(NULL, ",");
+	}
+
+	pfree(item);
+
+	item = pstrdup(start_time_str);
+
+	/* start time such as '08:00' */
+	ptr = strtok(item, ":");
+	if (ptr == NULL)
+		legacy_error("parse start hour failed: %s", start_time_str);
+
+	interval->start_time.hour = atoi(ptr);
+	if (interval->start_time.hour < 0 || interval->start_time.hour > 23)
+		legacy_error("parse start hour failed: out of range (%d)", interval->start_time.hour);
+
+	ptr = strtok(NULL, ":");
+	if (ptr == NULL)
+		legacy_error("parse start minute failed: %s", start_time_str);
+
+	interval->start_time.minute = atoi(ptr);
+	if (interval->start_time.minute < 0 || interval->start_time.minute > 59)
+		legacy_error("parse start minute failed: out of range (%d)", interval->start_time.minute);
+
+	pfree(item);
+
+	item = pstrdup(end_time_str);
+
+	/* end time such as '18:00' */
+	ptr = strtok(item, ":");
+	if (ptr == NULL)
+		legacy_error("parse end hour failed: %s", end_time_str);
+
+	interval->end_time.hour = atoi(ptr);
+	if (interval->end_time.hour < 0 || interval->end_time.hour > 23)
+		legacy_error("parse end hour failed: out of range (%d)", interval->end_time.hour);
+
+	ptr = strtok(NULL, ":");
+	if (ptr == NULL)
+		legacy_error("parse end minute failed: %s", end_time_str);
+
+	interval->end_time.minute = atoi(ptr);
+	if (interval->end_time.minute < 0 || interval->end_time.minute > 59)
+		legacy_error("parse end minute failed: out of range (%d)", interval->end_time.minute);
+
+	pfree(item);
+	pfree(weekday_str);
+	pfree(start_time_str);
+	pfree(end_time_str);
+}
+
+/*
+ * Each item of exclude_roles list are separated by comma.
+ *
+ * Example: foo, bar, baz, euler, jose
+ */
+static void
+legacy_parse_roles(BAIntervalRole *interval, char *s)
+{
+	char	*item;
+	char	*ptr;
+	int		i;
+
+	if (s == NULL)
+	{
+		interval->nroles = 0;
+		interval->roles = NULL;
+
+		return;
+	}
+
+	item = pstrdup(s);
+
+	/* number of roles */
+	interval->nroles = 1;		/* we should have at least one role */
+	for (ptr = item; *ptr != '\0'; ptr++)
+	{
+		if (*ptr == ',')
+			interval->nroles++;
+	}
+
+	interval->roles = (char **) palloc(interval->nroles * sizeof(char *));
+
+	/* store each role */
+	i = 0;
+	ptr = strtok(item, ",");
+	while (ptr)
+	{
+		interval->roles[i++] = legacy_trim(ptr);
+		ptr = strtok(NULL, ",");
+	}
+	interval->nroles = i;
+
+	pfree(item);
+}
+
+/*
+ * interval_time
+ * mon,tue,wed,thu,fri - 08:00-18:00; sat - 08:00-12:00
+ *
+ * exclude_roles
+ * foo,bar,baz ; euler, jose
+ */
+static void
+legacy_parse_options(BAIntervalRole *ir, int n, char *interval_time, char *exclude_roles)
+{
+	char	*intervals_str;
+	char	*roles_str;
+	char	*ptr;
+	char	**item;
+	int		i;
+
+	/* no intervals, no access block */
+	if (interval_time == NULL)
+		return;
+
+	/*
+	 * interval_time and exclude_roles shouldn't be modified, hence store
+	 * content in new variables.
+	 */
+	intervals_str = legacy_trim(interval_time);
+	roles_str = legacy_trim(exclude_roles);
+
+	/* store each token them parse'em */
+	item = (char **) palloc0(n * sizeof(char *));
+	i = 0;
+	ptr = strtok(intervals_str, ";");
+	while (ptr)
+	{
+		item[i++] = legacy_trim(ptr);
+		ptr = strtok(NULL, ";");
+	}
+
+	/* process each interval item */
+	for (i = 0; i < n; i++)
+	{
+		legacy_parse_interval(&ir[i], item[i]);
+		pfree(item[i]);
+	}
+	pfree(item);
+
+	/* store each token them parse'em */
+	item = (char **) palloc0(n * sizeof(char *));
+	i = 0;
+	ptr = roles_str != NULL ? legacy_strtok_all(roles_str, ";") : NULL;
+	while (ptr)
+	{
+		item[i++] = legacy_trim(ptr);
+		ptr = legacy_strtok_all(NULL, ";");
+	}
+
+	/* process each roles item */
+	for (i = 0; i < n; i++)
+	{
+		legacy_parse_roles(&ir[i], item[i]);
+		if (item[i])
+			pfree(item[i]);
+	}
+	pfree(item);
+
+	pfree(intervals_str);
+	if (roles_str)
+		pfree(roles_str);
+}
+
+/* Free what legacy_parse_options() allocated for n intervals */
+static void
+legacy_free_options(BAIntervalRole *ir, int n)
+{
+	int		i;
+	int		k;
+
+	for (i = 0; i < n; i++)
+	{
+		if (ir[i].wday)
+			pfree(ir[i].wday);
+		for (k = 0; k < ir[i].nroles; k++)
+			if (ir[i].roles[k])
+				pfree(ir[i].roles[k]);
+		if (ir[i].roles)
+			pfree(ir[i].roles);
+	}
+}
+
+/*
+ * Decide as block_access_checks() did before policies were compiled: the
+ * first interval that contains the week day decides, and a role that is
+ * excluded by that interval is always allowed. Return true if the connection
+ * is allowed.
+ *
+ * Keep this as it was: it is the reference the compiled policy is checked
+ * against.
+ */
+static bool
+legacy_evaluate(BAIntervalRole *intervals, int nintervals,
+				const char *role, int wday, int hour, int min)
+{
+	bool	bailout = false;
+	bool	allowed = true;
+	int		i, j, k;
+
+	/* search current date/time in the specified intervals */
+	for (i = 0; i < nintervals; i++)
+	{
+		/* we already find a week day but don't block access */
+		if (bailout)
+			break;
+
+		for (j = 0; j < intervals[i].nwday; j++)
+		{
+			/* same week day */
+			if (intervals[i].wday[j] == wday)
+			{
+				int s1, s2, n1;
+
+				/* time in minutes */
+				s1 = intervals[i].start_time.hour * 60 + intervals[i].start_time.minute;
+				s2 = intervals[i].end_time.hour * 60 + intervals[i].end_time.minute;
+				n1 = hour * 60 + min;
+
+				/* now is outside interval time */
+				if (n1 < s1 || n1 > s2)
+				{
+					bool	found = false;
+
+					/* check if role is excluded from block access */
+					for (k = 0; k < intervals[i].nroles; k++)
+					{
+						if (strcmp(intervals[i].roles[k], role) == 0)
+						{
+							found = true;
+							break;
+						}
+					}
+
+					if (!found)
+						allowed = false;
+				}
+
+				/* we found a week day; bail out */
+				bailout = true;
+				break;
+			}
+		}
+	}
+
+	return allowed;
+}
+
+int
+main(int argc, char **argv)
+{
+	static struct option long_options[] = {
+		{"benchmark", required_argument, NULL, 'b'},
+		{"policies", required_argument, NULL, 'p'},
+		{"roles", required_argument, NULL, 'r'},
+		{"tuples", required_argument, NULL, 't'},
+		{"seed", required_argument, NULL, 's'},
+		{"version", no_argument, NULL, 'V'},
+		{"help", no_argument, NULL, '?'},
+		{NULL, 0, NULL, 0}
+	};
+
+	const char	*benchmark = NULL;
+	int			npolicies = 0;
+	int			nroles = 100000;
+	int			ntuples = 10000;
+	uint64		seed;
+	char		*intervals;
+	char		*roles;
+	char		*edited;
+	VerifyTuple	*tuples;
+	bool		*legacy;
+	bool		*compiled;
+	uint64		nshapes[BA_SHAPE_FULL + 1] = {0};
+	uint64		nchecked = 0;
+	uint64		nmismatches = 0;
+	uint64		nallowed = 0;
+	int			npatched = 0;
+	uint64		npatch_mismatches = 0;
+	double		legacy_time = 0;
+	double		compiled_time = 0;
+	instr_time	start;
+	instr_time	duration;
+	int			c;
+	int			i;
+	int			j;
+
+	pg_logging_init(argv[0]);
+	progname = get_progname(argv[0]);
+
+	if (argc > 1)
+	{
+		if (strcmp(argv[1], "--help") == 0 || strcmp(argv[1], "-?") == 0)
+		{
+			usage();
+			exit(0);
+		}
+		if (strcmp(argv[1], "--version") == 0 || strcmp(argv[1], "-V") == 0)
+		{
+			puts("block_access_verify (PostgreSQL) " PG_VERSION);
+			exit(0);
+		}
+	}
+
+	INSTR_TIME_SET_CURRENT(start);
+	seed = (uint64) (INSTR_TIME_GET_DOUBLE(start) * 1000000);
+
+	while ((c = getopt_long(argc, argv, "b:p:r:t:s:V?", long_options, NULL)) != -1)
+	{
+		switch (c)
+		{
+			case 'b':
+				if (strcmp(optarg, "compile") != 0 && strcmp(optarg, "bitmaps") != 0 &&
+					strcmp(optarg, "shapes") != 0)
+				{
+					pg_log_error("invalid benchmark: \"%s\"", optarg);
+					exit(1);
+				}
+				benchmark = optarg;
+				break;
+			case 'r':
+				nroles = atoi(optarg);
+				if (nroles <= 0)
+				{
+					pg_log_error("invalid number of roles: \"%s\"", optarg);
+					exit(1);
+				}
+				break;
+			case 'p':
+				npolicies = atoi(optarg);
+				if (npolicies <= 0)
+				{
+					pg_log_error("invalid number of policies: \"%s\"", optarg);
+					exit(1);
+				}
+				break;
+			case 't':
+				ntuples = atoi(optarg);
+				if (ntuples <= 0)
+				{
+					pg_log_error("invalid number of tuples: \"%s\"", optarg);
+					exit(1);
+				}
+				break;
+			case 's':
+				seed = strtou64(optarg, NULL, 10);
+				break;
+			default:
+				fprintf(stderr, "Try \"%s --help\" for more information.\n", progname);
+				exit(1);
+		}
+	}
+
+	if (optind < argc)
+	{
+		pg_log_error("too many command-line arguments (first is \"%s\")", argv[optind]);
+		fprintf(stderr, "Try \"%s --help\" for more information.\n", progname);
+		exit(1);
+	}
+
+	/* xorshift never leaves 0 */
+	prng_state = seed != 0 ? seed : 1;
+
+	/* the last name is in no policy */
+	for (i = 0; i < VERIFY_MAX_ROLES; i++)
+		snprintf(role_names[i], NAMEDATALEN, "role_%d", i);
+	snprintf(role_names[VERIFY_MAX_ROLES], NAMEDATALEN, "nobody");
+
+	if (benchmark != NULL && strcmp(benchmark, "bitmaps") == 0)
+		exit(benchmark_bitmaps(npolicies > 0 ? npolicies : 5) ? 0 : 1);
+	if (benchmark != NULL && strcmp(benchmark, "shapes") == 0)
+		exit(benchmark_shapes(ntuples, npolicies > 0 ? npolicies : 5) ? 0 : 1);
+	if (benchmark != NULL)
+	{
+		benchmark_compile(nroles, npolicies > 0 ? npolicies : 5);
+		exit(0);
+	}
+
+	if (npolicies == 0)
+		npolicies = 1000;
+
+	intervals = pg_malloc(VERIFY_BUFFER_SIZE);
+	roles = pg_malloc(VERIFY_BUFFER_SIZE);
+	edited = pg_malloc(VERIFY_BUFFER_SIZE + NAMEDATALEN + 2);
+	tuples = pg_malloc(ntuples * sizeof(VerifyTuple));
+	legacy = pg_malloc(ntuples * sizeof(bool));
+	compiled = pg_malloc(ntuples * sizeof(bool));
+
+	for (i = 0; i < npolicies; i++)
+	{
+		BAIntervalRole	*parsed;
+		BAPolicy		*p;
+		BAPolicy		*q;
+		int				nintervals;
+
+		nintervals = random_policy(intervals, roles);
+
+		/* a parse error is reported and exits: the generator is wrong */
+		parsed = (BAIntervalRole *) pg_malloc0(nintervals * sizeof(BAIntervalRole));
+		legacy_parse_options(parsed, nintervals, intervals, roles);
+		p = parse_policy(NULL, intervals, roles, 0);
+
+		nshapes[p->shape]++;
+
+		random_tuples(tuples, ntuples);
+
+		INSTR_TIME_SET_CURRENT(start);
+		for (j = 0; j < ntuples; j++)
+			legacy[j] = legacy_evaluate(parsed, nintervals, tuples[j].role,
+										tuples[j].wday, tuples[j].hour, tuples[j].min);
+		INSTR_TIME_SET_CURRENT(duration);
+		INSTR_TIME_SUBTRACT(duration, start);
+		legacy_time += INSTR_TIME_GET_DOUBLE(duration);
+
+		INSTR_TIME_SET_CURRENT(start);
+		for (j = 0; j < ntuples; j++)
+		{
+			bool	exempted;
+
+			compiled[j] = policy_evaluate(p, tuples[j].role, tuples[j].minute, &exempted) != BA_VERDICT_DENIED;
+		}
+		INSTR_TIME_SET_CURRENT(duration);
+		INSTR_TIME_SUBTRACT(duration, start);
+		compiled_time += INSTR_TIME_GET_DOUBLE(duration);
+
+		for (j = 0; j < ntuples; j++)
+		{
+			if (legacy[j] != compiled[j] && ++nmismatches <= VERIFY_MAX_WARNINGS)
+				pg_log_error("policy %d (%s), role \"%s\" on %s at %02d:%02d: legacy %s, compiled %s\n"
+							 "intervals: \"%s\"\nexclude_roles: \"%s\"",
+							 i, policy_shape_names[p->shape], tuples[j].role,
+							 week_day_names[tuples[j].wday], tuples[j].hour, tuples[j].min,
+							 legacy[j] ? "allows" : "denies", compiled[j] ? "allows" : "denies",
+							 intervals, roles);
+			nallowed += legacy[j];
+		}
+		nchecked += ntuples;
+
+		/* the same policy with an edited role list: patched, and from scratch */
+		random_edit(edited, roles);
+		p->generation = 1;
+		q = rebuild_policy(NULL, p, roles, intervals, edited, 0);
+		if (q != NULL)
+		{
+			BAPolicy	*r = parse_policy(NULL, intervals, edited, 0);
+			int			counts[2][3];
+
+			q->roles_from = p->generation;
+			policy_diff(p, q, &counts[0][0], &counts[0][1], &counts[0][2]);
+			policy_diff(p, r, &counts[1][0], &counts[1][1], &counts[1][2]);
+			if (memcmp(counts[0], counts[1], sizeof(counts[0])) != 0 &&
+				++npatch_mismatches <= VERIFY_MAX_WARNINGS)
+				pg_log_error("policy %d: patched %d added, %d removed, %d changed, compiled %d, %d, %d\n"
+							 "exclude_roles: \"%s\"\nedited: \"%s\"",
+							 i, counts[0][0], counts[0][1], counts[0][2],
+							 counts[1][0], counts[1][1], counts[1][2], roles, edited);
+
+			for (j = 0; j < ntuples; j++)
+			{
+				bool	exempted;
+				bool	patched = policy_evaluate(q, tuples[j].role, tuples[j].minute, &exempted) != BA_VERDICT_DENIED;
+				bool	expected = policy_evaluate(r, tuples[j].role, tuples[j].minute, &exempted) != BA_VERDICT_DENIED;
+
+				if (patched != expected && ++npatch_mismatches <= VERIFY_MAX_WARNINGS)
+					pg_log_error("policy %d, role \"%s\" at minute %d: patched %s, compiled %s\n"
+								 "exclude_roles: \"%s\"\nedited: \"%s\"",
+								 i, tuples[j].role, tuples[j].minute,
+								 patched ? "allows" : "denies", expected ? "allows" : "denies",
+								 roles, edited);
+			}
+			npatched++;
+		}
+
+		policy_memory_reset();
+		legacy_free_options(parsed, nintervals);
+		pg_free(parsed);
+	}
+
+	printf("seed: " UINT64_FORMAT "\n", seed);
+	printf("policies: %d (", npolicies);
+	for (i = 0; i <= BA_SHAPE_FULL; i++)
+		printf("%s%s " UINT64_FORMAT, i > 0 ? ", " : "", policy_shape_names[i], nshapes[i]);
+	printf(")\n");
+	printf("tuples: " UINT64_FORMAT " (" UINT64_FORMAT " allowed), " UINT64_FORMAT " agree, "
+		   UINT64_FORMAT " differ\n",
+		   nchecked, nallowed, nchecked - nmismatches, nmismatches);
+	printf("patched: %d policies, " UINT64_FORMAT " differ\n", npatched, npatch_mismatches);
+	printf("legacy: %.3f s (%.0f tuples/s)\n", legacy_time,
+		   legacy_time > 0 ? nchecked / legacy_time : 0.0);
+	printf("compiled: %.3f s (%.0f tuples/s)\n", compiled_time,
+		   compiled_time > 0 ? nchecked / compiled_time : 0.0);
+	if (compiled_time > 0)
+		printf("speedup: %.1fx\n", legacy_time / compiled_time);
+
+	pg_free(compiled);
+	pg_free(legacy);
+	pg_free(tuples);
+	pg_free(edited);
+	pg_free(roles);
+	pg_free(intervals);
+
+	return nmismatches > 0 || npatch_mismatches > 0 ? 1 : 0;
+}
@@ -0,0 +1,88 @@
+# Named policies defined, activated and dropped on the primary are replayed
+# by a streaming standby, and so are scheduled activations.
+use strict;
+use warnings;
+
+use PostgreSQL::Test::Cluster;
+use PostgreSQL::Test::Utils;
+use Test::More;
+
+my $primary = PostgreSQL::Test::Cluster->new('primary');
+$primary->init(allows_streaming => 1);
+$primary->append_conf('postgresql.conf',
+	"shared_preload_libraries = 'block_access'");
+$primary->start;
+
+if ($primary->pg_version < 15)
+{
+	plan skip_all => 'named policies are replicated on PostgreSQL 15+ only';
+}
+
+$primary->safe_psql('postgres', 'CREATE EXTENSION block_access');
+$primary->backup('backup');
+
+my $standby = PostgreSQL::Test::Cluster->new('standby');
+$standby->init_from_backup($primary, 'backup', has_streaming => 1);
+$standby->start;
+
+my $everyday = 'mon, tue, wed, thu, fri, sat, sun';
+my $superuser = $primary->safe_psql('postgres', 'SELECT current_user');
+
+sub active_policy
+{
+	my ($node) = @_;
+
+	return $node->safe_psql('postgres',
+		'SELECT name FROM block_access_policies() WHERE active');
+}
+
+# define and activate
+$primary->safe_psql('postgres',
+	"SELECT block_access_define('night', '$everyday - 00:00-23:59', '$superuser')");
+$primary->safe_psql('postgres', "SELECT block_access_activate('night')");
+$primary->wait_for_catchup($standby);
+
+is( $standby->safe_psql('postgres',
+		"SELECT exclude_roles FROM block_access_policies() WHERE name = 'night'"),
+	$superuser, 'definition replayed');
+is(active_policy($standby), 'night', 'activation replayed');
+
+my ($ret, $stdout, $stderr) = $standby->psql('postgres',
+	"SELECT block_access_activate('default')");
+like($stderr, qr/cannot change block_access policies during recovery/,
+	'policies cannot be changed on the standby');
+
+# a scheduled activation is switched by the primary, and replayed
+$primary->safe_psql('postgres',
+	"SELECT block_access_schedule('default', now() + interval '2 seconds')");
+$primary->wait_for_catchup($standby);
+is( $standby->safe_psql('postgres', 'SELECT count(*) FROM block_access_scheduled()'),
+	'1', 'schedule replayed');
+
+sleep(3);
+
+my $log_offset = -s $standby->logfile;
+
+# the first login after the scheduled time switches the policy
+$primary->safe_psql('postgres', 'SELECT 1');
+$primary->wait_for_catchup($standby);
+
+is(active_policy($primary), 'default', 'scheduled activation applied');
+ok( $standby->log_contains(
+		'policy "default" activated by the primary server', $log_offset),
+	'scheduled activation replayed');
+is( $standby->safe_psql('postgres', 'SELECT count(*) FROM block_access_scheduled()'),
+	'0', 'no activation pending on the standby');
+
+# drop
+$primary->safe_psql('postgres', "SELECT block_access_drop('night')");
+$primary->wait_for_catchup($standby);
+
+is( $standby->safe_psql('postgres',
+		"SELECT count(*) FROM block_access_policies() WHERE name = 'night'"),
+	'0', 'drop replayed');
+
+$standby->stop;
+$primary->stop;
+
+done_testing();
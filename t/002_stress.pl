@@ -0,0 +1,78 @@
+# block_access_stress switches policies under load without an inconsistent
+# login, and puts the configuration back when it is done.
+use strict;
+use warnings;
+
+use PostgreSQL::Test::Cluster;
+use PostgreSQL::Test::Utils;
+use Test::More;
+
+if (!-x './block_access_stress')
+{
+	plan skip_all => 'block_access_stress is not built (make tools)';
+}
+
+my $node = PostgreSQL::Test::Cluster->new('stress');
+$node->init;
+$node->append_conf('postgresql.conf',
+	"shared_preload_libraries = 'block_access'");
+$node->start;
+
+$node->safe_psql('postgres', 'CREATE EXTENSION block_access');
+
+my $superuser = $node->safe_psql('postgres', 'SELECT current_user');
+
+sub setting
+{
+	my ($name) = @_;
+
+	return $node->safe_psql('postgres',
+		"SELECT setting FROM pg_file_settings WHERE name = '$name'");
+}
+
+sub stress_roles
+{
+	return $node->safe_psql('postgres',
+		"SELECT count(*) FROM pg_roles WHERE rolname LIKE 'ba\\_stress\\_%'");
+}
+
+# settings made by the operator, that the guc mode must put back
+$node->safe_psql('postgres',
+	"ALTER SYSTEM SET block_access.exclude_roles = '$superuser, nobody'");
+$node->safe_psql('postgres', 'SELECT pg_reload_conf()');
+
+command_ok(
+	[
+		'./block_access_stress', '-d', $node->connstr('postgres'),
+		'-c', '4', '-T', '3', '-i', '200', '-m', 'guc'
+	],
+	'guc mode');
+
+is(setting('block_access.exclude_roles'), "$superuser, nobody",
+	'exclude_roles put back');
+is(setting('block_access.intervals'), '', 'intervals put back');
+is(stress_roles(), '0', 'roles dropped after the guc mode');
+
+# an active policy, that the named mode must put back
+$node->safe_psql('postgres',
+	"SELECT block_access_define('mine', 'mon - 01:00-02:00', '$superuser')");
+$node->safe_psql('postgres', "SELECT block_access_activate('mine')");
+
+command_ok(
+	[
+		'./block_access_stress', '-d', $node->connstr('postgres'),
+		'-c', '4', '-T', '3', '-i', '200', '-m', 'named'
+	],
+	'named mode');
+
+is( $node->safe_psql('postgres',
+		'SELECT string_agg(name, \',\' ORDER BY name) FROM block_access_policies()'),
+	'default,mine', 'stress policies dropped');
+is( $node->safe_psql('postgres',
+		'SELECT name FROM block_access_policies() WHERE active'),
+	'mine', 'active policy put back');
+is(stress_roles(), '0', 'roles dropped after the named mode');
+
+$node->stop;
+
+done_testing();